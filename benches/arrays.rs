@@ -0,0 +1,118 @@
+// Array growth benchmark: building an array one element at a time with
+// `xs <- [x]`. Run with `cargo bench --bench arrays`.
+//
+// Each size is measured four ways: the whole program on the VM, once
+// appending numbers and once appending one-element arrays so that every
+// element is a heap reference the collector has to trace, the persistent
+// vector behind HeapObject::Array on its own, and the copy-on-update Vec the
+// VM used before, which copied both operands on every update. The copy
+// baseline is quadratic, so it is timed once at 100k and skipped at 1M.
+
+use n::interpreter::VirtualMachine;
+use n::runtime::compile_source;
+use n::types::compiler::HeapObject;
+use n::vector::Vector;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: usize = 5;
+const COPY_LIMIT: usize = 100_000;
+
+// `grow_k` appends 2^k elements by threading the array through two calls to
+// `grow_{k-1}`, since the language has no loops yet. Nesting one call per set
+// bit of `count` appends exactly `count` elements, each `element`.
+fn growth_workload(count: usize, element: &str) -> String {
+    let depth = usize::BITS - count.leading_zeros();
+    let mut source = format!("func grow_0(xs) {{\n    xs <- [{}]\n}}\n", element);
+    for level in 1..depth {
+        source.push_str(&format!(
+            "func grow_{level}(xs) {{\n    grow_{prev}(grow_{prev}(xs))\n}}\n",
+            prev = level - 1
+        ));
+    }
+    let mut expression = String::from("[]");
+    for level in (0..depth).filter(|level| count & (1 << level) != 0) {
+        expression = format!("grow_{}({})", level, expression);
+    }
+    source.push_str(&format!("let result = {}\n", expression));
+    source
+}
+
+fn persistent(count: usize) {
+    let mut current: Vector<HeapObject> = Vector::new();
+    for i in 0..count {
+        let mut next = current.clone();
+        next.push(HeapObject::Number(i as f64));
+        current = next;
+    }
+    assert_eq!(current.len(), count);
+}
+
+fn copying(count: usize) {
+    let mut current: Vec<HeapObject> = Vec::new();
+    for i in 0..count {
+        let right = [HeapObject::Number(i as f64)];
+        let mut next = Vec::with_capacity(current.len() + right.len());
+        next.extend_from_slice(&current);
+        next.extend_from_slice(&right);
+        current = next;
+    }
+    assert_eq!(current.len(), count);
+}
+
+fn time(mut run: impl FnMut()) -> (Duration, Duration) {
+    let mut total = Duration::ZERO;
+    let mut best = Duration::MAX;
+    for iteration in 0..=ITERATIONS {
+        let start = Instant::now();
+        run();
+        let elapsed = start.elapsed();
+        // The first run is warmup.
+        if iteration > 0 {
+            total += elapsed;
+            best = best.min(elapsed);
+        }
+    }
+    (total / ITERATIONS as u32, best)
+}
+
+fn report(name: &str, count: usize, (mean, best): (Duration, Duration)) {
+    println!(
+        "{:<12} {:>8} appends  mean {:>10.3} ms  best {:>10.3} ms  {:>9.1} ns/append",
+        name,
+        count,
+        mean.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e3,
+        mean.as_secs_f64() * 1e9 / count as f64
+    );
+}
+
+fn main() {
+    for count in [10_000, 100_000, 1_000_000] {
+        let vm = |element| {
+            let bytecode = compile_source(growth_workload(count, element), false)
+                .expect("workload failed to compile");
+            move || {
+                VirtualMachine::new(bytecode.clone())
+                    .run()
+                    .expect("workload failed")
+            }
+        };
+        report("vm", count, time(vm("1")));
+        report("vm arrays", count, time(vm("[1]")));
+        report("persistent", count, time(|| persistent(count)));
+        if count < COPY_LIMIT {
+            report("copying", count, time(|| copying(count)));
+        } else if count == COPY_LIMIT {
+            // One cold run; a warmup would double an already long wait.
+            let start = Instant::now();
+            copying(count);
+            let elapsed = start.elapsed();
+            report("copying", count, (elapsed, elapsed));
+        } else {
+            println!(
+                "{:<12} {:>8} appends  skipped (quadratic)",
+                "copying", count
+            );
+        }
+    }
+}
@@ -0,0 +1,265 @@
+// Dispatch throughput benchmark: instructions per second on arithmetic- and
+// call-heavy programs, compiled both plainly and with `-O`, then the same
+// programs and every tests/*.n file timed on the stack VM against the
+// register VM, and against the JIT when built with `--features jit`. Run with
+// `cargo bench --bench dispatch`;
+// `cargo bench --bench dispatch -- --profile` prints the combined opcode
+// profile of the `-O` builds instead.
+//
+// The `natives` workload calls the built-in min and max; `user min/max` calls
+// functions written in n that do the same, showing what CALL_GLOBAL saves by
+// skipping the call machinery.
+//
+// The language has no loops yet, so each workload gets its volume from a
+// binary tree of calls: `level_k` calls `level_{k-1}` twice, so the leaf
+// kernel runs 2^depth times from a few lines of source.
+
+use n::interpreter::VirtualMachine;
+use n::profile::{OpcodeProfile, Profiled};
+use n::register::RegisterMachine;
+use n::runtime::{Options, compile_source_with_options, lower_source_with_options};
+use n::types::compiler::{ByteCode, Function, Instruction, Value};
+use n::types::traits::Executable;
+use std::cell::Cell;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: usize = 20;
+
+// Counts fetches so instructions/second can be reported without adding a
+// counter to the VM's dispatch loop.
+struct Counting<'a> {
+    inner: &'a ByteCode,
+    fetched: &'a Cell<u64>,
+}
+
+impl Executable for Counting<'_> {
+    type Shared = ByteCode;
+
+    fn shared(&self) -> &ByteCode {
+        self.inner
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        self.fetched.set(self.fetched.get() + 1);
+        self.inner.instruction(pc)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.inner.constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.inner.function(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.inner.globals()
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        self.inner.line(pc)
+    }
+}
+
+fn call_tree(leaf: &str, depth: usize) -> String {
+    let mut source = String::from(leaf);
+    source.push_str("\nfunc level_0(x) {\n    kernel(x, 2)\n}\n");
+    for level in 1..=depth {
+        source.push_str(&format!(
+            "func level_{level}(x) {{\n    level_{prev}(x) + level_{prev}(x + 1)\n}}\n",
+            prev = level - 1
+        ));
+    }
+    source.push_str(&format!("let result = level_{}(1)\n", depth));
+    source
+}
+
+fn arithmetic_workload() -> String {
+    let mut kernel = String::from("func kernel(a, b) {\n    let t0 = a * 3 + b\n");
+    for i in 1..40 {
+        kernel.push_str(&format!(
+            "    let t{i} = (t{prev} + a) * 0.5 - b / 4 + {i}\n",
+            prev = i - 1
+        ));
+    }
+    kernel.push_str("    t39 * 2 - a\n}\n");
+    call_tree(&kernel, 10)
+}
+
+fn call_workload() -> String {
+    call_tree("func kernel(a, b) {\n    a + b\n}\n", 15)
+}
+
+// The same leaf once through the built-in min and max (CALL_GLOBAL) and once
+// through bytecode functions that compute them.
+fn native_workload() -> String {
+    call_tree("func kernel(a, b) {\n    max(a, b) - min(a, b)\n}\n", 15)
+}
+
+fn bytecode_min_max_workload() -> String {
+    call_tree(
+        "func larger(a, b) {\n    if a > b { a } else { b }\n}\n\
+         func smaller(a, b) {\n    if a < b { a } else { b }\n}\n\
+         func kernel(a, b) {\n    larger(a, b) - smaller(a, b)\n}\n",
+        15,
+    )
+}
+
+fn instruction_count(bytecode: &ByteCode) -> u64 {
+    let fetched = Cell::new(0);
+    let counting = Counting {
+        inner: bytecode,
+        fetched: &fetched,
+    };
+    VirtualMachine::new(counting)
+        .run()
+        .expect("workload failed");
+    fetched.get()
+}
+
+fn bench(name: &str, source: &str, optimize: bool) {
+    let options = Options {
+        optimize,
+        ..Options::default()
+    };
+    let bytecode = compile_source_with_options(source.to_string(), options)
+        .expect("workload failed to compile");
+    let name = if optimize {
+        format!("{} -O", name)
+    } else {
+        name.to_string()
+    };
+    let instructions = instruction_count(&bytecode);
+
+    let (mean, best) = time(ITERATIONS, || {
+        let mut vm = VirtualMachine::new(bytecode.clone());
+        let start = Instant::now();
+        vm.run().expect("workload failed");
+        start.elapsed()
+    });
+    println!(
+        "{:<15} {:>10} instr  mean {:>9.3} ms  best {:>9.3} ms  {:>8.1} M instr/s",
+        name,
+        instructions,
+        mean.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e3,
+        instructions as f64 / mean.as_secs_f64() / 1e6
+    );
+}
+
+// Mean and best of `iterations` runs of `run`, after one warmup run.
+fn time(iterations: usize, mut run: impl FnMut() -> Duration) -> (Duration, Duration) {
+    run();
+    let mut total = Duration::ZERO;
+    let mut best = Duration::MAX;
+    for _ in 0..iterations {
+        let elapsed = run();
+        total += elapsed;
+        best = best.min(elapsed);
+    }
+    (total / iterations as u32, best)
+}
+
+// Times one program with `-O` on every engine. Each run builds a fresh VM
+// from an already compiled program, so only execution is measured.
+fn compare_engines(name: &str, source: &str, iterations: usize) {
+    let options = Options {
+        optimize: true,
+        ..Options::default()
+    };
+    let (Ok(bytecode), Ok(registers)) = (
+        compile_source_with_options(source.to_string(), options),
+        lower_source_with_options(source.to_string(), options),
+    ) else {
+        return;
+    };
+    if VirtualMachine::new(bytecode.clone()).run().is_err() {
+        return;
+    }
+
+    let (stack, _) = time(iterations, || {
+        let mut vm = VirtualMachine::new(bytecode.clone());
+        let start = Instant::now();
+        vm.run().expect("workload failed");
+        start.elapsed()
+    });
+    let (register, _) = time(iterations, || {
+        let mut vm = RegisterMachine::new(registers.clone());
+        let start = Instant::now();
+        vm.run().expect("workload failed");
+        start.elapsed()
+    });
+    print!(
+        "{:<28} stack {:>10.1} us  register {:>10.1} us  {:>5.2}x",
+        name,
+        stack.as_secs_f64() * 1e6,
+        register.as_secs_f64() * 1e6,
+        stack.as_secs_f64() / register.as_secs_f64()
+    );
+    #[cfg(feature = "jit")]
+    {
+        let (jit, _) = time(iterations, || {
+            let mut vm = VirtualMachine::new(bytecode.clone());
+            vm.enable_jit();
+            let start = Instant::now();
+            vm.run().expect("workload failed");
+            start.elapsed()
+        });
+        print!(
+            "  jit {:>10.1} us  {:>5.2}x",
+            jit.as_secs_f64() * 1e6,
+            stack.as_secs_f64() / jit.as_secs_f64()
+        );
+    }
+    println!();
+}
+
+fn profile(source: &str) -> OpcodeProfile {
+    let options = Options {
+        optimize: true,
+        ..Options::default()
+    };
+    let bytecode = compile_source_with_options(source.to_string(), options)
+        .expect("workload failed to compile");
+    let mut vm = VirtualMachine::new(Profiled::new(bytecode));
+    vm.run().expect("workload failed");
+    vm.program().profile()
+}
+
+fn main() {
+    let workloads = [
+        ("arithmetic", arithmetic_workload()),
+        ("calls", call_workload()),
+        ("natives", native_workload()),
+        ("user min/max", bytecode_min_max_workload()),
+    ];
+
+    if std::env::args().any(|arg| arg == "--profile") {
+        let mut combined = OpcodeProfile::default();
+        for (_, source) in &workloads {
+            combined.merge(&profile(source));
+        }
+        println!("{}", combined);
+        return;
+    }
+
+    for (name, source) in &workloads {
+        bench(name, source, false);
+        bench(name, source, true);
+    }
+
+    println!();
+    for (name, source) in &workloads {
+        compare_engines(name, source, ITERATIONS);
+    }
+    let mut files: Vec<_> = std::fs::read_dir("tests")
+        .expect("tests directory")
+        .map(|entry| entry.expect("tests entry").path())
+        .filter(|path| path.extension().is_some_and(|extension| extension == "n"))
+        .collect();
+    files.sort();
+    for path in files {
+        let source = std::fs::read_to_string(&path).expect("readable test program");
+        compare_engines(&path.display().to_string(), &source, 1000);
+    }
+}
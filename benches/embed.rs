@@ -0,0 +1,58 @@
+// Embedding benchmark: runs a small program as if once per request, first
+// compiling it and building a VM every time, then on VMs of a Pool sharing one
+// compiled Image, on 1 to 8 threads. Reports runs per second for each. Run
+// with `cargo bench --bench embed`.
+
+use n::embed::{Image, Pool};
+use n::interpreter::VirtualMachine;
+use n::runtime::{Options, compile_source};
+use n::types::compiler::Value;
+use std::time::Instant;
+
+const RUNS: usize = 20_000;
+
+const SOURCE: &str = "\
+func fib(n) { if n < 2 { n } else { fib(n - 1) + fib(n - 2) } }
+func greet(name) { \"Hello, \" + name }
+let answer = fib(10)
+let message = greet(\"world\")
+let squares = [1, 2, 3, 4, 5] |> mul([1, 2, 3, 4, 5]) |> sum
+";
+
+fn report(label: &str, threads: usize, start: Instant) {
+    let seconds = start.elapsed().as_secs_f64();
+    println!(
+        "{:<8} threads {}  {:>9.0} runs/s",
+        label,
+        threads,
+        RUNS as f64 / seconds
+    );
+}
+
+fn main() {
+    let start = Instant::now();
+    for _ in 0..RUNS {
+        let mut vm = VirtualMachine::new(compile_source(SOURCE.to_string(), false).unwrap());
+        vm.run().expect("runs");
+        assert_eq!(vm.globals()[0], Value::Number(55.0));
+    }
+    report("compile", 1, start);
+
+    let image = Image::compile(SOURCE.to_string(), Options::default()).expect("compiles");
+    let mut pool = Pool::new(image);
+    pool.set_threads(1);
+    for threads in [1, 2, 4, 8] {
+        let start = Instant::now();
+        std::thread::scope(|scope| {
+            for _ in 0..threads {
+                scope.spawn(|| {
+                    for _ in 0..RUNS / threads {
+                        let answer = pool.run(|vm| vm.global("answer").cloned()).expect("runs");
+                        assert_eq!(answer, Some(Value::Number(55.0)));
+                    }
+                });
+            }
+        });
+        report("pooled", threads, start);
+    }
+}
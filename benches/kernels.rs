@@ -0,0 +1,96 @@
+// Array kernel benchmark: the bulk built-ins behind pipelines such as
+// `xs |> mul(2) |> sum`, run over a dense number array against the same
+// operation done an element at a time over the generic array the VM stored
+// before, where every element is a HeapObject to match on. Run with
+// `cargo bench --bench kernels`.
+
+use n::dense;
+use n::types::compiler::{HeapObject, Value};
+use n::vector::Vector;
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: usize = 10;
+
+fn time(mut run: impl FnMut()) -> Duration {
+    run();
+    let start = Instant::now();
+    for _ in 0..ITERATIONS {
+        run();
+    }
+    start.elapsed() / ITERATIONS as u32
+}
+
+fn report(name: &str, count: usize, dense: Duration, generic: Duration) {
+    println!(
+        "{:<14} {:>8} elements  dense {:>9.3} ms  generic {:>9.3} ms  {:>5.1}x",
+        name,
+        count,
+        dense.as_secs_f64() * 1e3,
+        generic.as_secs_f64() * 1e3,
+        generic.as_secs_f64() / dense.as_secs_f64()
+    );
+}
+
+fn number(element: &HeapObject) -> f64 {
+    match element {
+        HeapObject::Number(n) => *n,
+        _ => panic!("expected a number"),
+    }
+}
+
+fn main() {
+    for count in [10_000, 100_000, 1_000_000] {
+        let values: Vec<Value> = (0..count).map(|i| Value::Number(i as f64)).collect();
+        let HeapObject::Numbers(xs) = dense::array(&values) else {
+            panic!("expected a dense array");
+        };
+        let generic: Vector<HeapObject> = xs.iter().map(|n| HeapObject::Number(*n)).collect();
+
+        report(
+            "sum",
+            count,
+            time(|| {
+                black_box(dense::sum(black_box(&xs)));
+            }),
+            time(|| {
+                black_box(black_box(&generic).iter().map(number).sum::<f64>());
+            }),
+        );
+        report(
+            "mul",
+            count,
+            time(|| {
+                black_box(dense::map(black_box(&xs), |x| x * 2.0));
+            }),
+            time(|| {
+                black_box(
+                    black_box(&generic)
+                        .iter()
+                        .map(|element| HeapObject::Number(number(element) * 2.0))
+                        .collect::<Vector<HeapObject>>(),
+                );
+            }),
+        );
+        let threshold = count as f64 / 2.0;
+        report(
+            "greater+count",
+            count,
+            time(|| {
+                let mask = dense::compare(black_box(&xs), threshold, |x, y| x > y);
+                black_box(dense::count(&mask));
+            }),
+            time(|| {
+                let mask: Vector<HeapObject> = black_box(&generic)
+                    .iter()
+                    .map(|element| HeapObject::Boolean(number(element) > threshold))
+                    .collect();
+                black_box(
+                    mask.iter()
+                        .filter(|b| matches!(b, HeapObject::Boolean(true)))
+                        .count(),
+                );
+            }),
+        );
+    }
+}
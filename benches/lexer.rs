@@ -0,0 +1,157 @@
+// Front-end throughput benchmark: MB/s and tokens/s over large generated
+// sources, for the lexer alone, for the parser pulling tokens from it, and for
+// parsing plus compiling to bytecode. Every block adds distinct literals, so
+// the largest input pools over 100k constants. Each stage also reports the
+// peak heap it allocated, tracked by a counting global allocator.
+// Run with `cargo bench --bench lexer`.
+//
+// The input repeats a block that exercises every token class the lexer
+// handles: keywords, identifiers, numbers, strings, both comment styles and
+// the multi-character operators.
+
+use n::compiler::Compiler;
+use n::lexer::Lexer;
+use n::parser::Parser;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::hint::black_box;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+struct Counting;
+
+static LIVE: AtomicUsize = AtomicUsize::new(0);
+static PEAK: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let live = LIVE.fetch_add(layout.size(), Ordering::Relaxed) + layout.size();
+        PEAK.fetch_max(live, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        LIVE.fetch_sub(layout.size(), Ordering::Relaxed);
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: Counting = Counting;
+
+// Bytes allocated at the high-water mark of one run, over what was live
+// before it started.
+fn peak(run: impl FnOnce()) -> usize {
+    let before = LIVE.load(Ordering::Relaxed);
+    PEAK.store(before, Ordering::Relaxed);
+    run();
+    PEAK.load(Ordering::Relaxed) - before
+}
+
+const ITERATIONS: usize = 10;
+
+fn block(index: usize) -> String {
+    format!(
+        "// helper number {index}
+func helper_{index}(a, b) {{
+    let total = a * 3.25 + b / 4 - {index}
+    let label = \"helper {index} computes a total\"
+    /* keep the
+       previous value around */
+    let kept = [total, a, b] <- [label]
+    let same = total == a
+    let! last = kept |> helper_{index}(total)
+    total
+}}
+",
+    )
+}
+
+fn source(size: usize) -> String {
+    let mut source = String::with_capacity(size + 512);
+    let mut index = 0;
+    while source.len() < size {
+        source.push_str(&block(index));
+        index += 1;
+    }
+    source
+}
+
+fn time(mut run: impl FnMut()) -> (Duration, Duration) {
+    let mut total = Duration::ZERO;
+    let mut best = Duration::MAX;
+    for iteration in 0..=ITERATIONS {
+        let start = Instant::now();
+        run();
+        let elapsed = start.elapsed();
+        // The first run is warmup.
+        if iteration > 0 {
+            total += elapsed;
+            best = best.min(elapsed);
+        }
+    }
+    (total / ITERATIONS as u32, best)
+}
+
+fn report(
+    stage: &str,
+    bytes: usize,
+    tokens: usize,
+    (mean, best): (Duration, Duration),
+    peak: usize,
+) {
+    println!(
+        "{:>6} KB {:<7} {:>9} tokens  mean {:>8.3} ms  best {:>8.3} ms  {:>7.1} MB/s  {:>6.1} M tokens/s  peak {:>7.1} MB",
+        bytes / 1024,
+        stage,
+        tokens,
+        mean.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e3,
+        bytes as f64 / mean.as_secs_f64() / 1e6,
+        tokens as f64 / mean.as_secs_f64() / 1e6,
+        peak as f64 / 1e6
+    );
+}
+
+fn bench(size: usize) {
+    let source = source(size);
+    let tokens = Lexer::new(&source).tokenize().len();
+
+    let lex = || {
+        black_box(Lexer::new(black_box(&source)).tokenize());
+    };
+    report("lex", source.len(), tokens, time(lex), peak(lex));
+
+    let parse = || {
+        let mut parser = Parser::new(Lexer::new(black_box(&source)));
+        black_box(parser.parse().expect("benchmark source parses"));
+    };
+    report("parse", source.len(), tokens, time(parse), peak(parse));
+
+    let compile = || {
+        let mut parser = Parser::new(Lexer::new(black_box(&source)));
+        let program = parser.parse().expect("benchmark source parses");
+        let mut compiler = Compiler::new();
+        black_box(
+            compiler
+                .compile(&program)
+                .expect("benchmark source compiles"),
+        );
+    };
+    report(
+        "compile",
+        source.len(),
+        tokens,
+        time(compile),
+        peak(compile),
+    );
+
+    let program = Parser::new(Lexer::new(&source)).parse().unwrap();
+    let constants = Compiler::new().compile(&program).unwrap().constants.len();
+    println!("{:>6} KB {:>17} constants", source.len() / 1024, constants);
+}
+
+fn main() {
+    for size in [256 << 10, 1 << 20, 16 << 20] {
+        bench(size);
+    }
+}
@@ -0,0 +1,78 @@
+// Incremental build benchmark: generates programs of 10 to 400 modules of 20
+// functions each, all imported by one entry file, and times a full build, a
+// rebuild after editing the body of one function in one module, and a
+// rebuild with nothing changed. The full build grows with the program; the
+// rebuilds compile at most one module, and otherwise only check every file's
+// modification time and relink. Run with `cargo bench --bench modules`.
+
+use n::interpreter::VirtualMachine;
+use n::modules::Build;
+use n::runtime::Options;
+use n::types::compiler::Value;
+use std::fs;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: u32 = 5;
+const FUNCTIONS: usize = 20;
+
+fn module(index: usize, step: usize) -> String {
+    (0..FUNCTIONS)
+        .map(|function| {
+            format!(
+                "func f{}_{}(x) {{ if x < 1 {{ {} }} else {{ f{}_{}(x - 1) + {} }} }}\n",
+                index, function, step, index, function, function
+            )
+        })
+        .collect()
+}
+
+fn build(build: &mut Build, entry: &str) -> Duration {
+    let start = Instant::now();
+    let (bytecode, _) = build.build(entry).expect("builds");
+    let elapsed = start.elapsed();
+    let mut vm = VirtualMachine::new(bytecode);
+    vm.run().expect("runs");
+    assert!(matches!(vm.globals()[0], Value::Number(_)));
+    elapsed
+}
+
+fn millis(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1e3 / ITERATIONS as f64
+}
+
+fn main() {
+    let dir = std::env::temp_dir().join(format!("n-modules-bench-{}", std::process::id()));
+    for modules in [10, 50, 100, 400] {
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).expect("creates the program directory");
+        let mut entry = String::new();
+        for index in 0..modules {
+            fs::write(dir.join(format!("m{}.n", index)), module(index, 0)).expect("writes");
+            entry.push_str(&format!("import \"m{}\"\n", index));
+        }
+        entry.push_str("let total = f0_0(3) + f1_1(3)\n");
+        let main = dir.join("main.n");
+        fs::write(&main, entry).expect("writes");
+        let main = main.to_str().expect("path");
+
+        let (mut full, mut edited, mut unchanged) = Default::default();
+        for iteration in 0..ITERATIONS as usize {
+            let mut builds = Build::new(Options::default());
+            full += build(&mut builds, main);
+            let edit = Path::new(&dir).join("m1.n");
+            fs::write(edit, module(1, iteration + 1)).expect("writes");
+            edited += build(&mut builds, main);
+            assert_eq!(builds.compiled().len(), 1);
+            unchanged += build(&mut builds, main);
+        }
+        println!(
+            "modules {:>3}  full {:>8.3} ms  one edited {:>8.3} ms  unchanged {:>8.3} ms",
+            modules,
+            millis(full),
+            millis(edited),
+            millis(unchanged)
+        );
+    }
+    let _ = fs::remove_dir_all(&dir);
+}
@@ -0,0 +1,63 @@
+// Parallel map scaling benchmark: maps a call-heavy function over a 100k
+// element array on 1 to 32 threads and reports the time of each run and its
+// speedup over one thread. The array is built once per program run and the
+// map dominates, so the speedup tracks how well the chunks spread over the
+// cores; beyond the number of cores it stays flat. Run with
+// `cargo bench --bench parallel`.
+
+use n::interpreter::VirtualMachine;
+use n::runtime::{Options, compile_source_with_options};
+use n::types::compiler::Value;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: u32 = 5;
+const ELEMENTS: usize = 100_000;
+
+const SOURCE: &str = "\
+func range(n, xs) {
+    if n == 0 { xs } else { range(n - 1, xs <- [n]) }
+}
+func steps(n, acc) {
+    if n < 1 { acc } else { steps(n - 1, acc + 1) }
+}
+func weight(x) { steps(100, x) }
+";
+
+fn main() {
+    let options = Options {
+        optimize: true,
+        ..Options::default()
+    };
+    let source = format!(
+        "{}let xs = range({}, [])\nlet total = xs |> map(weight) |> sum\n",
+        SOURCE, ELEMENTS
+    );
+    let bytecode = compile_source_with_options(source, options).expect("compiles");
+    let cores = std::thread::available_parallelism().map_or(1, |cores| cores.get());
+    println!("{} elements, {} cores available", ELEMENTS, cores);
+
+    let mut single = None;
+    for threads in [1, 2, 4, 8, 16, 32] {
+        let mut total = Duration::ZERO;
+        let mut result = Value::Number(0.0);
+        for _ in 0..ITERATIONS {
+            let mut vm = VirtualMachine::new(bytecode.clone());
+            vm.set_threads(threads);
+            let start = Instant::now();
+            vm.run().expect("runs");
+            total += start.elapsed();
+            result = vm.globals()[1].clone();
+        }
+        let expected = (ELEMENTS * (ELEMENTS + 1) / 2 + ELEMENTS * 100) as f64;
+        assert_eq!(result, Value::Number(expected), "{} threads", threads);
+
+        let mean = total / ITERATIONS;
+        let single = *single.get_or_insert(mean);
+        println!(
+            "threads {:>2}  mean {:>9.3} ms  speedup {:>5.2}x",
+            threads,
+            mean.as_secs_f64() * 1e3,
+            single.as_secs_f64() / mean.as_secs_f64()
+        );
+    }
+}
@@ -0,0 +1,99 @@
+// Pipeline fusion benchmark: `xs |> mul(2) |> add(1) |> greater(120) |> count`
+// and two shorter chains over 10k and 100k element arrays, compiled without
+// `-O` (one CALL_GLOBAL per stage, each building an intermediate array) and
+// with it (one fused PIPELINE). Counts heap allocations with a counting
+// global allocator, as benches/recursion.rs does. Each program builds its
+// array and then runs the pipeline PIPELINES times; a program that only
+// builds the array is measured too and subtracted, so the figures are per
+// pipeline run. Run with `cargo bench --bench pipelines`.
+
+use n::interpreter::VirtualMachine;
+use n::runtime::{Options, compile_source_with_options};
+use n::types::compiler::ByteCode;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+struct Counting;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: Counting = Counting;
+
+const ITERATIONS: usize = 5;
+const PIPELINES: usize = 20;
+
+const CHAINS: [(&str, &str); 3] = [
+    ("map+sum", "xs |> mul(2) |> add(1) |> sum"),
+    (
+        "map+compare",
+        "xs |> mul(2) |> add(1) |> greater(120) |> count",
+    ),
+    ("select", "xs |> mul(3) |> select(mask) |> sum"),
+];
+
+// Mean time and allocations per run, after a warmup.
+fn measure(bytecode: &ByteCode) -> (Duration, usize) {
+    let run = || VirtualMachine::new(bytecode.clone()).run().expect("runs");
+    run();
+    let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+    let start = Instant::now();
+    for _ in 0..ITERATIONS {
+        run();
+    }
+    let elapsed = start.elapsed() / ITERATIONS as u32;
+    let allocations = (ALLOCATIONS.load(Ordering::Relaxed) - allocations) / ITERATIONS;
+    (elapsed, allocations)
+}
+
+fn compile(source: &str, optimize: bool) -> ByteCode {
+    let options = Options {
+        optimize,
+        ..Options::default()
+    };
+    compile_source_with_options(source.to_string(), options).expect("compiles")
+}
+
+fn main() {
+    for count in [10_000, 100_000] {
+        let elements: Vec<String> = (0..count).map(|i| (i % 100).to_string()).collect();
+        let masks: Vec<&str> = (0..count)
+            .map(|i| if i % 3 == 0 { "true" } else { "false" })
+            .collect();
+        let setup = format!(
+            "let xs = [{}]\nlet mask = [{}]\n",
+            elements.join(", "),
+            masks.join(", ")
+        );
+        for (name, chain) in CHAINS {
+            let mut source = setup.clone();
+            for i in 0..PIPELINES {
+                source.push_str(&format!("let r{} = {}\n", i, chain));
+            }
+            for (label, optimize) in [("plain", false), ("fused", true)] {
+                let (base_time, base_allocations) = measure(&compile(&setup, optimize));
+                let (time, allocations) = measure(&compile(&source, optimize));
+                println!(
+                    "{:<12} {:<6} {:>7} elements  {:>9.3} ms  {:>7} allocations",
+                    name,
+                    label,
+                    count,
+                    time.saturating_sub(base_time).as_secs_f64() * 1e3 / PIPELINES as f64,
+                    allocations.saturating_sub(base_allocations) / PIPELINES
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,19 @@
+// Per-phase benchmark of whole programs: every program in tests/ and the
+// recursion, string building and array update workloads in
+// benches/workloads/, each through lex, parse, compile and execute with the
+// warmup and iterations of the `n bench` defaults. Programs that fail on
+// purpose, like tests/error_cases.n, are listed as skipped. Run with
+// `cargo bench --bench programs`, or `n bench` for the same report from the
+// command line.
+
+use n::bench::{self, Config};
+
+fn main() {
+    let root = env!("CARGO_MANIFEST_DIR");
+    let paths = [
+        format!("{}/tests", root),
+        format!("{}/benches/workloads", root),
+    ];
+    let ran = bench::run(&paths, Config::default()).expect("finds the programs");
+    assert!(ran > 0);
+}
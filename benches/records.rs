@@ -0,0 +1,199 @@
+// Record layout benchmark: 100k four-field records built and read through
+// shared shapes, as HeapObject::Record lays them out, against the HashMap
+// with String keys that HeapObject::Object used before. Counts the bytes each
+// layout holds with a counting global allocator, as benches/pipelines.rs
+// counts allocations, and times reading one field of every record: through a
+// warm inline cache, through a cold one that looks the key up in the shape,
+// and by hashing the key into the map. A record-heavy program is timed on
+// the VM too. Run with `cargo bench --bench records`.
+
+use n::interpreter::VirtualMachine;
+use n::runtime::compile_source;
+use n::shape::{InlineCache, Record, Shapes};
+use n::types::compiler::HeapObject;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::HashMap;
+use std::hint::black_box;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+struct Counting;
+
+static LIVE: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        LIVE.fetch_add(layout.size(), Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        LIVE.fetch_sub(layout.size(), Ordering::Relaxed);
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: Counting = Counting;
+
+const ITERATIONS: usize = 10;
+const RECORDS: usize = 100_000;
+const KEYS: [&str; 4] = ["name", "age", "city", "score"];
+
+fn fields(i: usize) -> Vec<HeapObject> {
+    vec![
+        HeapObject::String(Arc::new(format!("user{}", i % 100))),
+        HeapObject::Number(i as f64),
+        HeapObject::String(Arc::new("Stockholm".to_string())),
+        HeapObject::Boolean(i.is_multiple_of(2)),
+    ]
+}
+
+fn records(shapes: &mut Shapes) -> Vec<HeapObject> {
+    let shape = shapes.intern(KEYS.iter().map(|key| Arc::new(key.to_string())).collect());
+    (0..RECORDS)
+        .map(|i| HeapObject::Record(Record::new(shape.clone(), fields(i))))
+        .collect()
+}
+
+fn maps() -> Vec<HashMap<String, HeapObject>> {
+    (0..RECORDS)
+        .map(|i| {
+            KEYS.iter()
+                .map(|key| key.to_string())
+                .zip(fields(i))
+                .collect()
+        })
+        .collect()
+}
+
+// Bytes still allocated once `build` has returned what it built.
+fn held<T>(build: impl FnOnce() -> T) -> (T, usize) {
+    let before = LIVE.load(Ordering::Relaxed);
+    let built = build();
+    (built, LIVE.load(Ordering::Relaxed) - before)
+}
+
+fn time(mut run: impl FnMut() -> f64) -> (Duration, Duration) {
+    let mut total = Duration::ZERO;
+    let mut best = Duration::MAX;
+    for iteration in 0..=ITERATIONS {
+        let start = Instant::now();
+        black_box(run());
+        let elapsed = start.elapsed();
+        // The first run is warmup.
+        if iteration > 0 {
+            total += elapsed;
+            best = best.min(elapsed);
+        }
+    }
+    (total / ITERATIONS as u32, best)
+}
+
+fn age(field: &HeapObject) -> f64 {
+    match field {
+        HeapObject::Number(n) => *n,
+        _ => 0.0,
+    }
+}
+
+fn report(name: &str, (mean, best): (Duration, Duration)) {
+    println!(
+        "{:<28} mean {:>8.2} ms  best {:>8.2} ms  {:>6.1} ns/read",
+        name,
+        mean.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e9 / RECORDS as f64
+    );
+}
+
+// `step_k` updates a record 2^k times by threading it through two calls to
+// `step_{k-1}`, since the language has no loops yet.
+fn transform_workload(depth: usize) -> String {
+    let mut source = String::from(
+        "func step_0(r) {\n    r <- { count = r.count + 1, total = r.total + r.count }\n}\n",
+    );
+    for level in 1..depth {
+        source.push_str(&format!(
+            "func step_{level}(r) {{\n    step_{prev}(step_{prev}(r))\n}}\n",
+            prev = level - 1
+        ));
+    }
+    source.push_str(&format!(
+        "let result = step_{}({{ name = \"n\", count = 0, total = 0 }})\n",
+        depth - 1
+    ));
+    source
+}
+
+fn main() {
+    let mut shapes = Shapes::new();
+    let (records, record_bytes) = held(|| records(&mut shapes));
+    let (maps, map_bytes) = held(maps);
+    println!("{} records of {} fields", RECORDS, KEYS.len());
+    println!(
+        "{:<28} {:>8.1} MB  {:>5} bytes/record",
+        "shape + slots",
+        record_bytes as f64 / 1e6,
+        record_bytes / RECORDS
+    );
+    println!(
+        "{:<28} {:>8.1} MB  {:>5} bytes/record  {:>5.2}x",
+        "HashMap<String, _>",
+        map_bytes as f64 / 1e6,
+        map_bytes / RECORDS,
+        map_bytes as f64 / record_bytes as f64
+    );
+    println!();
+
+    let name = Arc::new("age".to_string());
+    let key = || Ok(name.clone());
+    let mut cache = InlineCache::Empty;
+    report(
+        "record, inline cache",
+        time(|| {
+            records
+                .iter()
+                .map(|record| match record {
+                    HeapObject::Record(record) => age(record.get(&mut cache, key).unwrap()),
+                    _ => 0.0,
+                })
+                .sum()
+        }),
+    );
+    report(
+        "record, shape lookup",
+        time(|| {
+            records
+                .iter()
+                .map(|record| match record {
+                    HeapObject::Record(record) => {
+                        age(record.get(&mut InlineCache::Empty, key).unwrap())
+                    }
+                    _ => 0.0,
+                })
+                .sum()
+        }),
+    );
+    report(
+        "HashMap<String, _>",
+        time(|| maps.iter().map(|map| age(&map["age"])).sum()),
+    );
+    println!();
+
+    for depth in [10, 14, 17] {
+        let bytecode = compile_source(transform_workload(depth), false).expect("workload failed");
+        let (mean, best) = time(|| {
+            let mut vm = VirtualMachine::new(bytecode.clone());
+            vm.run().expect("workload failed");
+            0.0
+        });
+        println!(
+            "{:<28} mean {:>8.2} ms  best {:>8.2} ms",
+            format!("{} record updates", 1 << (depth - 1)),
+            mean.as_secs_f64() * 1e3,
+            best.as_secs_f64() * 1e3
+        );
+    }
+}
@@ -0,0 +1,106 @@
+// Deep recursion benchmark: a recursive sum from 1 to n, once with the call
+// in tail position (`sum(n - 1, acc + n)`, compiled to TAIL_CALL) and once
+// without (`n + sum(n - 1)`), on the stack VM and on the register VM. Reports
+// time and the peak heap of each run, tracked by a counting global allocator:
+// the tail-recursive sum stays flat as n grows to a million while the plain
+// one grows linearly with its frames. Run with `cargo bench --bench recursion`.
+
+use n::interpreter::VirtualMachine;
+use n::register::RegisterMachine;
+use n::runtime::{Options, compile_source_with_options, lower_source_with_options};
+use n::types::compiler::Value;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+struct Counting;
+
+static LIVE: AtomicUsize = AtomicUsize::new(0);
+static PEAK: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let live = LIVE.fetch_add(layout.size(), Ordering::Relaxed) + layout.size();
+        PEAK.fetch_max(live, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        LIVE.fetch_sub(layout.size(), Ordering::Relaxed);
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: Counting = Counting;
+
+const ITERATIONS: usize = 5;
+
+const TAIL: &str = "func sum(n, acc) {\n    if n == 0 { acc } else { sum(n - 1, acc + n) }\n}\n";
+const PLAIN: &str = "func sum(n) {\n    if n == 0 { 0 } else { n + sum(n - 1) }\n}\n";
+
+// Mean time and peak heap over `ITERATIONS` runs of `run`, after a warmup.
+// The peak is what one run allocated above what was live before it.
+fn measure(mut run: impl FnMut() -> Value) -> (Duration, usize, Value) {
+    let mut result = run();
+    let mut total = Duration::ZERO;
+    let mut peak = 0;
+    for _ in 0..ITERATIONS {
+        let before = LIVE.load(Ordering::Relaxed);
+        PEAK.store(before, Ordering::Relaxed);
+        let start = Instant::now();
+        result = run();
+        total += start.elapsed();
+        peak = peak.max(PEAK.load(Ordering::Relaxed) - before);
+    }
+    (total / ITERATIONS as u32, peak, result)
+}
+
+fn report(name: &str, depth: usize, (mean, peak, result): (Duration, usize, Value)) {
+    let expected = (depth * (depth + 1) / 2) as f64;
+    assert_eq!(result, Value::Number(expected), "{} n={}", name, depth);
+    println!(
+        "{:<16} n={:<8} mean {:>9.3} ms  peak heap {:>10.1} KB",
+        name,
+        depth,
+        mean.as_secs_f64() * 1e3,
+        peak as f64 / 1024.0
+    );
+}
+
+fn bench(name: &str, function: &str, call: &str, depth: usize) {
+    let options = Options {
+        optimize: true,
+        ..Options::default()
+    };
+    let source = format!("{}let total = {}\n", function, call);
+
+    let bytecode = compile_source_with_options(source.clone(), options).expect("compiles");
+    report(
+        &format!("{} stack", name),
+        depth,
+        measure(|| {
+            let mut vm = VirtualMachine::new(bytecode.clone());
+            vm.run().expect("runs");
+            vm.globals()[0].clone()
+        }),
+    );
+
+    let registers = lower_source_with_options(source, options).expect("lowers");
+    report(
+        &format!("{} register", name),
+        depth,
+        measure(|| {
+            let mut vm = RegisterMachine::new(registers.clone());
+            vm.run().expect("runs");
+            vm.globals()[0].clone()
+        }),
+    );
+}
+
+fn main() {
+    for depth in [10_000, 100_000, 1_000_000] {
+        bench("tail", TAIL, &format!("sum({}, 0)", depth), depth);
+        bench("plain", PLAIN, &format!("sum({})", depth), depth);
+    }
+}
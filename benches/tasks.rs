@@ -0,0 +1,56 @@
+// Async task benchmark: starts 10 to 10000 tasks that each sleep 10 ms and
+// wait for the task before them, and reports the time of each run next to
+// the time the sleeps would take one after another. The tasks all wait at the
+// same time, so a run takes about 10 ms plus the scheduler's own work on
+// every task. Run with `cargo bench --bench tasks`.
+
+use n::interpreter::VirtualMachine;
+use n::runtime::{Options, compile_source_with_options};
+use n::types::compiler::Value;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: u32 = 5;
+const SLEEP_MS: u64 = 10;
+
+const SOURCE: &str = "\
+func nap(prev) {
+    let waited = await sleep(10)
+    (await prev) + 1
+}
+func zero() { 0 }
+func start(n, prev) {
+    if n == 0 { prev } else { start(n - 1, async nap(prev)) }
+}
+";
+
+fn main() {
+    let options = Options {
+        optimize: true,
+        ..Options::default()
+    };
+    for tasks in [10, 100, 1000, 10_000] {
+        let source = format!(
+            "{}let done = await start({}, async zero())\n",
+            SOURCE, tasks
+        );
+        let bytecode = compile_source_with_options(source, options).expect("compiles");
+        let mut total = Duration::ZERO;
+        for _ in 0..ITERATIONS {
+            let mut vm = VirtualMachine::new(bytecode.clone());
+            let start = Instant::now();
+            vm.run().expect("runs");
+            total += start.elapsed();
+            assert_eq!(vm.globals()[0], Value::Number(tasks as f64));
+        }
+
+        let mean = total / ITERATIONS;
+        let sequential = Duration::from_millis(SLEEP_MS * tasks as u64);
+        println!(
+            "tasks {:>5}  mean {:>9.3} ms  sequential {:>9.3} ms  {:>7.1}x",
+            tasks,
+            mean.as_secs_f64() * 1e3,
+            sequential.as_secs_f64() * 1e3,
+            sequential.as_secs_f64() / mean.as_secs_f64()
+        );
+    }
+}
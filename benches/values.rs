@@ -0,0 +1,102 @@
+// Value layout microbenchmark: the same numeric stack traffic over the
+// current 16-byte Value and over the wider layout it replaced, which held a
+// function's parameter list inline. Run with `cargo bench --bench values`.
+//
+// The kernel mimics `let t = (t + a) * 0.5` across the frames of a deep
+// recursion: read two neighbouring slots, store the result, then jump to a
+// slot far away in a stack of a million. Nearly every slot touched misses
+// the cache, so the width of a Value sets the memory traffic. Cache-resident
+// dispatch is covered by the dispatch benchmark.
+
+use n::types::compiler::Value;
+use std::hint::black_box;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+const ITERATIONS: usize = 20;
+const OPERATIONS: usize = 2_000_000;
+const DEEP_STACK: usize = 1 << 20;
+
+#[allow(dead_code)]
+#[derive(Clone)]
+enum WideValue {
+    Number(f64),
+    String(Arc<String>),
+    Boolean(bool),
+    Function { params: Vec<String>, offset: usize },
+    HeapPointer(usize),
+}
+
+trait Numeric: Clone {
+    fn number(n: f64) -> Self;
+    fn as_number(&self) -> f64;
+}
+
+impl Numeric for Value {
+    fn number(n: f64) -> Self {
+        Value::Number(n)
+    }
+
+    fn as_number(&self) -> f64 {
+        match self {
+            Value::Number(n) => *n,
+            _ => 0.0,
+        }
+    }
+}
+
+impl Numeric for WideValue {
+    fn number(n: f64) -> Self {
+        WideValue::Number(n)
+    }
+
+    fn as_number(&self) -> f64 {
+        match self {
+            WideValue::Number(n) => *n,
+            _ => 0.0,
+        }
+    }
+}
+
+fn frames<V: Numeric>() -> f64 {
+    let mut stack: Vec<V> = vec![V::number(1.0); DEEP_STACK];
+    let mut slot = 0;
+    for _ in 0..OPERATIONS {
+        // Stride through the stack like a chain of frames far apart.
+        slot = (slot + 4099) % DEEP_STACK;
+        let a = stack[slot].as_number();
+        let b = stack[(slot + 1) % DEEP_STACK].as_number();
+        stack[slot] = V::number((a + b) * 0.5);
+    }
+    black_box(stack[0].as_number())
+}
+
+fn bench<V: Numeric>(name: &str, kernel: fn() -> f64) {
+    let mut total = Duration::ZERO;
+    let mut best = Duration::MAX;
+    for iteration in 0..=ITERATIONS {
+        let start = Instant::now();
+        black_box(kernel());
+        let elapsed = start.elapsed();
+        // The first run is warmup.
+        if iteration > 0 {
+            total += elapsed;
+            best = best.min(elapsed);
+        }
+    }
+
+    let mean = total / ITERATIONS as u32;
+    println!(
+        "{:<8} {:>3} bytes/value  mean {:>8.3} ms  best {:>8.3} ms  {:>6.2} ns/op",
+        name,
+        std::mem::size_of::<V>(),
+        mean.as_secs_f64() * 1e3,
+        best.as_secs_f64() * 1e3,
+        mean.as_secs_f64() * 1e9 / OPERATIONS as f64
+    );
+}
+
+fn main() {
+    bench::<Value>("compact", frames::<Value>);
+    bench::<WideValue>("wide", frames::<WideValue>);
+}
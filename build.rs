@@ -0,0 +1,34 @@
+// Fingerprints the compiler for the compilation cache (see src/cache.rs): a
+// hash of every source file under src/, so that any change to the compiler
+// gives cached bytecode new keys, whether or not it changes the .nb format.
+use std::fs;
+use std::path::{Path, PathBuf};
+
+fn sources(dir: &Path, files: &mut Vec<PathBuf>) {
+    for entry in fs::read_dir(dir).expect("cannot read src/") {
+        let path = entry.expect("cannot read src/").path();
+        if path.is_dir() {
+            sources(&path, files);
+        } else {
+            files.push(path);
+        }
+    }
+}
+
+fn main() {
+    println!("cargo:rerun-if-changed=src");
+    let mut files = Vec::new();
+    sources(Path::new("src"), &mut files);
+    files.sort();
+
+    // 64-bit FNV-1a, as in src/cache.rs.
+    let mut hash: u64 = 0xcbf2_9ce4_8422_2325;
+    for file in &files {
+        let name = file.to_string_lossy();
+        let contents = fs::read(file).expect("cannot read source file");
+        for byte in name.as_bytes().iter().chain(&contents) {
+            hash = (hash ^ *byte as u64).wrapping_mul(0x0100_0000_01b3);
+        }
+    }
+    println!("cargo:rustc-env=N_COMPILER_FINGERPRINT={:016x}", hash);
+}
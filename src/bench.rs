@@ -0,0 +1,215 @@
+use crate::compiler::Compiler;
+use crate::interpreter::VirtualMachine;
+use crate::lexer::Lexer;
+use crate::optimizer;
+use crate::parser::Parser;
+use crate::runtime::{self, Engine, Options};
+use std::fmt;
+use std::fs;
+use std::hint::black_box;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+// The harness behind `n bench` and benches/programs.rs. Each program is run
+// from its source through every phase, `warmup` times untimed and then
+// `iterations` times timed, and every phase is reported on its own so a
+// regression shows up in the phase that caused it. The parser pulls its
+// tokens from the lexer as it goes, so `parse` includes lexing; `lex` is a
+// separate pass over the source that only lexes. `execute` covers building
+// the VM and running the program on it, with nothing printed.
+#[derive(Debug, Clone, Copy)]
+pub struct Config {
+    pub warmup: usize,
+    pub iterations: usize,
+    pub options: Options, // `optimize` and `engine` apply
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Self {
+            warmup: 3,
+            iterations: 10,
+            options: Options::default(),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Phases {
+    pub lex: Duration,
+    pub parse: Duration,
+    pub compile: Duration,
+    pub execute: Duration,
+}
+
+impl Phases {
+    pub fn total(&self) -> Duration {
+        self.parse + self.compile + self.execute
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Stats {
+    pub mean: Duration,
+    pub median: Duration,
+    pub min: Duration,
+    pub max: Duration,
+    pub stddev: Duration,
+}
+
+impl Stats {
+    pub fn of(samples: &[Duration]) -> Self {
+        let mut sorted = samples.to_vec();
+        sorted.sort();
+        let seconds: Vec<f64> = sorted.iter().map(Duration::as_secs_f64).collect();
+        let mean = seconds.iter().sum::<f64>() / seconds.len().max(1) as f64;
+        let variance = seconds.iter().map(|s| (s - mean) * (s - mean)).sum::<f64>()
+            / seconds.len().saturating_sub(1).max(1) as f64;
+        Self {
+            mean: Duration::from_secs_f64(mean),
+            median: sorted.get(sorted.len() / 2).copied().unwrap_or_default(),
+            min: sorted.first().copied().unwrap_or_default(),
+            max: sorted.last().copied().unwrap_or_default(),
+            stddev: Duration::from_secs_f64(variance.sqrt()),
+        }
+    }
+}
+
+pub struct Report {
+    pub name: String,
+    pub iterations: usize,
+    pub lex: Stats,
+    pub parse: Stats,
+    pub compile: Stats,
+    pub execute: Stats,
+    pub total: Stats,
+}
+
+// Times one run of `source` through every phase.
+pub fn measure(source: &str, options: Options) -> Result<Phases, String> {
+    let start = Instant::now();
+    black_box(Lexer::new(source).tokenize());
+    let lex = start.elapsed();
+
+    let start = Instant::now();
+    let ast = Parser::new(Lexer::new(source))
+        .parse()
+        .map_err(|e| format!("Parse error: {}", e))?;
+    let parse = start.elapsed();
+
+    let start = Instant::now();
+    let mut compiler = Compiler::with_optimization(options.optimize);
+    let mut bytecode = compiler
+        .compile(&ast)
+        .map_err(|e| format!("Compile error: {}", e))?;
+    if options.optimize {
+        optimizer::optimize(&mut bytecode);
+    }
+    let compile = start.elapsed();
+
+    let start = Instant::now();
+    let mut vm = VirtualMachine::new(bytecode);
+    if options.engine == Engine::Jit {
+        runtime::enable_jit(&mut vm)?;
+    }
+    vm.run().map_err(|e| format!("Runtime error: {}", e))?;
+    black_box(vm.globals());
+    let execute = start.elapsed();
+
+    Ok(Phases {
+        lex,
+        parse,
+        compile,
+        execute,
+    })
+}
+
+pub fn bench(name: &str, source: &str, config: Config) -> Result<Report, String> {
+    if config.options.engine == Engine::Register {
+        return Err("Benchmarks run on the stack VM".to_string());
+    }
+    for _ in 0..config.warmup {
+        measure(source, config.options)?;
+    }
+    let runs = (0..config.iterations.max(1))
+        .map(|_| measure(source, config.options))
+        .collect::<Result<Vec<_>, String>>()?;
+    let stats =
+        |phase: fn(&Phases) -> Duration| Stats::of(&runs.iter().map(phase).collect::<Vec<_>>());
+    Ok(Report {
+        name: name.to_string(),
+        iterations: runs.len(),
+        lex: stats(|phases| phases.lex),
+        parse: stats(|phases| phases.parse),
+        compile: stats(|phases| phases.compile),
+        execute: stats(|phases| phases.execute),
+        total: stats(Phases::total),
+    })
+}
+
+// The .n files `paths` name: files as they are, and for a directory every
+// .n file directly in it, by name.
+pub fn programs(paths: &[String]) -> Result<Vec<PathBuf>, String> {
+    let mut programs = Vec::new();
+    for path in paths {
+        let path = Path::new(path);
+        if !path.is_dir() {
+            programs.push(path.to_path_buf());
+            continue;
+        }
+        let entries = fs::read_dir(path)
+            .map_err(|err| format!("Error reading directory '{}': {}", path.display(), err))?;
+        let mut files: Vec<PathBuf> = entries
+            .filter_map(|entry| Some(entry.ok()?.path()))
+            .filter(|file| file.extension().is_some_and(|extension| extension == "n"))
+            .collect();
+        files.sort();
+        programs.extend(files);
+    }
+    Ok(programs)
+}
+
+// Benchmarks every program in `paths` with `config`, printing each report as
+// it completes. A program that fails, such as one of the error cases, is
+// reported and skipped; the result is how many ran.
+pub fn run(paths: &[String], config: Config) -> Result<usize, String> {
+    let mut ran = 0;
+    for program in programs(paths)? {
+        let name = program.display().to_string();
+        let source = runtime::read_source(&name)?;
+        match bench(&name, &source, config) {
+            Ok(report) => {
+                println!("{}", report);
+                ran += 1;
+            }
+            Err(e) => println!("{}\n  skipped: {}\n", name, e),
+        }
+    }
+    Ok(ran)
+}
+
+impl fmt::Display for Stats {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let ms = |duration: Duration| duration.as_secs_f64() * 1e3;
+        write!(
+            f,
+            "mean {:>9.3} ms  median {:>9.3} ms  min {:>9.3} ms  max {:>9.3} ms  stddev {:>8.3} ms",
+            ms(self.mean),
+            ms(self.median),
+            ms(self.min),
+            ms(self.max),
+            ms(self.stddev)
+        )
+    }
+}
+
+impl fmt::Display for Report {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(f, "{} ({} iterations)", self.name, self.iterations)?;
+        writeln!(f, "  lex      {}", self.lex)?;
+        writeln!(f, "  parse    {}", self.parse)?;
+        writeln!(f, "  compile  {}", self.compile)?;
+        writeln!(f, "  execute  {}", self.execute)?;
+        write!(f, "  total    {}", self.total)
+    }
+}
@@ -0,0 +1,403 @@
+use crate::types::compiler::{ByteCode, Function, Instruction, Value};
+use crate::types::constants::{
+    BYTECODE_ANONYMOUS_NAME, BYTECODE_HEADER_SIZE, BYTECODE_MAGIC, BYTECODE_VERSION,
+    CONSTANT_TAG_BOOLEAN, CONSTANT_TAG_NULL, CONSTANT_TAG_NUMBER, CONSTANT_TAG_STRING,
+};
+use std::sync::Arc;
+
+// Writer for the binary .nb format described in docs/BYTECODE.md. All
+// multi-byte fields are little-endian.
+pub fn encode(bytecode: &ByteCode) -> Result<Vec<u8>, String> {
+    let mut writer = Writer::new();
+
+    // Header
+    writer.bytes(BYTECODE_MAGIC);
+    writer.u16(BYTECODE_VERSION);
+    writer.u16(0); // flags
+    writer.u16(0); // reserved
+
+    // Constant table
+    writer.u16(narrow(bytecode.constants.len(), "constant count")?);
+    for constant in &bytecode.constants {
+        writer.value(constant)?;
+    }
+
+    // Function table
+    writer.u16(narrow(bytecode.functions.len(), "function count")?);
+    writer.u16(narrow(bytecode.globals, "global count")?);
+    for function in &bytecode.functions {
+        writer.u16(BYTECODE_ANONYMOUS_NAME);
+        writer.u8(narrow(function.params.len(), "argument count")?);
+        writer.u16(narrow(function.locals, "local count")?);
+        writer.u8(narrow(function.depth, "scope depth")?);
+        writer.u32(narrow(function.offset, "function offset")?);
+        for param in &function.params {
+            writer.string(param)?;
+        }
+    }
+
+    // Enum table
+    writer.u16(0);
+
+    // Instruction stream
+    writer.u32(narrow(bytecode.instructions.len(), "instruction count")?);
+    for instruction in &bytecode.instructions {
+        writer.instruction(instruction)?;
+    }
+
+    // Line table, run-length encoded as (line, run) pairs
+    let mut runs: Vec<(usize, usize)> = Vec::new();
+    for line in &bytecode.instruction_lines {
+        match runs.last_mut() {
+            Some((last_line, run)) if last_line == line => *run += 1,
+            _ => runs.push((*line, 1)),
+        }
+    }
+    writer.u32(narrow(runs.len(), "line table size")?);
+    for (line, run) in runs {
+        writer.u32(narrow(line, "line number")?);
+        writer.u32(narrow(run, "line run")?);
+    }
+
+    Ok(writer.buffer)
+}
+
+pub fn decode(bytes: &[u8]) -> Result<ByteCode, String> {
+    let mut reader = Reader::new(bytes);
+
+    reader.header()?;
+
+    let constant_count = reader.u16()? as usize;
+    let mut constants = Vec::with_capacity(constant_count);
+    for _ in 0..constant_count {
+        constants.push(reader.value()?);
+    }
+
+    let function_count = reader.u16()? as usize;
+    let globals = reader.u16()? as usize;
+    let mut functions = Vec::with_capacity(function_count);
+    for _ in 0..function_count {
+        functions.push(reader.function()?);
+    }
+
+    if reader.u16()? != 0 {
+        return Err("Enum tables are not supported yet".to_string());
+    }
+
+    let instruction_count = reader.u32()? as usize;
+    let mut instructions = Vec::with_capacity(instruction_count);
+    for _ in 0..instruction_count {
+        instructions.push(reader.instruction()?);
+    }
+
+    let run_count = reader.u32()? as usize;
+    let mut instruction_lines = Vec::with_capacity(instruction_count);
+    for _ in 0..run_count {
+        let line = reader.u32()? as usize;
+        let run = reader.u32()? as usize;
+        instruction_lines.extend(std::iter::repeat(line).take(run));
+    }
+    if instruction_lines.len() != instruction_count {
+        return Err(format!(
+            "Line table covers {} instructions, expected {}",
+            instruction_lines.len(),
+            instruction_count
+        ));
+    }
+
+    if !reader.is_empty() {
+        return Err("Trailing bytes after line table".to_string());
+    }
+
+    Ok(ByteCode {
+        constants,
+        functions,
+        globals,
+        instructions,
+        instruction_lines,
+    })
+}
+
+fn narrow<T: TryFrom<usize>>(value: usize, what: &str) -> Result<T, String> {
+    T::try_from(value).map_err(|_| format!("Bytecode {} {} is out of range", what, value))
+}
+
+struct Writer {
+    buffer: Vec<u8>,
+}
+
+impl Writer {
+    fn new() -> Self {
+        Self { buffer: Vec::new() }
+    }
+
+    fn bytes(&mut self, bytes: &[u8]) {
+        self.buffer.extend_from_slice(bytes);
+    }
+
+    fn u8(&mut self, value: u8) {
+        self.buffer.push(value);
+    }
+
+    fn u16(&mut self, value: u16) {
+        self.bytes(&value.to_le_bytes());
+    }
+
+    fn u32(&mut self, value: u32) {
+        self.bytes(&value.to_le_bytes());
+    }
+
+    fn string(&mut self, value: &str) -> Result<(), String> {
+        self.u16(narrow(value.len(), "string length")?);
+        self.bytes(value.as_bytes());
+        Ok(())
+    }
+
+    fn value(&mut self, value: &Value) -> Result<(), String> {
+        match value {
+            Value::String(s) => {
+                self.u8(CONSTANT_TAG_STRING);
+                self.string(s)?;
+            }
+            Value::Number(n) => {
+                self.u8(CONSTANT_TAG_NUMBER);
+                self.bytes(&n.to_le_bytes());
+            }
+            Value::Boolean(b) => {
+                self.u8(CONSTANT_TAG_BOOLEAN);
+                self.u8(*b as u8);
+            }
+            other => {
+                return Err(format!(
+                    "Cannot encode {} as a constant",
+                    other.type_name_stack()
+                ));
+            }
+        }
+        Ok(())
+    }
+
+    fn instruction(&mut self, instruction: &Instruction) -> Result<(), String> {
+        self.u8(instruction.opcode());
+        match instruction {
+            Instruction::StoreVar(depth, index)
+            | Instruction::LoadVar(depth, index)
+            | Instruction::LoadVarAdd(depth, index)
+            | Instruction::StoreVarKeep(depth, index) => {
+                self.u8(narrow(*depth as usize, "scope depth")?);
+                self.u16(narrow(*index as usize, "variable index")?);
+            }
+            Instruction::Call(index)
+            | Instruction::TailCall(index)
+            | Instruction::Map(index)
+            | Instruction::Filter(index)
+            | Instruction::Async(index) => self.u16(narrow(*index as usize, "function index")?),
+            Instruction::CallGlobal(index) => self.u16(narrow(*index as usize, "native index")?),
+            Instruction::Pipeline(stages) => self.u16(narrow(*stages as usize, "pipeline stages")?),
+            Instruction::LoadConst(index)
+            | Instruction::AddConst(index)
+            | Instruction::SubConst(index)
+            | Instruction::MulConst(index)
+            | Instruction::DivConst(index) => self.u16(narrow(*index as usize, "constant index")?),
+            Instruction::CreateArray(size) => self.u16(narrow(*size as usize, "array size")?),
+            Instruction::CreateRecord(first, count) => {
+                self.u16(narrow(*first as usize, "constant index")?);
+                self.u16(narrow(*count as usize, "record size")?);
+            }
+            Instruction::GetField(name) => self.u16(narrow(*name as usize, "constant index")?),
+            Instruction::Jump(addr)
+            | Instruction::JumpIfFalse(addr)
+            | Instruction::JumpIfTrue(addr)
+            | Instruction::EqualJumpIfFalse(addr)
+            | Instruction::LessJumpIfFalse(addr)
+            | Instruction::GreaterJumpIfFalse(addr) => self.u32(*addr),
+            Instruction::Return
+            | Instruction::Await
+            | Instruction::Add
+            | Instruction::Sub
+            | Instruction::Div
+            | Instruction::Mul
+            | Instruction::Equal
+            | Instruction::Less
+            | Instruction::Greater
+            | Instruction::Not
+            | Instruction::ConcatArray
+            | Instruction::Negate
+            | Instruction::Pop
+            | Instruction::Dup
+            | Instruction::Halt => {}
+        }
+        Ok(())
+    }
+}
+
+pub struct Reader<'a> {
+    bytes: &'a [u8],
+    position: usize,
+}
+
+impl<'a> Reader<'a> {
+    pub fn new(bytes: &'a [u8]) -> Self {
+        Self { bytes, position: 0 }
+    }
+
+    pub fn at(bytes: &'a [u8], position: usize) -> Self {
+        Self { bytes, position }
+    }
+
+    pub fn position(&self) -> usize {
+        self.position
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.position >= self.bytes.len()
+    }
+
+    pub fn take(&mut self, count: usize) -> Result<&'a [u8], String> {
+        let end = self
+            .position
+            .checked_add(count)
+            .filter(|end| *end <= self.bytes.len())
+            .ok_or_else(|| format!("Unexpected end of bytecode at byte {}", self.position))?;
+        let slice = &self.bytes[self.position..end];
+        self.position = end;
+        Ok(slice)
+    }
+
+    pub fn u8(&mut self) -> Result<u8, String> {
+        Ok(self.take(1)?[0])
+    }
+
+    pub fn u16(&mut self) -> Result<u16, String> {
+        let bytes = self.take(2)?;
+        Ok(u16::from_le_bytes([bytes[0], bytes[1]]))
+    }
+
+    pub fn u32(&mut self) -> Result<u32, String> {
+        let bytes = self.take(4)?;
+        Ok(u32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+    }
+
+    pub fn f64(&mut self) -> Result<f64, String> {
+        let mut raw = [0u8; 8];
+        raw.copy_from_slice(self.take(8)?);
+        Ok(f64::from_le_bytes(raw))
+    }
+
+    pub fn string(&mut self) -> Result<String, String> {
+        Ok(self.str()?.to_string())
+    }
+
+    // The string at the reader's position, checked to be UTF-8. Callers that
+    // keep it copy it: string constants become Arc<String>s at load.
+    pub fn str(&mut self) -> Result<&'a str, String> {
+        let length = self.u16()? as usize;
+        let bytes = self.take(length)?;
+        std::str::from_utf8(bytes).map_err(|_| "Invalid UTF-8 in string constant".to_string())
+    }
+
+    pub fn header(&mut self) -> Result<(), String> {
+        if self.bytes.len() < BYTECODE_HEADER_SIZE || &self.bytes[..2] != BYTECODE_MAGIC {
+            return Err("Not an n bytecode file (bad magic number)".to_string());
+        }
+        self.take(2)?;
+        let version = self.u16()?;
+        if version != BYTECODE_VERSION {
+            return Err(format!(
+                "Unsupported bytecode version {} (expected {})",
+                version, BYTECODE_VERSION
+            ));
+        }
+        let _flags = self.u16()?;
+        let _reserved = self.u16()?;
+        Ok(())
+    }
+
+    pub fn function(&mut self) -> Result<Function, String> {
+        let _name_index = self.u16()?;
+        let arg_count = self.u8()? as usize;
+        let locals = self.u16()? as usize;
+        let depth = self.u8()? as usize;
+        let offset = self.u32()? as usize;
+        let mut params = Vec::with_capacity(arg_count);
+        for _ in 0..arg_count {
+            params.push(self.string()?);
+        }
+        if locals < arg_count {
+            return Err(format!(
+                "Function at {} has {} locals for {} parameters",
+                offset, locals, arg_count
+            ));
+        }
+        Ok(Function {
+            params,
+            offset,
+            locals,
+            depth,
+        })
+    }
+
+    pub fn value(&mut self) -> Result<Value, String> {
+        match self.u8()? {
+            CONSTANT_TAG_STRING => Ok(Value::String(Arc::new(self.string()?))),
+            CONSTANT_TAG_NUMBER => Ok(Value::Number(self.f64()?)),
+            CONSTANT_TAG_BOOLEAN => Ok(Value::Boolean(self.u8()? != 0)),
+            CONSTANT_TAG_NULL => Err("Null constants are not supported yet".to_string()),
+            tag => Err(format!("Unknown constant type {}", tag)),
+        }
+    }
+
+    pub fn instruction(&mut self) -> Result<Instruction, String> {
+        let opcode = self.u8()?;
+        let instruction = match opcode {
+            0x01 => Instruction::StoreVar(self.u8()? as u32, self.u16()? as u32),
+            0x02 => Instruction::LoadVar(self.u8()? as u32, self.u16()? as u32),
+            0x03 => Instruction::TailCall(self.u16()? as u32),
+            0x04 => Instruction::Call(self.u16()? as u32),
+            0x05 => Instruction::Return,
+            0x06 => Instruction::LoadConst(self.u16()? as u32),
+            0x07 => Instruction::LoadVarAdd(self.u8()? as u32, self.u16()? as u32),
+            0x08 => Instruction::StoreVarKeep(self.u8()? as u32, self.u16()? as u32),
+            0x09 => Instruction::CallGlobal(self.u16()? as u32),
+            0x0A => Instruction::Pipeline(self.u16()? as u32),
+            0x0B => Instruction::Map(self.u16()? as u32),
+            0x0C => Instruction::Filter(self.u16()? as u32),
+            0x0D => Instruction::Async(self.u16()? as u32),
+            0x0E => Instruction::Await,
+            0x10 => Instruction::Add,
+            0x11 => Instruction::Sub,
+            0x12 => Instruction::Div,
+            0x13 => Instruction::Mul,
+            0x14 => Instruction::Equal,
+            0x15 => Instruction::Less,
+            0x16 => Instruction::Greater,
+            0x17 => Instruction::Not,
+            0x18 => Instruction::CreateArray(self.u16()? as u32),
+            0x19 => Instruction::ConcatArray,
+            0x1A => Instruction::Negate,
+            0x1B => Instruction::AddConst(self.u16()? as u32),
+            0x1C => Instruction::SubConst(self.u16()? as u32),
+            0x1D => Instruction::MulConst(self.u16()? as u32),
+            0x1E => Instruction::DivConst(self.u16()? as u32),
+            0x20 => Instruction::Jump(self.u32()?),
+            0x21 => Instruction::JumpIfFalse(self.u32()?),
+            0x22 => Instruction::JumpIfTrue(self.u32()?),
+            0x23 => Instruction::EqualJumpIfFalse(self.u32()?),
+            0x24 => Instruction::LessJumpIfFalse(self.u32()?),
+            0x25 => Instruction::GreaterJumpIfFalse(self.u32()?),
+            0x30 => Instruction::Pop,
+            0x32 => Instruction::Dup,
+            0x33 => Instruction::Halt,
+            0x40 => Instruction::CreateRecord(self.u16()? as u32, self.u16()? as u32),
+            0x41 => Instruction::GetField(self.u16()? as u32),
+            _ => {
+                return Err(format!(
+                    "Unknown opcode 0x{:02X} at byte {}",
+                    opcode,
+                    self.position - 1
+                ));
+            }
+        };
+        Ok(instruction)
+    }
+}
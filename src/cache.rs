@@ -0,0 +1,95 @@
+use crate::bytecode;
+use crate::mapped::MappedByteCode;
+use crate::runtime::Options;
+use crate::types::compiler::ByteCode;
+use crate::types::constants::{
+    BYTECODE_EXTENSION, BYTECODE_VERSION, CACHE_DIR_NAME, CACHE_DIR_VARIABLE,
+};
+use std::env;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process;
+
+// On-disk cache of compiled source files (`--cache`). An entry is an
+// ordinary .nb file named after a hash of everything its bytecode depends
+// on: the source text (with that of the modules it imports, as gathered by
+// modules::sources), the options that change code generation, a
+// fingerprint of the compiler (a hash of its sources, taken by build.rs) and
+// the bytecode format version. A source file that is
+// unchanged since it was last compiled maps its entry straight into the VM
+// (see mapped.rs) without being parsed or compiled; anything else misses and
+// gets an entry of its own. Entries are never updated in place, so nothing
+// has to be invalidated, and stale ones are simply left behind.
+//
+// Entries are written to a temporary file first and renamed into place, so
+// processes sharing a cache never map a file that is still being written.
+
+// Where the cache lives: $N_CACHE_DIR if set, otherwise the user's cache
+// directory.
+pub fn directory() -> PathBuf {
+    if let Some(dir) = env::var_os(CACHE_DIR_VARIABLE) {
+        return PathBuf::from(dir);
+    }
+    let base = env::var_os("XDG_CACHE_HOME")
+        .map(PathBuf::from)
+        .or_else(|| env::var_os("HOME").map(|home| Path::new(&home).join(".cache")))
+        .unwrap_or_else(env::temp_dir);
+    base.join(CACHE_DIR_NAME)
+}
+
+// The entry `source` compiled with `options` has in `dir`.
+pub fn entry(dir: &Path, source: &str, options: Options) -> PathBuf {
+    let mut hash = Fnv::new();
+    hash.write(env!("N_COMPILER_FINGERPRINT").as_bytes());
+    hash.write(&BYTECODE_VERSION.to_le_bytes());
+    hash.write(&[options.optimize as u8]);
+    hash.write(source.as_bytes());
+    dir.join(format!("{:016x}{}", hash.finish(), BYTECODE_EXTENSION))
+}
+
+// The cached bytecode of `source`, if there is a valid entry for it. An entry
+// that fails to open is treated as missing, and overwritten when stored.
+pub fn load(dir: &Path, source: &str, options: Options) -> Option<MappedByteCode> {
+    let path = entry(dir, source, options);
+    MappedByteCode::open(path.to_str()?).ok()
+}
+
+// Adds the bytecode compiled from `source` to the cache.
+pub fn store(
+    dir: &Path,
+    source: &str,
+    options: Options,
+    bytecode: &ByteCode,
+) -> Result<(), String> {
+    let bytes = bytecode::encode(bytecode)?;
+    let path = entry(dir, source, options);
+    let temporary = path.with_extension(format!("tmp{}", process::id()));
+    let write = || {
+        fs::create_dir_all(dir)?;
+        fs::write(&temporary, &bytes)?;
+        fs::rename(&temporary, &path)
+    };
+    write().map_err(|err| {
+        let _ = fs::remove_file(&temporary);
+        format!("Error writing cache entry '{}': {}", path.display(), err)
+    })
+}
+
+// 64-bit FNV-1a, which unlike std's hasher is the same on every build.
+pub(crate) struct Fnv(u64);
+
+impl Fnv {
+    pub(crate) fn new() -> Self {
+        Self(0xcbf2_9ce4_8422_2325)
+    }
+
+    pub(crate) fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.0 = (self.0 ^ *byte as u64).wrapping_mul(0x0100_0000_01b3);
+        }
+    }
+
+    pub(crate) fn finish(&self) -> u64 {
+        self.0
+    }
+}
@@ -1,197 +1,297 @@
+use crate::natives;
+use crate::optimizer::{self, Folded};
 use crate::types::ast::*;
 use std::collections::HashMap;
 use std::fmt;
+use std::sync::Arc;
 
 use crate::types::compiler::*;
 
 pub struct Compiler {
-    pub constants: Vec<Value>,
-    pub functions: HashMap<String, usize>,
-    pub function_table: Vec<Value>,
-    pub variables: Vec<HashMap<String, usize>>,
+    pub constants: ConstantPool,
+    pub functions: HashMap<Symbol, usize>,
+    pub function_table: Vec<Function>,
+    function_names: Vec<String>, // By index in function_table
+    // One scope per lexical depth, so `variables.len() == depth + 1`. A
+    // variable's index is its slot in the frame of the function at that depth.
+    pub variables: Vec<HashMap<Symbol, usize>>,
     pub instructions: Vec<Instruction>,
     pub instruction_lines: Vec<usize>,
-    pub current_function: Option<String>,
+    pub current_function: Option<Symbol>,
     pub depth: usize,
-    pub in_new_function: bool,
+    optimize: bool,
+    next_function: usize,
+    modules: bool,                   // Set by compile_module, which allows `import`
+    top_level: Vec<(Symbol, usize)>, // Top-level functions, which modules export
+}
+
+// Identity of a constant in the pool. Numbers compare by bit pattern and
+// strings by their interned symbol, so deduplicating a literal is one hash
+// lookup instead of a scan over every constant collected so far.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+enum ConstantKey {
+    Number(u64),
+    String(Symbol),
+    Boolean(bool),
+    Keys(Vec<Symbol>), // The first of a run of record keys
+}
+
+// Constant table shared by the stack compiler and the register lowering in
+// register.rs, so both engines number their literals the same way.
+#[derive(Debug, Clone, Default)]
+pub struct ConstantPool {
+    values: Vec<Value>,
+    index: HashMap<ConstantKey, u32>,
 }
 
 impl Compiler {
-    fn resolve_function_index(&self, name: &str) -> Result<usize, String> {
+    fn resolve_function_index(&self, program: &Program, name: Symbol) -> Result<u32, String> {
         self.functions
-            .get(name)
-            .cloned()
-            .ok_or_else(|| format!("Undefined function '{}'", name))
+            .get(&name)
+            .map(|index| *index as u32)
+            .ok_or_else(|| format!("Undefined function '{}'", program.name(name)))
     }
     pub fn new() -> Self {
+        Self::with_optimization(false)
+    }
+
+    // With `optimize` set, expressions built only from literals are folded to
+    // a single constant and unary minus compiles to NEGATE. The peephole pass
+    // in optimizer::optimize runs separately on the finished bytecode.
+    pub fn with_optimization(optimize: bool) -> Self {
         Self {
-            constants: Vec::new(),
+            constants: ConstantPool::default(),
             functions: HashMap::new(),
             function_table: Vec::new(),
-            variables: Vec::new(),
+            function_names: Vec::new(),
+            variables: vec![HashMap::new()],
             depth: 0,
             instructions: Vec::new(),
             instruction_lines: Vec::new(),
             current_function: None,
-            in_new_function: false,
+            optimize,
+            next_function: 0,
+            modules: false,
+            top_level: Vec::new(),
         }
     }
 
-    fn insert_variable(&mut self, name: &str) -> usize {
-        while self.variables.len() <= self.depth {
-            self.variables.push(HashMap::new());
-        }
-
-        if self.in_new_function {
-            self.variables[self.depth].clear();
-            self.in_new_function = false;
-        }
-
+    fn insert_variable(&mut self, name: Symbol) -> usize {
         let current_scope = &mut self.variables[self.depth];
         let local_index = current_scope.len(); // Next available index in this scope
-        current_scope.insert(name.to_string(), local_index);
+        current_scope.insert(name, local_index);
 
         local_index
     }
 
-    fn get_variable(&self, name: &str) -> Option<(usize, usize)> {
-        let mut result = None;
-        for (depth, scope) in self.variables.iter().enumerate() {
-            if depth > self.depth {
-                break;
-            }
-            if let Some(index) = scope.get(name) {
-                result = Some((*index, depth));
-            }
-        }
-        result
+    fn get_variable(&self, name: Symbol) -> Option<(usize, usize)> {
+        self.variables
+            .iter()
+            .enumerate()
+            .rev()
+            .find_map(|(depth, scope)| scope.get(&name).map(|index| (*index, depth)))
     }
 
     pub fn compile(&mut self, program: &Program) -> Result<ByteCode, String> {
-        self.collect_pass(&program.statements);
-        self.generate_instructions(&program.statements)?;
+        self.collect_pass(program, &program.statements, 0);
+        self.generate_instructions(program, &program.statements)?;
         self.instructions.push(Instruction::Halt);
         self.instruction_lines.push(self.current_line());
 
         Ok(ByteCode {
-            constants: self.constants.clone(),
+            constants: self.constants.values().to_vec(),
             functions: self.function_table.clone(),
+            globals: self.variables[0].len(),
             instructions: self.instructions.clone(),
             instruction_lines: self.instruction_lines.clone(),
         })
     }
 
-    fn collect_pass(&mut self, statements: &[Stmt]) {
+    // Compiles one module of a program built by modules.rs. The functions of
+    // the modules it imports come first in its function table, with their
+    // parameters but no code, and the linker points calls to them at their
+    // real entries. `import` itself compiles to nothing.
+    pub fn compile_module(
+        &mut self,
+        program: &Program,
+        imports: &[Export],
+    ) -> Result<ByteCode, String> {
+        for import in imports {
+            if let Some(name) = program.lookup(&import.name) {
+                self.functions.insert(name, self.function_table.len());
+            }
+            self.function_names.push(import.name.clone());
+            self.function_table.push(Function {
+                params: import.params.clone(),
+                offset: 0,
+                locals: 0,
+                depth: 1,
+            });
+        }
+        self.next_function = imports.len();
+        self.modules = true;
+        self.compile(program)
+    }
+
+    // The top-level functions of the program compiled last.
+    pub fn exports(&self, program: &Program) -> Vec<Export> {
+        self.top_level
+            .iter()
+            .map(|(name, index)| Export {
+                name: program.name(*name).to_string(),
+                params: self.function_table[*index].params.clone(),
+                index: *index,
+            })
+            .collect()
+    }
+
+    // The symbol table of the program compiled last.
+    pub fn symbols(&self, program: &Program) -> Symbols {
+        let globals = self.variables[0]
+            .iter()
+            .map(|(name, slot)| (program.name(*name).to_string(), *slot))
+            .collect();
+        Symbols {
+            globals,
+            functions: self.function_names.clone(),
+        }
+    }
+
+    // Registers every function with the lexical depth its body runs at, so a
+    // call can be checked for tail call eligibility before its callee has
+    // been compiled.
+    fn collect_pass(&mut self, program: &Program, statements: &[Stmt], depth: usize) {
         for stmt in statements {
             match stmt {
                 Stmt::Func {
                     name, params, body, ..
                 } => {
                     let function_index = self.function_table.len();
-                    self.functions.insert(name.clone(), function_index);
+                    self.functions.insert(*name, function_index);
+                    if depth == 0 {
+                        self.top_level.push((*name, function_index));
+                    }
 
-                    let function_value = Value::Function {
-                        params: params.clone(),
+                    self.function_names.push(program.name(*name).to_string());
+                    self.function_table.push(Function {
+                        params: params
+                            .iter()
+                            .map(|param| program.name(*param).to_string())
+                            .collect(),
                         offset: 0,
-                    };
-                    self.function_table.push(function_value);
-                    self.collect_pass(body);
+                        locals: 0,
+                        depth: depth + 1,
+                    });
+                    self.collect_pass(program, body, depth + 1);
                 }
                 Stmt::Let { value, .. } => {
-                    self.collect_constants_from_expr(value);
+                    self.collect_constants_from_expr(program, *value);
                 }
                 Stmt::Expr(expr, _) => {
-                    self.collect_constants_from_expr(expr);
+                    self.collect_constants_from_expr(program, *expr);
                 }
+                Stmt::Import { .. } => {}
             }
         }
     }
 
-    fn collect_constants_from_expr(&mut self, expr: &Expr) {
-        match expr {
-            Expr::Boolean(b) => {
-                let value = Value::Boolean(*b);
-                if !self.constants.iter().any(
-                    |c| matches!((c, &value), (Value::Boolean(a), Value::Boolean(b)) if a == b),
-                ) {
-                    self.constants.push(value);
-                }
-            }
-            Expr::Number(n) => {
-                let value = Value::Number(*n);
-                if !self
-                    .constants
-                    .iter()
-                    .any(|c| matches!((c, &value), (Value::Number(a), Value::Number(b)) if a == b))
-                {
-                    self.constants.push(value);
-                }
-            }
-            Expr::String(s) => {
-                let value = Value::String(s.clone());
-                if !self
-                    .constants
-                    .iter()
-                    .any(|c| matches!((c, &value), (Value::String(a), Value::String(b)) if a == b))
-                {
-                    self.constants.push(value);
-                }
+    fn collect_constants_from_expr(&mut self, program: &Program, expr: ExprId) {
+        if let Some(folded) = self.fold(program, expr) {
+            self.constants.folded(folded);
+            return;
+        }
+        match *program.expr(expr) {
+            Expr::Boolean(_) | Expr::Number(_) | Expr::String(_) => {
+                self.constants.literal(program, expr);
             }
             Expr::Binary { left, right, .. } => {
-                self.collect_constants_from_expr(left);
-                self.collect_constants_from_expr(right);
+                self.collect_constants_from_expr(program, left);
+                self.collect_constants_from_expr(program, right);
             }
             Expr::Call { func, args } => {
-                self.collect_constants_from_expr(func);
-                for arg in args {
-                    self.collect_constants_from_expr(arg);
+                self.collect_constants_from_expr(program, func);
+                for arg in program.list(args) {
+                    self.collect_constants_from_expr(program, *arg);
                 }
             }
             Expr::Pipeline { left, right } => {
-                self.collect_constants_from_expr(left);
-                self.collect_constants_from_expr(right);
+                self.collect_constants_from_expr(program, left);
+                self.collect_constants_from_expr(program, right);
             }
-            Expr::Unary { right, .. } => {
-                self.collect_constants_from_expr(right);
+            Expr::Unary { right, .. } | Expr::Async { call: right } | Expr::Await { right } => {
+                self.collect_constants_from_expr(program, right);
             }
             Expr::Update { left, right } => {
-                self.collect_constants_from_expr(left);
-                self.collect_constants_from_expr(right);
+                self.collect_constants_from_expr(program, left);
+                self.collect_constants_from_expr(program, right);
             }
             Expr::Array { elements } => {
-                for element in elements {
-                    self.collect_constants_from_expr(element);
+                for element in program.list(elements) {
+                    self.collect_constants_from_expr(program, *element);
+                }
+            }
+            Expr::Record { fields } => {
+                let (keys, values) = record_fields(program, fields);
+                self.constants.keys(program, &keys);
+                for value in values {
+                    self.collect_constants_from_expr(program, value);
                 }
             }
+            Expr::Field { record, name } => {
+                self.collect_constants_from_expr(program, record);
+                self.constants.string(program, name);
+            }
+            Expr::If {
+                cond,
+                then,
+                otherwise,
+            } => {
+                self.collect_constants_from_expr(program, cond);
+                self.collect_constants_from_expr(program, then);
+                self.collect_constants_from_expr(program, otherwise);
+            }
             Expr::Identifier(_) => {}
         }
     }
 
-    fn generate_instructions(&mut self, statements: &[Stmt]) -> Result<(), String> {
+    fn generate_instructions(
+        &mut self,
+        program: &Program,
+        statements: &[Stmt],
+    ) -> Result<(), String> {
         for stmt in statements {
-            self.compile_statement(stmt, false)?;
+            self.compile_statement(program, stmt, false)?;
         }
         Ok(())
     }
 
-    fn compile_statement(&mut self, stmt: &Stmt, last: bool) -> Result<(), String> {
+    fn compile_statement(
+        &mut self,
+        program: &Program,
+        stmt: &Stmt,
+        last: bool,
+    ) -> Result<(), String> {
         match stmt {
             Stmt::Let { name, value, line } => {
-                self.compile_expression(value)?;
-                let var_index = match self.get_or_create_variable_index(name) {
+                self.compile_expression(program, *value)?;
+                let var_index = match self.get_or_create_variable_index(*name) {
                     VarOutput::Created { index, .. } => index,
                     VarOutput::GotCurrentScope { .. } => {
                         return Err(format!(
                             "Variable '{}' is already defined in the current scope",
-                            name
+                            program.name(*name)
                         ));
                     }
-                    VarOutput::GotOuterScope { .. } => self.insert_variable(name),
+                    VarOutput::GotOuterScope { .. } => self.insert_variable(*name),
                 };
 
-                self.push_with_line(Instruction::StoreVar(self.depth, var_index), *line);
+                self.push_with_line(
+                    Instruction::StoreVar(self.depth as u32, var_index as u32),
+                    *line,
+                );
                 if last {
-                    self.push_with_line(Instruction::Push(Value::Number(0.0)), *line); // TEMP MEASURE, REPLACE THIS ONCE ENUMS ARE IMPLEMENTED PLEASE !!!
+                    let zero = self.constants.number(0.0);
+                    self.push_with_line(Instruction::LoadConst(zero), *line); // TEMP MEASURE, REPLACE THIS ONCE ENUMS ARE IMPLEMENTED PLEASE !!!
                 }
             }
             Stmt::Func {
@@ -202,47 +302,73 @@ impl Compiler {
             } => {
                 let jump_over_function = self.instructions.len();
                 self.push_with_line(Instruction::Jump(0), *line);
-                self.depth += 1;
-                self.in_new_function = true;
-                if let Some(function_index) = self.functions.get(name).cloned() {
-                    if let Some(Value::Function { params, .. }) =
-                        self.function_table.get_mut(function_index)
-                    {
-                        let param_count = params.len();
-                        let params = params.clone();
-                        self.function_table[function_index] = Value::Function {
-                            params,
-                            offset: self.instructions.len(),
-                        };
-
-                        if param_count > 0 {
-                            self.push_with_line(Instruction::LoadArg(param_count), *line);
-                        }
-                    }
-                }
 
-                let old_function = self.current_function.clone();
-
-                self.current_function = Some(name.clone());
+                // Functions are compiled in the same order collect_pass
+                // registered them, so the table entry is found positionally.
+                let function_index = self.next_function;
+                self.next_function += 1;
 
+                self.depth += 1;
+                self.variables.push(HashMap::new());
                 for param_name in params.iter() {
-                    let _ = self.get_or_create_variable_index(param_name);
+                    if self.variables[self.depth].contains_key(param_name) {
+                        return Err(format!(
+                            "Duplicate parameter '{}' in function '{}'",
+                            program.name(*param_name),
+                            program.name(*name)
+                        ));
+                    }
+                    self.insert_variable(*param_name);
                 }
 
+                let offset = self.instructions.len();
+                let old_function = self.current_function.replace(*name);
+
                 for (i, body_stmt) in body.iter().enumerate() {
                     let last = i == body.len() - 1;
-                    self.compile_statement(body_stmt, last)?;
+                    self.compile_statement(program, body_stmt, last)?;
                 }
-                self.depth -= 1;
 
+                // A call always leaves exactly one value behind, so a body that
+                // is empty or ends in a nested definition returns 0.
+                if !matches!(body.last(), Some(Stmt::Let { .. } | Stmt::Expr(..))) {
+                    let zero = self.constants.number(0.0);
+                    self.push_with_line(Instruction::LoadConst(zero), *line);
+                }
                 self.push_with_line(Instruction::Return, *line);
+
+                let locals = self.variables.pop().map_or(0, |scope| scope.len());
+                let function = &mut self.function_table[function_index];
+                function.offset = offset;
+                function.locals = locals;
+                function.depth = self.depth;
+
+                self.depth -= 1;
                 self.current_function = old_function;
 
                 let after_function = self.instructions.len();
-                self.instructions[jump_over_function] = Instruction::Jump(after_function);
+                self.instructions[jump_over_function] = Instruction::Jump(after_function as u32);
+            }
+            Stmt::Import { line, .. } => {
+                if !self.modules {
+                    return Err(format!(
+                        "import at line {} needs the program to be compiled from its file",
+                        line
+                    ));
+                }
+                if self.depth > 0 {
+                    return Err(format!(
+                        "import is only allowed at the top level of a file, found one at line {}",
+                        line
+                    ));
+                }
             }
             Stmt::Expr(expr, line) => {
-                self.compile_expression(expr)?;
+                if last && self.depth > 0 {
+                    self.compile_tail_expression(program, *expr)?;
+                } else {
+                    self.compile_expression(program, *expr)?;
+                }
                 if !last {
                     self.push_with_line(Instruction::Pop, *line);
                 }
@@ -251,31 +377,26 @@ impl Compiler {
         Ok(())
     }
 
-    fn compile_expression(&mut self, expr: &Expr) -> Result<(), String> {
-        match expr {
-            Expr::Boolean(b) => {
-                let const_index = self.get_constant_index(&Value::Boolean(*b));
-                self.push(Instruction::LoadConst(const_index));
-            }
-            Expr::Number(n) => {
-                let const_index = self.get_constant_index(&Value::Number(*n));
-                self.push(Instruction::LoadConst(const_index));
-            }
-            Expr::String(s) => {
-                let const_index = self.get_constant_index(&Value::String(s.clone()));
+    fn compile_expression(&mut self, program: &Program, expr: ExprId) -> Result<(), String> {
+        if let Some(folded) = self.fold(program, expr) {
+            let const_index = self.constants.folded(folded);
+            self.push(Instruction::LoadConst(const_index));
+            return Ok(());
+        }
+        match *program.expr(expr) {
+            Expr::Boolean(_) | Expr::Number(_) | Expr::String(_) => {
+                let const_index = self.constants.literal(program, expr);
                 self.push(Instruction::LoadConst(const_index));
             }
             Expr::Identifier(name) => {
-                let (var_index, fetch_depth) = match self.get_or_create_variable_index(name) {
-                    VarOutput::Created { index, depth } => (index, depth),
-                    VarOutput::GotCurrentScope { index, depth } => (index, depth),
-                    VarOutput::GotOuterScope { index, depth } => (index, depth),
-                };
-                self.push(Instruction::LoadVar(fetch_depth, var_index));
+                let (var_index, fetch_depth) = self
+                    .get_variable(name)
+                    .ok_or_else(|| format!("Undefined variable '{}'", program.name(name)))?;
+                self.push(Instruction::LoadVar(fetch_depth as u32, var_index as u32));
             }
             Expr::Binary { left, op, right } => {
-                self.compile_expression(left)?;
-                self.compile_expression(right)?;
+                self.compile_expression(program, left)?;
+                self.compile_expression(program, right)?;
                 match op {
                     BinaryOp::Add => self.push(Instruction::Add),
                     BinaryOp::Sub => self.push(Instruction::Sub),
@@ -296,80 +417,339 @@ impl Compiler {
                 }
             }
             Expr::Call { func, args } => {
-                for arg in args.iter().rev() {
-                    self.compile_expression(arg)?;
+                // Arguments are pushed in order and become the callee's first
+                // local slots.
+                let args = program.list(args);
+                if let Expr::Identifier(name) = *program.expr(func)
+                    && self.compile_map(program, name, args)?
+                {
+                    return Ok(());
+                }
+                for arg in args {
+                    self.compile_expression(program, *arg)?;
                 }
 
-                if let Expr::Identifier(func_name) = func.as_ref() {
-                    let function_index = self.resolve_function_index(func_name)?;
-                    self.push(Instruction::Call(function_index));
-                } else {
-                    self.compile_expression(func)?;
+                match *program.expr(func) {
+                    Expr::Identifier(func_name) => {
+                        self.emit_call(program, func_name, args.len(), false)?
+                    }
+                    _ => return Err("Only named functions can be called".to_string()),
                 }
             }
-            Expr::Pipeline { left, right } => {
-                self.compile_expression(left)?;
-
-                match right.as_ref() {
-                    Expr::Call { func, args } => {
-                        for arg in args.iter().rev() {
-                            self.compile_expression(arg)?;
-                        }
-                        if let Expr::Identifier(func_name) = func.as_ref() {
-                            let function_index = self.resolve_function_index(func_name)?;
-                            self.push(Instruction::Call(function_index));
+            Expr::Pipeline { left, right } => match self.fused_pipeline(program, expr) {
+                Some(fused) => self.compile_fused_pipeline(program, fused)?,
+                None => {
+                    if let Expr::Call { func, args } = *program.expr(right)
+                        && let Expr::Identifier(name) = *program.expr(func)
+                    {
+                        let args: Vec<ExprId> = std::iter::once(left)
+                            .chain(program.list(args).iter().copied())
+                            .collect();
+                        if self.compile_map(program, name, &args)? {
+                            return Ok(());
                         }
                     }
-                    Expr::Identifier(func_name) => {
-                        let function_index = self.resolve_function_index(func_name)?;
-                        self.push(Instruction::Call(function_index));
-                    }
-                    _ => {
-                        println!("right: {:?}", right);
-                        self.compile_expression(right)?;
+                    self.compile_expression(program, left)?;
+
+                    match *program.expr(right) {
+                        Expr::Call { func, args } => {
+                            let args = program.list(args);
+                            for arg in args {
+                                self.compile_expression(program, *arg)?;
+                            }
+                            match *program.expr(func) {
+                                Expr::Identifier(func_name) => {
+                                    self.emit_call(program, func_name, args.len() + 1, false)?
+                                }
+                                _ => return Err("Only named functions can be called".to_string()),
+                            }
+                        }
+                        Expr::Identifier(func_name) => {
+                            self.emit_call(program, func_name, 1, false)?
+                        }
+                        _ => {
+                            self.compile_expression(program, right)?;
+                        }
                     }
                 }
-            }
+            },
             Expr::Unary { op, right } => match op {
+                UnaryOp::Neg if self.optimize => {
+                    self.compile_expression(program, right)?;
+                    self.push(Instruction::Negate);
+                }
                 UnaryOp::Neg => {
-                    self.push(Instruction::Push(Value::Number(0.0)));
-                    self.compile_expression(right)?;
+                    let zero = self.constants.number(0.0);
+                    self.push(Instruction::LoadConst(zero));
+                    self.compile_expression(program, right)?;
                     self.push(Instruction::Sub);
                 }
                 UnaryOp::Not => {
-                    self.compile_expression(right)?;
+                    self.compile_expression(program, right)?;
                     self.push(Instruction::Not);
                 }
             },
             Expr::Update { left, right } => {
                 // Compile left and right arrays onto the stack, then concatenate
-                self.compile_expression(left)?;
-                self.compile_expression(right)?;
+                self.compile_expression(program, left)?;
+                self.compile_expression(program, right)?;
                 self.push(Instruction::ConcatArray);
             }
             Expr::Array { elements } => {
-                for element in elements.iter() {
-                    self.compile_expression(element)?;
+                let elements = program.list(elements);
+                for element in elements {
+                    self.compile_expression(program, *element)?;
                 }
-                self.push(Instruction::CreateArray(elements.len()));
+                self.push(Instruction::CreateArray(elements.len() as u32));
+            }
+            // The fields go on the stack in source order, the order of the
+            // record's keys in the constant pool.
+            Expr::Record { fields } => {
+                let (keys, values) = record_fields(program, fields);
+                for value in &values {
+                    self.compile_expression(program, *value)?;
+                }
+                let first = self.constants.keys(program, &keys);
+                self.push(Instruction::CreateRecord(first, keys.len() as u32));
+            }
+            Expr::Field { record, name } => {
+                self.compile_expression(program, record)?;
+                let name = self.constants.string(program, name);
+                self.push(Instruction::GetField(name));
+            }
+            Expr::If {
+                cond,
+                then,
+                otherwise,
+            } => self.compile_if(program, cond, then, otherwise, false)?,
+            Expr::Async { call } => self.compile_async(program, call)?,
+            Expr::Await { right } => {
+                self.compile_expression(program, right)?;
+                self.push(Instruction::Await);
             }
         }
         Ok(())
     }
 
-    fn get_constant_index(&self, value: &Value) -> usize {
-        self.constants
-            .iter()
-            .position(|c| match (c, value) {
-                (Value::Number(a), Value::Number(b)) => a == b,
-                (Value::String(a), Value::String(b)) => a == b,
-                (Value::Boolean(a), Value::Boolean(b)) => a == b,
-                _ => false,
-            })
-            .unwrap_or(0)
+    // `async f(args)` evaluates the arguments and starts the call as a new
+    // task (see scheduler.rs), evaluating to its future. As with map, f must
+    // be a top-level function: the task has no frames but its own.
+    fn compile_async(&mut self, program: &Program, call: ExprId) -> Result<(), String> {
+        let Expr::Call { func, args } = *program.expr(call) else {
+            return Err("Expected a function call after 'async'".to_string());
+        };
+        let (name, function) = match *program.expr(func) {
+            Expr::Identifier(name) => self.functions.get(&name).map(|index| (name, *index)),
+            _ => None,
+        }
+        .filter(|(_, index)| self.function_table[*index].depth == 1)
+        .ok_or("async expects a call to a top-level function")?;
+        let args = program.list(args);
+        let arity = self.function_table[function].params.len();
+        if arity != args.len() {
+            return Err(format!(
+                "Function '{}' expects {} arguments, got {}",
+                program.name(name),
+                arity,
+                args.len()
+            ));
+        }
+        for arg in args {
+            self.compile_expression(program, *arg)?;
+        }
+        self.push(Instruction::Async(function as u32));
+        Ok(())
+    }
+
+    // An expression whose value the function returns: the last one in a
+    // body, or a branch of an if in that position. A call there becomes a
+    // TAIL_CALL, so self-recursion runs in a constant number of frames.
+    fn compile_tail_expression(&mut self, program: &Program, expr: ExprId) -> Result<(), String> {
+        match *program.expr(expr) {
+            Expr::Call { func, args } => {
+                let Expr::Identifier(func_name) = *program.expr(func) else {
+                    return Err("Only named functions can be called".to_string());
+                };
+                let args = program.list(args);
+                if self.compile_map(program, func_name, args)? {
+                    return Ok(());
+                }
+                for arg in args {
+                    self.compile_expression(program, *arg)?;
+                }
+                self.emit_call(program, func_name, args.len(), true)
+            }
+            Expr::If {
+                cond,
+                then,
+                otherwise,
+            } => self.compile_if(program, cond, then, otherwise, true),
+            _ => self.compile_expression(program, expr),
+        }
+    }
+
+    fn compile_if(
+        &mut self,
+        program: &Program,
+        cond: ExprId,
+        then: ExprId,
+        otherwise: ExprId,
+        tail: bool,
+    ) -> Result<(), String> {
+        self.compile_expression(program, cond)?;
+        let jump_to_else = self.instructions.len();
+        self.push(Instruction::JumpIfFalse(0));
+        match tail {
+            true => self.compile_tail_expression(program, then)?,
+            false => self.compile_expression(program, then)?,
+        }
+        let jump_to_end = self.instructions.len();
+        self.push(Instruction::Jump(0));
+
+        self.instructions[jump_to_else] = Instruction::JumpIfFalse(self.instructions.len() as u32);
+        match tail {
+            true => self.compile_tail_expression(program, otherwise)?,
+            false => self.compile_expression(program, otherwise)?,
+        }
+        self.instructions[jump_to_end] = Instruction::Jump(self.instructions.len() as u32);
+        Ok(())
+    }
+
+    // With `tail` set the call replaces the current frame, unless the callee
+    // is nested deeper than the caller: it may then read the caller's locals
+    // through the display, so the frame has to stay.
+    fn emit_call(
+        &mut self,
+        program: &Program,
+        name: Symbol,
+        arg_count: usize,
+        tail: bool,
+    ) -> Result<(), String> {
+        if !self.functions.contains_key(&name) {
+            if let Some(index) = natives::lookup(program.name(name)) {
+                return self.emit_native_call(program, name, index, arg_count);
+            }
+        }
+        let function_index = self.resolve_function_index(program, name)?;
+        let function = &self.function_table[function_index as usize];
+        let arity = function.params.len();
+        let tail = tail && function.depth <= self.depth;
+        if arity != arg_count {
+            return Err(format!(
+                "Function '{}' expects {} arguments, got {}",
+                program.name(name),
+                arity,
+                arg_count
+            ));
+        }
+        self.push(match tail {
+            true => Instruction::TailCall(function_index),
+            false => Instruction::Call(function_index),
+        });
+        Ok(())
+    }
+
+    // `map(xs, f)` and `filter(xs, f)`, unless the program defines a function
+    // of that name, compile to MAP or FILTER, which call f on every element
+    // of xs, possibly on several threads at once. f must name a top-level
+    // function of one argument, since the worker threads have no frames for
+    // another function's locals. For a pipeline, `args` starts with its left
+    // side. Returns false, having emitted nothing, for any other call.
+    fn compile_map(
+        &mut self,
+        program: &Program,
+        name: Symbol,
+        args: &[ExprId],
+    ) -> Result<bool, String> {
+        let builtin = program.name(name);
+        if !is_map(builtin) || self.functions.contains_key(&name) {
+            return Ok(false);
+        }
+        let &[source, function] = args else {
+            return Err(format!(
+                "Function '{}' expects 2 arguments, got {}",
+                builtin,
+                args.len()
+            ));
+        };
+        let function = match *program.expr(function) {
+            Expr::Identifier(function) => self.functions.get(&function).copied(),
+            _ => None,
+        }
+        .filter(|index| {
+            let function = &self.function_table[*index];
+            function.depth == 1 && function.params.len() == 1
+        })
+        .ok_or_else(|| {
+            format!(
+                "{} expects the name of a top-level function of one argument",
+                builtin
+            )
+        })? as u32;
+        self.compile_expression(program, source)?;
+        self.push(match builtin {
+            "map" => Instruction::Map(function),
+            _ => Instruction::Filter(function),
+        });
+        Ok(true)
+    }
+
+    fn fused_pipeline(&self, program: &Program, expr: ExprId) -> Option<FusedPipeline> {
+        match self.optimize {
+            true => fused_pipeline(program, expr, &self.functions),
+            false => None,
+        }
+    }
+
+    // The source, then every stage's argument, then the stages.
+    fn compile_fused_pipeline(
+        &mut self,
+        program: &Program,
+        fused: FusedPipeline,
+    ) -> Result<(), String> {
+        self.compile_expression(program, fused.source)?;
+        for arg in fused.stages.iter().filter_map(|(_, arg)| *arg) {
+            self.compile_expression(program, arg)?;
+        }
+        self.push(Instruction::Pipeline(fused.stages.len() as u32));
+        for (native, _) in &fused.stages {
+            self.push(Instruction::CallGlobal(*native));
+        }
+        Ok(())
+    }
+
+    // A built-in never has a frame to replace, so tail position changes
+    // nothing.
+    fn emit_native_call(
+        &mut self,
+        program: &Program,
+        name: Symbol,
+        index: u32,
+        arg_count: usize,
+    ) -> Result<(), String> {
+        let arity = natives::NATIVES[index as usize].arity;
+        if arity != arg_count {
+            return Err(format!(
+                "Function '{}' expects {} arguments, got {}",
+                program.name(name),
+                arity,
+                arg_count
+            ));
+        }
+        self.push(Instruction::CallGlobal(index));
+        Ok(())
+    }
+
+    fn fold(&self, program: &Program, expr: ExprId) -> Option<Folded> {
+        match program.expr(expr) {
+            Expr::Unary { .. } | Expr::Binary { .. } if self.optimize => {
+                optimizer::fold(program, expr)
+            }
+            _ => None,
+        }
     }
 
-    fn get_or_create_variable_index(&mut self, name: &str) -> VarOutput {
+    fn get_or_create_variable_index(&mut self, name: Symbol) -> VarOutput {
         if let Some((index, depth)) = self.get_variable(name) {
             if depth == self.depth {
                 VarOutput::GotCurrentScope { index, depth }
@@ -386,6 +766,69 @@ impl Compiler {
     }
 }
 
+impl ConstantPool {
+    // Returns the pool index of a literal expression, adding it on first use.
+    pub fn literal(&mut self, program: &Program, expr: ExprId) -> u32 {
+        match *program.expr(expr) {
+            Expr::Number(n) => self.number(n),
+            Expr::Boolean(b) => self.boolean(b),
+            Expr::String(s) => self.string(program, s),
+            _ => unreachable!("only literals are pooled"),
+        }
+    }
+
+    pub fn string(&mut self, program: &Program, s: Symbol) -> u32 {
+        self.insert(ConstantKey::String(s), || {
+            Value::String(Arc::new(program.name(s).to_string()))
+        })
+    }
+
+    // The index of the first of `keys`, pooled as consecutive strings so
+    // CREATE_RECORD can name them all by one index and a count. Literals with
+    // the same keys in the same order share the run.
+    pub fn keys(&mut self, program: &Program, keys: &[Symbol]) -> u32 {
+        let key = ConstantKey::Keys(keys.to_vec());
+        if let Some(first) = self.index.get(&key) {
+            return *first;
+        }
+        let first = self.values.len() as u32;
+        self.values.extend(
+            keys.iter()
+                .map(|key| Value::String(Arc::new(program.name(*key).to_string()))),
+        );
+        self.index.insert(key, first);
+        first
+    }
+
+    pub fn folded(&mut self, folded: Folded) -> u32 {
+        match folded {
+            Folded::Number(n) => self.number(n),
+            Folded::Boolean(b) => self.boolean(b),
+        }
+    }
+
+    pub fn number(&mut self, n: f64) -> u32 {
+        self.insert(ConstantKey::Number(n.to_bits()), || Value::Number(n))
+    }
+
+    pub fn boolean(&mut self, b: bool) -> u32 {
+        self.insert(ConstantKey::Boolean(b), || Value::Boolean(b))
+    }
+
+    pub fn values(&self) -> &[Value] {
+        &self.values
+    }
+
+    // The collect pass adds every literal in source order; constants
+    // synthesized during code generation are appended when first needed.
+    fn insert(&mut self, key: ConstantKey, value: impl FnOnce() -> Value) -> u32 {
+        *self.index.entry(key).or_insert_with(|| {
+            self.values.push(value());
+            self.values.len() as u32 - 1
+        })
+    }
+}
+
 impl Compiler {
     fn current_line(&self) -> usize {
         *self.instruction_lines.last().unwrap_or(&1)
@@ -404,16 +847,100 @@ impl Compiler {
     }
 }
 
+// The keys of a record literal, and its values in the same order.
+pub(crate) fn record_fields(program: &Program, fields: ExprList) -> (Vec<Symbol>, Vec<ExprId>) {
+    program
+        .list(fields)
+        .chunks(2)
+        .map(|field| match *program.expr(field[0]) {
+            Expr::String(key) => (key, field[1]),
+            _ => unreachable!("record keys are strings"),
+        })
+        .unzip()
+}
+
+// The built-ins compiled to MAP and FILTER rather than CALL_GLOBAL.
+pub(crate) fn is_map(name: &str) -> bool {
+    matches!(name, "map" | "filter")
+}
+
+// A chain of built-in array stages, `source |> mul(2) |> greater(5) |> count`,
+// that runs as one PIPELINE; see natives::fuses. Each stage is a native and
+// its argument, if it takes one besides the array.
+pub(crate) struct FusedPipeline {
+    pub source: ExprId,
+    pub stages: Vec<(u32, Option<ExprId>)>,
+}
+
+// The longest run of fusible stages ending at `expr`, when it fuses. The
+// calls before it stay part of the source and compile as usual.
+pub(crate) fn fused_pipeline(
+    program: &Program,
+    expr: ExprId,
+    functions: &HashMap<Symbol, usize>,
+) -> Option<FusedPipeline> {
+    let stage = |right: ExprId| {
+        let (name, args) = match *program.expr(right) {
+            Expr::Identifier(name) => (name, &[][..]),
+            Expr::Call { func, args } => match *program.expr(func) {
+                Expr::Identifier(name) => (name, program.list(args)),
+                _ => return None,
+            },
+            _ => return None,
+        };
+        if functions.contains_key(&name) {
+            return None;
+        }
+        let native = natives::lookup(program.name(name))?;
+        natives::fusible(native)?;
+        match (natives::NATIVES[native as usize].arity, args) {
+            (1, []) => Some((native, None)),
+            (2, [arg]) => Some((native, Some(*arg))),
+            _ => None,
+        }
+    };
+
+    let mut chain = Vec::new();
+    let mut node = expr;
+    while let Expr::Pipeline { left, right } = *program.expr(node) {
+        let Some(stage) = stage(right) else { break };
+        chain.push((stage, left));
+        node = left;
+    }
+    chain.reverse();
+
+    (0..chain.len()).find_map(|start| {
+        let natives: Vec<u32> = chain[start..]
+            .iter()
+            .map(|((native, _), _)| *native)
+            .collect();
+        natives::fuses(&natives).then(|| FusedPipeline {
+            source: chain[start].1,
+            stages: chain[start..].iter().map(|(stage, _)| *stage).collect(),
+        })
+    })
+}
+
 impl fmt::Display for Instruction {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
-            Instruction::Push(value) => write!(f, "PUSH {}", value),
             Instruction::StoreVar(scope, idx) => write!(f, "STORE_VAR {} {}", scope, idx),
             Instruction::LoadVar(scope, idx) => write!(f, "LOAD_VAR {} {}", scope, idx),
-            Instruction::LoadArg(idx) => write!(f, "LOAD_ARG {}", idx),
             Instruction::Call(idx) => write!(f, "CALL {}", idx),
+            Instruction::TailCall(idx) => write!(f, "TAIL_CALL {}", idx),
+            Instruction::CallGlobal(idx) => match natives::NATIVES.get(*idx as usize) {
+                Some(native) => write!(f, "CALL_GLOBAL {} ({})", idx, native.name),
+                None => write!(f, "CALL_GLOBAL {}", idx),
+            },
+            Instruction::Pipeline(stages) => write!(f, "PIPELINE {}", stages),
+            Instruction::Map(idx) => write!(f, "MAP {}", idx),
+            Instruction::Filter(idx) => write!(f, "FILTER {}", idx),
+            Instruction::Async(idx) => write!(f, "ASYNC {}", idx),
+            Instruction::Await => write!(f, "AWAIT"),
             Instruction::Return => write!(f, "RETURN"),
             Instruction::LoadConst(idx) => write!(f, "LOAD_CONST {}", idx),
+            Instruction::LoadVarAdd(scope, idx) => write!(f, "LOAD_VAR_ADD {} {}", scope, idx),
+            Instruction::StoreVarKeep(scope, idx) => write!(f, "STORE_VAR_KEEP {} {}", scope, idx),
             Instruction::Add => write!(f, "ADD"),
             Instruction::Sub => write!(f, "SUB"),
             Instruction::Div => write!(f, "DIV"),
@@ -424,12 +951,24 @@ impl fmt::Display for Instruction {
             Instruction::Not => write!(f, "NOT"),
             Instruction::CreateArray(size) => write!(f, "CREATE_ARRAY {}", size),
             Instruction::ConcatArray => write!(f, "CONCAT_ARRAY"),
+            Instruction::Negate => write!(f, "NEGATE"),
+            Instruction::AddConst(idx) => write!(f, "ADD_CONST {}", idx),
+            Instruction::SubConst(idx) => write!(f, "SUB_CONST {}", idx),
+            Instruction::MulConst(idx) => write!(f, "MUL_CONST {}", idx),
+            Instruction::DivConst(idx) => write!(f, "DIV_CONST {}", idx),
             Instruction::Jump(addr) => write!(f, "JUMP {}", addr),
             Instruction::JumpIfFalse(addr) => write!(f, "JUMP_IF_FALSE {}", addr),
             Instruction::JumpIfTrue(addr) => write!(f, "JUMP_IF_TRUE {}", addr),
+            Instruction::EqualJumpIfFalse(addr) => write!(f, "EQUAL_JUMP_IF_FALSE {}", addr),
+            Instruction::LessJumpIfFalse(addr) => write!(f, "LESS_JUMP_IF_FALSE {}", addr),
+            Instruction::GreaterJumpIfFalse(addr) => write!(f, "GREATER_JUMP_IF_FALSE {}", addr),
             Instruction::Pop => write!(f, "POP"),
             Instruction::Dup => write!(f, "DUP"),
             Instruction::Halt => write!(f, "HALT"),
+            Instruction::CreateRecord(first, count) => {
+                write!(f, "CREATE_RECORD {} {}", first, count)
+            }
+            Instruction::GetField(name) => write!(f, "GET_FIELD {}", name),
         }
     }
 }
@@ -440,14 +979,25 @@ impl fmt::Display for Value {
             Value::Number(n) => write!(f, "{}", n),
             Value::String(s) => write!(f, "\"{}\"", s),
             Value::Boolean(b) => write!(f, "{}", b),
-            Value::Function { params, offset } => {
-                write!(f, "fn({}) @{}", params.join(", "), offset)
-            }
+            Value::Function(index) => write!(f, "FUNCTION {}", index),
             Value::HeapPointer(idx) => write!(f, "HEAP_POINTER {}", idx),
         }
     }
 }
 
+impl fmt::Display for Function {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "fn({}) @{} locals={} depth={}",
+            self.params.join(", "),
+            self.offset,
+            self.locals,
+            self.depth
+        )
+    }
+}
+
 impl fmt::Display for ByteCode {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         writeln!(f, "=== BYTECODE ===")?;
@@ -0,0 +1,505 @@
+use crate::types::compiler::{HeapObject, Value};
+use crate::types::traits::Traceable;
+use crate::vector::{Vector, WIDTH};
+use std::borrow::Cow;
+
+// Dense arrays. An array literal or update whose elements are all numbers is
+// stored as HeapObject::Numbers, all booleans as HeapObject::Booleans, and
+// anything else (and the empty array) as a generic HeapObject::Array. Both
+// are persistent vectors, so `xs <- [x]` stays cheap either way.
+//
+// The kernels below run the bulk built-ins in natives.rs (sum, elementwise
+// arithmetic and comparison, select) over a dense vector's leaves: WIDTH
+// contiguous elements at a time through plain loops over slices, which the
+// compiler turns into SIMD code. A generic array that happens to hold only
+// numbers or booleans is converted first.
+
+// The representation for an array of `elements`.
+pub fn array(elements: &[Value]) -> HeapObject {
+    if elements.is_empty() {
+        return HeapObject::Array(Vector::new());
+    }
+    if elements
+        .iter()
+        .all(|value| matches!(value, Value::Number(_)))
+    {
+        let numbers: Vec<f64> = elements
+            .iter()
+            .map(|value| match value {
+                Value::Number(n) => *n,
+                _ => unreachable!(),
+            })
+            .collect();
+        return HeapObject::Numbers(from_slice(&numbers));
+    }
+    if elements
+        .iter()
+        .all(|value| matches!(value, Value::Boolean(_)))
+    {
+        let booleans: Vec<bool> = elements
+            .iter()
+            .map(|value| matches!(value, Value::Boolean(true)))
+            .collect();
+        return HeapObject::Booleans(from_slice(&booleans));
+    }
+    HeapObject::Array(elements.iter().cloned().map(HeapObject::from).collect())
+}
+
+// `left <- right`, or None if either is not an array. Two dense arrays of
+// the same kind stay dense; any other mix becomes a generic array.
+pub fn concat(left: &HeapObject, right: &HeapObject) -> Option<HeapObject> {
+    let (left_len, right_len) = (len(left)?, len(right)?);
+    if left_len == 0 {
+        return Some(right.clone());
+    }
+    if right_len == 0 {
+        return Some(left.clone());
+    }
+    let joined = match (left, right) {
+        (HeapObject::Numbers(left), HeapObject::Numbers(right)) => {
+            let mut joined = left.clone();
+            joined.append(right);
+            HeapObject::Numbers(joined)
+        }
+        (HeapObject::Booleans(left), HeapObject::Booleans(right)) => {
+            let mut joined = left.clone();
+            joined.append(right);
+            HeapObject::Booleans(joined)
+        }
+        _ => {
+            let mut joined = generic(left)?.into_owned();
+            joined.append(&generic(right)?.into_owned());
+            HeapObject::Array(joined)
+        }
+    };
+    Some(joined)
+}
+
+// The array with `value` added at the end, or None if it is not an array.
+pub fn push(object: &HeapObject, value: Value) -> Option<HeapObject> {
+    let pushed = match (object, value) {
+        (HeapObject::Numbers(numbers), Value::Number(n)) => {
+            let mut numbers = numbers.clone();
+            numbers.push(n);
+            HeapObject::Numbers(numbers)
+        }
+        (HeapObject::Booleans(booleans), Value::Boolean(b)) => {
+            let mut booleans = booleans.clone();
+            booleans.push(b);
+            HeapObject::Booleans(booleans)
+        }
+        (object, value) if len(object)? == 0 => array(&[value]),
+        (object, value) => {
+            let mut elements = generic(object)?.into_owned();
+            elements.push(HeapObject::from(value));
+            HeapObject::Array(elements)
+        }
+    };
+    Some(pushed)
+}
+
+pub fn len(object: &HeapObject) -> Option<usize> {
+    match object {
+        HeapObject::Array(elements) => Some(elements.len()),
+        HeapObject::Numbers(numbers) => Some(numbers.len()),
+        HeapObject::Booleans(booleans) => Some(booleans.len()),
+        _ => None,
+    }
+}
+
+// Element `index` of an array as a value, or None past its end.
+pub fn element(object: &HeapObject, index: usize) -> Option<Value> {
+    match object {
+        HeapObject::Numbers(numbers) => numbers.get(index).map(|n| Value::Number(*n)),
+        HeapObject::Booleans(booleans) => booleans.get(index).map(|b| Value::Boolean(*b)),
+        HeapObject::Array(elements) => value(elements.get(index)?),
+        _ => None,
+    }
+}
+
+// An element of a generic array, or a field of a record, as a stack value.
+pub fn value(object: &HeapObject) -> Option<Value> {
+    match object {
+        HeapObject::Number(n) => Some(Value::Number(*n)),
+        HeapObject::String(s) => Some(Value::String(s.clone())),
+        HeapObject::Boolean(b) => Some(Value::Boolean(*b)),
+        HeapObject::HeapPointer(idx) => Some(Value::HeapPointer(*idx)),
+        _ => None,
+    }
+}
+
+// Any array as generic elements. Only dense arrays need converting.
+pub fn generic(object: &HeapObject) -> Option<Cow<'_, Vector<HeapObject>>> {
+    match object {
+        HeapObject::Array(elements) => Some(Cow::Borrowed(elements)),
+        HeapObject::Numbers(numbers) => Some(Cow::Owned(
+            numbers.iter().map(|n| HeapObject::Number(*n)).collect(),
+        )),
+        HeapObject::Booleans(booleans) => Some(Cow::Owned(
+            booleans.iter().map(|b| HeapObject::Boolean(*b)).collect(),
+        )),
+        _ => None,
+    }
+}
+
+// The array's elements as numbers, or None if it is not an array of numbers.
+pub fn numbers(object: &HeapObject) -> Option<Cow<'_, Vector<f64>>> {
+    match object {
+        HeapObject::Numbers(numbers) => Some(Cow::Borrowed(numbers)),
+        HeapObject::Array(elements) => elements
+            .iter()
+            .map(|element| match element {
+                HeapObject::Number(n) => Some(*n),
+                _ => None,
+            })
+            .collect::<Option<Vector<f64>>>()
+            .map(Cow::Owned),
+        _ => None,
+    }
+}
+
+pub fn booleans(object: &HeapObject) -> Option<Cow<'_, Vector<bool>>> {
+    match object {
+        HeapObject::Booleans(booleans) => Some(Cow::Borrowed(booleans)),
+        HeapObject::Array(elements) => elements
+            .iter()
+            .map(|element| match element {
+                HeapObject::Boolean(b) => Some(*b),
+                _ => None,
+            })
+            .collect::<Option<Vector<bool>>>()
+            .map(Cow::Owned),
+        _ => None,
+    }
+}
+
+fn from_slice<T: Clone + Traceable>(items: &[T]) -> Vector<T> {
+    let mut vector = Vector::new();
+    vector.extend_from_slice(items);
+    vector
+}
+
+// Sums into LANES independent accumulators so the additions vectorize; the
+// lanes are only combined at the end, so rounding can differ in the last
+// bits from adding left to right.
+const LANES: usize = 8;
+
+pub fn sum(xs: &Vector<f64>) -> f64 {
+    let mut lanes = [0.0; LANES];
+    for chunk in xs.chunks() {
+        add_lanes(&mut lanes, chunk);
+    }
+    lanes.iter().sum()
+}
+
+// Element i of a vector always lands in lane i % LANES: every chunk but the
+// last holds WIDTH elements, a multiple of LANES.
+fn add_lanes(lanes: &mut [f64; LANES], chunk: &[f64]) {
+    let mut parts = chunk.chunks_exact(LANES);
+    for part in &mut parts {
+        for (lane, x) in lanes.iter_mut().zip(part) {
+            *lane += x;
+        }
+    }
+    for (lane, x) in lanes.iter_mut().zip(parts.remainder()) {
+        *lane += x;
+    }
+}
+
+pub fn map(xs: &Vector<f64>, f: impl Fn(f64) -> f64) -> Vector<f64> {
+    let mut out = Vector::new();
+    let mut buffer = [0.0; WIDTH];
+    for chunk in xs.chunks() {
+        let buffer = &mut buffer[..chunk.len()];
+        for (out, x) in buffer.iter_mut().zip(chunk) {
+            *out = f(*x);
+        }
+        out.extend_from_slice(buffer);
+    }
+    out
+}
+
+// Elementwise over two arrays of the same length, whose chunks line up.
+pub fn zip(xs: &Vector<f64>, ys: &Vector<f64>, f: impl Fn(f64, f64) -> f64) -> Vector<f64> {
+    let mut out = Vector::new();
+    let mut buffer = [0.0; WIDTH];
+    for (xs, ys) in xs.chunks().zip(ys.chunks()) {
+        let buffer = &mut buffer[..xs.len()];
+        for ((out, x), y) in buffer.iter_mut().zip(xs).zip(ys) {
+            *out = f(*x, *y);
+        }
+        out.extend_from_slice(buffer);
+    }
+    out
+}
+
+pub fn compare(xs: &Vector<f64>, y: f64, f: impl Fn(f64, f64) -> bool) -> Vector<bool> {
+    let mut out = Vector::new();
+    let mut buffer = [false; WIDTH];
+    for chunk in xs.chunks() {
+        let buffer = &mut buffer[..chunk.len()];
+        for (out, x) in buffer.iter_mut().zip(chunk) {
+            *out = f(*x, y);
+        }
+        out.extend_from_slice(buffer);
+    }
+    out
+}
+
+pub fn compare_zip(
+    xs: &Vector<f64>,
+    ys: &Vector<f64>,
+    f: impl Fn(f64, f64) -> bool,
+) -> Vector<bool> {
+    let mut out = Vector::new();
+    let mut buffer = [false; WIDTH];
+    for (xs, ys) in xs.chunks().zip(ys.chunks()) {
+        let buffer = &mut buffer[..xs.len()];
+        for ((out, x), y) in buffer.iter_mut().zip(xs).zip(ys) {
+            *out = f(*x, *y);
+        }
+        out.extend_from_slice(buffer);
+    }
+    out
+}
+
+// The elements of `xs` whose entry in `mask`, of the same length, is true.
+pub fn select<T: Clone + Traceable>(xs: &Vector<T>, mask: &Vector<bool>) -> Vector<T> {
+    let mut out = Vector::new();
+    let mut kept = Vec::with_capacity(WIDTH);
+    for (xs, mask) in xs.chunks().zip(mask.chunks()) {
+        kept.clear();
+        kept.extend(
+            xs.iter()
+                .zip(mask)
+                .filter(|(_, keep)| **keep)
+                .map(|(x, _)| x.clone()),
+        );
+        out.extend_from_slice(&kept);
+    }
+    out
+}
+
+// The array of the elements of `object` whose entry in `mask` is true, in
+// the same representation, or None if it is not an array.
+pub fn filter(object: &HeapObject, mask: &Vector<bool>) -> Option<HeapObject> {
+    match object {
+        HeapObject::Numbers(numbers) => Some(HeapObject::Numbers(select(numbers, mask))),
+        HeapObject::Booleans(booleans) => Some(HeapObject::Booleans(select(booleans, mask))),
+        HeapObject::Array(elements) => Some(HeapObject::Array(select(elements, mask))),
+        _ => None,
+    }
+}
+
+pub fn count(mask: &Vector<bool>) -> usize {
+    mask.chunks()
+        .map(|chunk| chunk.iter().map(|b| *b as usize).sum::<usize>())
+        .sum()
+}
+
+// Fused pipelines. `xs |> mul(2) |> greater(5) |> count` compiles to one
+// PIPELINE instruction rather than three calls, and runs here: each leaf of
+// the source is copied into a buffer, every stage runs over the buffer in
+// turn, and only the last stage's result is kept, so no intermediate array
+// is built. Stages arrive type-checked from natives::pipeline; a stage's
+// array operand has the source's length, so its chunks line up too.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Op {
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Less,
+    Greater,
+    Equal,
+}
+
+pub enum Operand<'a> {
+    Scalar(f64),
+    Array(Cow<'a, Vector<f64>>),
+}
+
+pub enum Stage<'a> {
+    Arithmetic(Op, Operand<'a>), // Numbers to numbers
+    Compare(Op, Operand<'a>),    // Numbers to booleans
+    Select(Cow<'a, Vector<bool>>),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Terminal {
+    Collect,
+    Sum,
+    Count,
+}
+
+pub enum Fused {
+    Numbers(Vector<f64>),
+    Booleans(Vector<bool>),
+    Number(f64),
+}
+
+// A stage's operand for one chunk.
+#[derive(Clone, Copy)]
+enum Column<'a> {
+    Scalar(f64),
+    Slice(&'a [f64]),
+}
+
+// A stage's operand split into chunks up front.
+enum Chunks<'a> {
+    Scalar(f64),
+    Numbers(Vec<&'a [f64]>),
+    Mask(Vec<&'a [bool]>),
+}
+
+impl Chunks<'_> {
+    fn column(&self, index: usize) -> Column<'_> {
+        match self {
+            Chunks::Numbers(chunks) => Column::Slice(chunks[index]),
+            Chunks::Scalar(y) => Column::Scalar(*y),
+            Chunks::Mask(_) => Column::Scalar(0.0),
+        }
+    }
+}
+
+pub fn fused(source: &Vector<f64>, stages: &[Stage], terminal: Terminal) -> Fused {
+    let operands: Vec<Chunks> =
+        stages
+            .iter()
+            .map(|stage| match stage {
+                Stage::Arithmetic(_, Operand::Scalar(y))
+                | Stage::Compare(_, Operand::Scalar(y)) => Chunks::Scalar(*y),
+                Stage::Arithmetic(_, Operand::Array(ys))
+                | Stage::Compare(_, Operand::Array(ys)) => Chunks::Numbers(ys.chunks().collect()),
+                Stage::Select(mask) => Chunks::Mask(mask.chunks().collect()),
+            })
+            .collect();
+    let selects = stages.iter().any(|stage| matches!(stage, Stage::Select(_)));
+    let boolean = stages
+        .iter()
+        .rev()
+        .find_map(|stage| match stage {
+            Stage::Arithmetic(..) => Some(false),
+            Stage::Compare(..) => Some(true),
+            Stage::Select(_) => None,
+        })
+        .unwrap_or(false);
+
+    let mut numbers = [0.0; WIDTH];
+    let mut booleans = [false; WIDTH];
+    let mut keep = [true; WIDTH];
+    let mut kept_numbers = [0.0; WIDTH];
+    let mut kept_booleans = [false; WIDTH];
+
+    let mut out_numbers = Vector::new();
+    let mut out_booleans = Vector::new();
+    let mut lanes = [0.0; LANES];
+    let mut total = 0;
+    let mut position = 0;
+
+    for (index, chunk) in source.chunks().enumerate() {
+        let len = chunk.len();
+        let (numbers, booleans, keep) =
+            (&mut numbers[..len], &mut booleans[..len], &mut keep[..len]);
+        numbers.copy_from_slice(chunk);
+        keep.fill(true);
+
+        for (stage, operand) in stages.iter().zip(&operands) {
+            match (stage, operand) {
+                (Stage::Arithmetic(op, _), operand) => {
+                    arithmetic(*op, numbers, operand.column(index))
+                }
+                (Stage::Compare(op, _), operand) => {
+                    comparison(*op, numbers, operand.column(index), booleans)
+                }
+                (Stage::Select(_), Chunks::Mask(mask)) => {
+                    for (keep, selected) in keep.iter_mut().zip(mask[index]) {
+                        *keep &= selected;
+                    }
+                }
+                (Stage::Select(_), _) => unreachable!("a select's operand is a mask"),
+            }
+        }
+
+        match (terminal, selects) {
+            (Terminal::Sum, false) => add_lanes(&mut lanes, numbers),
+            (Terminal::Count, false) => {
+                total += booleans.iter().map(|b| *b as usize).sum::<usize>()
+            }
+            (Terminal::Collect, false) if boolean => out_booleans.extend_from_slice(booleans),
+            (Terminal::Collect, false) => out_numbers.extend_from_slice(numbers),
+            (Terminal::Sum, true) => {
+                for x in compact(numbers, keep, &mut kept_numbers) {
+                    lanes[position % LANES] += x;
+                    position += 1;
+                }
+            }
+            (Terminal::Count, true) => {
+                total += booleans
+                    .iter()
+                    .zip(keep.iter())
+                    .map(|(b, keep)| (*b && *keep) as usize)
+                    .sum::<usize>()
+            }
+            (Terminal::Collect, true) if boolean => {
+                out_booleans.extend_from_slice(compact(booleans, keep, &mut kept_booleans))
+            }
+            (Terminal::Collect, true) => {
+                out_numbers.extend_from_slice(compact(numbers, keep, &mut kept_numbers))
+            }
+        }
+    }
+
+    match terminal {
+        Terminal::Sum => Fused::Number(lanes.iter().sum()),
+        Terminal::Count => Fused::Number(total as f64),
+        Terminal::Collect if boolean => Fused::Booleans(out_booleans),
+        Terminal::Collect => Fused::Numbers(out_numbers),
+    }
+}
+
+fn arithmetic(op: Op, xs: &mut [f64], column: Column) {
+    match op {
+        Op::Add => each(xs, column, |x, y| x + y),
+        Op::Sub => each(xs, column, |x, y| x - y),
+        Op::Mul => each(xs, column, |x, y| x * y),
+        Op::Div => each(xs, column, |x, y| x / y),
+        _ => unreachable!("not an arithmetic stage"),
+    }
+}
+
+fn each(xs: &mut [f64], column: Column, f: impl Fn(f64, f64) -> f64) {
+    match column {
+        Column::Scalar(y) => xs.iter_mut().for_each(|x| *x = f(*x, y)),
+        Column::Slice(ys) => xs.iter_mut().zip(ys).for_each(|(x, y)| *x = f(*x, *y)),
+    }
+}
+
+fn comparison(op: Op, xs: &[f64], column: Column, out: &mut [bool]) {
+    match op {
+        Op::Less => test(xs, column, out, |x, y| x < y),
+        Op::Greater => test(xs, column, out, |x, y| x > y),
+        Op::Equal => test(xs, column, out, |x, y| x == y),
+        _ => unreachable!("not a comparison stage"),
+    }
+}
+
+fn test(xs: &[f64], column: Column, out: &mut [bool], f: impl Fn(f64, f64) -> bool) {
+    match column {
+        Column::Scalar(y) => out.iter_mut().zip(xs).for_each(|(out, x)| *out = f(*x, y)),
+        Column::Slice(ys) => out
+            .iter_mut()
+            .zip(xs.iter().zip(ys))
+            .for_each(|(out, (x, y))| *out = f(*x, *y)),
+    }
+}
+
+// The kept elements of `items`, packed into the front of `buffer`.
+fn compact<'b, T: Copy>(items: &[T], keep: &[bool], buffer: &'b mut [T]) -> &'b [T] {
+    let mut len = 0;
+    for (item, keep) in items.iter().zip(keep) {
+        buffer[len] = *item;
+        len += *keep as usize;
+    }
+    &buffer[..len]
+}
@@ -0,0 +1,166 @@
+use crate::interpreter::VirtualMachine;
+use crate::runtime::{self, Options};
+use crate::types::compiler::{ByteCode, Function, Instruction, Symbols, Value};
+use crate::types::traits::Executable;
+use std::sync::{Arc, Mutex};
+
+// The library API for running one program many times, such as once per
+// request of a server. An Image is compiled once and never changes, so a
+// single Arc of it is shared by every VM on every thread; a VM itself only
+// holds what one run changes (stack, frames, heap, tasks) and is reset
+// between runs rather than rebuilt. A Pool keeps the idle VMs of an image:
+//
+//     let pool = Pool::new(Image::compile(source, Options::default())?);
+//     let total = pool.run(|vm| vm.global("total").cloned())?;
+//
+// Runs are isolated from each other: each starts with its globals zeroed and
+// an empty heap, exactly like a VM fresh from `VirtualMachine::new`.
+#[derive(Debug)]
+pub struct Image {
+    bytecode: ByteCode,
+    symbols: Symbols,
+}
+
+pub type Instance = VirtualMachine<Arc<Image>>;
+
+impl Image {
+    pub fn new(bytecode: ByteCode, symbols: Symbols) -> Arc<Self> {
+        Arc::new(Self { bytecode, symbols })
+    }
+
+    pub fn compile(source_code: String, options: Options) -> Result<Arc<Self>, String> {
+        let (bytecode, symbols) = runtime::compile_source_with_symbols(source_code, options)?;
+        Ok(Self::new(bytecode, symbols))
+    }
+
+    pub fn compile_file(filename: &str, options: Options) -> Result<Arc<Self>, String> {
+        let (bytecode, symbols) = runtime::compile_file_with_symbols(filename, options)?;
+        Ok(Self::new(bytecode, symbols))
+    }
+
+    pub fn bytecode(&self) -> &ByteCode {
+        &self.bytecode
+    }
+
+    // The slot of top-level variable `name` among the globals.
+    pub fn global(&self, name: &str) -> Option<usize> {
+        self.symbols.globals.get(name).copied()
+    }
+}
+
+impl Executable for Image {
+    type Shared = ByteCode;
+
+    fn shared(&self) -> &ByteCode {
+        &self.bytecode
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        self.bytecode.instruction(pc)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.bytecode.constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.bytecode.function(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.bytecode.globals
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        self.bytecode.line(pc)
+    }
+}
+
+impl VirtualMachine<Arc<Image>> {
+    // The value of top-level variable `name` after a run.
+    pub fn global(&self, name: &str) -> Option<&Value> {
+        self.globals().get(self.program().global(name)?)
+    }
+}
+
+// Idle VMs of one image, shared by any number of threads. Each run takes an
+// idle VM, or builds one when there is none, and hands it back reset. The
+// lock is only held to take or return a VM, never during a run.
+pub struct Pool {
+    image: Arc<Image>,
+    idle: Mutex<Vec<Instance>>,
+    threads: Option<usize>,
+    #[cfg(feature = "jit")]
+    jit: bool,
+}
+
+impl Pool {
+    pub fn new(image: Arc<Image>) -> Self {
+        Self {
+            image,
+            idle: Mutex::new(Vec::new()),
+            threads: None,
+            #[cfg(feature = "jit")]
+            jit: false,
+        }
+    }
+
+    pub fn image(&self) -> &Arc<Image> {
+        &self.image
+    }
+
+    // How many threads map and filter may use in each run (see
+    // VirtualMachine::set_threads). A server already running requests on
+    // every core will usually want 1.
+    pub fn set_threads(&mut self, threads: usize) {
+        self.threads = Some(threads);
+        for vm in self.idle.get_mut().unwrap_or_else(|e| e.into_inner()) {
+            vm.set_threads(threads);
+        }
+    }
+
+    // Has every VM of the pool compile hot functions to native code.
+    #[cfg(feature = "jit")]
+    pub fn enable_jit(&mut self) {
+        self.jit = true;
+        for vm in self.idle.get_mut().unwrap_or_else(|e| e.into_inner()) {
+            vm.enable_jit();
+        }
+    }
+
+    // A VM ready to run the image, idle or new.
+    pub fn instance(&self) -> Instance {
+        if let Some(vm) = self.idle.lock().unwrap_or_else(|e| e.into_inner()).pop() {
+            return vm;
+        }
+        let mut vm = Instance::new(self.image.clone());
+        if let Some(threads) = self.threads {
+            vm.set_threads(threads);
+        }
+        #[cfg(feature = "jit")]
+        if self.jit {
+            vm.enable_jit();
+        }
+        vm
+    }
+
+    // Takes back a VM from `instance`, whatever state its run left it in.
+    pub fn release(&self, mut vm: Instance) {
+        vm.reset();
+        self.idle.lock().unwrap_or_else(|e| e.into_inner()).push(vm);
+    }
+
+    // Runs the image once on a pooled VM and returns what `read` takes from
+    // it afterwards, typically a few globals.
+    pub fn run<R>(&self, read: impl FnOnce(&Instance) -> R) -> Result<R, String> {
+        let mut vm = self.instance();
+        let result = vm.run().map(|()| read(&vm));
+        self.release(vm);
+        result
+    }
+
+    // How many VMs are idle.
+    pub fn idle(&self) -> usize {
+        self.idle.lock().unwrap_or_else(|e| e.into_inner()).len()
+    }
+}
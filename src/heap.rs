@@ -0,0 +1,370 @@
+use crate::shape::Record;
+use crate::types::compiler::{HeapObject, Value};
+use crate::types::constants::{
+    GC_COMPACT_MIN_SLOTS, GC_GROWTH_FACTOR, GC_HISTORY_BUFFER_SIZE, GC_NURSERY_SIZE, GC_THRESHOLD,
+    HEAP_SCORE_ARRAY_BASE, HEAP_SCORE_ARRAY_PER_ELEMENT, HEAP_SCORE_DENSE_PER_ELEMENT,
+    HEAP_SCORE_OTHER_OBJECT, HEAP_SCORE_RECORD_BASE, HEAP_SCORE_RECORD_PER_FIELD,
+    HEAP_SCORE_STRING_BASE,
+};
+use crate::vector;
+use std::collections::VecDeque;
+use std::fmt;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+// Non-moving, two-generation heap. Objects live in stable slots whose indices
+// are handed out as HeapPointers; freed slots go on a free list and are
+// reused, so a collection never copies a live object or rewrites a pointer.
+//
+// Heap objects are immutable once allocated, which makes generations cheap:
+// an object can only reference objects that already existed when it was
+// created, so nothing older than the last collection can point into the
+// nursery. A minor collection therefore traces from the roots only through
+// young objects and sweeps only the nursery list, costing time proportional
+// to what was allocated since the last collection and never touching the old
+// generation. That includes the trie nodes a young array shares with older
+// versions of it: tracing stops at nodes written before the last collection
+// (see Vector::clock), whose references were all promoted then, so a minor
+// pause follows what the new versions wrote rather than the length of the
+// list. Survivors are promoted in place. The old generation is swept
+// by a full collection whose threshold adapts to the recent live size, and
+// only when that leaves most slots empty is the heap compacted.
+#[derive(Clone)]
+pub struct Heap {
+    slots: Vec<Option<HeapObject>>,
+    marks: Vec<bool>, // Always all false outside a collection
+    young: Vec<bool>, // Set for exactly the slots listed in `nursery`
+    free: Vec<usize>,
+    nursery: Vec<usize>,
+    nursery_score: usize,
+    old_score: usize,
+    boundary: u64, // Vector::clock at the start of the last collection
+    gc_threshold: usize,
+    last_heap_score: VecDeque<usize>, // Live heap score after recent full collections
+    stats: GcStats,
+}
+
+// What the collector has done since the heap was created or cleared. Freed
+// space is measured in the heap's own size estimate (see object_score),
+// which is roughly bytes. Kept once per collection, never per allocation.
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct GcStats {
+    pub minor: u64,
+    pub major: u64,
+    pub pause: Duration,
+    pub freed: u64,       // Objects
+    pub reclaimed: usize, // Size estimate of the freed objects
+}
+
+impl Heap {
+    pub fn new() -> Self {
+        Self {
+            slots: Vec::new(),
+            marks: Vec::new(),
+            young: Vec::new(),
+            free: Vec::new(),
+            nursery: Vec::new(),
+            nursery_score: 0,
+            old_score: 0,
+            boundary: 0,
+            gc_threshold: GC_THRESHOLD,
+            last_heap_score: VecDeque::new(),
+            stats: GcStats::default(),
+        }
+    }
+
+    // Drops every object, leaving the heap as `new` made it except for the
+    // capacity of its tables.
+    pub fn clear(&mut self) {
+        self.slots.clear();
+        self.marks.clear();
+        self.young.clear();
+        self.free.clear();
+        self.nursery.clear();
+        self.nursery_score = 0;
+        self.old_score = 0;
+        self.boundary = 0;
+        self.gc_threshold = GC_THRESHOLD;
+        self.last_heap_score.clear();
+        self.stats = GcStats::default();
+    }
+
+    pub fn get(&self, index: usize) -> Option<&HeapObject> {
+        self.slots.get(index)?.as_ref()
+    }
+
+    // Number of live (or not yet collected) objects.
+    pub fn len(&self) -> usize {
+        self.slots.len() - self.free.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn stats(&self) -> GcStats {
+        self.stats
+    }
+
+    // Stores `object` and returns its slot. `roots` must hold every value the
+    // program can still reach; `object` itself is kept alive too, since the
+    // elements it was built from have usually just been popped off the stack.
+    // The returned index is only different from the slot it started in if the
+    // collection compacted the heap, in which case `roots` are rewritten.
+    pub fn allocate(&mut self, object: HeapObject, roots: &mut [Value]) -> usize {
+        self.allocate_across(object, || vec![roots])
+    }
+
+    // `allocate` with the roots spread over several stacks, one per task of
+    // the async scheduler. They are only gathered if a collection runs.
+    pub fn allocate_across<'a>(
+        &mut self,
+        object: HeapObject,
+        roots: impl FnOnce() -> Vec<&'a mut [Value]>,
+    ) -> usize {
+        self.nursery_score += Self::object_score(&object);
+        let index = match self.free.pop() {
+            Some(index) => {
+                self.slots[index] = Some(object);
+                index
+            }
+            None => {
+                self.slots.push(Some(object));
+                self.marks.push(false);
+                self.young.push(false);
+                self.slots.len() - 1
+            }
+        };
+        self.young[index] = true;
+        self.nursery.push(index);
+
+        if self.nursery_score < GC_NURSERY_SIZE {
+            return index;
+        }
+        let start = Instant::now();
+        let clock = vector::clock();
+        let roots = &mut roots();
+        self.minor_collection(roots, index);
+        let index = match self.old_score >= self.gc_threshold {
+            true => self.major_collection(roots, index),
+            false => index,
+        };
+        self.boundary = clock;
+        self.stats.pause += start.elapsed();
+        index
+    }
+
+    // A copy of `object` that stands on its own: every HeapPointer in it is
+    // replaced by a copy of what it points to, so it can move to another heap.
+    pub fn detach(&self, object: &HeapObject) -> HeapObject {
+        match object {
+            HeapObject::HeapPointer(idx) => match self.get(*idx) {
+                Some(object) => self.detach(object),
+                None => HeapObject::Null,
+            },
+            HeapObject::Array(items) if items.has_references() => {
+                HeapObject::Array(items.iter().map(|item| self.detach(item)).collect())
+            }
+            HeapObject::Record(record) => HeapObject::Record(Record {
+                shape: record.shape.clone(),
+                fields: record.fields.iter().map(|item| self.detach(item)).collect(),
+            }),
+            object => object.clone(),
+        }
+    }
+
+    fn minor_collection(&mut self, roots: &[&mut [Value]], pinned: usize) {
+        // Mark phase: Old objects are live by assumption and never point into
+        // the nursery, so tracing stops as soon as it leaves it
+        let mut pending = Self::root_indices(roots, pinned);
+        while let Some(idx) = pending.pop() {
+            if self.is_young(idx) && !self.marks[idx] {
+                self.marks[idx] = true;
+                if let Some(object) = &self.slots[idx] {
+                    Self::trace(object, self.boundary, &mut pending);
+                }
+            }
+        }
+
+        // Sweep phase: Free the dead and promote the survivors in place
+        for idx in std::mem::take(&mut self.nursery) {
+            self.young[idx] = false;
+            if self.marks[idx] {
+                self.marks[idx] = false;
+                self.old_score += self.slots[idx].as_ref().map_or(0, Self::object_score);
+            } else {
+                let object = self.slots[idx].take();
+                self.stats.freed += 1;
+                self.stats.reclaimed += object.as_ref().map_or(0, Self::object_score);
+                self.free.push(idx);
+            }
+        }
+        self.nursery_score = 0;
+        self.stats.minor += 1;
+    }
+
+    // Runs right after a minor collection, so every object is old.
+    fn major_collection(&mut self, roots: &mut [&mut [Value]], pinned: usize) -> usize {
+        let mut pending = Self::root_indices(roots, pinned);
+        while let Some(idx) = pending.pop() {
+            if idx < self.marks.len() && !self.marks[idx] {
+                self.marks[idx] = true;
+                if let Some(object) = &self.slots[idx] {
+                    Self::trace(object, 0, &mut pending);
+                }
+            }
+        }
+
+        let mut live_score = 0;
+        for idx in 0..self.slots.len() {
+            if self.marks[idx] {
+                self.marks[idx] = false;
+                live_score += self.slots[idx].as_ref().map_or(0, Self::object_score);
+            } else if let Some(object) = self.slots[idx].take() {
+                self.stats.freed += 1;
+                self.stats.reclaimed += Self::object_score(&object);
+                self.free.push(idx);
+            }
+        }
+        self.old_score = live_score;
+        self.stats.major += 1;
+        self.adjust_threshold(live_score);
+
+        if self.slots.len() >= GC_COMPACT_MIN_SLOTS && self.free.len() * 2 > self.slots.len() {
+            return self.compact(roots, pinned);
+        }
+        pinned
+    }
+
+    // Slides the live objects down to the front of the heap, rewriting every
+    // reference. This is the only place objects move.
+    fn compact(&mut self, roots: &mut [&mut [Value]], pinned: usize) -> usize {
+        let mut remap = vec![None; self.slots.len()];
+        let mut slots = Vec::with_capacity(self.len());
+        for (idx, slot) in std::mem::take(&mut self.slots).into_iter().enumerate() {
+            if let Some(object) = slot {
+                remap[idx] = Some(slots.len());
+                slots.push(Some(object));
+            }
+        }
+
+        for value in roots.iter_mut().flat_map(|roots| roots.iter_mut()) {
+            if let Value::HeapPointer(idx) = value {
+                if let Some(Some(new_idx)) = remap.get(*idx) {
+                    *idx = *new_idx;
+                }
+            }
+        }
+        for object in slots.iter_mut().flatten() {
+            Self::relocate(object, &remap);
+        }
+
+        self.marks = vec![false; slots.len()];
+        self.young = vec![false; slots.len()];
+        self.slots = slots;
+        self.free.clear();
+        remap[pinned].unwrap_or(pinned)
+    }
+
+    // The next full collection is due once the old generation has grown by
+    // GC_GROWTH_FACTOR over the largest live size seen in the last few
+    // collections. Using the recent peak rather than the latest sample keeps
+    // a program whose live set oscillates from collecting on every dip.
+    fn adjust_threshold(&mut self, live_score: usize) {
+        self.last_heap_score.push_back(live_score);
+        if self.last_heap_score.len() > GC_HISTORY_BUFFER_SIZE {
+            self.last_heap_score.pop_front();
+        }
+        let peak = self.last_heap_score.iter().copied().max().unwrap_or(0);
+        self.gc_threshold = GC_THRESHOLD.max(peak.saturating_mul(GC_GROWTH_FACTOR));
+    }
+
+    fn is_young(&self, idx: usize) -> bool {
+        self.young.get(idx).copied().unwrap_or(false)
+    }
+
+    fn root_indices(roots: &[&mut [Value]], pinned: usize) -> Vec<usize> {
+        let mut pending = vec![pinned];
+        for value in roots.iter().flat_map(|roots| roots.iter()) {
+            if let Value::HeapPointer(idx) = value {
+                pending.push(*idx);
+            }
+        }
+        pending
+    }
+
+    // Pushes the objects `object` references, skipping array nodes stamped
+    // before `since`.
+    fn trace(object: &HeapObject, since: u64, pending: &mut Vec<usize>) {
+        match object {
+            HeapObject::HeapPointer(idx) => pending.push(*idx),
+            HeapObject::Array(items) => {
+                items.for_each_reference_since(since, &mut |item| Self::trace(item, since, pending))
+            }
+            HeapObject::Record(record) => record
+                .fields
+                .iter()
+                .for_each(|item| Self::trace(item, since, pending)),
+            _ => {}
+        }
+    }
+
+    fn relocate(object: &mut HeapObject, remap: &[Option<usize>]) {
+        match object {
+            HeapObject::HeapPointer(idx) => {
+                if let Some(Some(new_idx)) = remap.get(*idx) {
+                    *idx = *new_idx;
+                }
+            }
+            HeapObject::Array(items) => {
+                items.for_each_reference_mut(&mut |item| Self::relocate(item, remap))
+            }
+            HeapObject::Record(record) => Arc::make_mut(&mut record.fields)
+                .iter_mut()
+                .for_each(|item| Self::relocate(item, remap)),
+            _ => {}
+        }
+    }
+
+    // Arrays are scored by the slots their version wrote rather than by
+    // their length: a version made by `xs <- [x]` shares all but its tail and
+    // one path with xs, and charging it all of xs again would make a growing
+    // list fill the nursery on every append.
+    fn object_score(object: &HeapObject) -> usize {
+        match object {
+            HeapObject::Array(arr) => {
+                HEAP_SCORE_ARRAY_BASE + arr.written() * HEAP_SCORE_ARRAY_PER_ELEMENT
+            }
+            HeapObject::Numbers(arr) => {
+                HEAP_SCORE_ARRAY_BASE + arr.written() * HEAP_SCORE_DENSE_PER_ELEMENT
+            }
+            HeapObject::Booleans(arr) => {
+                HEAP_SCORE_ARRAY_BASE + arr.written() * HEAP_SCORE_DENSE_PER_ELEMENT
+            }
+            HeapObject::String(s) => HEAP_SCORE_STRING_BASE + s.len(),
+            HeapObject::Record(record) => {
+                HEAP_SCORE_RECORD_BASE + record.fields.len() * HEAP_SCORE_RECORD_PER_FIELD
+            }
+            _ => HEAP_SCORE_OTHER_OBJECT,
+        }
+    }
+}
+
+impl Default for Heap {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl fmt::Debug for Heap {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_map()
+            .entries(
+                self.slots
+                    .iter()
+                    .enumerate()
+                    .filter_map(|(idx, slot)| slot.as_ref().map(|object| (idx, object))),
+            )
+            .finish()
+    }
+}
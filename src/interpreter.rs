@@ -1,436 +1,968 @@
-use crate::compiler::Compiler;
-use crate::types::compiler::{ByteCode, HeapObject, Instruction, Value};
+use crate::dense;
+use crate::heap::Heap;
+#[cfg(feature = "jit")]
+use crate::jit::Jit;
+use crate::natives::{self, Returned};
+use crate::parallel;
+use crate::scheduler::{Context, MAIN, Scheduler, Wait};
+use crate::shape::{InlineCache, Record, Shapes};
+use crate::types::compiler::{ByteCode, Future, HeapObject, Instruction, Value};
 use crate::types::constants::{
-    GC_CHECK_INTERVAL, GC_HISTORY_BUFFER_SIZE, GC_THRESHOLD, HEAP_SCORE_ARRAY_BASE,
-    HEAP_SCORE_ARRAY_PER_ELEMENT, HEAP_SCORE_MAP_BASE, HEAP_SCORE_MAP_PER_ELEMENT,
-    HEAP_SCORE_OTHER_OBJECT, HEAP_SCORE_STRING_BASE, INVALID_HEAP_POINTER_ERROR, MAX_STRING_LENGTH,
-    UNDERFLOW_ERROR,
+    INVALID_HEAP_POINTER_ERROR, MAX_STRING_LENGTH, PARALLEL_MIN_ELEMENTS, UNDERFLOW_ERROR,
 };
-use crate::types::traits::IntoResult;
-use std::collections::VecDeque;
+use crate::types::traits::{Executable, IntoResult};
+use crate::vector::Vector;
+use std::sync::Arc;
+use std::thread;
+use std::time::Instant;
 
-#[derive(Debug, Clone)]
-pub struct StackFrame {
-    variables: Vec<Value>,
+// A function activation. Its locals live directly on the VM stack starting at
+// `base`; `saved_display` is the display entry this call overwrote.
+#[derive(Debug, Clone, Copy)]
+pub struct CallFrame {
+    return_address: usize,
+    base: usize,
+    depth: usize,
+    saved_display: usize,
 }
 
-impl StackFrame {
-    pub fn new() -> Self {
-        Self {
-            variables: Vec::new(),
-        }
-    }
-
-    pub fn set_variable(&mut self, index: usize, value: Value) {
-        while index >= self.variables.len() {
-            self.variables.push(Value::Number(0.0));
-        }
-        self.variables[index] = value;
-    }
-
-    pub fn get_variable(&self, index: usize) -> Option<&Value> {
-        self.variables.get(index)
-    }
+// A function table entry as CALL needs it, copied out of the program once
+// when the VM is created (the linked call table).
+#[derive(Debug, Clone, Copy)]
+struct CallTarget {
+    offset: usize,
+    arity: usize,
+    locals: usize,
+    depth: usize,
 }
 
-pub struct VirtualMachine {
+// All values live on one contiguous stack: the global slots first, then for
+// each active call its local slots followed by its operand temporaries.
+// `display[d]` is the base of the innermost active frame at lexical depth d,
+// which turns LOAD_VAR depth index into a single indexed read.
+pub struct VirtualMachine<P: Executable = ByteCode> {
     stack: Vec<Value>,
-    stack_frames: Vec<StackFrame>,
-    return_addresses: Vec<usize>,
+    frames: Vec<CallFrame>,
+    display: Vec<usize>,
     pc: usize,
-    constants: Vec<Value>,
-    functions: Vec<Value>,
-    instructions: Vec<Instruction>,
-    instruction_lines: Vec<usize>,
-    heap: Vec<HeapObject>,
-    last_heap_score: VecDeque<usize>,
-    raw_compiler: Compiler,
+    program: P,
+    calls: Vec<CallTarget>,
+    heap: Heap,
+    threads: usize, // Used by MAP and FILTER
+    mapping: usize, // Calls made by MAP and FILTER in progress, which cannot await
+    scheduler: Scheduler,
+    waiting: Option<Wait>, // Set when AWAIT suspends the running task
+    shapes: Shapes,
+    caches: Vec<InlineCache>, // By pc, for the instructions on records
+    #[cfg(feature = "jit")]
+    jit: Option<Jit>,
 }
 
-impl VirtualMachine {
-    pub fn new(bytecode: ByteCode, compiler: Compiler) -> Self {
-        let vm = Self {
-            stack: Vec::new(),
-            stack_frames: vec![StackFrame::new()],
-            return_addresses: Vec::new(),
+impl<P: Executable> VirtualMachine<P> {
+    pub fn new(program: P) -> Self {
+        let calls = (0..)
+            .map_while(|index| program.function(index))
+            .map(|function| CallTarget {
+                offset: function.offset,
+                arity: function.params.len(),
+                locals: function.locals,
+                depth: function.depth,
+            })
+            .collect();
+        Self {
+            stack: vec![Value::Number(0.0); program.globals()],
+            frames: Vec::new(),
+            display: vec![0],
             pc: 0,
-            raw_compiler: compiler,
-            constants: bytecode.constants,
-            functions: bytecode.functions,
-            instructions: bytecode.instructions,
-            instruction_lines: bytecode.instruction_lines,
-            heap: Vec::new(),
-            last_heap_score: VecDeque::new(),
-        };
+            program,
+            calls,
+            heap: Heap::new(),
+            threads: thread::available_parallelism().map_or(1, |threads| threads.get()),
+            mapping: 0,
+            scheduler: Scheduler::new(),
+            waiting: None,
+            shapes: Shapes::new(),
+            caches: Vec::new(),
+            #[cfg(feature = "jit")]
+            jit: None,
+        }
+    }
+
+    // A VM for one thread of a parallel map: it starts with a copy of the
+    // globals and the heap of the VM running the map, with the array being
+    // mapped in the slot right after the globals. Copying the heap copies
+    // the slot table; the objects themselves are persistent and shared.
+    // Workers run nested maps on their own thread. They start out with the
+    // shapes of the VM running the map, so its records hit their caches.
+    fn worker(program: P, globals: &[Value], heap: &Heap, shapes: &Shapes, source: Value) -> Self {
+        let mut vm = Self::new(program);
+        vm.shapes = shapes.clone();
+        vm.stack.clear();
+        vm.stack.extend_from_slice(globals);
+        vm.stack.push(source);
+        vm.heap = heap.clone();
+        vm.threads = 1;
         vm
     }
 
-    fn gc(&mut self) {
-        // Mark phase: Find all live objects by tracing from stack variables
-        let mut marked = vec![false; self.heap.len()];
-        for frame in &self.stack_frames {
-            for value in &frame.variables {
-                if let Value::HeapPointer(idx) = value {
-                    if *idx < marked.len() {
-                        marked[*idx] = true;
-                    }
-                }
-            }
+    // Puts the VM back where `new` left it, ready to run its program again
+    // from the start. The stack and heap keep their capacity, and JIT-compiled
+    // code, shapes and inline caches are kept too, since they belong to the
+    // program rather than to a run.
+    pub fn reset(&mut self) {
+        self.stack.clear();
+        self.stack
+            .resize(self.program.globals(), Value::Number(0.0));
+        self.frames.clear();
+        self.display.clear();
+        self.display.push(0);
+        self.pc = 0;
+        self.heap.clear();
+        self.mapping = 0;
+        self.scheduler = Scheduler::new();
+        self.waiting = None;
+        #[cfg(feature = "jit")]
+        if let Some(jit) = &mut self.jit {
+            jit.reset();
         }
+    }
 
-        // Sweep phase: Build new compacted heap and create index mapping
-        let mut new_heap = Vec::with_capacity(self.heap.len());
-        let mut remap = vec![None; self.heap.len()];
-        for (i, (obj, is_marked)) in self.heap.iter().zip(marked.iter()).enumerate() {
-            if *is_marked {
-                remap[i] = Some(new_heap.len());
-                new_heap.push(obj.clone());
-            }
-        }
+    // How many threads MAP and FILTER may use, the number of cores by default.
+    pub fn set_threads(&mut self, threads: usize) {
+        self.threads = threads.max(1);
+    }
 
-        // Update phase: Fix all heap pointer references to use new indices
-        for frame in &mut self.stack_frames {
-            for value in &mut frame.variables {
-                if let Value::HeapPointer(idx) = value {
-                    if *idx < remap.len() {
-                        if let Some(new_idx) = remap[*idx] {
-                            *value = Value::HeapPointer(new_idx);
-                        }
-                    }
-                }
-            }
-        }
+    // Compiles hot numeric functions to native code from now on (see jit.rs).
+    #[cfg(feature = "jit")]
+    pub fn enable_jit(&mut self) {
+        self.jit.get_or_insert_with(Jit::new);
+    }
 
-        // Replace old heap with compacted heap
-        self.heap = new_heap;
+    pub fn globals(&self) -> &[Value] {
+        &self.stack[..self.program.globals().min(self.stack.len())]
     }
 
-    fn heap_score(&mut self) -> usize {
-        let mut heap_score: usize = 0;
-        for obj in &self.heap {
-            match obj {
-                HeapObject::Array(arr) => {
-                    heap_score += HEAP_SCORE_ARRAY_BASE + arr.len() * HEAP_SCORE_ARRAY_PER_ELEMENT;
-                }
-                HeapObject::String(s) => {
-                    heap_score += HEAP_SCORE_STRING_BASE + s.len();
-                }
-                HeapObject::Object(map) => {
-                    heap_score += HEAP_SCORE_MAP_BASE + map.len() * HEAP_SCORE_MAP_PER_ELEMENT;
-                }
-                _ => {
-                    heap_score += HEAP_SCORE_OTHER_OBJECT;
-                }
-            }
-        }
-        self.last_heap_score.push_back(heap_score);
-        if self.last_heap_score.len() > GC_HISTORY_BUFFER_SIZE {
-            self.last_heap_score.pop_front();
-        }
-        heap_score
+    pub fn heap(&self) -> &Heap {
+        &self.heap
+    }
+
+    pub fn program(&self) -> &P {
+        &self.program
     }
 
+    // Runs the program and then every task it started (see scheduler.rs).
+    // Dispatch returns whenever the running task finishes or waits, and the
+    // scheduler picks the next one; a program without `async` simply runs
+    // once. The run ends with the main program's context in place.
     pub fn run(&mut self) -> Result<(), String> {
-        while self.pc < self.instructions.len() {
-            if (self.pc + 1) % GC_CHECK_INTERVAL == 0 {
-                let heap_score = self.heap_score();
-                if heap_score >= GC_THRESHOLD {
-                    self.gc();
-                }
+        loop {
+            if let Err(e) = self.dispatch() {
+                // Leave pc on the instruction that failed.
+                self.pc -= 1;
+                let line = self.program.line(self.pc);
+                return Err(format!("[line {}] {}", line, e));
             }
-            match &self.instructions[self.pc] {
-                Instruction::Halt => break,
-                _ => {
-                    if let Err(e) = self.execute_instruction() {
-                        let line = self.instruction_lines.get(self.pc).cloned().unwrap_or(0);
-                        return Err(format!("[line {}] {}", line, e));
-                    }
+            match self.waiting.take() {
+                Some(wait) => self.scheduler.park(wait),
+                None if self.scheduler.current() == MAIN => self.scheduler.finish(None),
+                None => {
+                    let result = self.pop()?;
+                    self.stack.truncate(self.program.globals());
+                    self.frames.clear();
+                    self.scheduler.finish(Some(result));
                 }
             }
+            match self.scheduler.next()? {
+                Some(next) => self.switch(next),
+                None => break,
+            }
         }
+        self.switch(MAIN);
         Ok(())
     }
 
-    fn execute_instruction(&mut self) -> Result<(), String> {
-        match &self.instructions[self.pc].clone() {
-            Instruction::Push(value) => {
-                self.stack.push(value.clone());
-            }
+    fn switch(&mut self, next: usize) {
+        let context = Context {
+            stack: std::mem::take(&mut self.stack),
+            frames: std::mem::take(&mut self.frames),
+            display: std::mem::take(&mut self.display),
+            pc: self.pc,
+        };
+        let context = self.scheduler.switch(next, context, self.program.globals());
+        self.program.switched(next);
+        self.stack = context.stack;
+        self.frames = context.frames;
+        self.display = context.display;
+        self.pc = context.pc;
+    }
 
-            Instruction::LoadConst(index) => {
-                let value = self
-                    .constants
-                    .get(*index)
-                    .ok_or("Invalid constant index")?
-                    .clone();
-                self.stack.push(value);
-            }
+    // The pc is advanced before an instruction executes, so jumps and calls
+    // simply overwrite it and a failing instruction is always at pc - 1.
+    fn dispatch(&mut self) -> Result<(), String> {
+        while let Some(instruction) = self.program.instruction(self.pc) {
+            self.pc += 1;
+
+            match instruction {
+                Instruction::LoadConst(index) => {
+                    let value = self.constant(index)?;
+                    self.stack.push(value);
+                }
 
-            Instruction::StoreVar(_, var_index) => {
-                let value = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
+                Instruction::StoreVar(depth, var_index) => {
+                    let value = self.pop()?;
+                    let value = self.heap_push(value);
+                    let slot = self.slot(depth as usize, var_index as usize)?;
+                    self.stack[slot] = value;
+                }
 
-                self.set_variable(*var_index, value)?;
-            }
+                Instruction::LoadVar(depth, var_index) => {
+                    let slot = self.slot(depth as usize, var_index as usize)?;
+                    let value = self.stack[slot].clone();
+                    self.stack.push(value);
+                }
 
-            Instruction::LoadVar(depth, var_index) => {
-                let value = self.resolve_variable(*depth, *var_index)?;
-                self.stack.push(value);
-            }
+                Instruction::StoreVarKeep(depth, var_index) => {
+                    let value = self.pop()?;
+                    let value = self.heap_push(value);
+                    let slot = self.slot(depth as usize, var_index as usize)?;
+                    self.stack[slot] = value.clone();
+                    self.stack.push(value);
+                }
 
-            Instruction::LoadArg(arg_count) => {
-                let mut args = Vec::new();
-                for _ in 0..*arg_count {
-                    args.push(self.stack.pop().ok_or("Not enough arguments")?);
+                Instruction::LoadVarAdd(depth, var_index) => {
+                    let slot = self.slot(depth as usize, var_index as usize)?;
+                    let b = self.stack[slot].clone();
+                    let a = self.pop()?;
+                    let result = add(a, b, &self.heap)?;
+                    self.stack.push(result);
                 }
-                for (param_index, arg_value) in args.iter().rev().enumerate() {
-                    self.set_variable(param_index, arg_value.clone())?;
+
+                Instruction::Add => {
+                    let b = self.pop()?;
+                    let a = self.pop()?;
+                    let result = add(a, b, &self.heap)?;
+                    self.stack.push(result);
                 }
-            }
 
-            Instruction::Add => {
-                let b = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
-                let a = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
+                Instruction::AddConst(index) => {
+                    let b = self.constant(index)?;
+                    let a = self.pop()?;
+                    let result = add(a, b, &self.heap)?;
+                    self.stack.push(result);
+                }
 
-                match (&a, &b) {
-                    (Value::Number(a_num), Value::Number(b_num)) => {
-                        self.stack.push(Value::Number(a_num + b_num));
+                Instruction::Sub => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Number(a - b));
+                }
+
+                Instruction::SubConst(index) => {
+                    let b: f64 = self.constant(index)?.into_result()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Number(a - b));
+                }
+
+                Instruction::MulConst(index) => {
+                    let b: f64 = self.constant(index)?.into_result()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Number(a * b));
+                }
+
+                Instruction::DivConst(index) => {
+                    let b: f64 = self.constant(index)?.into_result()?;
+                    let a: f64 = self.pop_value()?;
+                    if b == 0.0 {
+                        return Err("Division by zero".to_string());
                     }
-                    (Value::String(a_str), Value::String(b_str)) => {
-                        let result = format!("{}{}", a_str, b_str);
-                        self.stack.push(Value::String(result));
+                    self.stack.push(Value::Number(a / b));
+                }
+
+                Instruction::Negate => {
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Number(0.0 - a));
+                }
+
+                Instruction::Mul => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Number(a * b));
+                }
+
+                Instruction::Div => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    if b == 0.0 {
+                        return Err("Division by zero".to_string());
                     }
-                    _ => {
-                        return Err(format!(
-                            "Cannot add {} and {} - both operands must be the same type",
-                            a.type_name(&self.heap),
-                            b.type_name(&self.heap)
-                        ));
+                    self.stack.push(Value::Number(a / b));
+                }
+
+                Instruction::Equal => {
+                    let b = self.pop()?;
+                    let a = self.pop()?;
+                    let result = values_equal(&a, &b);
+                    self.stack.push(Value::Boolean(result));
+                }
+
+                Instruction::Less => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Boolean(a < b));
+                }
+
+                Instruction::Greater => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    self.stack.push(Value::Boolean(a > b));
+                }
+
+                Instruction::Not => {
+                    let value = self.pop()?;
+                    match value {
+                        Value::Boolean(b) => {
+                            self.stack.push(Value::Boolean(!b));
+                        }
+                        _ => {
+                            return Err(format!(
+                                "Logical NOT operation requires boolean operand, got {}",
+                                value.type_name_stack()
+                            ));
+                        }
                     }
                 }
-            }
 
-            Instruction::Sub => {
-                let b: f64 = self.pop_value()?;
-                let a: f64 = self.pop_value()?;
-                self.stack.push(Value::Number(a - b));
-            }
+                Instruction::CreateArray(size) => {
+                    let start = self
+                        .stack
+                        .len()
+                        .checked_sub(size as usize)
+                        .ok_or(UNDERFLOW_ERROR)?;
+                    let array = dense::array(&self.stack[start..]);
+                    self.stack.truncate(start);
 
-            Instruction::Mul => {
-                let b: f64 = self.pop_value()?;
-                let a: f64 = self.pop_value()?;
-                self.stack.push(Value::Number(a * b));
-            }
+                    let heap_index = self.allocate(array);
+                    self.stack.push(Value::HeapPointer(heap_index));
+                }
+
+                Instruction::CreateRecord(first, count) => {
+                    let start = self
+                        .stack
+                        .len()
+                        .checked_sub(count as usize)
+                        .ok_or(UNDERFLOW_ERROR)?;
+                    let program = &self.program;
+                    let cache = cache(&mut self.caches, self.pc - 1);
+                    let shape = self.shapes.literal(cache, || {
+                        (first..first + count)
+                            .map(|index| match program.constant(index as usize) {
+                                Some(Value::String(key)) => Ok(key),
+                                _ => Err("Invalid record key".to_string()),
+                            })
+                            .collect()
+                    })?;
+                    let fields = self.stack[start..].iter().cloned().map(HeapObject::from);
+                    let record = Record::new(shape, fields.collect());
+                    self.stack.truncate(start);
 
-            Instruction::Div => {
-                let b: f64 = self.pop_value()?;
-                let a: f64 = self.pop_value()?;
-                if b == 0.0 {
-                    return Err("Division by zero".to_string());
+                    let heap_index = self.allocate(HeapObject::Record(record));
+                    self.stack.push(Value::HeapPointer(heap_index));
                 }
-                self.stack.push(Value::Number(a / b));
-            }
 
-            Instruction::Equal => {
-                const STACK_UNDERFLOW: &str = UNDERFLOW_ERROR;
-                let b: Value = self.stack.pop().ok_or(STACK_UNDERFLOW)?;
-                let a: Value = self.stack.pop().ok_or(STACK_UNDERFLOW)?;
-                let result = self.values_equal(&a, &b);
-                self.stack
-                    .push(Value::Boolean(if result { true } else { false }));
-            }
+                // A read from a record of the shape this GET_FIELD saw last
+                // goes straight to the cached slot.
+                Instruction::GetField(name) => {
+                    let value = self.pop()?;
+                    let record = match &value {
+                        Value::HeapPointer(index) => match self.heap.get(*index) {
+                            Some(HeapObject::Record(record)) => Some(record),
+                            _ => None,
+                        },
+                        _ => None,
+                    }
+                    .ok_or_else(|| {
+                        format!(
+                            "Field access expects a record, got {}",
+                            value.type_name(&self.heap)
+                        )
+                    })?;
+                    let program = &self.program;
+                    let cache = cache(&mut self.caches, self.pc - 1);
+                    let field = record.get(cache, || match program.constant(name as usize) {
+                        Some(Value::String(key)) => Ok(key),
+                        _ => Err("Invalid field name".to_string()),
+                    })?;
+                    let field = dense::value(field).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+                    self.stack.push(field);
+                }
 
-            Instruction::Less => {
-                let b: f64 = self.pop_value()?;
-                let a: f64 = self.pop_value()?;
-                self.stack
-                    .push(Value::Boolean(if a < b { true } else { false }));
-            }
+                Instruction::ConcatArray => {
+                    let right = self.pop()?;
+                    let left = self.pop()?;
 
-            Instruction::Greater => {
-                let b: f64 = self.pop_value()?;
-                let a: f64 = self.pop_value()?;
-                self.stack
-                    .push(Value::Boolean(if a > b { true } else { false }));
-            }
+                    let (left_idx, right_idx) = match (left, right) {
+                        (Value::HeapPointer(li), Value::HeapPointer(ri)) => (li, ri),
+                        (l, r) => {
+                            return Err(format!(
+                                "Update expects arrays, got {} and {}",
+                                l.type_name(&self.heap),
+                                r.type_name(&self.heap)
+                            ));
+                        }
+                    };
 
-            Instruction::Not => {
-                let value = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
-                match value {
-                    Value::Boolean(b) => {
-                        self.stack.push(Value::Boolean(!b));
+                    let left_arr = self.heap.get(left_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+                    let right_arr = self.heap.get(right_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+
+                    // Updating a record copies its fields into a new record,
+                    // whose shape the update site caches.
+                    if let (HeapObject::Record(left), HeapObject::Record(right)) =
+                        (left_arr, right_arr)
+                    {
+                        let cache = cache(&mut self.caches, self.pc - 1);
+                        let record = self.shapes.update(left, right, cache);
+                        let idx = self.allocate(HeapObject::Record(record));
+                        self.stack.push(Value::HeapPointer(idx));
+                        continue;
                     }
-                    _ => {
-                        return Err(format!(
-                            "Logical NOT operation requires boolean operand, got {}",
-                            value.type_name_stack()
-                        ));
+
+                    // The result shares left's storage; only right's elements
+                    // are appended to it.
+                    let joined = dense::concat(left_arr, right_arr)
+                        .ok_or_else(|| "Update expects arrays".to_string())?;
+                    let idx = self.allocate(joined);
+                    self.stack.push(Value::HeapPointer(idx));
+                }
+
+                Instruction::Jump(addr) => {
+                    self.pc = addr as usize;
+                }
+
+                Instruction::JumpIfFalse(addr) => {
+                    let value: bool = self.pop_value()?;
+                    if !value {
+                        self.pc = addr as usize;
                     }
                 }
-            }
 
-            Instruction::CreateArray(size) => {
-                let mut elements = Vec::new();
-                for _ in 0..*size {
-                    let element = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
-                    elements.push(self.value_to_heap_object(element));
+                Instruction::EqualJumpIfFalse(addr) => {
+                    let b = self.pop()?;
+                    let a = self.pop()?;
+                    if !values_equal(&a, &b) {
+                        self.pc = addr as usize;
+                    }
                 }
-                elements.reverse();
 
-                let heap_array = HeapObject::Array(elements);
-                self.heap.push(heap_array);
-                let heap_index = self.heap.len() - 1;
-                self.stack.push(Value::HeapPointer(heap_index));
-            }
+                Instruction::LessJumpIfFalse(addr) => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    if !(a < b) {
+                        self.pc = addr as usize;
+                    }
+                }
 
-            Instruction::ConcatArray => {
-                let right = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
-                let left = self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
-
-                let (left_idx, right_idx) = match (left, right) {
-                    (Value::HeapPointer(li), Value::HeapPointer(ri)) => (li, ri),
-                    (l, r) => {
-                        return Err(format!(
-                            "Update expects arrays, got {} and {}",
-                            l.type_name(&self.heap),
-                            r.type_name(&self.heap)
-                        ));
+                Instruction::GreaterJumpIfFalse(addr) => {
+                    let b: f64 = self.pop_value()?;
+                    let a: f64 = self.pop_value()?;
+                    if !(a > b) {
+                        self.pc = addr as usize;
                     }
-                };
-
-                let left_arr = self.heap.get(left_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
-                let right_arr = self.heap.get(right_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
-
-                match (left_arr, right_arr) {
-                    (HeapObject::Array(left_vec), HeapObject::Array(right_vec)) => {
-                        let mut new_vec = Vec::with_capacity(left_vec.len() + right_vec.len());
-                        new_vec.extend_from_slice(left_vec);
-                        new_vec.extend_from_slice(right_vec);
-                        self.heap.push(HeapObject::Array(new_vec));
-                        let idx = self.heap.len() - 1;
-                        self.stack.push(Value::HeapPointer(idx));
+                }
+
+                Instruction::JumpIfTrue(addr) => {
+                    let value: bool = self.pop_value()?;
+                    if value {
+                        self.pc = addr as usize;
                     }
-                    _ => {
-                        return Err("Update expects arrays".to_string());
+                }
+
+                Instruction::Call(func_index) => {
+                    #[cfg(feature = "jit")]
+                    if let Some(value) = self.call_compiled(func_index, false)? {
+                        self.stack.push(value);
+                        continue;
                     }
+                    self.call(func_index, self.pc, None)?;
                 }
-            }
 
-            Instruction::Jump(addr) => {
-                self.pc = *addr;
-                return Ok(());
-            }
+                Instruction::TailCall(func_index) => {
+                    // The finished frame is unwound first, so the callee
+                    // returns straight to our caller and recursion in tail
+                    // position runs in constant space.
+                    #[cfg(feature = "jit")]
+                    if let Some(value) = self.call_compiled(func_index, true)? {
+                        self.stack.push(value);
+                        self.ret()?;
+                        continue;
+                    }
+                    let frame = self.frames.pop().ok_or("No return address available")?;
+                    self.display[frame.depth] = frame.saved_display;
+                    self.program.returned();
+                    self.call(func_index, frame.return_address, Some(frame.base))?;
+                }
 
-            Instruction::JumpIfFalse(addr) => {
-                let value: bool = self.pop_value()?;
-                if value == false {
-                    self.pc = *addr;
-                    return Ok(());
+                Instruction::CallGlobal(index) => {
+                    let native = natives::native(index)?;
+                    let args = self
+                        .stack
+                        .len()
+                        .checked_sub(native.arity)
+                        .ok_or("Not enough arguments")?;
+                    let value = match (native.run)(&self.stack[args..], &self.heap)? {
+                        Returned::Value(value) => value,
+                        Returned::Object(object) => {
+                            // Allocated before the arguments are popped, so
+                            // they are still roots if this collects.
+                            let index = self.allocate(object);
+                            Value::HeapPointer(index)
+                        }
+                    };
+                    self.stack.truncate(args);
+                    self.stack.push(value);
                 }
-            }
 
-            Instruction::JumpIfTrue(addr) => {
-                let value: bool = self.pop_value()?;
-                if value == true {
-                    self.pc = *addr;
-                    return Ok(());
+                // The stages are data: the pc skips them once the pipeline
+                // has run, so an error still points at the PIPELINE itself.
+                Instruction::Pipeline(count) => {
+                    let stages = (self.pc..self.pc + count as usize)
+                        .map(|pc| match self.program.instruction(pc) {
+                            Some(Instruction::CallGlobal(index)) => Ok(index),
+                            _ => Err("Malformed pipeline".to_string()),
+                        })
+                        .collect::<Result<Vec<u32>, String>>()?;
+                    let args = self
+                        .stack
+                        .len()
+                        .checked_sub(natives::pipeline_arity(&stages))
+                        .ok_or("Not enough arguments")?;
+                    let value = match natives::pipeline(&stages, &self.stack[args..], &self.heap)? {
+                        Returned::Value(value) => value,
+                        Returned::Object(object) => Value::HeapPointer(self.allocate(object)),
+                    };
+                    self.stack.truncate(args);
+                    self.stack.push(value);
+                    self.pc += count as usize;
                 }
-            }
 
-            Instruction::Call(func_index) => {
-                let function = self
-                    .functions
-                    .get(*func_index)
-                    .ok_or("Invalid function index")?;
+                Instruction::Map(func_index) => self.map(func_index)?,
 
-                if let Value::Function { offset, .. } = function {
-                    self.return_addresses.push(self.pc + 1);
+                Instruction::Filter(func_index) => self.filter(func_index)?,
 
-                    let new_frame = StackFrame::new();
-                    self.stack_frames.push(new_frame);
+                Instruction::Async(func_index) => {
+                    let task = self.spawn(func_index)?;
+                    let index = self.allocate(HeapObject::Future(Future::Task(task)));
+                    self.stack.push(Value::HeapPointer(index));
+                }
 
-                    self.pc = *offset;
-                    return Ok(());
-                } else {
-                    return Err("Invalid function value".to_string());
+                // A future that is not complete yet suspends the running task
+                // with the pc back on the AWAIT, which runs again on resume.
+                Instruction::Await => {
+                    let future = match self.stack.last() {
+                        Some(Value::HeapPointer(index)) => match self.heap.get(*index) {
+                            Some(HeapObject::Future(future)) => Some(*future),
+                            _ => None,
+                        },
+                        _ => None,
+                    }
+                    .ok_or_else(|| {
+                        let value = self.stack.last().cloned().unwrap_or(Value::Number(0.0));
+                        format!(
+                            "await expects a future, got {}",
+                            value.type_name(&self.heap)
+                        )
+                    })?;
+                    let (result, wait) = match future {
+                        Future::Task(task) => {
+                            (self.scheduler.result(task)?.cloned(), Wait::Task(task))
+                        }
+                        Future::Timer { deadline, value } => (
+                            (Instant::now() >= deadline).then_some(Value::Number(value)),
+                            Wait::Until(deadline),
+                        ),
+                    };
+                    match result {
+                        Some(value) => {
+                            self.pop()?;
+                            self.stack.push(value);
+                        }
+                        None if self.mapping > 0 => {
+                            return Err("Cannot await inside map or filter".to_string());
+                        }
+                        None => {
+                            self.pc -= 1;
+                            self.waiting = Some(wait);
+                            return Ok(());
+                        }
+                    }
+                }
+
+                Instruction::Return => self.ret()?,
+
+                Instruction::Pop => {
+                    self.pop()?;
                 }
-            }
 
-            Instruction::Return => {
-                if self.stack_frames.len() > 1 {
-                    self.stack_frames.pop();
+                Instruction::Dup => {
+                    let value = self.stack.last().ok_or(UNDERFLOW_ERROR)?.clone();
+                    self.stack.push(value);
                 }
 
-                if let Some(return_addr) = self.return_addresses.pop() {
-                    self.pc = return_addr;
+                Instruction::Halt => {
+                    self.pc -= 1;
                     return Ok(());
-                } else {
-                    return Err("No return address available".to_string());
                 }
             }
+        }
+        Ok(())
+    }
 
-            Instruction::Pop => {
-                self.stack.pop().ok_or(UNDERFLOW_ERROR)?;
+    fn ret(&mut self) -> Result<(), String> {
+        let frame = self.frames.pop().ok_or("No return address available")?;
+        let value = self.pop()?;
+
+        self.stack.truncate(frame.base);
+        self.stack.push(value);
+        self.display[frame.depth] = frame.saved_display;
+        self.pc = frame.return_address;
+        self.program.returned();
+        Ok(())
+    }
+
+    // Starts a call of a top-level function on the arguments on top of the
+    // stack as a new task, with a frame that returns past the end of the
+    // program, and returns its index.
+    fn spawn(&mut self, func_index: u32) -> Result<usize, String> {
+        if self.mapping > 0 {
+            return Err("Cannot start a task inside map or filter".to_string());
+        }
+        let CallTarget {
+            offset,
+            arity,
+            locals,
+            depth,
+        } = *self
+            .calls
+            .get(func_index as usize)
+            .ok_or("Invalid function index")?;
+        let args = self
+            .stack
+            .len()
+            .checked_sub(arity)
+            .ok_or("Not enough arguments")?;
+        let globals = self.program.globals();
+        let mut stack = Vec::with_capacity(globals + locals);
+        stack.extend_from_slice(&self.stack[..globals]);
+        stack.extend(self.stack.drain(args..));
+        stack.resize(globals + locals, Value::Number(0.0));
+        let mut display = vec![0; depth + 1];
+        display[depth] = globals;
+        let frames = vec![CallFrame {
+            return_address: usize::MAX,
+            base: globals,
+            depth,
+            saved_display: 0,
+        }];
+        let task = self.scheduler.spawn(Context {
+            stack,
+            frames,
+            display,
+            pc: offset,
+        });
+        self.program.spawned(task, func_index as usize);
+        Ok(task)
+    }
+
+    // Runs a call natively if the JIT has compiled the callee, replacing the
+    // arguments with the result. None leaves the call to the interpreter. If
+    // native code gave up, the frames the interpreter runs the call in - for
+    // a tail call, including the one it replaces - stay interpreted.
+    #[cfg(feature = "jit")]
+    fn call_compiled(&mut self, func_index: u32, tail: bool) -> Result<Option<Value>, String> {
+        let Some(jit) = self.jit.as_mut() else {
+            return Ok(None);
+        };
+        let depth = self.frames.len();
+        let Some(entry) = jit.entry(&self.program, func_index as usize, depth) else {
+            return Ok(None);
+        };
+        let arity = self
+            .calls
+            .get(func_index as usize)
+            .ok_or("Invalid function index")?
+            .arity;
+        let args = self
+            .stack
+            .len()
+            .checked_sub(arity)
+            .ok_or("Not enough arguments")?;
+        match jit.call(entry, &self.stack[args..], depth - tail as usize) {
+            Some(result) => {
+                self.stack.truncate(args);
+                Ok(Some(Value::Number(result)))
             }
+            None => Ok(None),
+        }
+    }
 
-            Instruction::Dup => {
-                let value = self.stack.last().ok_or(UNDERFLOW_ERROR)?.clone();
-                self.stack.push(value);
+    // Enters a function whose arguments are on top of the stack. A tail call
+    // passes the base of the frame it replaces; the arguments move down to it,
+    // dropping that frame's slots.
+    fn call(
+        &mut self,
+        func_index: u32,
+        return_address: usize,
+        reuse: Option<usize>,
+    ) -> Result<(), String> {
+        let CallTarget {
+            offset,
+            arity,
+            locals,
+            depth,
+        } = *self
+            .calls
+            .get(func_index as usize)
+            .ok_or("Invalid function index")?;
+
+        // The arguments already sit in the first slots of the new frame; the
+        // remaining locals are reserved in place.
+        let args = self
+            .stack
+            .len()
+            .checked_sub(arity)
+            .ok_or("Not enough arguments")?;
+        let base = match reuse {
+            Some(base) if base <= args => {
+                self.stack.drain(base..args);
+                base
             }
+            Some(_) => return Err("Not enough arguments".to_string()),
+            None => args,
+        };
+        self.stack.resize(base + locals, Value::Number(0.0));
+
+        if depth >= self.display.len() {
+            self.display.resize(depth + 1, 0);
+        }
+        self.frames.push(CallFrame {
+            return_address,
+            base,
+            depth,
+            saved_display: self.display[depth],
+        });
+        self.display[depth] = base;
+        self.pc = offset;
+        self.program.entered(func_index as usize);
+        Ok(())
+    }
 
-            Instruction::Halt => {
-                return Ok(());
+    // MAP replaces the array on top of the stack with the array of what the
+    // function returns for each element. Large arrays are split across worker
+    // VMs on other threads (see parallel.rs); a result that refers to the heap
+    // is detached from the worker's heap and attached to this one. Smaller
+    // arrays, and every map a worker runs, call the function on this VM.
+    fn map(&mut self, func_index: u32) -> Result<(), String> {
+        let (source, len) = self.source(func_index, "map")?;
+        let base = self.stack.len();
+        if self.parallel(len) {
+            let results = self.in_parallel(func_index, len, |heap, value| {
+                Ok(heap.detach(&HeapObject::from(value)))
+            })?;
+            for object in results {
+                let value = self.attach(object);
+                self.stack.push(value);
+            }
+        } else {
+            // Each result stays on the stack, where the collector sees it.
+            for index in 0..len {
+                self.call_element(func_index, source, index)?;
             }
         }
+        let array = dense::array(&self.stack[base..]);
+        self.stack.truncate(source);
+        let index = self.allocate(array);
+        self.stack.push(Value::HeapPointer(index));
+        Ok(())
+    }
 
-        self.pc += 1;
+    // FILTER keeps the elements the function returns true for.
+    fn filter(&mut self, func_index: u32) -> Result<(), String> {
+        let (source, len) = self.source(func_index, "filter")?;
+        let keep: Vector<bool> = if self.parallel(len) {
+            self.in_parallel(func_index, len, kept)?
+                .into_iter()
+                .collect()
+        } else {
+            (0..len)
+                .map(|index| {
+                    self.call_element(func_index, source, index)?;
+                    let value = self.pop()?;
+                    kept(&self.heap, value)
+                })
+                .collect::<Result<_, String>>()?
+        };
+        let filtered = match &self.stack[source] {
+            Value::HeapPointer(index) => self.heap.get(*index),
+            _ => None,
+        }
+        .and_then(|array| dense::filter(array, &keep))
+        .ok_or(INVALID_HEAP_POINTER_ERROR)?;
+        self.stack.truncate(source);
+        let index = self.allocate(filtered);
+        self.stack.push(Value::HeapPointer(index));
         Ok(())
     }
 
-    fn resolve_variable(&self, depth: usize, var_index: usize) -> Result<Value, String> {
-        for frame in self.stack_frames.iter().rev() {
-            if let Some(value) = frame.get_variable(var_index) {
-                return Ok(value.clone());
-            }
+    // The stack slot and length of the array MAP or FILTER runs over.
+    fn source(&self, func_index: u32, name: &str) -> Result<(usize, usize), String> {
+        let source = self.stack.len().checked_sub(1).ok_or(UNDERFLOW_ERROR)?;
+        let len = match &self.stack[source] {
+            Value::HeapPointer(index) => self.heap.get(*index).and_then(dense::len),
+            _ => None,
+        }
+        .ok_or_else(|| {
+            format!(
+                "{} expects an array, got {}",
+                name,
+                self.stack[source].type_name(&self.heap)
+            )
+        })?;
+        if self.calls.get(func_index as usize).map(|call| call.arity) != Some(1) {
+            return Err(format!("{} expects a function of one argument", name));
         }
-        if let Some(scope) = self.raw_compiler.variables.get(depth) {
-            for (name, idx) in scope.iter() {
-                if *idx == var_index {
-                    return Err(format!(
-                        "Variable '{}' (index {}) not found",
-                        name, var_index
-                    ));
+        Ok((source, len))
+    }
+
+    fn parallel(&self, len: usize) -> bool {
+        self.threads > 1 && len >= PARALLEL_MIN_ELEMENTS
+    }
+
+    // Calls the function on every element of the array on top of the stack
+    // in worker VMs, returning what `result` makes of each return value.
+    fn in_parallel<R: Send>(
+        &self,
+        func_index: u32,
+        len: usize,
+        result: impl Fn(&Heap, Value) -> Result<R, String> + Sync,
+    ) -> Result<Vec<R>, String> {
+        let program = self.program.shared();
+        let globals = self.globals();
+        let heap = &self.heap;
+        let shapes = &self.shapes;
+        let source = self.stack.last().ok_or(UNDERFLOW_ERROR)?;
+        parallel::run(
+            len,
+            self.threads,
+            || VirtualMachine::worker(program, globals, heap, shapes, source.clone()),
+            |vm, index| {
+                vm.call_element(func_index, globals.len(), index)?;
+                let value = vm.pop()?;
+                result(&vm.heap, value)
+            },
+        )
+    }
+
+    // Calls a function of one argument on element `index` of the array in
+    // stack slot `source` and leaves the result on the stack. The call
+    // returns to an address past the end of the program, which is where the
+    // nested dispatch loop stops; the pc is restored either way, so an error
+    // is reported at the MAP or FILTER.
+    fn call_element(&mut self, func_index: u32, source: usize, index: usize) -> Result<(), String> {
+        let element = match &self.stack[source] {
+            Value::HeapPointer(array) => self
+                .heap
+                .get(*array)
+                .and_then(|array| dense::element(array, index)),
+            _ => None,
+        }
+        .ok_or(INVALID_HEAP_POINTER_ERROR)?;
+        self.stack.push(element);
+        #[cfg(feature = "jit")]
+        if let Some(value) = self.call_compiled(func_index, false)? {
+            self.stack.push(value);
+            return Ok(());
+        }
+        let pc = self.pc;
+        self.call(func_index, usize::MAX, None)?;
+        self.mapping += 1;
+        let result = self.dispatch();
+        self.mapping -= 1;
+        self.pc = pc;
+        result
+    }
+
+    // Moves a map result detached from a worker's heap into this one. Nested
+    // arrays and records are allocated innermost first, each kept on the
+    // stack until the object holding it is built, since an allocation may
+    // collect. A record's shape is interned again here, so that it is the
+    // one this VM's inline caches compare against.
+    fn attach(&mut self, object: HeapObject) -> Value {
+        match object {
+            HeapObject::Number(n) => Value::Number(n),
+            HeapObject::String(s) => Value::String(s),
+            HeapObject::Boolean(b) => Value::Boolean(b),
+            HeapObject::Array(items) => {
+                let base = self.stack.len();
+                for item in items.iter() {
+                    let value = self.attach(item.clone());
+                    self.stack.push(value);
+                }
+                let array = dense::array(&self.stack[base..]);
+                self.stack.truncate(base);
+                Value::HeapPointer(self.allocate(array))
+            }
+            HeapObject::Record(record) => {
+                let base = self.stack.len();
+                for field in record.fields.iter() {
+                    let value = self.attach(field.clone());
+                    self.stack.push(value);
                 }
+                let shape = self.shapes.intern(record.shape.keys().to_vec());
+                let fields = self.stack.drain(base..).map(HeapObject::from).collect();
+                Value::HeapPointer(self.allocate(HeapObject::Record(Record::new(shape, fields))))
             }
+            object => Value::HeapPointer(self.allocate(object)),
         }
-        Err(format!("Variable with index {} not found", var_index))
     }
 
-    fn heap_push(&mut self, value: Value) -> Option<Value> {
-        let heap_index = match &value {
-            Value::String(s) if s.len() > MAX_STRING_LENGTH => {
-                let heap_obj = HeapObject::String(s.clone());
-                self.heap.push(heap_obj);
-                Some(self.heap.len() - 1)
-            }
-            _ => None,
-        };
+    // Every heap allocation goes through here, which is also where the
+    // collector gets its chance to run instead of being polled per instruction.
+    // Values of parked tasks are roots too.
+    fn allocate(&mut self, object: HeapObject) -> usize {
+        let stack = &mut self.stack;
+        let scheduler = &mut self.scheduler;
+        self.heap.allocate_across(object, || {
+            std::iter::once(&mut stack[..])
+                .chain(scheduler.roots())
+                .collect()
+        })
+    }
 
-        heap_index.map(|index| Value::HeapPointer(index))
+    fn constant(&self, index: u32) -> Result<Value, String> {
+        self.program
+            .constant(index as usize)
+            .ok_or_else(|| "Invalid constant index".to_string())
     }
 
-    fn set_variable(&mut self, var_index: usize, value: Value) -> Result<(), String> {
-        let final_value = match self.heap_push(value.clone()) {
-            Some(heap_pointer) => heap_pointer,
-            None => value,
-        };
+    fn slot(&self, depth: usize, var_index: usize) -> Result<usize, String> {
+        let slot = self.display.get(depth).ok_or("Invalid scope depth")? + var_index;
+        if slot < self.stack.len() {
+            Ok(slot)
+        } else {
+            Err(format!("Variable with index {} not found", var_index))
+        }
+    }
 
-        let current_frame = self
-            .stack_frames
-            .last_mut()
-            .ok_or("No stack frame available")?;
+    fn heap_push(&mut self, value: Value) -> Value {
+        match value {
+            Value::String(s) if s.len() > MAX_STRING_LENGTH => {
+                Value::HeapPointer(self.allocate(HeapObject::String(s)))
+            }
+            value => value,
+        }
+    }
 
-        current_frame.set_variable(var_index, final_value);
-        Ok(())
+    fn pop(&mut self) -> Result<Value, String> {
+        self.stack.pop().ok_or_else(|| UNDERFLOW_ERROR.to_string())
     }
 
     fn pop_value<T>(&mut self) -> Result<T, String>
@@ -443,34 +975,73 @@ impl VirtualMachine {
         }
     }
 
-    fn values_equal(&self, a: &Value, b: &Value) -> bool {
-        match (a, b) {
-            (Value::Number(x), Value::Number(y)) => x == y,
-            (Value::String(x), Value::String(y)) => x == y,
-            _ => false,
-        }
-    }
-
     pub fn debug_stack(&self) {
         println!("=== VM DEBUG ===");
         println!("PC: {}", self.pc);
         println!("Stack: {:?}", self.stack);
-        println!("Stack Frames: {}", self.stack_frames.len());
+        println!("Stack Frames: {}", self.frames.len() + 1);
         println!("Heap: {:?}", self.heap);
 
-        if let Some(current_instruction) = self.instructions.get(self.pc) {
+        if let Some(current_instruction) = self.program.instruction(self.pc) {
             println!("Next Instruction: {:?}", current_instruction);
         }
         println!("================");
     }
+}
 
-    fn value_to_heap_object(&self, value: Value) -> HeapObject {
-        match value {
-            Value::Number(n) => HeapObject::Number(n),
-            Value::String(s) => HeapObject::String(s),
-            Value::Boolean(b) => HeapObject::Boolean(b),
-            Value::HeapPointer(_) => HeapObject::Null, // Could preserve references, but simplify for now
-            Value::Function { .. } => HeapObject::Null, // Functions can't go in arrays yet
+// Arithmetic shared with the register machine, so both engines agree on
+// what ADD and EQUAL mean.
+pub(crate) fn add(a: Value, b: Value, heap: &Heap) -> Result<Value, String> {
+    match (a, b) {
+        (Value::Number(a_num), Value::Number(b_num)) => Ok(Value::Number(a_num + b_num)),
+        (Value::String(mut a_str), Value::String(b_str)) => {
+            // A string built by a previous Add is owned by nothing else,
+            // so a chain like a + b + c extends one buffer in place.
+            // Shared strings are copied once into a buffer sized for the
+            // result.
+            match Arc::get_mut(&mut a_str) {
+                Some(buffer) => buffer.push_str(&b_str),
+                None => {
+                    let mut buffer = String::with_capacity(a_str.len() + b_str.len());
+                    buffer.push_str(&a_str);
+                    buffer.push_str(&b_str);
+                    a_str = Arc::new(buffer);
+                }
+            }
+            Ok(Value::String(a_str))
         }
+        (a, b) => Err(format!(
+            "Cannot add {} and {} - both operands must be the same type",
+            a.type_name(heap),
+            b.type_name(heap)
+        )),
+    }
+}
+
+// What FILTER makes of the function's return value.
+fn kept(heap: &Heap, value: Value) -> Result<bool, String> {
+    match value {
+        Value::Boolean(keep) => Ok(keep),
+        value => Err(format!(
+            "filter expects a function returning a boolean, got {}",
+            value.type_name(heap)
+        )),
+    }
+}
+
+// The inline cache of the instruction at `pc`, made on its first run.
+fn cache(caches: &mut Vec<InlineCache>, pc: usize) -> &mut InlineCache {
+    if caches.len() <= pc {
+        caches.resize(pc + 1, InlineCache::Empty);
+    }
+    &mut caches[pc]
+}
+
+pub(crate) fn values_equal(a: &Value, b: &Value) -> bool {
+    match (a, b) {
+        (Value::Number(x), Value::Number(y)) => x == y,
+        // Interned strings compare by address before falling back to bytes
+        (Value::String(x), Value::String(y)) => Arc::ptr_eq(x, y) || x == y,
+        _ => false,
     }
 }
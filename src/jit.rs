@@ -0,0 +1,865 @@
+use crate::types::compiler::{Instruction, Value};
+use crate::types::constants::{JIT_STACK_BUDGET, JIT_THRESHOLD};
+use crate::types::traits::Executable;
+use std::collections::HashMap;
+
+// Baseline tier for the stack VM, built with `--features jit`. The VM counts
+// calls per function; once one reaches JIT_THRESHOLD its bytecode, and that of
+// every function it calls, is translated instruction by instruction to x86-64
+// and later calls run natively.
+//
+// Only numeric functions are compiled: every value is a number, or a boolean
+// that feeds straight into a jump, and nothing outside the function's own
+// frame is read or written. Such a function is pure, which keeps falling back
+// simple: whenever native code cannot continue (a zero divisor, or recursion
+// deeper than JIT_STACK_BUDGET allows on the machine stack) it abandons the
+// whole call, and the interpreter runs the call again from its arguments,
+// raising the error or recursing on its own stack as usual. Anything else -
+// strings, arrays, outer variables, opcodes not listed in `analyze` - keeps
+// the function in the interpreter.
+pub struct Jit {
+    tiers: Vec<Tier>,
+    code: Vec<native::Code>,
+    args: Vec<f64>,
+    suspended: Option<usize>,
+}
+
+#[derive(Clone, Copy)]
+enum Tier {
+    Counting(u32),
+    Compiled(native::Entry),
+    Unsupported,
+}
+
+impl Jit {
+    pub fn new() -> Self {
+        Self {
+            tiers: Vec::new(),
+            code: Vec::new(),
+            args: Vec::new(),
+            suspended: None,
+        }
+    }
+
+    // Forgets a call given up mid-run; the counts and compiled code stay.
+    pub fn reset(&mut self) {
+        self.suspended = None;
+    }
+
+    // Counts a call of `function` made with `depth` frames active and
+    // returns its native entry point once it has one. After a native call
+    // gives up the interpreter runs that call and everything it calls itself,
+    // so a deep recursion or a failing loop is only attempted natively once.
+    pub fn entry<P: Executable>(
+        &mut self,
+        program: &P,
+        function: usize,
+        depth: usize,
+    ) -> Option<native::Entry> {
+        if let Some(suspended) = self.suspended {
+            if depth > suspended {
+                return None;
+            }
+            self.suspended = None;
+        }
+        if function >= self.tiers.len() {
+            self.tiers.resize(function + 1, Tier::Counting(0));
+        }
+        match self.tiers[function] {
+            Tier::Compiled(entry) => Some(entry),
+            Tier::Unsupported => None,
+            Tier::Counting(calls) if calls + 1 < JIT_THRESHOLD => {
+                self.tiers[function] = Tier::Counting(calls + 1);
+                None
+            }
+            Tier::Counting(_) => {
+                self.compile(program, function);
+                match self.tiers[function] {
+                    Tier::Compiled(entry) => Some(entry),
+                    _ => None,
+                }
+            }
+        }
+    }
+
+    // Runs `entry` on `args`. None means the interpreter has to make the
+    // call: an argument is not a number, or native code gave up, in which
+    // case calls stay interpreted until the frames above `depth` are gone.
+    pub fn call(&mut self, entry: native::Entry, args: &[Value], depth: usize) -> Option<f64> {
+        self.args.clear();
+        for arg in args {
+            match arg {
+                Value::Number(n) => self.args.push(*n),
+                _ => return None,
+            }
+        }
+        let result = native::call(entry, &self.args, JIT_STACK_BUDGET);
+        if result.is_none() {
+            self.suspended = Some(depth);
+        }
+        result
+    }
+
+    // Compiles `root` together with every function it can reach through
+    // calls that is not compiled yet, so calls within the group are direct.
+    // A function is only compiled if everything it calls is.
+    fn compile<P: Executable>(&mut self, program: &P, root: usize) {
+        let mut group: HashMap<usize, Analysis> = HashMap::new();
+        let mut pending = vec![root];
+        while let Some(function) = pending.pop() {
+            if group.contains_key(&function) || self.compiled(function).is_some() {
+                continue;
+            }
+            if matches!(self.tier(function), Tier::Unsupported) {
+                continue;
+            }
+            match analyze(program, function) {
+                Some(analysis) => {
+                    pending.extend(analysis.callees.iter().copied());
+                    group.insert(function, analysis);
+                }
+                None => self.set_tier(function, Tier::Unsupported),
+            }
+        }
+
+        loop {
+            let unsupported: Vec<usize> = group
+                .iter()
+                .filter(|(_, analysis)| {
+                    analysis.callees.iter().any(|callee| {
+                        !group.contains_key(callee) && self.compiled(*callee).is_none()
+                    })
+                })
+                .map(|(function, _)| *function)
+                .collect();
+            if unsupported.is_empty() {
+                break;
+            }
+            for function in unsupported {
+                group.remove(&function);
+                self.set_tier(function, Tier::Unsupported);
+            }
+        }
+        if group.is_empty() {
+            return;
+        }
+
+        let external = |function: usize| self.compiled(function);
+        match native::compile(program, &group, external) {
+            Some((code, entries)) => {
+                for (function, entry) in entries {
+                    self.set_tier(function, Tier::Compiled(entry));
+                }
+                self.code.push(code);
+            }
+            None => {
+                for function in group.keys() {
+                    self.set_tier(*function, Tier::Unsupported);
+                }
+            }
+        }
+    }
+
+    fn tier(&self, function: usize) -> Tier {
+        self.tiers
+            .get(function)
+            .copied()
+            .unwrap_or(Tier::Counting(0))
+    }
+
+    fn compiled(&self, function: usize) -> Option<native::Entry> {
+        match self.tier(function) {
+            Tier::Compiled(entry) => Some(entry),
+            _ => None,
+        }
+    }
+
+    fn set_tier(&mut self, function: usize, tier: Tier) {
+        if function >= self.tiers.len() {
+            self.tiers.resize(function + 1, Tier::Counting(0));
+        }
+        self.tiers[function] = tier;
+    }
+}
+
+impl Default for Jit {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Type {
+    Number,
+    Boolean,
+}
+
+// What code generation needs to know about a compilable function. `code`
+// lists every reachable instruction in address order with the operand stack
+// depth before it; the compiler always leaves the same depth at a jump and
+// at its target, and anything else is rejected.
+pub struct Analysis {
+    arity: usize,
+    locals: usize,
+    max_stack: usize,
+    code: Vec<(usize, Instruction, usize)>,
+    callees: Vec<usize>,
+}
+
+// Checks `function` against the numeric subset by walking its reachable
+// instructions with a stack of operand types.
+fn analyze<P: Executable>(program: &P, index: usize) -> Option<Analysis> {
+    let function = program.function(index)?;
+    let (arity, locals, depth) = (function.params.len(), function.locals, function.depth);
+    if locals < arity {
+        return None;
+    }
+
+    let number = |constant: u32| match program.constant(constant as usize) {
+        Some(Value::Number(_)) => Some(()),
+        _ => None,
+    };
+    let local = |var_depth: u32, var_index: u32| {
+        (var_depth as usize == depth && (var_index as usize) < locals).then_some(())
+    };
+
+    let mut states: HashMap<usize, Vec<Type>> = HashMap::new();
+    let mut pending = vec![(function.offset, Vec::new())];
+    let mut callees = Vec::new();
+    let mut max_stack = 0;
+
+    while let Some((pc, mut stack)) = pending.pop() {
+        if let Some(seen) = states.get(&pc) {
+            if *seen != stack {
+                return None;
+            }
+            continue;
+        }
+        states.insert(pc, stack.clone());
+        let instruction = program.instruction(pc)?;
+
+        let pop = |stack: &mut Vec<Type>, expected: Type| match stack.pop() {
+            Some(found) if found == expected => Some(()),
+            _ => None,
+        };
+        let mut next = vec![pc + 1];
+        match instruction {
+            Instruction::LoadConst(constant) => {
+                number(constant)?;
+                stack.push(Type::Number);
+            }
+            Instruction::LoadVar(var_depth, var_index) => {
+                local(var_depth, var_index)?;
+                stack.push(Type::Number);
+            }
+            Instruction::StoreVar(var_depth, var_index) => {
+                local(var_depth, var_index)?;
+                pop(&mut stack, Type::Number)?;
+            }
+            Instruction::StoreVarKeep(var_depth, var_index)
+            | Instruction::LoadVarAdd(var_depth, var_index) => {
+                local(var_depth, var_index)?;
+                pop(&mut stack, Type::Number)?;
+                stack.push(Type::Number);
+            }
+            Instruction::Add | Instruction::Sub | Instruction::Mul | Instruction::Div => {
+                pop(&mut stack, Type::Number)?;
+                pop(&mut stack, Type::Number)?;
+                stack.push(Type::Number);
+            }
+            Instruction::AddConst(constant)
+            | Instruction::SubConst(constant)
+            | Instruction::MulConst(constant)
+            | Instruction::DivConst(constant) => {
+                number(constant)?;
+                pop(&mut stack, Type::Number)?;
+                stack.push(Type::Number);
+            }
+            Instruction::Negate => {
+                pop(&mut stack, Type::Number)?;
+                stack.push(Type::Number);
+            }
+            Instruction::Equal | Instruction::Less | Instruction::Greater => {
+                pop(&mut stack, Type::Number)?;
+                pop(&mut stack, Type::Number)?;
+                stack.push(Type::Boolean);
+            }
+            Instruction::Not => {
+                pop(&mut stack, Type::Boolean)?;
+                stack.push(Type::Boolean);
+            }
+            Instruction::Jump(target) => next = vec![target as usize],
+            Instruction::JumpIfFalse(target) | Instruction::JumpIfTrue(target) => {
+                pop(&mut stack, Type::Boolean)?;
+                next.push(target as usize);
+            }
+            Instruction::EqualJumpIfFalse(target)
+            | Instruction::LessJumpIfFalse(target)
+            | Instruction::GreaterJumpIfFalse(target) => {
+                pop(&mut stack, Type::Number)?;
+                pop(&mut stack, Type::Number)?;
+                next.push(target as usize);
+            }
+            Instruction::Call(callee) | Instruction::TailCall(callee) => {
+                let callee_arity = program.function(callee as usize)?.params.len();
+                for _ in 0..callee_arity {
+                    pop(&mut stack, Type::Number)?;
+                }
+                callees.push(callee as usize);
+                match instruction {
+                    Instruction::Call(_) => stack.push(Type::Number),
+                    _ => next.clear(),
+                }
+            }
+            Instruction::Return => {
+                pop(&mut stack, Type::Number)?;
+                next.clear();
+            }
+            Instruction::Pop => {
+                stack.pop()?;
+            }
+            Instruction::Dup => {
+                let top = *stack.last()?;
+                stack.push(top);
+            }
+            Instruction::CreateArray(_)
+            | Instruction::ConcatArray
+            | Instruction::CallGlobal(_)
+            | Instruction::Pipeline(_)
+            | Instruction::Map(_)
+            | Instruction::Filter(_)
+            | Instruction::Async(_)
+            | Instruction::Await
+            | Instruction::CreateRecord(..)
+            | Instruction::GetField(_)
+            | Instruction::Halt => {
+                return None;
+            }
+        }
+        max_stack = max_stack.max(stack.len());
+        for target in next {
+            pending.push((target, stack.clone()));
+        }
+    }
+
+    let mut code: Vec<(usize, Instruction, usize)> = states
+        .into_iter()
+        .map(|(pc, stack)| Some((pc, program.instruction(pc)?, stack.len())))
+        .collect::<Option<_>>()?;
+    code.sort_by_key(|(pc, _, _)| *pc);
+    callees.sort_unstable();
+    callees.dedup();
+    Some(Analysis {
+        arity,
+        locals,
+        max_stack,
+        code,
+        callees,
+    })
+}
+
+#[cfg(all(target_arch = "x86_64", target_os = "linux"))]
+mod native {
+    use super::Analysis;
+    use crate::types::compiler::{Instruction, Value};
+    use crate::types::traits::Executable;
+    use std::collections::HashMap;
+    use std::ffi::{c_int, c_void};
+
+    // Internal calling convention, shared by every compiled function: rdi
+    // points at the arguments, rsi at the Context, and the result comes back
+    // as (rax, xmm0) = (status, value). A nonzero status means "give up", and
+    // callers pass it straight up to the entry from Rust.
+    #[repr(C)]
+    pub struct NativeResult {
+        status: u64,
+        value: f64,
+    }
+
+    #[repr(C)]
+    struct Context {
+        stack_limit: usize, // Lowest rsp a function may start at
+        tail_args: [f64; TAIL_ARGS],
+    }
+
+    // Tail calls to another function pass their arguments through the
+    // context, since the caller's frame is gone by the time the callee reads
+    // them. Callees with more parameters get a plain call and return.
+    const TAIL_ARGS: usize = 8;
+    const TAIL_ARG_OFFSET: i32 = 8;
+
+    pub type Entry = unsafe extern "sysv64" fn(*const f64, *mut c_void) -> NativeResult;
+
+    pub fn call(entry: Entry, args: &[f64], budget: usize) -> Option<f64> {
+        let marker = 0u8;
+        let here = &marker as *const u8 as usize;
+        let mut context = Context {
+            stack_limit: here.saturating_sub(budget),
+            tail_args: [0.0; TAIL_ARGS],
+        };
+        let context = &mut context as *mut Context as *mut c_void;
+        let result = unsafe { entry(args.as_ptr(), context) };
+        (result.status == 0).then_some(result.value)
+    }
+
+    // Executable memory holding one compiled group.
+    pub struct Code {
+        ptr: *mut c_void,
+        len: usize,
+    }
+
+    const PROT_READ: c_int = 1;
+    const PROT_WRITE: c_int = 2;
+    const PROT_EXEC: c_int = 4;
+    const MAP_PRIVATE: c_int = 2;
+    const MAP_ANONYMOUS: c_int = 0x20;
+    const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+
+    unsafe extern "C" {
+        fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        fn mprotect(addr: *mut c_void, len: usize, prot: c_int) -> c_int;
+        fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    }
+
+    impl Code {
+        // Pages are written while mapped read-write, then become read-execute.
+        fn new(bytes: &[u8]) -> Option<Self> {
+            let len = bytes.len().max(1);
+            let ptr = unsafe {
+                mmap(
+                    std::ptr::null_mut(),
+                    len,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0,
+                )
+            };
+            if ptr == MAP_FAILED {
+                return None;
+            }
+            let code = Self { ptr, len };
+            unsafe {
+                std::ptr::copy_nonoverlapping(bytes.as_ptr(), ptr as *mut u8, bytes.len());
+                if mprotect(ptr, len, PROT_READ | PROT_EXEC) != 0 {
+                    return None;
+                }
+            }
+            Some(code)
+        }
+    }
+
+    // The mapping belongs to this value alone and is never written once it
+    // is executable, so it can move to another thread with its VM.
+    unsafe impl Send for Code {}
+
+    impl Drop for Code {
+        fn drop(&mut self) {
+            unsafe {
+                munmap(self.ptr, self.len);
+            }
+        }
+    }
+
+    #[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+    enum Label {
+        Entry(usize),
+        Body(usize),
+        Pc(usize, usize),
+        Bail(usize),
+        Exit(usize),
+    }
+
+    const JCC_BE: u8 = 0x86; // jcc opcodes, after 0x0F
+    const JCC_B: u8 = 0x82;
+    const JCC_E: u8 = 0x84;
+    const JCC_NE: u8 = 0x85;
+    const JCC_P: u8 = 0x8A;
+
+    const ADDSD: u8 = 0x58;
+    const MULSD: u8 = 0x59;
+    const SUBSD: u8 = 0x5C;
+    const DIVSD: u8 = 0x5E;
+
+    // Emits code for a group of analyzed functions into one buffer. Calls to
+    // functions compiled earlier go through their absolute address.
+    pub fn compile<P: Executable>(
+        program: &P,
+        group: &HashMap<usize, Analysis>,
+        external: impl Fn(usize) -> Option<Entry>,
+    ) -> Option<(Code, Vec<(usize, Entry)>)> {
+        let mut assembler = Assembler::default();
+        let mut functions: Vec<usize> = group.keys().copied().collect();
+        functions.sort_unstable();
+        for function in &functions {
+            assembler.function(program, *function, &group[function], group, &external)?;
+        }
+
+        let code = assembler.finish()?;
+        let base = code.ptr as usize;
+        let entries = functions
+            .iter()
+            .map(|function| {
+                let offset = assembler.labels[&Label::Entry(*function)];
+                let entry: Entry = unsafe { std::mem::transmute(base + offset) };
+                (*function, entry)
+            })
+            .collect();
+        Some((code, entries))
+    }
+
+    // Every value lives in a frame slot addressed from rbx: locals first, then
+    // the operand stack, whose depth at each instruction is known statically.
+    #[derive(Default)]
+    struct Assembler {
+        code: Vec<u8>,
+        labels: HashMap<Label, usize>,
+        fixups: Vec<(usize, Label)>, // rel32 fields to point at a label
+    }
+
+    impl Assembler {
+        fn function<P: Executable>(
+            &mut self,
+            program: &P,
+            function: usize,
+            analysis: &Analysis,
+            group: &HashMap<usize, Analysis>,
+            external: &impl Fn(usize) -> Option<Entry>,
+        ) -> Option<()> {
+            let locals = analysis.locals;
+            let slot = |index: usize| (8 * index) as i32;
+            let operand = |depth: usize| slot(locals + depth);
+            let frame = (8 * (locals + analysis.max_stack)).next_multiple_of(16) as u32;
+
+            // Prologue: rbp/rbx/r12 saved (leaving rsp 16-byte aligned), r12 =
+            // context, the stack budget checked, then rbx = frame slots.
+            self.bind(Label::Entry(function));
+            self.bytes(&[0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54, 0x49, 0x89, 0xF4]);
+            self.bytes(&[0x49, 0x3B, 0x24, 0x24]); // cmp rsp, [r12]
+            self.jcc(JCC_B, Label::Bail(function));
+            self.bytes(&[0x48, 0x81, 0xEC]); // sub rsp, frame
+            self.bytes(&frame.to_le_bytes());
+            self.bytes(&[0x48, 0x89, 0xE3]); // mov rbx, rsp
+            for i in 0..analysis.arity {
+                self.sse_rdi(0x10, 0, slot(i)); // movsd xmm0, [rdi + 8i]
+                self.store_xmm0(slot(i));
+            }
+            self.bind(Label::Body(function));
+
+            let constant = |index: u32| match program.constant(index as usize) {
+                Some(Value::Number(n)) => Some(n),
+                _ => None,
+            };
+
+            for &(pc, instruction, depth) in &analysis.code {
+                self.bind(Label::Pc(function, pc));
+                let top = || operand(depth - 1);
+                let second = || operand(depth - 2);
+                match instruction {
+                    Instruction::LoadConst(index) => {
+                        self.mov_rax_imm(constant(index)?.to_bits());
+                        self.store_rax(operand(depth));
+                    }
+                    Instruction::LoadVar(_, index) => {
+                        self.load_rax(slot(index as usize));
+                        self.store_rax(operand(depth));
+                    }
+                    Instruction::StoreVar(_, index) | Instruction::StoreVarKeep(_, index) => {
+                        self.load_rax(top());
+                        self.store_rax(slot(index as usize));
+                    }
+                    Instruction::LoadVarAdd(_, index) => {
+                        self.sse(0x10, 0, top());
+                        self.sse(ADDSD, 0, slot(index as usize));
+                        self.store_xmm0(top());
+                    }
+                    Instruction::Add | Instruction::Sub | Instruction::Mul => {
+                        let op = match instruction {
+                            Instruction::Add => ADDSD,
+                            Instruction::Sub => SUBSD,
+                            _ => MULSD,
+                        };
+                        self.sse(0x10, 0, second());
+                        self.sse(op, 0, top());
+                        self.store_xmm0(second());
+                    }
+                    Instruction::Div => {
+                        self.sse(0x10, 1, top()); // movsd xmm1, divisor
+                        self.bail_if_zero(function);
+                        self.sse(0x10, 0, second());
+                        self.bytes(&[0xF2, 0x0F, DIVSD, 0xC1]); // divsd xmm0, xmm1
+                        self.store_xmm0(second());
+                    }
+                    Instruction::AddConst(index)
+                    | Instruction::SubConst(index)
+                    | Instruction::MulConst(index)
+                    | Instruction::DivConst(index) => {
+                        let value = constant(index)?;
+                        let op = match instruction {
+                            Instruction::AddConst(_) => ADDSD,
+                            Instruction::SubConst(_) => SUBSD,
+                            Instruction::MulConst(_) => MULSD,
+                            _ if value == 0.0 => {
+                                self.jmp(Label::Bail(function));
+                                continue;
+                            }
+                            _ => DIVSD,
+                        };
+                        self.sse(0x10, 0, top());
+                        self.mov_rax_imm(value.to_bits());
+                        self.bytes(&[0x66, 0x48, 0x0F, 0x6E, 0xC8]); // movq xmm1, rax
+                        self.bytes(&[0xF2, 0x0F, op, 0xC1]); // op xmm0, xmm1
+                        self.store_xmm0(top());
+                    }
+                    Instruction::Negate => {
+                        self.bytes(&[0x66, 0x0F, 0x57, 0xC0]); // xorpd xmm0, xmm0
+                        self.sse(SUBSD, 0, top());
+                        self.store_xmm0(top());
+                    }
+                    Instruction::Equal => {
+                        self.compare(second(), top());
+                        self.bytes(&[0x0F, 0x94, 0xC0]); // sete al
+                        self.bytes(&[0x0F, 0x9B, 0xC1]); // setnp cl
+                        self.bytes(&[0x20, 0xC8]); // and al, cl
+                        self.boolean_from_al(second());
+                    }
+                    Instruction::Less | Instruction::Greater => {
+                        // a < b is b > a: both use the unordered-false `above`.
+                        match instruction {
+                            Instruction::Less => self.compare(top(), second()),
+                            _ => self.compare(second(), top()),
+                        }
+                        self.bytes(&[0x0F, 0x97, 0xC0]); // seta al
+                        self.boolean_from_al(second());
+                    }
+                    Instruction::Not => {
+                        self.bytes(&[0x48, 0x83, 0xB3]); // xor qword [rbx + top], 1
+                        self.bytes(&top().to_le_bytes());
+                        self.bytes(&[0x01]);
+                    }
+                    Instruction::Jump(target) => self.jmp(Label::Pc(function, target as usize)),
+                    Instruction::JumpIfFalse(target) | Instruction::JumpIfTrue(target) => {
+                        self.load_rax(top());
+                        self.bytes(&[0x48, 0x85, 0xC0]); // test rax, rax
+                        let condition = match instruction {
+                            Instruction::JumpIfFalse(_) => JCC_E,
+                            _ => JCC_NE,
+                        };
+                        self.jcc(condition, Label::Pc(function, target as usize));
+                    }
+                    Instruction::EqualJumpIfFalse(target) => {
+                        self.compare(second(), top());
+                        self.jcc(JCC_P, Label::Pc(function, target as usize));
+                        self.jcc(JCC_NE, Label::Pc(function, target as usize));
+                    }
+                    Instruction::LessJumpIfFalse(target) => {
+                        self.compare(top(), second());
+                        self.jcc(JCC_BE, Label::Pc(function, target as usize));
+                    }
+                    Instruction::GreaterJumpIfFalse(target) => {
+                        self.compare(second(), top());
+                        self.jcc(JCC_BE, Label::Pc(function, target as usize));
+                    }
+                    Instruction::Call(callee) | Instruction::TailCall(callee) => {
+                        let callee = callee as usize;
+                        let arity = program.function(callee)?.params.len();
+                        let args = operand(depth - arity);
+                        if matches!(instruction, Instruction::TailCall(_)) && callee == function {
+                            // Self tail call: new arguments, same frame.
+                            for i in 0..arity {
+                                self.load_rax(args + slot(i));
+                                self.store_rax(slot(i));
+                            }
+                            self.jmp(Label::Body(function));
+                            continue;
+                        }
+                        if matches!(instruction, Instruction::TailCall(_)) && arity <= TAIL_ARGS {
+                            // Unwind this frame and jump, so the callee returns
+                            // straight to our caller.
+                            for i in 0..arity {
+                                self.load_rax(args + slot(i));
+                                self.bytes(&[0x49, 0x89, 0x84, 0x24]); // mov [r12 + 8 + 8i], rax
+                                self.bytes(&(TAIL_ARG_OFFSET + slot(i)).to_le_bytes());
+                            }
+                            self.bytes(&[0x49, 0x8D, 0xBC, 0x24]); // lea rdi, [r12 + 8]
+                            self.bytes(&TAIL_ARG_OFFSET.to_le_bytes());
+                            self.bytes(&[0x4C, 0x89, 0xE6]); // mov rsi, r12
+                            // lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp
+                            self.bytes(&[0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D]);
+                            if group.contains_key(&callee) {
+                                self.jmp(Label::Entry(callee));
+                            } else {
+                                self.mov_rax_imm(external(callee)? as usize as u64);
+                                self.bytes(&[0xFF, 0xE0]); // jmp rax
+                            }
+                            continue;
+                        }
+                        self.bytes(&[0x48, 0x8D, 0xBB]); // lea rdi, [rbx + args]
+                        self.bytes(&args.to_le_bytes());
+                        self.bytes(&[0x4C, 0x89, 0xE6]); // mov rsi, r12
+                        if group.contains_key(&callee) {
+                            self.bytes(&[0xE8]); // call rel32
+                            self.fixup(Label::Entry(callee));
+                        } else {
+                            self.mov_rax_imm(external(callee)? as usize as u64);
+                            self.bytes(&[0xFF, 0xD0]); // call rax
+                        }
+                        self.bytes(&[0x48, 0x85, 0xC0]); // test rax, rax
+                        self.jcc(JCC_NE, Label::Exit(function));
+                        self.store_xmm0(args);
+                        if matches!(instruction, Instruction::TailCall(_)) {
+                            self.bytes(&[0x31, 0xC0]); // xor eax, eax
+                            self.jmp(Label::Exit(function));
+                        }
+                    }
+                    Instruction::Return => {
+                        self.sse(0x10, 0, top());
+                        self.bytes(&[0x31, 0xC0]); // xor eax, eax
+                        self.jmp(Label::Exit(function));
+                    }
+                    Instruction::Pop => {}
+                    Instruction::Dup => {
+                        self.load_rax(top());
+                        self.store_rax(operand(depth));
+                    }
+                    Instruction::CreateArray(_)
+                    | Instruction::ConcatArray
+                    | Instruction::CallGlobal(_)
+                    | Instruction::Pipeline(_)
+                    | Instruction::Map(_)
+                    | Instruction::Filter(_)
+                    | Instruction::Async(_)
+                    | Instruction::Await
+                    | Instruction::CreateRecord(..)
+                    | Instruction::GetField(_)
+                    | Instruction::Halt => {
+                        return None;
+                    }
+                }
+            }
+
+            self.bind(Label::Bail(function));
+            self.bytes(&[0xB8, 0x01, 0x00, 0x00, 0x00]); // mov eax, 1
+            self.bind(Label::Exit(function));
+            // lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp; ret
+            self.bytes(&[0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3]);
+            Some(())
+        }
+
+        fn finish(&mut self) -> Option<Code> {
+            for (at, label) in &self.fixups {
+                let target = *self.labels.get(label)? as i64;
+                let rel = i32::try_from(target - (*at as i64 + 4)).ok()?;
+                self.code[*at..*at + 4].copy_from_slice(&rel.to_le_bytes());
+            }
+            Code::new(&self.code)
+        }
+
+        fn bind(&mut self, label: Label) {
+            self.labels.insert(label, self.code.len());
+        }
+
+        fn bytes(&mut self, bytes: &[u8]) {
+            self.code.extend_from_slice(bytes);
+        }
+
+        fn fixup(&mut self, label: Label) {
+            self.fixups.push((self.code.len(), label));
+            self.bytes(&[0; 4]);
+        }
+
+        fn jmp(&mut self, label: Label) {
+            self.bytes(&[0xE9]);
+            self.fixup(label);
+        }
+
+        fn jcc(&mut self, condition: u8, label: Label) {
+            self.bytes(&[0x0F, condition]);
+            self.fixup(label);
+        }
+
+        // `op xmm<reg>, [rbx + disp]` for the F2-prefixed scalar double ops
+        // (0x10 is movsd load).
+        fn sse(&mut self, op: u8, reg: u8, disp: i32) {
+            self.bytes(&[0xF2, 0x0F, op, 0x83 | (reg << 3)]);
+            self.bytes(&disp.to_le_bytes());
+        }
+
+        fn sse_rdi(&mut self, op: u8, reg: u8, disp: i32) {
+            self.bytes(&[0xF2, 0x0F, op, 0x87 | (reg << 3)]);
+            self.bytes(&disp.to_le_bytes());
+        }
+
+        fn store_xmm0(&mut self, disp: i32) {
+            self.bytes(&[0xF2, 0x0F, 0x11, 0x83]);
+            self.bytes(&disp.to_le_bytes());
+        }
+
+        fn load_rax(&mut self, disp: i32) {
+            self.bytes(&[0x48, 0x8B, 0x83]);
+            self.bytes(&disp.to_le_bytes());
+        }
+
+        fn store_rax(&mut self, disp: i32) {
+            self.bytes(&[0x48, 0x89, 0x83]);
+            self.bytes(&disp.to_le_bytes());
+        }
+
+        fn mov_rax_imm(&mut self, value: u64) {
+            self.bytes(&[0x48, 0xB8]);
+            self.bytes(&value.to_le_bytes());
+        }
+
+        // `ucomisd` of the slots at `a` and `b`: `above` then means a > b,
+        // and is false when either is NaN, as the VM's comparisons are.
+        fn compare(&mut self, a: i32, b: i32) {
+            self.sse(0x10, 0, a);
+            self.bytes(&[0x66, 0x0F, 0x2E, 0x83]); // ucomisd xmm0, [rbx + b]
+            self.bytes(&b.to_le_bytes());
+        }
+
+        fn boolean_from_al(&mut self, disp: i32) {
+            self.bytes(&[0x0F, 0xB6, 0xC0]); // movzx eax, al
+            self.store_rax(disp);
+        }
+
+        // Gives up when xmm1 is zero; a NaN divisor divides like the VM does.
+        fn bail_if_zero(&mut self, function: usize) {
+            self.bytes(&[0x66, 0x0F, 0x57, 0xD2]); // xorpd xmm2, xmm2
+            self.bytes(&[0x66, 0x0F, 0x2E, 0xCA]); // ucomisd xmm1, xmm2
+            self.bytes(&[0x7A, 0x06]); // jp past the je
+            self.jcc(JCC_E, Label::Bail(function));
+        }
+    }
+}
+
+// Elsewhere nothing is compiled and every function stays interpreted.
+#[cfg(not(all(target_arch = "x86_64", target_os = "linux")))]
+mod native {
+    use super::Analysis;
+    use crate::types::traits::Executable;
+    use std::collections::HashMap;
+
+    pub type Entry = fn(&[f64]) -> Option<f64>;
+
+    pub struct Code;
+
+    pub fn call(entry: Entry, args: &[f64], _budget: usize) -> Option<f64> {
+        entry(args)
+    }
+
+    pub fn compile<P: Executable>(
+        _program: &P,
+        _group: &HashMap<usize, Analysis>,
+        _external: impl Fn(usize) -> Option<Entry>,
+    ) -> Option<(Code, Vec<(usize, Entry)>)> {
+        None
+    }
+}
@@ -1,29 +1,42 @@
 use crate::types::token::Token;
 
-pub struct Lexer {
-    input: String,
+// Single pass over the source by byte offset. Tokens borrow their text
+// straight from the source, so lexing allocates nothing but the token list.
+// Non-ASCII characters are decoded where they occur, which keeps the Unicode
+// rules for identifiers and whitespace without rescanning the input.
+pub struct Lexer<'a> {
+    input: &'a str,
     position: usize,
     current_char: Option<char>,
 }
 
-impl Lexer {
-    pub fn new(input: String) -> Self {
-        let mut lexer = Lexer {
+impl<'a> Lexer<'a> {
+    pub fn new(input: &'a str) -> Self {
+        Lexer {
             input,
             position: 0,
-            current_char: None,
-        };
-        lexer.current_char = lexer.input.chars().nth(0);
-        lexer
+            current_char: Self::char_at(input, 0),
+        }
+    }
+
+    fn char_at(input: &str, position: usize) -> Option<char> {
+        match input.as_bytes().get(position) {
+            Some(&byte) if byte.is_ascii() => Some(byte as char),
+            Some(_) => input[position..].chars().next(),
+            None => None,
+        }
     }
 
     fn advance(&mut self) {
-        self.position += 1;
-        self.current_char = self.input.chars().nth(self.position);
+        if let Some(ch) = self.current_char {
+            self.position += ch.len_utf8();
+            self.current_char = Self::char_at(self.input, self.position);
+        }
     }
 
     fn peek(&self) -> Option<char> {
-        self.input.chars().nth(self.position + 1)
+        let ch = self.current_char?;
+        Self::char_at(self.input, self.position + ch.len_utf8())
     }
 
     fn skip_whitespace(&mut self) {
@@ -36,55 +49,53 @@ impl Lexer {
         }
     }
 
-    fn read_string(&mut self) -> String {
-        let mut value = String::new();
+    fn read_string(&mut self) -> &'a str {
         self.advance(); // skip opening quote
+        let start = self.position;
 
         while let Some(ch) = self.current_char {
             if ch == '"' {
+                let value = &self.input[start..self.position];
                 self.advance(); // skip closing quote
-                break;
+                return value;
             }
-            value.push(ch);
             self.advance();
         }
 
-        value
+        &self.input[start..]
     }
 
     fn read_number(&mut self) -> f64 {
-        let mut value = String::new();
+        let start = self.position;
 
         while let Some(ch) = self.current_char {
             if ch.is_ascii_digit() || ch == '.' {
-                value.push(ch);
                 self.advance();
             } else {
                 break;
             }
         }
 
-        value.parse::<f64>().unwrap_or(0.0)
+        self.input[start..self.position]
+            .parse::<f64>()
+            .unwrap_or(0.0)
     }
 
-    fn read_identifier(&mut self) -> String {
-        let mut value = String::new();
+    fn read_identifier(&mut self) -> &'a str {
+        let start = self.position;
 
         while let Some(ch) = self.current_char {
             if ch.is_alphanumeric() || ch == '_' {
-                value.push(ch);
                 self.advance();
             } else {
                 break;
             }
         }
 
-        value
+        &self.input[start..self.position]
     }
 
-    fn read_comment(&mut self) -> String {
-        let mut comment = String::new();
-
+    fn skip_comment(&mut self) {
         if self.current_char == Some('/') && self.peek() == Some('/') {
             // Single line comment
             self.advance(); // skip first /
@@ -94,7 +105,6 @@ impl Lexer {
                 if ch == '\n' {
                     break;
                 }
-                comment.push(ch);
                 self.advance();
             }
         } else if self.current_char == Some('/') && self.peek() == Some('*') {
@@ -108,15 +118,12 @@ impl Lexer {
                     self.advance(); // skip /
                     break;
                 }
-                comment.push(ch);
                 self.advance();
             }
         }
-
-        comment
     }
 
-    pub fn next_token(&mut self) -> Token {
+    pub fn next_token(&mut self) -> Token<'a> {
         loop {
             match self.current_char {
                 None => return Token::Eof,
@@ -143,7 +150,7 @@ impl Lexer {
 
                 Some(ch) if ch.is_alphabetic() || ch == '_' => {
                     let identifier = self.read_identifier();
-                    return match identifier.as_str() {
+                    return match identifier {
                         "let" => {
                             if self.current_char == Some('!') {
                                 self.advance();
@@ -169,7 +176,7 @@ impl Lexer {
                 }
 
                 Some('/') if self.peek() == Some('/') || self.peek() == Some('*') => {
-                    self.read_comment();
+                    self.skip_comment();
                     continue; // Skip comments entirely
                 }
 
@@ -269,7 +276,7 @@ impl Lexer {
         }
     }
 
-    pub fn tokenize(&mut self) -> Vec<Token> {
+    pub fn tokenize(&mut self) -> Vec<Token<'a>> {
         let mut tokens = Vec::new();
 
         loop {
@@ -0,0 +1,489 @@
+pub mod bench;
+pub mod bytecode;
+pub mod cache;
+pub mod compiler;
+pub mod debug;
+pub mod dense;
+pub mod embed;
+pub mod heap;
+pub mod interpreter;
+#[cfg(feature = "jit")]
+pub mod jit;
+pub mod lexer;
+pub mod mapped;
+pub mod modules;
+pub mod natives;
+pub mod optimizer;
+pub mod parallel;
+pub mod parser;
+pub mod profile;
+pub mod register;
+pub mod scheduler;
+pub mod shape;
+pub mod types;
+pub mod vector;
+
+#[cfg(test)]
+mod tests;
+
+pub mod runtime {
+    use crate::bytecode;
+    use crate::cache;
+    use crate::compiler::Compiler;
+    use crate::interpreter::VirtualMachine;
+    use crate::lexer::Lexer;
+    use crate::mapped::MappedByteCode;
+    use crate::modules::{self, Build};
+    use crate::optimizer;
+    use crate::parser::Parser;
+    use crate::profile::{Instrumented, Profiled};
+    use crate::register::{self, RegisterMachine, RegisterProgram};
+    use crate::types::ast::Program;
+    use crate::types::compiler::{ByteCode, Symbols};
+    use crate::types::constants::BYTECODE_EXTENSION;
+    use crate::types::traits::Executable;
+    use std::fs;
+    use std::path::Path;
+
+    // How a source file is compiled and run. `optimize` corresponds to the
+    // `-O` flag: constant folding in the compiler plus the peephole pass in
+    // optimizer::optimize. `profile` (`--profile-opcodes`) prints the opcode
+    // profile of the run once it finishes. `engine` picks the VM a source
+    // file runs on (`--register` selects the register machine, `--jit` the
+    // stack VM with hot functions compiled to native code, which needs a
+    // build with `--features jit`). `cache` (`--cache`) reuses the bytecode
+    // of an unchanged source file from the compilation cache in cache.rs.
+    // `quiet` (`-q`) leaves out the VM state that is otherwise printed after
+    // every run.
+    #[derive(Debug, Clone, Copy, Default)]
+    pub struct Options {
+        pub debug: bool,
+        pub optimize: bool,
+        pub profile: bool,
+        pub engine: Engine,
+        pub cache: bool,
+        pub quiet: bool,
+    }
+
+    #[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+    pub enum Engine {
+        #[default]
+        Stack,
+        Register,
+        Jit,
+    }
+
+    pub fn compile_and_run(filename: &str) -> Result<String, String> {
+        compile_and_run_with_debug(filename, false)
+    }
+
+    pub fn compile_and_run_with_debug(filename: &str, debug: bool) -> Result<String, String> {
+        compile_and_run_with_options(
+            filename,
+            Options {
+                debug,
+                ..Options::default()
+            },
+        )
+    }
+
+    pub fn compile_and_run_with_options(
+        filename: &str,
+        options: Options,
+    ) -> Result<String, String> {
+        if options.engine == Engine::Register {
+            if options.profile {
+                return Err("Opcode profiles are only recorded on the stack VM".to_string());
+            }
+            if options.cache {
+                return Err("The compilation cache only holds stack VM bytecode".to_string());
+            }
+            let program = lower_file_with_options(filename, options)?;
+            return execute_registers(program, options);
+        }
+        if options.engine == Engine::Jit && options.profile {
+            return Err("Opcode profiles are only recorded by the interpreter".to_string());
+        }
+        if options.cache {
+            return compile_and_run_cached(filename, &cache::directory(), options);
+        }
+        let bytecode = compile_file_with_options(filename, options)?;
+        run_with_options(bytecode, options)
+    }
+
+    // Runs a source file under the time profiler in profile.rs, prints its
+    // summary and writes the full report to `output`: JSON if the name ends
+    // in .json, folded stacks for flamegraph tools otherwise.
+    pub fn compile_and_run_instrumented(
+        filename: &str,
+        options: Options,
+        output: &str,
+    ) -> Result<String, String> {
+        if options.engine != Engine::Stack {
+            return Err("Time profiles are only recorded by the stack VM interpreter".to_string());
+        }
+        let (bytecode, symbols) = compile_file_with_symbols(filename, options)?;
+        run_instrumented(bytecode, &symbols, output)
+    }
+
+    // Runs `program` under the time profiler, for compile_and_run_instrumented
+    // and run_bytecode_instrumented.
+    fn run_instrumented<P: Executable>(
+        program: P,
+        symbols: &Symbols,
+        output: &str,
+    ) -> Result<String, String> {
+        let mut vm = VirtualMachine::new(Instrumented::new(program));
+        let result = vm.run();
+        let profile = vm.program().profile(symbols, vm.heap().stats());
+        let report = match output.ends_with(".json") {
+            true => profile.json(),
+            false => profile.folded(),
+        };
+        fs::write(output, report)
+            .map_err(|err| format!("Error writing profile '{}': {}", output, err))?;
+        println!("{}", profile);
+        match result {
+            Ok(()) => Ok(format!(
+                "Successfully executed program, profile written to {}",
+                output
+            )),
+            Err(e) => Err(format!("Runtime error: {}", e)),
+        }
+    }
+
+    // compile_and_run_with_options with the compilation cache in `dir`: the
+    // source is only compiled if the cache has no bytecode for it yet.
+    pub fn compile_and_run_cached(
+        filename: &str,
+        dir: &Path,
+        options: Options,
+    ) -> Result<String, String> {
+        let source = modules::sources(filename)?;
+        if let Some(image) = cache::load(dir, &source, options) {
+            if options.debug {
+                print_bytecode(&bytecode::decode(image.bytes())?);
+            }
+            return run_with_options(image, options);
+        }
+        let bytecode = compile_file_with_options(filename, options)?;
+        // A cache that cannot be written only costs the next run a compile.
+        let _ = cache::store(dir, &source, options, &bytecode);
+        run_with_options(bytecode, options)
+    }
+
+    fn run_with_options<P: Executable>(program: P, options: Options) -> Result<String, String> {
+        if options.profile {
+            return execute_profiled(program, options.debug);
+        }
+        let mut vm = VirtualMachine::new(program);
+        if options.engine == Engine::Jit {
+            enable_jit(&mut vm)?;
+        }
+        execute(vm, options)
+    }
+
+    #[cfg(feature = "jit")]
+    pub fn enable_jit<P: Executable>(vm: &mut VirtualMachine<P>) -> Result<(), String> {
+        vm.enable_jit();
+        Ok(())
+    }
+
+    #[cfg(not(feature = "jit"))]
+    pub fn enable_jit<P: Executable>(_vm: &mut VirtualMachine<P>) -> Result<(), String> {
+        Err("This build has no JIT; rebuild with `--features jit`".to_string())
+    }
+
+    pub fn run_bytecode(filename: &str) -> Result<String, String> {
+        run_bytecode_with_debug(filename, false)
+    }
+
+    pub fn run_bytecode_with_debug(filename: &str, debug: bool) -> Result<String, String> {
+        run_bytecode_with_options(
+            filename,
+            Options {
+                debug,
+                ..Options::default()
+            },
+        )
+    }
+
+    // Only `debug` and `quiet` apply to a precompiled file.
+    // Runs a precompiled file, with the JIT and the opcode profiler if
+    // `options` ask for them. Options that only apply to compiling a source
+    // file are errors rather than being ignored.
+    pub fn run_bytecode_with_options(filename: &str, options: Options) -> Result<String, String> {
+        check_precompiled(options)?;
+        let image = load_bytecode(filename)?;
+
+        if options.debug {
+            print_bytecode(&bytecode::decode(image.bytes())?);
+        }
+
+        run_with_options(image, options)
+    }
+
+    // compile_and_run_instrumented for a precompiled file. The .nb format
+    // keeps no function names, so functions are named by index and line.
+    pub fn run_bytecode_instrumented(
+        filename: &str,
+        options: Options,
+        output: &str,
+    ) -> Result<String, String> {
+        check_precompiled(options)?;
+        if options.engine != Engine::Stack {
+            return Err("Time profiles are only recorded by the stack VM interpreter".to_string());
+        }
+        run_instrumented(load_bytecode(filename)?, &Symbols::default(), output)
+    }
+
+    fn check_precompiled(options: Options) -> Result<(), String> {
+        if options.optimize {
+            return Err(
+                "-O applies when compiling; rebuild the file with `n build -O`".to_string(),
+            );
+        }
+        if options.engine == Engine::Register {
+            return Err("--register only runs source files, not stack VM bytecode".to_string());
+        }
+        if options.cache {
+            return Err("--cache only applies to source files".to_string());
+        }
+        if options.engine == Engine::Jit && options.profile {
+            return Err("Opcode profiles are only recorded by the interpreter".to_string());
+        }
+        Ok(())
+    }
+
+    pub fn build(filename: &str, output: &str) -> Result<String, String> {
+        build_with_options(filename, output, Options::default())
+    }
+
+    pub fn build_with_options(
+        filename: &str,
+        output: &str,
+        options: Options,
+    ) -> Result<String, String> {
+        let bytecode = compile_file_with_options(filename, options)?;
+        let bytes = bytecode::encode(&bytecode)?;
+
+        match std::fs::write(output, &bytes) {
+            Ok(()) => Ok(format!("Wrote {} bytes to '{}'", bytes.len(), output)),
+            Err(err) => Err(format!("Error writing file '{}': {}", output, err)),
+        }
+    }
+
+    pub fn load_bytecode(filename: &str) -> Result<MappedByteCode, String> {
+        if !filename.ends_with(BYTECODE_EXTENSION) {
+            return Err(format!(
+                "Error: File must have {} extension",
+                BYTECODE_EXTENSION
+            ));
+        }
+
+        MappedByteCode::open(filename).map_err(|e| format!("Bytecode error: {}", e))
+    }
+
+    pub fn compile_file(filename: &str, debug: bool) -> Result<ByteCode, String> {
+        compile_file_with_options(
+            filename,
+            Options {
+                debug,
+                ..Options::default()
+            },
+        )
+    }
+
+    // Source files may import others, so they are compiled as a module
+    // build (see modules.rs); a file without imports is a build of one unit.
+    pub fn compile_file_with_options(filename: &str, options: Options) -> Result<ByteCode, String> {
+        compile_file_with_symbols(filename, options).map(|(bytecode, _)| bytecode)
+    }
+
+    pub fn compile_file_with_symbols(
+        filename: &str,
+        options: Options,
+    ) -> Result<(ByteCode, Symbols), String> {
+        Build::new(options).build(filename)
+    }
+
+    pub fn lower_file_with_options(
+        filename: &str,
+        options: Options,
+    ) -> Result<RegisterProgram, String> {
+        lower_source_with_options(read_source(filename)?, options)
+    }
+
+    pub(crate) fn read_source(filename: &str) -> Result<String, String> {
+        check_source_name(filename)?;
+
+        // Read the file
+        match std::fs::read_to_string(filename) {
+            Ok(content) => Ok(content),
+            Err(err) => Err(format!("Error reading file '{}': {}", filename, err)),
+        }
+    }
+
+    pub(crate) fn check_source_name(filename: &str) -> Result<(), String> {
+        match filename.ends_with(".n") {
+            true => Ok(()),
+            false => Err("Error: File must have .n extension".to_string()),
+        }
+    }
+
+    pub fn compile_source(source_code: String, debug: bool) -> Result<ByteCode, String> {
+        compile_source_with_options(
+            source_code,
+            Options {
+                debug,
+                ..Options::default()
+            },
+        )
+    }
+
+    pub fn compile_source_with_options(
+        source_code: String,
+        options: Options,
+    ) -> Result<ByteCode, String> {
+        compile_source_with_symbols(source_code, options).map(|(bytecode, _)| bytecode)
+    }
+
+    // compile_source_with_options, also returning the names of the globals.
+    pub fn compile_source_with_symbols(
+        source_code: String,
+        options: Options,
+    ) -> Result<(ByteCode, Symbols), String> {
+        let debug = options.debug;
+        let ast = parse_source(&source_code, debug)?;
+
+        let mut compiler = Compiler::with_optimization(options.optimize);
+        let mut bytecode = match compiler.compile(&ast) {
+            Ok(bc) => bc,
+            Err(e) => return Err(format!("Compile error: {}", e)),
+        };
+        if options.optimize {
+            optimizer::optimize(&mut bytecode);
+        }
+
+        if debug {
+            print_bytecode(&bytecode);
+        }
+
+        Ok((bytecode, compiler.symbols(&ast)))
+    }
+
+    // Register-machine counterpart of compile_source_with_options.
+    pub fn lower_source_with_options(
+        source_code: String,
+        options: Options,
+    ) -> Result<RegisterProgram, String> {
+        let ast = parse_source(&source_code, options.debug)?;
+        let program =
+            register::lower(&ast, options.optimize).map_err(|e| format!("Compile error: {}", e))?;
+
+        if options.debug {
+            println!("{}", program);
+        }
+
+        Ok(program)
+    }
+
+    pub(crate) fn parse_source(source_code: &str, debug: bool) -> Result<Program<'_>, String> {
+        if debug {
+            println!("--- Source Code ---\n{}", source_code);
+        }
+
+        if debug {
+            // The parser pulls tokens as it goes, so listing them takes a
+            // separate pass over the source.
+            println!("--- Tokens ---");
+            for token in Lexer::new(source_code).tokenize() {
+                println!("{:?}", token);
+            }
+        }
+
+        let mut parser = Parser::new(Lexer::new(source_code));
+        let ast = match parser.parse() {
+            Ok(ast) => ast,
+            Err(e) => return Err(format!("Parse error: {}", e)),
+        };
+
+        if debug {
+            println!("--- AST ---");
+            // Assuming AST implements Debug
+            println!("{:#?}", ast);
+        }
+
+        Ok(ast)
+    }
+
+    pub(crate) fn print_bytecode(bytecode: &ByteCode) {
+        println!("--- Bytecode ---\n");
+        if bytecode.functions.len() > 0 {
+            println!("--- Functions ---");
+            for function in bytecode.functions.iter() {
+                println!("{}", function);
+            }
+        }
+        if bytecode.constants.len() > 0 {
+            println!("--- Constants ---");
+            for constant in bytecode.constants.iter() {
+                println!("{}", constant);
+            }
+        }
+        println!("--- Instructions ---");
+        for instruction in bytecode.instructions.iter() {
+            println!("{}", instruction);
+        }
+    }
+
+    fn execute_profiled<P: Executable>(program: P, debug: bool) -> Result<String, String> {
+        let mut vm = VirtualMachine::new(Profiled::new(program));
+        let result = vm.run();
+        println!("{}", vm.program().profile());
+        match result {
+            Ok(()) => {
+                if debug {
+                    vm.debug_stack();
+                }
+                Ok("Successfully executed program".to_string())
+            }
+            Err(e) => Err(format!("Runtime error: {}", e)),
+        }
+    }
+
+    fn execute<P: Executable>(
+        mut vm: VirtualMachine<P>,
+        options: Options,
+    ) -> Result<String, String> {
+        if options.debug {
+            println!("--- Runtime ---");
+        }
+
+        let result = vm.run();
+        if !options.quiet {
+            vm.debug_stack();
+        }
+        match result {
+            Ok(()) => Ok("Successfully executed program".to_string()),
+            Err(e) => Err(format!("Runtime error: {}", e)),
+        }
+    }
+
+    fn execute_registers(program: RegisterProgram, options: Options) -> Result<String, String> {
+        let mut vm = RegisterMachine::new(program);
+
+        if options.debug {
+            println!("--- Runtime ---");
+        }
+
+        let result = vm.run();
+        if !options.quiet {
+            vm.debug_registers();
+        }
+        match result {
+            Ok(()) => Ok("Successfully executed program".to_string()),
+            Err(e) => Err(format!("Runtime error: {}", e)),
+        }
+    }
+}
@@ -1,129 +1,162 @@
-mod compiler;
-mod debug;
-mod interpreter;
-mod lexer;
-mod parser;
-mod types;
+use std::env;
+use std::process;
 
-#[cfg(test)]
-mod tests;
+use n::bench;
+use n::runtime;
+use n::types::constants::{BYTECODE_EXTENSION, CACHE_DIR_VARIABLE};
+
+fn usage(program: &str) -> ! {
+    eprintln!(
+        "Usage: {} [-O] [-q] [--cache] [--profile-opcodes | --profile <out>] [--register | --jit] <file.n|file{}>",
+        program, BYTECODE_EXTENSION
+    );
+    eprintln!(
+        "       {} build [-O] <file.n> [-o <file{}>]",
+        program, BYTECODE_EXTENSION
+    );
+    eprintln!(
+        "       {} bench [-O] [--jit] [--warmup <n>] [--iterations <n>] [<file.n|dir>...]",
+        program
+    );
+    eprintln!("  -O                 fold constants and run the peephole optimizer");
+    eprintln!("  -q, --quiet        print only the result, not the bytecode and VM state");
+    eprintln!(
+        "  --cache            reuse the bytecode of unchanged files (kept in ${} or ~/.cache/n)",
+        CACHE_DIR_VARIABLE
+    );
+    eprintln!("  --profile-opcodes  count executed opcodes, pairs and triples");
+    eprintln!(
+        "  --profile <out>    time opcodes, functions and the collector; writes folded stacks, or JSON to a .json file"
+    );
+    eprintln!("  --register         run source files on the register VM");
+    eprintln!("  --jit              compile hot functions to native code (--features jit)");
+    process::exit(1);
+}
 
-pub mod runtime {
-    use crate::compiler::Compiler;
-    use crate::interpreter::VirtualMachine;
-    use crate::lexer::Lexer;
-    use crate::parser::Parser;
+// Removes `flag` from the arguments, reporting whether it was there.
+fn take_flag(args: &mut Vec<String>, flag: &str) -> bool {
+    match args.iter().position(|arg| arg == flag) {
+        Some(index) => {
+            args.remove(index);
+            true
+        }
+        None => false,
+    }
+}
 
-    pub fn compile_and_run(filename: &str) -> Result<String, String> {
-        compile_and_run_with_debug(filename, false)
+// Removes `flag` and the value after it from the arguments, returning the
+// value.
+fn take_value(args: &mut Vec<String>, flag: &str) -> Option<String> {
+    let index = args.iter().position(|arg| arg == flag)?;
+    if index + 1 >= args.len() {
+        usage(&args[0]);
     }
+    args.remove(index);
+    Some(args.remove(index))
+}
 
-    pub fn compile_and_run_with_debug(filename: &str, debug: bool) -> Result<String, String> {
-        // Check if file ends with .n extension
-        if !filename.ends_with(".n") {
-            return Err("Error: File must have .n extension".to_string());
-        }
+// take_value for a number, `default` if the flag is not there.
+fn take_count(args: &mut Vec<String>, flag: &str, default: usize) -> usize {
+    match take_value(args, flag).map(|value| value.parse()) {
+        Some(Ok(count)) => count,
+        Some(Err(_)) => usage(&args[0]),
+        None => default,
+    }
+}
 
-        // Read the file
-        let source_code = match std::fs::read_to_string(filename) {
-            Ok(content) => content,
-            Err(err) => {
-                return Err(format!("Error reading file '{}': {}", filename, err));
+fn main() {
+    let mut args: Vec<String> = env::args().collect();
+    let optimize = take_flag(&mut args, "-O");
+    let cache = take_flag(&mut args, "--cache");
+    let quiet = take_flag(&mut args, "-q") | take_flag(&mut args, "--quiet");
+    let profile = take_flag(&mut args, "--profile-opcodes");
+    let profile_output = take_value(&mut args, "--profile");
+    let engine = match (
+        take_flag(&mut args, "--register"),
+        take_flag(&mut args, "--jit"),
+    ) {
+        (true, _) => runtime::Engine::Register,
+        (false, true) => runtime::Engine::Jit,
+        (false, false) => runtime::Engine::Stack,
+    };
+
+    match args.get(1).map(String::as_str) {
+        Some("bench") => {
+            let defaults = bench::Config::default();
+            let config = bench::Config {
+                warmup: take_count(&mut args, "--warmup", defaults.warmup),
+                iterations: take_count(&mut args, "--iterations", defaults.iterations),
+                options: runtime::Options {
+                    optimize,
+                    engine,
+                    ..runtime::Options::default()
+                },
+            };
+            let paths = match &args[2..] {
+                [] => vec!["tests".to_string(), "benches/workloads".to_string()],
+                paths => paths.to_vec(),
+            };
+            if let Err(e) = bench::run(&paths, config) {
+                eprintln!("{}", e);
+                process::exit(1);
             }
-        };
-
-        if debug {
-            println!("--- Source Code ---\n{}", source_code);
         }
-
-        let mut lexer = Lexer::new(source_code);
-        let tokens = lexer.tokenize();
-
-        if debug {
-            println!("--- Tokens ---");
-            for token in &tokens {
-                println!("{:?}", token);
+        Some("build") => {
+            let input = args.get(2).unwrap_or_else(|| usage(&args[0]));
+            let output = match (args.get(3).map(String::as_str), args.get(4)) {
+                (Some("-o"), Some(path)) if args.len() == 5 => path.clone(),
+                (None, None) => format!(
+                    "{}{}",
+                    input.strip_suffix(".n").unwrap_or(input),
+                    BYTECODE_EXTENSION
+                ),
+                _ => usage(&args[0]),
+            };
+            let options = runtime::Options {
+                optimize,
+                ..runtime::Options::default()
+            };
+            match runtime::build_with_options(input, &output, options) {
+                Ok(result) => println!("{}", result),
+                Err(e) => {
+                    eprintln!("{}", e);
+                    process::exit(1);
+                }
             }
         }
-
-        let mut parser = Parser::new(tokens);
-        let ast = match parser.parse() {
-            Ok(ast) => ast,
-            Err(e) => return Err(format!("Parse error: {}", e)),
-        };
-
-        if debug {
-            println!("--- AST ---");
-            // Assuming AST implements Debug
-            println!("{:#?}", ast);
-        }
-
-        let mut compiler = Compiler::new();
-        let bytecode = match compiler.compile(&ast) {
-            Ok(bc) => bc,
-            Err(e) => return Err(format!("Compile error: {}", e)),
-        };
-
-        if debug {
-            println!("--- Bytecode ---\n");
-            if bytecode.functions.len() > 0 {
-                println!("--- Functions ---");
-                for function in bytecode.functions.iter() {
-                    println!("{}", function);
+        Some(filename) if args.len() == 2 => {
+            let options = runtime::Options {
+                debug: !profile && profile_output.is_none() && !quiet,
+                optimize,
+                profile,
+                engine,
+                cache,
+                quiet,
+            };
+            let precompiled = filename.ends_with(BYTECODE_EXTENSION);
+            let result = match (&profile_output, precompiled) {
+                (Some(output), true) => {
+                    runtime::run_bytecode_instrumented(filename, options, output)
                 }
-            }
-            if bytecode.constants.len() > 0 {
-                println!("--- Constants ---");
-                for constant in bytecode.constants.iter() {
-                    println!("{}", constant);
+                (Some(output), false) => {
+                    runtime::compile_and_run_instrumented(filename, options, output)
+                }
+                (None, true) => runtime::run_bytecode_with_options(filename, options),
+                (None, false) => runtime::compile_and_run_with_options(filename, options),
+            };
+
+            match result {
+                Ok(result) if quiet => println!("{}", result),
+                Ok(result) => {
+                    println!("=== EXECUTION ===");
+                    println!("{}", result);
+                }
+                Err(e) => {
+                    eprintln!("{}", e);
+                    process::exit(1);
                 }
             }
-            println!("--- Instructions ---");
-            for instruction in bytecode.instructions.iter() {
-                println!("{}", instruction);
-            }
-        }
-
-        let mut vm = VirtualMachine::new(bytecode, compiler);
-
-        if debug {
-            println!("--- Runtime ---");
-        }
-
-        match vm.run() {
-            Ok(()) => {
-                vm.debug_stack();
-                Ok("Successfully executed program".to_string())
-            }
-            Err(e) => {
-                vm.debug_stack();
-                Err(format!("Runtime error: {}", e))
-            }
-        }
-    }
-}
-
-use std::env;
-use std::process;
-
-fn main() {
-    let args: Vec<String> = env::args().collect();
-
-    if args.len() != 2 {
-        eprintln!("Usage: {} <file.n>", args[0]);
-        process::exit(1);
-    }
-
-    let filename = &args[1];
-
-    match runtime::compile_and_run_with_debug(filename, true) {
-        Ok(result) => {
-            println!("=== EXECUTION ===");
-            println!("{}", result);
-        }
-        Err(e) => {
-            eprintln!("{}", e);
-            process::exit(1);
         }
+        _ => usage(&args[0]),
     }
 }
@@ -0,0 +1,237 @@
+use crate::bytecode::Reader;
+use crate::types::compiler::{Function, Instruction, Value};
+use crate::types::traits::Executable;
+use std::fs::File;
+
+// Read-only view of a precompiled .nb file that the VM executes straight out
+// of a memory mapping. Opening the file walks it once to validate it and to
+// record where every instruction starts. Instructions are decoded from the
+// mapped bytes when the VM fetches them, so a program's code pages stay clean
+// and are shared through the OS page cache by every process running it. Only
+// the small constant and function tables are decoded eagerly: every call
+// consults the latter, and decoding constants once interns their strings, so
+// LOAD_CONST of a string shares one allocation instead of building a new one.
+// Those strings are copies in the process's own memory rather than views of
+// the mapping: a string Value is an Arc<String> that the heap, other tasks
+// and the caller of a pooled VM may keep after the mapping is gone. Only the
+// instruction stream stays shared between processes.
+pub struct MappedByteCode {
+    map: Mmap,
+    constants: Vec<Value>,
+    functions: Vec<Function>,
+    globals: usize,
+    instruction_offsets: Vec<u32>,
+    line_runs: Vec<(usize, usize)>, // (first instruction, line)
+}
+
+impl MappedByteCode {
+    pub fn open(filename: &str) -> Result<Self, String> {
+        let file = File::open(filename)
+            .map_err(|err| format!("Error reading file '{}': {}", filename, err))?;
+        let map = Mmap::map(&file)
+            .map_err(|err| format!("Error mapping file '{}': {}", filename, err))?;
+
+        let mut image = Self {
+            map,
+            constants: Vec::new(),
+            functions: Vec::new(),
+            globals: 0,
+            instruction_offsets: Vec::new(),
+            line_runs: Vec::new(),
+        };
+        image.index()?;
+        Ok(image)
+    }
+
+    pub fn bytes(&self) -> &[u8] {
+        self.map.bytes()
+    }
+
+    fn index(&mut self) -> Result<(), String> {
+        let mut reader = Reader::new(self.map.bytes());
+
+        reader.header()?;
+
+        let constant_count = reader.u16()? as usize;
+        self.constants.reserve_exact(constant_count);
+        for _ in 0..constant_count {
+            self.constants.push(reader.value()?);
+        }
+
+        let function_count = reader.u16()? as usize;
+        self.globals = reader.u16()? as usize;
+        self.functions.reserve_exact(function_count);
+        for _ in 0..function_count {
+            self.functions.push(reader.function()?);
+        }
+
+        if reader.u16()? != 0 {
+            return Err("Enum tables are not supported yet".to_string());
+        }
+
+        let instruction_count = reader.u32()? as usize;
+        self.instruction_offsets.reserve_exact(instruction_count);
+        for _ in 0..instruction_count {
+            self.instruction_offsets.push(reader.position() as u32);
+            reader.instruction()?;
+        }
+
+        let run_count = reader.u32()? as usize;
+        let mut covered = 0;
+        for _ in 0..run_count {
+            let line = reader.u32()? as usize;
+            let run = reader.u32()? as usize;
+            self.line_runs.push((covered, line));
+            covered += run;
+        }
+        if covered != instruction_count {
+            return Err(format!(
+                "Line table covers {} instructions, expected {}",
+                covered, instruction_count
+            ));
+        }
+
+        if !reader.is_empty() {
+            return Err("Trailing bytes after line table".to_string());
+        }
+        Ok(())
+    }
+}
+
+impl Executable for MappedByteCode {
+    type Shared = MappedByteCode;
+
+    fn shared(&self) -> &MappedByteCode {
+        self
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        let offset = *self.instruction_offsets.get(pc)? as usize;
+        Reader::at(self.map.bytes(), offset).instruction().ok()
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.constants.get(index).cloned()
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.functions.get(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.globals
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        let run = self.line_runs.partition_point(|(start, _)| *start <= pc);
+        match run.checked_sub(1).and_then(|run| self.line_runs.get(run)) {
+            Some((_, line)) => *line,
+            None => 0,
+        }
+    }
+}
+
+#[cfg(unix)]
+struct Mmap {
+    ptr: *mut std::ffi::c_void,
+    len: usize,
+}
+
+#[cfg(unix)]
+mod sys {
+    use std::ffi::{c_int, c_void};
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_PRIVATE: c_int = 2;
+    pub const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+
+    unsafe extern "C" {
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    }
+}
+
+#[cfg(unix)]
+impl Mmap {
+    fn map(file: &File) -> std::io::Result<Self> {
+        use std::os::unix::io::AsRawFd;
+
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            // mmap rejects empty mappings; the header check reports the error.
+            return Ok(Self {
+                ptr: std::ptr::null_mut(),
+                len,
+            });
+        }
+
+        // The mapping is private and read-only. Like any mmap, truncating the
+        // file underneath a running program is outside what we defend against.
+        let ptr = unsafe {
+            sys::mmap(
+                std::ptr::null_mut(),
+                len,
+                sys::PROT_READ,
+                sys::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == sys::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(Self { ptr, len })
+    }
+
+    fn bytes(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len > 0 {
+            unsafe {
+                sys::munmap(self.ptr, self.len);
+            }
+        }
+    }
+}
+
+// The mapping is never written through, so sharing it between threads is safe.
+#[cfg(unix)]
+unsafe impl Send for Mmap {}
+#[cfg(unix)]
+unsafe impl Sync for Mmap {}
+
+// Platforms without mmap fall back to reading the whole file once.
+#[cfg(not(unix))]
+struct Mmap {
+    bytes: Vec<u8>,
+}
+
+#[cfg(not(unix))]
+impl Mmap {
+    fn map(file: &File) -> std::io::Result<Self> {
+        use std::io::Read;
+
+        let mut bytes = Vec::new();
+        (&*file).read_to_end(&mut bytes)?;
+        Ok(Self { bytes })
+    }
+
+    fn bytes(&self) -> &[u8] {
+        &self.bytes
+    }
+}
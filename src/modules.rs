@@ -0,0 +1,465 @@
+use crate::cache::Fnv;
+use crate::compiler::Compiler;
+use crate::lexer::Lexer;
+use crate::optimizer;
+use crate::runtime::{self, Options};
+use crate::types::ast::{Program, Stmt};
+use crate::types::compiler::{ByteCode, Export, Function, Instruction, Symbols, Value};
+use crate::types::token::Token;
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::time::SystemTime;
+
+// Programs of several files. `import "./utils"` at the top level of a file
+// makes the top-level functions of utils.n, next to it, callable from it; a
+// module imported that way may only define functions and import others, and
+// what it imports is not passed on to its importers.
+//
+// Every file is a compilation unit of its own. A unit is compiled as if it
+// were the whole program, with jumps, function entries and constant indices
+// counted from its own start, and with the functions it imports at the head
+// of its function table as entries without code. Linking lays the units out
+// one after another, the entry file first so that it starts at pc 0, adds
+// each unit's base to its offsets and points calls to imported functions at
+// the module that defines them. It touches every instruction once and never
+// compiles anything.
+//
+// A Build keeps its units from one build to the next. A unit is compiled
+// again only when its source changed, or when the parameters of a function
+// it imports did; a function body changing somewhere else only means
+// relinking. Editing one module of a large program therefore costs reading
+// and hashing every file, compiling that module and relinking.
+pub struct Build {
+    options: Options,
+    units: HashMap<PathBuf, Unit>,
+    compiled: Vec<PathBuf>,
+}
+
+struct Unit {
+    stamp: Option<Stamp>, // The file's modification time and size
+    hash: u64,
+    entry: bool,
+    imports: Vec<PathBuf>,
+    seen: Vec<Interface>, // What `imports` exported when this unit was compiled
+    externals: Vec<String>, // Imported functions heading the function table
+    exports: Vec<Export>,
+    interface: Interface,
+    bytecode: ByteCode,
+    symbols: Symbols,
+}
+
+type Stamp = (SystemTime, u64);
+
+// A hash of the part of a module its importers are compiled against: the
+// name and arity of every function it exports.
+type Interface = u64;
+
+impl Build {
+    pub fn new(options: Options) -> Self {
+        Self {
+            options,
+            units: HashMap::new(),
+            compiled: Vec::new(),
+        }
+    }
+
+    // Builds the program whose entry file is `filename`, compiling only the
+    // units that changed since the last build, and returns it linked along
+    // with the symbol table of its entry file, naming the linked functions.
+    pub fn build(&mut self, filename: &str) -> Result<(ByteCode, Symbols), String> {
+        runtime::check_source_name(filename)?;
+        let entry = fs::canonicalize(filename)
+            .map_err(|err| format!("Error reading file '{}': {}", filename, err))?;
+
+        self.compiled.clear();
+        let mut order = Vec::new();
+        let mut done = HashSet::new();
+        self.visit(&entry, true, &mut Vec::new(), &mut done, &mut order)?;
+        self.units.retain(|path, _| done.contains(path));
+
+        // `order` lists every module before the ones importing it, which
+        // leaves the entry file last.
+        order.rotate_right(1);
+        let bytecode = self.link(&order);
+        if self.options.debug {
+            runtime::print_bytecode(&bytecode);
+        }
+        // The linked function table holds each unit's own functions in turn.
+        let functions = order
+            .iter()
+            .map(|path| &self.units[path])
+            .flat_map(|unit| {
+                unit.symbols.functions[unit.externals.len()..]
+                    .iter()
+                    .cloned()
+            })
+            .collect();
+        let symbols = Symbols {
+            functions,
+            ..self.units[&entry].symbols.clone()
+        };
+        Ok((bytecode, symbols))
+    }
+
+    // The files the last build compiled, in the order it compiled them.
+    pub fn compiled(&self) -> &[PathBuf] {
+        &self.compiled
+    }
+
+    fn visit(
+        &mut self,
+        path: &PathBuf,
+        entry: bool,
+        visiting: &mut Vec<PathBuf>,
+        done: &mut HashSet<PathBuf>,
+        order: &mut Vec<PathBuf>,
+    ) -> Result<(), String> {
+        if done.contains(path) {
+            return Ok(());
+        }
+        if let Some(start) = visiting.iter().position(|file| file == path) {
+            let cycle: Vec<String> = visiting[start..]
+                .iter()
+                .chain([path])
+                .map(|file| file.display().to_string())
+                .collect();
+            return Err(format!("Import cycle: {}", cycle.join(" -> ")));
+        }
+
+        // A file whose size and modification time are what they were is not
+        // even read. One that was touched but has the same text is read and
+        // hashed, but imports what it did last time, so it is only parsed if
+        // it has to be compiled again.
+        let name = path.display().to_string();
+        let stamp = fs::metadata(path)
+            .ok()
+            .and_then(|metadata| Some((metadata.modified().ok()?, metadata.len())));
+        let unit = self.units.get(path);
+        let untouched = unit
+            .filter(|unit| stamp.is_some() && unit.stamp == stamp)
+            .map(|unit| unit.hash);
+        let source = match untouched {
+            Some(_) => None,
+            None => Some(runtime::read_source(&name)?),
+        };
+        let hash = untouched.unwrap_or_else(|| {
+            let mut hash = Fnv::new();
+            hash.write(source.as_deref().unwrap_or_default().as_bytes());
+            hash.finish()
+        });
+
+        let mut program = None;
+        let imports = match (unit, &source) {
+            (Some(unit), _) if unit.hash == hash => unit.imports.clone(),
+            (_, source) => {
+                let parsed = self.parse(path, source.as_deref().unwrap_or_default(), entry)?;
+                let imports = imports(path, &parsed)?;
+                program = Some(parsed);
+                imports
+            }
+        };
+
+        visiting.push(path.clone());
+        for import in &imports {
+            self.visit(import, false, visiting, done, order)?;
+        }
+        visiting.pop();
+
+        let seen: Vec<Interface> = imports
+            .iter()
+            .map(|import| self.units[import].interface)
+            .collect();
+        let fresh = self
+            .units
+            .get(path)
+            .is_some_and(|unit| unit.hash == hash && unit.entry == entry && unit.seen == seen);
+        if fresh {
+            if let Some(unit) = self.units.get_mut(path) {
+                unit.stamp = stamp;
+            }
+        } else {
+            let reread;
+            let program = match (program, &source) {
+                (Some(program), _) => program,
+                (None, Some(source)) => self.parse(path, source, entry)?,
+                (None, None) => {
+                    reread = runtime::read_source(&name)?;
+                    self.parse(path, &reread, entry)?
+                }
+            };
+            let unit = self.compile(path, &program, entry, stamp, hash, imports, seen)?;
+            self.units.insert(path.clone(), unit);
+            self.compiled.push(path.clone());
+        }
+        done.insert(path.clone());
+        order.push(path.clone());
+        Ok(())
+    }
+
+    fn parse<'a>(&self, path: &Path, source: &'a str, entry: bool) -> Result<Program<'a>, String> {
+        runtime::parse_source(source, self.options.debug).map_err(|e| in_module(e, path, entry))
+    }
+
+    fn compile(
+        &self,
+        path: &Path,
+        program: &Program,
+        entry: bool,
+        stamp: Option<Stamp>,
+        hash: u64,
+        imports: Vec<PathBuf>,
+        seen: Vec<Interface>,
+    ) -> Result<Unit, String> {
+        if !entry {
+            let statement = program
+                .statements
+                .iter()
+                .find(|stmt| !matches!(stmt, Stmt::Func { .. } | Stmt::Import { .. }));
+            if let Some(Stmt::Let { line, .. } | Stmt::Expr(_, line)) = statement {
+                return Err(format!(
+                    "Modules can only define functions and imports, found a statement at line {} of '{}'",
+                    line,
+                    path.display()
+                ));
+            }
+        }
+
+        // One name, one function: nothing imported may clash with another
+        // import or with a function of the file itself.
+        let mut owners: HashMap<&str, &Path> = HashMap::new();
+        let mut externals = Vec::new();
+        for import in &imports {
+            for export in &self.units[import].exports {
+                if let Some(other) = owners.insert(&export.name, import) {
+                    return Err(clash(&export.name, other, import));
+                }
+                externals.push(export.clone());
+            }
+        }
+        for stmt in &program.statements {
+            if let Stmt::Func { name, .. } = stmt
+                && let Some(owner) = owners.get(program.name(*name))
+            {
+                return Err(clash(program.name(*name), owner, path));
+            }
+        }
+
+        let mut compiler = Compiler::with_optimization(self.options.optimize);
+        let mut bytecode = compiler
+            .compile_module(program, &externals)
+            .map_err(|e| in_module(format!("Compile error: {}", e), path, entry))?;
+        if self.options.optimize {
+            optimizer::optimize(&mut bytecode);
+        }
+        let exports = compiler.exports(program);
+        Ok(Unit {
+            stamp,
+            hash,
+            entry,
+            imports,
+            seen,
+            externals: externals.into_iter().map(|export| export.name).collect(),
+            interface: interface(&exports),
+            exports,
+            bytecode,
+            symbols: compiler.symbols(program),
+        })
+    }
+
+    // Lays out the units of `order` one after another. A unit's own entries
+    // of the function table follow those of the units before it; its
+    // imported entries are dropped, and calls to them go to the entry of the
+    // module exporting the function.
+    fn link(&self, order: &[PathBuf]) -> ByteCode {
+        let units: Vec<&Unit> = order.iter().map(|path| &self.units[path]).collect();
+        let positions: HashMap<&PathBuf, usize> = order
+            .iter()
+            .enumerate()
+            .map(|(position, path)| (path, position))
+            .collect();
+        let mut next = 0;
+        let mut bases = Vec::with_capacity(units.len());
+        for unit in &units {
+            bases.push(next);
+            next += unit.bytecode.functions.len() - unit.externals.len();
+        }
+
+        let mut linked = ByteCode {
+            constants: Vec::new(),
+            functions: Vec::with_capacity(next),
+            globals: units[0].bytecode.globals,
+            instructions: Vec::new(),
+            instruction_lines: Vec::new(),
+        };
+        for (unit, base) in units.iter().zip(&bases) {
+            // Where each of the unit's function indices ends up: the imported
+            // ones in the order compile_module was given them, then its own.
+            let mut functions = Vec::with_capacity(unit.bytecode.functions.len());
+            for import in &unit.imports {
+                let position = positions[import];
+                let owner = units[position];
+                let owner_base = bases[position];
+                functions.extend(
+                    owner
+                        .exports
+                        .iter()
+                        .map(|export| (owner_base + export.index - owner.externals.len()) as u32),
+                );
+            }
+            let own = unit.bytecode.functions.len() - functions.len();
+            functions.extend((*base..base + own).map(|index| index as u32));
+            let constants = linked.constants.len() as u32;
+            let code = linked.instructions.len();
+
+            linked.constants.extend(unit.bytecode.constants.iter().map(
+                |constant| match constant {
+                    Value::Function(index) => Value::Function(functions[*index as usize]),
+                    constant => constant.clone(),
+                },
+            ));
+            linked
+                .functions
+                .extend(
+                    unit.bytecode.functions[unit.externals.len()..]
+                        .iter()
+                        .map(|function| Function {
+                            offset: function.offset + code,
+                            ..function.clone()
+                        }),
+                );
+            linked.instructions.extend(
+                unit.bytecode
+                    .instructions
+                    .iter()
+                    .map(|instruction| relocate(*instruction, code as u32, constants, &functions)),
+            );
+            linked
+                .instruction_lines
+                .extend_from_slice(&unit.bytecode.instruction_lines);
+        }
+        linked
+    }
+}
+
+// The modules `program`, read from `path`, imports, each once. A path is
+// relative to the importing file and may leave out the .n extension.
+fn imports(path: &Path, program: &Program) -> Result<Vec<PathBuf>, String> {
+    let dir = path.parent().unwrap_or(Path::new("."));
+    let mut imports = Vec::new();
+    for stmt in &program.statements {
+        if let Stmt::Import { path: module, line } = stmt {
+            let module = program.name(*module);
+            let file = resolve(dir, module).map_err(|err| {
+                format!(
+                    "Cannot import '{}' at line {} of '{}': {}",
+                    module,
+                    line,
+                    path.display(),
+                    err
+                )
+            })?;
+            if !imports.contains(&file) {
+                imports.push(file);
+            }
+        }
+    }
+    Ok(imports)
+}
+
+fn resolve(dir: &Path, module: &str) -> std::io::Result<PathBuf> {
+    let mut file = dir.join(module);
+    if file.extension().is_none() {
+        file.set_extension("n");
+    }
+    fs::canonicalize(&file)
+}
+
+// The text of `filename` followed by that of every module it imports,
+// directly or not: everything its compiled program depends on, which makes
+// it the key of the compilation cache. Imports are found by lexing alone, so
+// this is far cheaper than a build. A file importing nothing is its own text.
+pub fn sources(filename: &str) -> Result<String, String> {
+    let mut text = runtime::read_source(filename)?;
+    let entry = fs::canonicalize(filename)
+        .map_err(|err| format!("Error reading file '{}': {}", filename, err))?;
+    let mut seen = HashSet::from([entry.clone()]);
+    let mut pending = vec![(entry, text.clone())];
+    while let Some((path, source)) = pending.pop() {
+        let dir = path.parent().unwrap_or(Path::new("."));
+        let tokens = Lexer::new(&source).tokenize();
+        for pair in tokens.windows(2).rev() {
+            let [Token::Import, Token::String(module)] = pair else {
+                continue;
+            };
+            // Unresolvable imports fail the build that follows.
+            let Ok(file) = resolve(dir, module) else {
+                continue;
+            };
+            if seen.insert(file.clone()) {
+                let module = runtime::read_source(&file.display().to_string())?;
+                text.push_str(&format!("\0{}\0{}", module.len(), module));
+                pending.push((file, module));
+            }
+        }
+    }
+    Ok(text)
+}
+
+fn interface(exports: &[Export]) -> Interface {
+    let mut hash = Fnv::new();
+    for export in exports {
+        hash.write(export.name.as_bytes());
+        hash.write(&[0]);
+        hash.write(&export.params.len().to_le_bytes());
+    }
+    hash.finish()
+}
+
+fn clash(name: &str, first: &Path, second: &Path) -> String {
+    format!(
+        "Function '{}' is defined by both '{}' and '{}'",
+        name,
+        first.display(),
+        second.display()
+    )
+}
+
+// Errors in the entry file read as they do for a single-file program.
+fn in_module(error: String, path: &Path, entry: bool) -> String {
+    match entry {
+        true => error,
+        false => format!("{} (in '{}')", error, path.display()),
+    }
+}
+
+// Moves an instruction of a unit to where linking put the unit: `code` and
+// `constants` are where its instructions and constants start, and
+// `functions` maps its function indices to linked ones.
+fn relocate(
+    mut instruction: Instruction,
+    code: u32,
+    constants: u32,
+    functions: &[u32],
+) -> Instruction {
+    if let Some(target) = optimizer::target_mut(&mut instruction) {
+        *target += code;
+        return instruction;
+    }
+    match &mut instruction {
+        Instruction::LoadConst(index)
+        | Instruction::AddConst(index)
+        | Instruction::SubConst(index)
+        | Instruction::MulConst(index)
+        | Instruction::DivConst(index)
+        | Instruction::CreateRecord(index, _)
+        | Instruction::GetField(index) => *index += constants,
+        Instruction::Call(index)
+        | Instruction::TailCall(index)
+        | Instruction::Map(index)
+        | Instruction::Filter(index)
+        | Instruction::Async(index) => *index = functions[*index as usize],
+        _ => {}
+    }
+    instruction
+}
@@ -0,0 +1,475 @@
+use crate::dense::{self, Fused, Op, Operand, Stage, Terminal};
+use crate::heap::Heap;
+use crate::types::compiler::{Future, HeapObject, Value};
+use crate::types::constants::INVALID_HEAP_POINTER_ERROR;
+use crate::vector::Vector;
+use std::borrow::Cow;
+use std::time::{Duration, Instant};
+
+// Built-in functions, called with CALL_GLOBAL index. The compiler resolves a
+// call to one of these names at compile time when no user function of that
+// name is in scope, so a program's own `len` shadows the built-in. A native
+// runs directly on its arguments: no frame is pushed and no bytecode runs.
+pub struct Native {
+    pub name: &'static str,
+    pub arity: usize,
+    pub run: fn(&[Value], &Heap) -> Result<Returned, String>,
+}
+
+// An allocation is handed back for the VM to make, so it happens with the
+// VM's roots in view.
+pub enum Returned {
+    Value(Value),
+    Object(HeapObject),
+}
+
+pub const NATIVES: [Native; 18] = [
+    Native {
+        name: "len",
+        arity: 1,
+        run: len,
+    },
+    Native {
+        name: "append",
+        arity: 2,
+        run: append,
+    },
+    Native {
+        name: "abs",
+        arity: 1,
+        run: |args, heap| unary(args, heap, "abs", f64::abs),
+    },
+    Native {
+        name: "floor",
+        arity: 1,
+        run: |args, heap| unary(args, heap, "floor", f64::floor),
+    },
+    Native {
+        name: "sqrt",
+        arity: 1,
+        run: |args, heap| unary(args, heap, "sqrt", f64::sqrt),
+    },
+    Native {
+        name: "min",
+        arity: 2,
+        run: |args, heap| binary(args, heap, "min", f64::min),
+    },
+    Native {
+        name: "max",
+        arity: 2,
+        run: |args, heap| binary(args, heap, "max", f64::max),
+    },
+    // Array kernels, meant for pipelines such as `xs |> mul(2) |> sum`. They
+    // take arrays of numbers (and masks of booleans) and run over the dense
+    // representation a leaf at a time; see dense.rs.
+    Native {
+        name: "sum",
+        arity: 1,
+        run: sum,
+    },
+    Native {
+        name: "add",
+        arity: 2,
+        run: |args, heap| elementwise(args, heap, "add", |x, y| x + y),
+    },
+    Native {
+        name: "sub",
+        arity: 2,
+        run: |args, heap| elementwise(args, heap, "sub", |x, y| x - y),
+    },
+    Native {
+        name: "mul",
+        arity: 2,
+        run: |args, heap| elementwise(args, heap, "mul", |x, y| x * y),
+    },
+    Native {
+        name: "div",
+        arity: 2,
+        run: div,
+    },
+    Native {
+        name: "less",
+        arity: 2,
+        run: |args, heap| comparison(args, heap, "less", |x, y| x < y),
+    },
+    Native {
+        name: "greater",
+        arity: 2,
+        run: |args, heap| comparison(args, heap, "greater", |x, y| x > y),
+    },
+    Native {
+        name: "equal",
+        arity: 2,
+        run: |args, heap| comparison(args, heap, "equal", |x, y| x == y),
+    },
+    Native {
+        name: "select",
+        arity: 2,
+        run: select,
+    },
+    Native {
+        name: "count",
+        arity: 1,
+        run: count,
+    },
+    Native {
+        name: "sleep",
+        arity: 1,
+        run: sleep,
+    },
+];
+
+// How a built-in takes part in a fused pipeline; see dense::fused.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Fusible {
+    Arithmetic(Op),
+    Compare(Op),
+    Select,
+    Sum,
+    Count,
+}
+
+pub fn fusible(index: u32) -> Option<Fusible> {
+    let fusible = match NATIVES.get(index as usize)?.name {
+        "add" => Fusible::Arithmetic(Op::Add),
+        "sub" => Fusible::Arithmetic(Op::Sub),
+        "mul" => Fusible::Arithmetic(Op::Mul),
+        "div" => Fusible::Arithmetic(Op::Div),
+        "less" => Fusible::Compare(Op::Less),
+        "greater" => Fusible::Compare(Op::Greater),
+        "equal" => Fusible::Compare(Op::Equal),
+        "select" => Fusible::Select,
+        "sum" => Fusible::Sum,
+        "count" => Fusible::Count,
+        _ => return None,
+    };
+    Some(fusible)
+}
+
+// Whether a chain of calls can run as one fused pass: at least two stages,
+// the first of them arithmetic or a comparison (so the source must be an
+// array of numbers), each getting the element type it expects, and sum or
+// count only at the end. Only sum and count may follow a select, since a
+// later stage's array operand would no longer line up with the elements.
+pub fn fuses(stages: &[u32]) -> bool {
+    let mut boolean = None;
+    let mut selected = false;
+    for (position, stage) in stages.iter().enumerate() {
+        let last = position + 1 == stages.len();
+        let fits = match (fusible(*stage), boolean) {
+            (Some(Fusible::Arithmetic(_)), None | Some(false)) if !selected => {
+                boolean = Some(false);
+                true
+            }
+            (Some(Fusible::Compare(_)), None | Some(false)) if !selected => {
+                boolean = Some(true);
+                true
+            }
+            (Some(Fusible::Select), Some(_)) if !selected => {
+                selected = true;
+                true
+            }
+            (Some(Fusible::Sum), Some(false)) | (Some(Fusible::Count), Some(true)) => last,
+            _ => false,
+        };
+        if !fits {
+            return false;
+        }
+    }
+    stages.len() >= 2
+}
+
+// How many values a fused pipeline takes from the stack: the source, then
+// each stage's argument in order.
+pub fn pipeline_arity(stages: &[u32]) -> usize {
+    1 + stages
+        .iter()
+        .filter(|stage| NATIVES[**stage as usize].arity == 2)
+        .count()
+}
+
+// Runs the stages of a pipeline that `fuses` accepted in one pass. The
+// checks run in the order the separate calls would have made them, so a
+// failing pipeline reports the same error, though by then every stage's
+// argument has been evaluated.
+pub fn pipeline(stages: &[u32], args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let (source, mut rest) = args.split_first().ok_or("Not enough arguments")?;
+    let mut xs: Option<Cow<Vector<f64>>> = None;
+    let mut fused = Vec::with_capacity(stages.len());
+    let mut terminal = Terminal::Collect;
+    for stage in stages {
+        let native = native(*stage)?;
+        let kind = fusible(*stage).ok_or("Invalid pipeline stage")?;
+        let arg = match native.arity {
+            2 => {
+                let (arg, others) = rest.split_first().ok_or("Not enough arguments")?;
+                rest = others;
+                Some(arg)
+            }
+            _ => None,
+        };
+        // div looks at its divisor before its array.
+        if let (Fusible::Arithmetic(Op::Div), Some(arg)) = (kind, arg) {
+            check_divisor(arg, heap)?;
+        }
+        let len = match &xs {
+            Some(xs) => xs.len(),
+            None => xs.insert(numbers(source, heap, native.name)?).len(),
+        };
+        match (kind, arg) {
+            (Fusible::Arithmetic(op), Some(arg)) => {
+                fused.push(Stage::Arithmetic(op, operand(arg, heap, native.name, len)?))
+            }
+            (Fusible::Compare(op), Some(arg)) => {
+                fused.push(Stage::Compare(op, operand(arg, heap, native.name, len)?))
+            }
+            (Fusible::Select, Some(arg)) => fused.push(Stage::Select(mask(arg, heap, len)?)),
+            (Fusible::Sum, None) => terminal = Terminal::Sum,
+            (Fusible::Count, None) => terminal = Terminal::Count,
+            _ => return Err("Invalid pipeline stage".to_string()),
+        }
+    }
+    let xs = xs.ok_or("Empty pipeline")?;
+    Ok(match dense::fused(&xs, &fused, terminal) {
+        Fused::Numbers(numbers) => Returned::Object(HeapObject::Numbers(numbers)),
+        Fused::Booleans(booleans) => Returned::Object(HeapObject::Booleans(booleans)),
+        Fused::Number(n) => Returned::Value(Value::Number(n)),
+    })
+}
+
+fn operand<'h>(
+    value: &Value,
+    heap: &'h Heap,
+    name: &str,
+    len: usize,
+) -> Result<Operand<'h>, String> {
+    match value {
+        Value::Number(y) => Ok(Operand::Scalar(*y)),
+        value => {
+            let ys = numbers(value, heap, name)?;
+            same_length(name, len, ys.len())?;
+            Ok(Operand::Array(ys))
+        }
+    }
+}
+
+pub fn lookup(name: &str) -> Option<u32> {
+    NATIVES
+        .iter()
+        .position(|native| native.name == name)
+        .map(|index| index as u32)
+}
+
+pub fn native(index: u32) -> Result<&'static Native, String> {
+    NATIVES
+        .get(index as usize)
+        .ok_or_else(|| format!("Invalid native function index {}", index))
+}
+
+fn len(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let length = match &args[0] {
+        Value::String(s) => Some(s.chars().count()),
+        Value::HeapPointer(index) => match heap.get(*index).ok_or(INVALID_HEAP_POINTER_ERROR)? {
+            HeapObject::String(s) => Some(s.chars().count()),
+            object => dense::len(object),
+        },
+        _ => None,
+    }
+    .ok_or_else(|| {
+        format!(
+            "len expects an array or string, got {}",
+            args[0].type_name(heap)
+        )
+    })?;
+    Ok(Returned::Value(Value::Number(length as f64)))
+}
+
+// A new array sharing the list's storage, as `list <- [value]` would build.
+fn append(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let array = match &args[0] {
+        Value::HeapPointer(index) => heap.get(*index).ok_or(INVALID_HEAP_POINTER_ERROR)?,
+        value => {
+            return Err(format!(
+                "append expects an array, got {}",
+                value.type_name(heap)
+            ));
+        }
+    };
+    dense::push(array, args[1].clone())
+        .map(Returned::Object)
+        .ok_or_else(|| "append expects an array".to_string())
+}
+
+fn unary(args: &[Value], heap: &Heap, name: &str, f: fn(f64) -> f64) -> Result<Returned, String> {
+    match &args[0] {
+        Value::Number(n) => Ok(Returned::Value(Value::Number(f(*n)))),
+        value => Err(format!(
+            "{} expects a number, got {}",
+            name,
+            value.type_name(heap)
+        )),
+    }
+}
+
+fn binary(
+    args: &[Value],
+    heap: &Heap,
+    name: &str,
+    f: fn(f64, f64) -> f64,
+) -> Result<Returned, String> {
+    match (&args[0], &args[1]) {
+        (Value::Number(a), Value::Number(b)) => Ok(Returned::Value(Value::Number(f(*a, *b)))),
+        (a, b) => Err(format!(
+            "{} expects numbers, got {} and {}",
+            name,
+            a.type_name(heap),
+            b.type_name(heap)
+        )),
+    }
+}
+
+fn array<'h>(value: &Value, heap: &'h Heap) -> Option<&'h HeapObject> {
+    match value {
+        Value::HeapPointer(index) => heap.get(*index),
+        _ => None,
+    }
+}
+
+fn numbers<'h>(value: &Value, heap: &'h Heap, name: &str) -> Result<Cow<'h, Vector<f64>>, String> {
+    array(value, heap).and_then(dense::numbers).ok_or_else(|| {
+        format!(
+            "{} expects an array of numbers, got {}",
+            name,
+            value.type_name(heap)
+        )
+    })
+}
+
+fn booleans<'h>(
+    value: &Value,
+    heap: &'h Heap,
+    name: &str,
+) -> Result<Cow<'h, Vector<bool>>, String> {
+    array(value, heap).and_then(dense::booleans).ok_or_else(|| {
+        format!(
+            "{} expects an array of booleans, got {}",
+            name,
+            value.type_name(heap)
+        )
+    })
+}
+
+fn same_length(name: &str, left: usize, right: usize) -> Result<(), String> {
+    if left == right {
+        return Ok(());
+    }
+    Err(format!(
+        "{} expects arrays of the same length, got {} and {}",
+        name, left, right
+    ))
+}
+
+fn sum(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let xs = numbers(&args[0], heap, "sum")?;
+    Ok(Returned::Value(Value::Number(dense::sum(&xs))))
+}
+
+// `op(xs, y)` applies `f` to each element and y, or, when y is an array of
+// the same length, to each pair of elements.
+fn elementwise(
+    args: &[Value],
+    heap: &Heap,
+    name: &str,
+    f: impl Fn(f64, f64) -> f64,
+) -> Result<Returned, String> {
+    let xs = numbers(&args[0], heap, name)?;
+    let out = match &args[1] {
+        Value::Number(y) => dense::map(&xs, |x| f(x, *y)),
+        value => {
+            let ys = numbers(value, heap, name)?;
+            same_length(name, xs.len(), ys.len())?;
+            dense::zip(&xs, &ys, f)
+        }
+    };
+    Ok(Returned::Object(HeapObject::Numbers(out)))
+}
+
+fn div(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    check_divisor(&args[1], heap)?;
+    elementwise(args, heap, "div", |x, y| x / y)
+}
+
+fn check_divisor(value: &Value, heap: &Heap) -> Result<(), String> {
+    let zero = match value {
+        Value::Number(y) => *y == 0.0,
+        value => numbers(value, heap, "div")?.iter().any(|y| *y == 0.0),
+    };
+    match zero {
+        true => Err("Division by zero".to_string()),
+        false => Ok(()),
+    }
+}
+
+fn comparison(
+    args: &[Value],
+    heap: &Heap,
+    name: &str,
+    f: impl Fn(f64, f64) -> bool,
+) -> Result<Returned, String> {
+    let xs = numbers(&args[0], heap, name)?;
+    let out = match &args[1] {
+        Value::Number(y) => dense::compare(&xs, *y, f),
+        value => {
+            let ys = numbers(value, heap, name)?;
+            same_length(name, xs.len(), ys.len())?;
+            dense::compare_zip(&xs, &ys, f)
+        }
+    };
+    Ok(Returned::Object(HeapObject::Booleans(out)))
+}
+
+// The elements of an array whose entries in a boolean mask are true.
+fn select(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let Some((object, length)) =
+        array(&args[0], heap).and_then(|object| Some((object, dense::len(object)?)))
+    else {
+        return Err(format!(
+            "select expects an array, got {}",
+            args[0].type_name(heap)
+        ));
+    };
+    let mask = mask(&args[1], heap, length)?;
+    let selected = dense::filter(object, &mask).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+    Ok(Returned::Object(selected))
+}
+
+fn mask<'h>(value: &Value, heap: &'h Heap, length: usize) -> Result<Cow<'h, Vector<bool>>, String> {
+    let mask = booleans(value, heap, "select")?;
+    same_length("select", length, mask.len())?;
+    Ok(mask)
+}
+
+fn count(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let mask = booleans(&args[0], heap, "count")?;
+    Ok(Returned::Value(Value::Number(dense::count(&mask) as f64)))
+}
+
+// A future that `await` completes once `ms` milliseconds have passed, with ms
+// as its value. Nothing waits until then: the timer runs from the call.
+fn sleep(args: &[Value], heap: &Heap) -> Result<Returned, String> {
+    let ms = match &args[0] {
+        Value::Number(ms) => *ms,
+        value => {
+            return Err(format!(
+                "sleep expects a number, got {}",
+                value.type_name(heap)
+            ));
+        }
+    };
+    let delay = Duration::try_from_secs_f64(ms.max(0.0) / 1000.0)
+        .map_err(|_| format!("sleep expects a finite delay, got {}", ms))?;
+    Ok(Returned::Object(HeapObject::Future(Future::Timer {
+        deadline: Instant::now() + delay,
+        value: ms,
+    })))
+}
@@ -0,0 +1,226 @@
+use crate::types::ast::{BinaryOp, Expr, ExprId, Program, UnaryOp};
+use crate::types::compiler::{ByteCode, Instruction};
+
+// Optimizations enabled by `-O`. Constant folding runs inside the compiler on
+// the AST; everything else rewrites the finished instruction stream. Every
+// rewrite preserves what the unoptimized program computes, including which
+// runtime errors it raises, so an expression that would fail (a division by
+// zero, negating a string) is left for the VM to report.
+
+// The value of `expr` if it is built only from literals. Only operators the
+// VM evaluates directly are folded, and each one with the VM's semantics:
+// unary minus is `0 - x`, and equality is only folded between numbers since
+// the VM compares no other literal type.
+pub fn fold(program: &Program, expr: ExprId) -> Option<Folded> {
+    match *program.expr(expr) {
+        Expr::Number(n) => Some(Folded::Number(n)),
+        Expr::Boolean(b) => Some(Folded::Boolean(b)),
+        Expr::Unary { op, right } => match (op, fold(program, right)?) {
+            (UnaryOp::Neg, Folded::Number(n)) => Some(Folded::Number(0.0 - n)),
+            (UnaryOp::Not, Folded::Boolean(b)) => Some(Folded::Boolean(!b)),
+            _ => None,
+        },
+        Expr::Binary { left, op, right } => {
+            let (Folded::Number(a), Folded::Number(b)) =
+                (fold(program, left)?, fold(program, right)?)
+            else {
+                return None;
+            };
+            match op {
+                BinaryOp::Add => Some(Folded::Number(a + b)),
+                BinaryOp::Sub => Some(Folded::Number(a - b)),
+                BinaryOp::Mul => Some(Folded::Number(a * b)),
+                BinaryOp::Div if b != 0.0 => Some(Folded::Number(a / b)),
+                BinaryOp::Eq => Some(Folded::Boolean(a == b)),
+                BinaryOp::Lt => Some(Folded::Boolean(a < b)),
+                BinaryOp::Gt => Some(Folded::Boolean(a > b)),
+                _ => None,
+            }
+        }
+        _ => None,
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Folded {
+    Number(f64),
+    Boolean(bool),
+}
+
+// Peephole pass over compiled bytecode, repeated until nothing changes:
+// - jumps whose target is another jump go straight to the final target, and
+//   a jump to the next instruction is dropped;
+// - a value pushed only to be popped again is never pushed;
+// - the pairs that dominate opcode profiles of our workloads (see
+//   `cargo bench --bench dispatch -- --profile`) become one superinstruction:
+//   LOAD_CONST + arithmetic, LOAD_VAR + ADD, STORE_VAR + LOAD_VAR of the same
+//   slot, and comparison + JUMP_IF_FALSE.
+// A pair is only rewritten when no jump lands between its two halves.
+pub fn optimize(bytecode: &mut ByteCode) {
+    loop {
+        thread_jumps(&mut bytecode.instructions);
+        if !rewrite_pairs(bytecode) {
+            break;
+        }
+    }
+}
+
+fn thread_jumps(instructions: &mut [Instruction]) {
+    for pc in 0..instructions.len() {
+        let mut instruction = instructions[pc];
+        if let Some(target) = target_mut(&mut instruction) {
+            *target = final_target(instructions, *target);
+            instructions[pc] = instruction;
+        }
+    }
+}
+
+// Follows unconditional jumps from `target`, stopping at a cycle.
+fn final_target(instructions: &[Instruction], mut target: u32) -> u32 {
+    for _ in 0..instructions.len() {
+        match instructions.get(target as usize) {
+            Some(Instruction::Jump(next)) if *next != target => target = *next,
+            _ => break,
+        }
+    }
+    target
+}
+
+fn rewrite_pairs(bytecode: &mut ByteCode) -> bool {
+    let instructions = &mut bytecode.instructions;
+    let mut landing = vec![false; instructions.len() + 1];
+    let targets = instructions.iter().filter_map(|instruction| {
+        let mut instruction = *instruction;
+        target_mut(&mut instruction).copied()
+    });
+    let entries = bytecode
+        .functions
+        .iter()
+        .map(|function| function.offset as u32);
+    for target in targets.chain(entries) {
+        if let Some(landing) = landing.get_mut(target as usize) {
+            *landing = true;
+        }
+    }
+
+    let mut keep = vec![true; instructions.len()];
+    let mut changed = false;
+    let mut pc = 0;
+    while pc < instructions.len() {
+        if let Instruction::Jump(target) = instructions[pc] {
+            if target as usize == pc + 1 {
+                keep[pc] = false;
+                changed = true;
+                pc += 1;
+                continue;
+            }
+        }
+
+        let Some(next) = instructions.get(pc + 1).filter(|_| !landing[pc + 1]) else {
+            pc += 1;
+            continue;
+        };
+        match (instructions[pc], *next) {
+            (
+                Instruction::LoadConst(_) | Instruction::LoadVar(..) | Instruction::Dup,
+                Instruction::Pop,
+            ) => {
+                keep[pc] = false;
+                keep[pc + 1] = false;
+            }
+            (first, second) => match fuse(first, second) {
+                Some(fused) => {
+                    instructions[pc] = fused;
+                    keep[pc + 1] = false;
+                }
+                None => {
+                    pc += 1;
+                    continue;
+                }
+            },
+        }
+        changed = true;
+        pc += 2;
+    }
+
+    if changed {
+        retain(bytecode, &keep);
+    }
+    changed
+}
+
+// The superinstruction that does what `first` followed by `second` does.
+fn fuse(first: Instruction, second: Instruction) -> Option<Instruction> {
+    let fused = match (first, second) {
+        (Instruction::LoadConst(index), Instruction::Add) => Instruction::AddConst(index),
+        (Instruction::LoadConst(index), Instruction::Sub) => Instruction::SubConst(index),
+        (Instruction::LoadConst(index), Instruction::Mul) => Instruction::MulConst(index),
+        (Instruction::LoadConst(index), Instruction::Div) => Instruction::DivConst(index),
+        (Instruction::LoadVar(depth, index), Instruction::Add) => {
+            Instruction::LoadVarAdd(depth, index)
+        }
+        (Instruction::StoreVar(depth, index), Instruction::LoadVar(load_depth, load_index))
+            if (depth, index) == (load_depth, load_index) =>
+        {
+            Instruction::StoreVarKeep(depth, index)
+        }
+        (Instruction::Equal, Instruction::JumpIfFalse(target)) => {
+            Instruction::EqualJumpIfFalse(target)
+        }
+        (Instruction::Less, Instruction::JumpIfFalse(target)) => {
+            Instruction::LessJumpIfFalse(target)
+        }
+        (Instruction::Greater, Instruction::JumpIfFalse(target)) => {
+            Instruction::GreaterJumpIfFalse(target)
+        }
+        _ => return None,
+    };
+    Some(fused)
+}
+
+// The target of a jump, which the linker in modules.rs relocates too.
+pub(crate) fn target_mut(instruction: &mut Instruction) -> Option<&mut u32> {
+    match instruction {
+        Instruction::Jump(target)
+        | Instruction::JumpIfFalse(target)
+        | Instruction::JumpIfTrue(target)
+        | Instruction::EqualJumpIfFalse(target)
+        | Instruction::LessJumpIfFalse(target)
+        | Instruction::GreaterJumpIfFalse(target) => Some(target),
+        _ => None,
+    }
+}
+
+// Drops the instructions not marked in `keep`, renumbering jump targets,
+// function offsets and the line table. A target that was dropped moves to
+// the next instruction that survives, which is what running the dropped
+// instructions would have amounted to.
+fn retain(bytecode: &mut ByteCode, keep: &[bool]) {
+    let mut remap = Vec::with_capacity(keep.len() + 1);
+    let mut next = 0;
+    for kept in keep {
+        remap.push(next);
+        next += *kept as u32;
+    }
+    remap.push(next);
+
+    let mut index = 0;
+    bytecode.instructions.retain(|_| {
+        index += 1;
+        keep[index - 1]
+    });
+    let mut index = 0;
+    bytecode.instruction_lines.retain(|_| {
+        index += 1;
+        keep[index - 1]
+    });
+
+    for instruction in &mut bytecode.instructions {
+        if let Some(target) = target_mut(instruction) {
+            *target = remap.get(*target as usize).copied().unwrap_or(next);
+        }
+    }
+    for function in &mut bytecode.functions {
+        function.offset = remap.get(function.offset).copied().unwrap_or(next) as usize;
+    }
+}
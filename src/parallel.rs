@@ -0,0 +1,68 @@
+use crate::types::constants::PARALLEL_CHUNK;
+use std::panic;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+// The thread pool behind MAP and FILTER. The elements are split into chunks of
+// PARALLEL_CHUNK that the threads claim one at a time off a shared counter,
+// so a thread that gets cheap elements simply claims more chunks instead of
+// idling while the others finish a fixed share. Each thread builds its own
+// `context` (a worker VM) once and runs `task` on it for every element of
+// every chunk it claims.
+//
+// Results come back in element order. The counter only moves forward, so
+// when a chunk fails every chunk before it has already been claimed; those
+// still run to the end while no new chunk is started, and the error returned
+// is always the one of the earliest failing element, as if the elements had
+// been processed one after another.
+pub fn run<C, R: Send>(
+    len: usize,
+    threads: usize,
+    context: impl Fn() -> C + Sync,
+    task: impl Fn(&mut C, usize) -> Result<R, String> + Sync,
+) -> Result<Vec<R>, String> {
+    let chunks = len.div_ceil(PARALLEL_CHUNK);
+    let next = AtomicUsize::new(0);
+    let failed = AtomicUsize::new(usize::MAX); // Earliest failing chunk so far
+
+    let worker = || {
+        let mut context = context();
+        let mut claimed = Vec::new();
+        loop {
+            let chunk = next.fetch_add(1, Ordering::Relaxed);
+            if chunk >= chunks || chunk > failed.load(Ordering::Relaxed) {
+                return claimed;
+            }
+            let start = chunk * PARALLEL_CHUNK;
+            let result = (start..len.min(start + PARALLEL_CHUNK))
+                .map(|index| task(&mut context, index))
+                .collect::<Result<Vec<R>, String>>();
+            let stop = result.is_err();
+            if stop {
+                failed.fetch_min(chunk, Ordering::Relaxed);
+            }
+            claimed.push((chunk, result));
+            if stop {
+                // The context may be left mid-call.
+                return claimed;
+            }
+        }
+    };
+
+    let mut claimed: Vec<(usize, Result<Vec<R>, String>)> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads.clamp(1, chunks.max(1)))
+            .map(|_| scope.spawn(&worker))
+            .collect();
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap_or_else(|e| panic::resume_unwind(e)))
+            .collect()
+    });
+    claimed.sort_by_key(|(chunk, _)| *chunk);
+
+    let mut results = Vec::with_capacity(len);
+    for (_, chunk) in claimed {
+        results.extend(chunk?);
+    }
+    Ok(results)
+}
@@ -1,16 +1,37 @@
+use crate::lexer::Lexer;
 use crate::types::{ast::*, token::Token};
 
-pub struct Parser {
-    tokens: Vec<Token>,
-    pos: usize,
+// Pulls tokens from the lexer as it goes, holding only the current token and
+// one of lookahead, so the front end never materializes the token stream and
+// a parse error surfaces as soon as the offending token is lexed. Nodes go
+// straight into the Program's arenas as they are parsed.
+pub struct Parser<'a> {
+    lexer: Lexer<'a>,
+    current: Token<'a>,
+    next: Token<'a>,
+    line: usize,
+    program: Program<'a>,
+    pending: Vec<ExprId>, // Elements of the argument, array and record lists being parsed
 }
 
-impl Parser {
-    pub fn new(tokens: Vec<Token>) -> Self {
-        Self { tokens, pos: 0 }
+impl<'a> Parser<'a> {
+    pub fn new(mut lexer: Lexer<'a>) -> Self {
+        let current = lexer.next_token();
+        let next = match current {
+            Token::Eof => Token::Eof,
+            _ => lexer.next_token(),
+        };
+        Self {
+            lexer,
+            current,
+            next,
+            line: 1,
+            program: Program::new(),
+            pending: Vec::new(),
+        }
     }
 
-    pub fn parse(&mut self) -> Result<Program, String> {
+    pub fn parse(&mut self) -> Result<Program<'a>, String> {
         let mut statements = Vec::new();
         while !self.is_at_end() {
             self.skip_newlines();
@@ -18,7 +39,9 @@ impl Parser {
                 statements.push(self.statement()?);
             }
         }
-        Ok(Program { statements })
+        let mut program = std::mem::take(&mut self.program);
+        program.statements = statements;
+        Ok(program)
     }
 
     fn statement(&mut self) -> Result<Stmt, String> {
@@ -26,6 +49,7 @@ impl Parser {
         match self.current() {
             Token::Let | Token::LetBang => self.let_statement(line),
             Token::Func => self.func_statement(line),
+            Token::Import => self.import_statement(line),
             _ => Ok(Stmt::Expr(self.expression(1)?, line)),
         }
     }
@@ -43,7 +67,25 @@ impl Parser {
         };
         self.expect(Token::Assign)?;
         let value = self.expression(1)?;
-        Ok(Stmt::Let { name, value, line })
+        Ok(Stmt::Let {
+            name: self.program.intern(name),
+            value,
+            line,
+        })
+    }
+
+    fn import_statement(&mut self, line: usize) -> Result<Stmt, String> {
+        self.advance();
+        match self.advance() {
+            Token::String(path) => Ok(Stmt::Import {
+                path: self.program.intern(path),
+                line,
+            }),
+            _ => Err(format!(
+                "Expected a module path after 'import' at line {}",
+                line
+            )),
+        }
     }
 
     fn func_statement(&mut self, line: usize) -> Result<Stmt, String> {
@@ -61,7 +103,7 @@ impl Parser {
         let mut params = Vec::new();
         while !matches!(self.current(), Token::RightParen) {
             if let Token::Identifier(p) = self.advance() {
-                params.push(p);
+                params.push(self.program.intern(p));
             }
             if matches!(self.current(), Token::Comma) {
                 self.advance();
@@ -78,14 +120,14 @@ impl Parser {
         }
         self.expect(Token::RightBrace)?;
         Ok(Stmt::Func {
-            name,
+            name: self.program.intern(name),
             params,
             body,
             line,
         })
     }
 
-    fn expression(&mut self, min_prec: u8) -> Result<Expr, String> {
+    fn expression(&mut self, min_prec: u8) -> Result<ExprId, String> {
         let mut left = self.nud()?;
         while self.precedence(false)? >= min_prec {
             left = self.led(left)?;
@@ -93,42 +135,44 @@ impl Parser {
         Ok(left)
     }
 
-    fn nud(&mut self) -> Result<Expr, String> {
-        match self.advance() {
-            Token::Identifier(s) => Ok(Expr::Identifier(s)),
-            Token::Number(n) => Ok(Expr::Number(n)),
-            Token::String(s) => Ok(Expr::String(s)),
+    fn nud(&mut self) -> Result<ExprId, String> {
+        let expr = match self.advance() {
+            Token::Identifier(s) => Expr::Identifier(self.program.intern(s)),
+            Token::Number(n) => Expr::Number(n),
+            Token::String(s) => Expr::String(self.program.intern(s)),
             Token::LeftParen => {
                 let expr = self.expression(1)?;
                 self.expect(Token::RightParen)?;
-                Ok(expr)
+                return Ok(expr);
             }
             Token::Minus => {
                 let right = self.expression(5)?;
-                Ok(Expr::Unary {
+                Expr::Unary {
                     op: UnaryOp::Neg,
-                    right: Box::new(right),
-                })
+                    right,
+                }
             }
             Token::Not => {
                 let right = self.expression(5)?;
-                Ok(Expr::Unary {
+                Expr::Unary {
                     op: UnaryOp::Not,
-                    right: Box::new(right),
-                })
+                    right,
+                }
             }
             Token::LeftBracket => {
-                let mut elements = Vec::new();
+                let base = self.pending.len();
 
                 // Handle empty array
                 if matches!(self.current(), Token::RightBracket) {
                     self.advance();
-                    return Ok(Expr::Array { elements });
+                    let elements = self.program.push_list(&[]);
+                    return Ok(self.program.push(Expr::Array { elements }));
                 }
 
                 // Parse array elements [expr, expr, ...]
                 loop {
-                    elements.push(self.expression(1)?);
+                    let element = self.expression(1)?;
+                    self.pending.push(element);
 
                     match self.current() {
                         Token::Comma => {
@@ -149,20 +193,57 @@ impl Parser {
                 }
 
                 self.expect(Token::RightBracket)?;
-                Ok(Expr::Array { elements })
+                let elements = self.take_pending(base);
+                Expr::Array { elements }
             }
-            Token::True => Ok(Expr::Boolean(true)),
-            Token::False => Ok(Expr::Boolean(false)),
-            t => Err(format!(
-                "Unexpected token in nud: {:?} at line {}",
-                t,
-                self.current_line()
-            )),
-        }
+            Token::LeftBrace => {
+                let fields = self.record()?;
+                Expr::Record { fields }
+            }
+            Token::Async => {
+                let call = self.expression(5)?;
+                if !matches!(self.program.expr(call), Expr::Call { .. }) {
+                    return Err(format!(
+                        "Expected a function call after 'async' at line {}",
+                        self.current_line()
+                    ));
+                }
+                Expr::Async { call }
+            }
+            Token::Await => {
+                let right = self.expression(5)?;
+                Expr::Await { right }
+            }
+            Token::True => Expr::Boolean(true),
+            Token::False => Expr::Boolean(false),
+            Token::If => {
+                let cond = self.expression(1)?;
+                let then = self.block()?;
+                self.expect(Token::Else)?;
+                // `else if` chains without another pair of braces.
+                let otherwise = match self.current() {
+                    Token::If => self.nud()?,
+                    _ => self.block()?,
+                };
+                Expr::If {
+                    cond,
+                    then,
+                    otherwise,
+                }
+            }
+            t => {
+                return Err(format!(
+                    "Unexpected token in nud: {:?} at line {}",
+                    t,
+                    self.current_line()
+                ));
+            }
+        };
+        Ok(self.program.push(expr))
     }
 
-    fn led(&mut self, left: Expr) -> Result<Expr, String> {
-        match self.current() {
+    fn led(&mut self, left: ExprId) -> Result<ExprId, String> {
+        let expr = match self.current() {
             Token::Plus
             | Token::Minus
             | Token::Multiply
@@ -176,48 +257,121 @@ impl Parser {
                 let op = self.binary_op()?;
                 self.advance();
                 let right = self.expression(self.precedence(true)? + 1)?;
-                Ok(Expr::Binary {
-                    left: Box::new(left),
-                    op,
-                    right: Box::new(right),
-                })
+                Expr::Binary { left, op, right }
             }
             Token::LeftParen => {
                 self.advance();
-                let mut args = Vec::new();
+                let base = self.pending.len();
                 while !matches!(self.current(), Token::RightParen) {
-                    args.push(self.expression(1)?);
+                    let arg = self.expression(1)?;
+                    self.pending.push(arg);
                     if matches!(self.current(), Token::Comma) {
                         self.advance();
                     }
                 }
                 self.expect(Token::RightParen)?;
-                Ok(Expr::Call {
-                    func: Box::new(left),
-                    args,
-                })
+                let args = self.take_pending(base);
+                Expr::Call { func: left, args }
             }
             Token::Pipeline => {
                 self.advance();
                 let right = self.expression(self.precedence(true)? + 1)?;
-                Ok(Expr::Pipeline {
-                    left: Box::new(left),
-                    right: Box::new(right),
-                })
+                Expr::Pipeline { left, right }
             }
-            Token::Update => {
+            Token::Dot => {
                 self.advance();
+                let name = match self.advance() {
+                    Token::Identifier(name) => name,
+                    _ => {
+                        return Err(format!(
+                            "Expected a field name after '.' at line {}",
+                            self.current_line()
+                        ));
+                    }
+                };
+                let name = self.program.intern(name);
+                Expr::Field { record: left, name }
+            }
+            Token::Update => {
                 // Make update right-associative: parse RHS with same precedence
-                println!("{:?}", self.current());
-                let right = self.expression(self.precedence(true)?)?;
+                let precedence = self.precedence(true)?;
+                self.advance();
+                let right = self.expression(precedence)?;
+                Expr::Update { left, right }
+            }
+            _ => return Ok(left),
+        };
+        Ok(self.program.push(expr))
+    }
+
+    // `{ expression }`, the body of an if or else branch.
+    fn block(&mut self) -> Result<ExprId, String> {
+        self.expect(Token::LeftBrace)?;
+        self.skip_newlines();
+        let expr = self.expression(1)?;
+        self.skip_newlines();
+        self.expect(Token::RightBrace)?;
+        Ok(expr)
+    }
 
-                Ok(Expr::Update {
-                    left: Box::new(left),
-                    right: Box::new(right),
-                })
+    // `{ key = value, ... }` after its opening brace, as the alternating keys
+    // and values of an Expr::Record. The fields may span lines.
+    fn record(&mut self) -> Result<ExprList, String> {
+        let base = self.pending.len();
+        let mut keys = Vec::new();
+        loop {
+            self.skip_newlines();
+            if matches!(self.current(), Token::RightBrace) {
+                break;
+            }
+            let key = match self.advance() {
+                Token::Identifier(key) => key,
+                _ => {
+                    return Err(format!(
+                        "Expected a field name in record literal at line {}",
+                        self.current_line()
+                    ));
+                }
+            };
+            if keys.contains(&key) {
+                return Err(format!(
+                    "Duplicate field '{}' in record literal at line {}",
+                    key,
+                    self.current_line()
+                ));
+            }
+            keys.push(key);
+            let symbol = self.program.intern(key);
+            let key = self.program.push(Expr::String(symbol));
+            self.pending.push(key);
+            self.expect(Token::Assign)?;
+            let value = self.expression(1)?;
+            self.pending.push(value);
+
+            self.skip_newlines();
+            match self.current() {
+                Token::Comma => {
+                    self.advance();
+                }
+                Token::RightBrace => break,
+                _ => {
+                    return Err(format!(
+                        "Expected ',' or '}}' in record literal at line {}",
+                        self.current_line()
+                    ));
+                }
             }
-            _ => Ok(left),
         }
+        self.expect(Token::RightBrace)?;
+        Ok(self.take_pending(base))
+    }
+
+    // Moves the list elements pushed since `base` into the program. Lists nest,
+    // so an inner list is always taken before its enclosing one resumes.
+    fn take_pending(&mut self, base: usize) -> ExprList {
+        let list = self.program.push_list(&self.pending[base..]);
+        self.pending.truncate(base);
+        list
     }
 
     fn binary_op(&self) -> Result<BinaryOp, String> {
@@ -252,13 +406,13 @@ impl Parser {
             Token::Plus | Token::Minus => Ok(3),
             Token::Multiply | Token::Divide => Ok(4),
             Token::LeftParen => Ok(5),
+            Token::Dot => Ok(6),
             Token::String(_)
             | Token::Number(_)
             | Token::Identifier(_)
             | Token::True
             | Token::False
-            | Token::LeftBracket
-            | Token::LeftBrace => {
+            | Token::LeftBracket => {
                 if right_parse {
                     return Ok(1);
                 } else {
@@ -273,23 +427,26 @@ impl Parser {
         }
     }
 
-    fn current(&self) -> &Token {
-        self.tokens.get(self.pos).unwrap_or(&Token::Eof)
-    }
-
-    fn peek(&self) -> Option<&Token> {
-        self.tokens.get(self.pos + 1)
+    fn current(&self) -> &Token<'a> {
+        &self.current
     }
 
-    fn advance(&mut self) -> Token {
-        let token = self.current().clone();
-        if self.pos < self.tokens.len() - 1 {
-            self.pos += 1;
+    // Once the end is reached the parser stays on Eof.
+    fn advance(&mut self) -> Token<'a> {
+        let token = self.current;
+        if !matches!(token, Token::Eof) {
+            if matches!(token, Token::Newline) {
+                self.line += 1;
+            }
+            self.current = self.next;
+            if !matches!(self.next, Token::Eof) {
+                self.next = self.lexer.next_token();
+            }
         }
         token
     }
 
-    fn expect(&mut self, expected: Token) -> Result<(), String> {
+    fn expect(&mut self, expected: Token<'a>) -> Result<(), String> {
         if std::mem::discriminant(self.current()) != std::mem::discriminant(&expected) {
             return Err(format!(
                 "Expected {:?}, found {:?} at line {}",
@@ -314,12 +471,6 @@ impl Parser {
     }
 
     fn current_line(&self) -> usize {
-        let mut line = 1;
-        for t in self.tokens.iter().take(self.pos) {
-            if matches!(t, Token::Newline) {
-                line += 1;
-            }
-        }
-        line
+        self.line
     }
 }
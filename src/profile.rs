@@ -0,0 +1,605 @@
+use crate::heap::GcStats;
+use crate::types::compiler::{Function, Instruction, Symbols, Value};
+use crate::types::traits::Executable;
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::fmt;
+use std::time::{Duration, Instant};
+
+// Opcode profile of a run: how often each opcode executed, and how often each
+// pair and triple of opcodes executed back to back at consecutive addresses.
+// Only straight-line sequences are counted, since those are the ones a
+// superinstruction can replace; a jump, call or return starts a new sequence.
+//
+// The VM fetches every instruction through Executable, so profiling wraps the
+// program instead of adding counters to the dispatch loop.
+pub struct Profiled<P> {
+    inner: P,
+    state: RefCell<State>,
+}
+
+#[derive(Default)]
+struct State {
+    last_pc: Option<usize>,
+    window: [Option<Instruction>; 2], // The two previous instructions, oldest first
+    profile: OpcodeProfile,
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct OpcodeProfile {
+    pub singles: HashMap<&'static str, u64>,
+    pub pairs: HashMap<(&'static str, &'static str), u64>,
+    pub triples: HashMap<(&'static str, &'static str, &'static str), u64>,
+}
+
+impl<P: Executable> Profiled<P> {
+    pub fn new(inner: P) -> Self {
+        Self {
+            inner,
+            state: RefCell::new(State::default()),
+        }
+    }
+
+    pub fn profile(&self) -> OpcodeProfile {
+        self.state.borrow().profile.clone()
+    }
+}
+
+// Instructions run by worker threads are not counted.
+impl<P: Executable> Executable for Profiled<P> {
+    type Shared = P::Shared;
+
+    fn shared(&self) -> &P::Shared {
+        self.inner.shared()
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        let instruction = self.inner.instruction(pc)?;
+        let mut state = self.state.borrow_mut();
+        if state.last_pc.is_none_or(|last| last + 1 != pc) {
+            state.window = [None, None];
+        }
+        state.last_pc = Some(pc);
+
+        let name = mnemonic(&instruction);
+        *state.profile.singles.entry(name).or_default() += 1;
+        if let Some(previous) = state.window[1] {
+            let previous = mnemonic(&previous);
+            *state.profile.pairs.entry((previous, name)).or_default() += 1;
+            if let Some(first) = state.window[0] {
+                let triple = (mnemonic(&first), previous, name);
+                *state.profile.triples.entry(triple).or_default() += 1;
+            }
+        }
+        state.window = [state.window[1], Some(instruction)];
+        Some(instruction)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.inner.constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.inner.function(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.inner.globals()
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        self.inner.line(pc)
+    }
+
+    fn entered(&self, function: usize) {
+        self.inner.entered(function)
+    }
+
+    fn returned(&self) {
+        self.inner.returned()
+    }
+
+    fn spawned(&self, task: usize, function: usize) {
+        self.inner.spawned(task, function)
+    }
+
+    fn switched(&self, task: usize) {
+        self.inner.switched(task)
+    }
+}
+
+// Time profile of a run (`--profile`): how often each opcode ran and how
+// long it took, how often each function was called and the time spent in
+// it with and without its callees, and what the collector did. Every fetch
+// reads the clock and charges the time since the previous fetch to the
+// previous instruction and to the call path it ran on, a node of a call tree
+// that follows the VM's calls through the Executable hooks. Tasks started
+// with `async` hang off the root and keep their own place in the tree, so
+// time spent waiting for timers goes to the AWAIT that waited.
+//
+// Like Profiled, this wraps the program: an unwrapped one never reads the
+// clock, and its hooks are empty.
+pub struct Instrumented<P> {
+    inner: P,
+    state: RefCell<Timeline>,
+}
+
+const ROOT: usize = 0;
+
+struct Timeline {
+    last: Option<(Instant, &'static str, usize)>, // Previous fetch, its opcode and node
+    nodes: Vec<Node>,
+    tasks: Vec<usize>, // The node each task is in
+    task: usize,
+    calls: Vec<u64>, // By function
+    opcodes: HashMap<&'static str, (u64, Duration)>,
+}
+
+struct Node {
+    function: Option<usize>, // None for the root
+    parent: usize,
+    time: Duration, // Not counting the callees
+    children: Vec<(usize, usize)>,
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct TimeProfile {
+    pub total: Duration,
+    pub opcodes: Vec<OpcodeTime>,     // Longest first
+    pub functions: Vec<FunctionTime>, // Longest inclusive time first
+    pub stacks: Vec<(String, Duration)>,
+    pub gc: GcStats,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct OpcodeTime {
+    pub name: &'static str,
+    pub count: u64,
+    pub time: Duration,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct FunctionTime {
+    pub name: String,
+    pub line: usize,
+    pub calls: u64,
+    pub time: Duration,      // Spent in the function itself
+    pub inclusive: Duration, // Including its callees, recursive calls counted once
+}
+
+impl<P: Executable> Instrumented<P> {
+    pub fn new(inner: P) -> Self {
+        let root = Node {
+            function: None,
+            parent: ROOT,
+            time: Duration::ZERO,
+            children: Vec::new(),
+        };
+        Self {
+            inner,
+            state: RefCell::new(Timeline {
+                last: None,
+                nodes: vec![root],
+                tasks: vec![ROOT],
+                task: 0,
+                calls: Vec::new(),
+                opcodes: HashMap::new(),
+            }),
+        }
+    }
+
+    // The profile so far, with functions named by `symbols` and the
+    // collector's work taken from `gc`. The last instruction is charged up
+    // to now.
+    pub fn profile(&self, symbols: &Symbols, gc: GcStats) -> TimeProfile {
+        let mut state = self.state.borrow_mut();
+        state.charge(Instant::now());
+        state.last = None;
+
+        let label = |function: usize| {
+            let name = symbols.functions.get(function).cloned();
+            let line = self
+                .inner
+                .function(function)
+                .map_or(0, |f| self.inner.line(f.offset));
+            (
+                name.unwrap_or_else(|| format!("function {}", function)),
+                line,
+            )
+        };
+        let nodes = &state.nodes;
+
+        // Inclusive times, children always coming after their parent.
+        let mut inclusive: Vec<Duration> = nodes.iter().map(|node| node.time).collect();
+        for index in (1..nodes.len()).rev() {
+            let time = inclusive[index];
+            inclusive[nodes[index].parent] += time;
+        }
+
+        // One walk of the tree for the folded stacks and for each function's
+        // inclusive time, which a node only adds to if no caller above it is
+        // the same function.
+        let mut functions: Vec<FunctionTime> = state
+            .calls
+            .iter()
+            .enumerate()
+            .map(|(function, calls)| {
+                let (name, line) = label(function);
+                FunctionTime {
+                    name,
+                    line,
+                    calls: *calls,
+                    time: Duration::ZERO,
+                    inclusive: Duration::ZERO,
+                }
+            })
+            .collect();
+        let mut active = vec![0usize; functions.len()];
+        let mut stacks = Vec::new();
+        let mut path = String::from("main");
+        let mut pending = vec![(ROOT, false)];
+        while let Some((index, done)) = pending.pop() {
+            let node = &nodes[index];
+            let Some(function) = node.function else {
+                if !done {
+                    stacks.push((path.clone(), node.time));
+                    pending.extend(node.children.iter().rev().map(|(_, child)| (*child, false)));
+                }
+                continue;
+            };
+            if done {
+                active[function] -= 1;
+                let parent = path.rfind(';').unwrap_or(path.len());
+                path.truncate(parent);
+                continue;
+            }
+            let (name, line) = label(function);
+            path.push_str(&format!(";{}:{}", name, line));
+            if node.time > Duration::ZERO {
+                stacks.push((path.clone(), node.time));
+            }
+            functions[function].time += node.time;
+            if active[function] == 0 {
+                functions[function].inclusive += inclusive[index];
+            }
+            active[function] += 1;
+            pending.push((index, true));
+            pending.extend(node.children.iter().rev().map(|(_, child)| (*child, false)));
+        }
+        stacks.retain(|(_, time)| *time > Duration::ZERO);
+        functions.retain(|function| function.calls > 0);
+        functions.sort_by(|a, b| b.inclusive.cmp(&a.inclusive).then(a.name.cmp(&b.name)));
+
+        let mut opcodes: Vec<OpcodeTime> = state
+            .opcodes
+            .iter()
+            .map(|(name, (count, time))| OpcodeTime {
+                name,
+                count: *count,
+                time: *time,
+            })
+            .collect();
+        opcodes.sort_by(|a, b| b.time.cmp(&a.time).then(a.name.cmp(b.name)));
+
+        TimeProfile {
+            total: inclusive[ROOT],
+            opcodes,
+            functions,
+            stacks,
+            gc,
+        }
+    }
+}
+
+impl Timeline {
+    fn charge(&mut self, now: Instant) {
+        if let Some((then, opcode, node)) = self.last {
+            let elapsed = now - then;
+            self.opcodes.entry(opcode).or_default().1 += elapsed;
+            self.nodes[node].time += elapsed;
+        }
+    }
+
+    // The node for a call of `function` from `parent`.
+    fn child(&mut self, parent: usize, function: usize) -> usize {
+        if self.calls.len() <= function {
+            self.calls.resize(function + 1, 0);
+        }
+        self.calls[function] += 1;
+        let existing = self.nodes[parent]
+            .children
+            .iter()
+            .find(|(callee, _)| *callee == function);
+        if let Some((_, node)) = existing {
+            return *node;
+        }
+        let node = self.nodes.len();
+        self.nodes.push(Node {
+            function: Some(function),
+            parent,
+            time: Duration::ZERO,
+            children: Vec::new(),
+        });
+        self.nodes[parent].children.push((function, node));
+        node
+    }
+}
+
+// Worker threads run the program underneath, so their instructions and
+// calls are not recorded; their time is part of the MAP or FILTER.
+impl<P: Executable> Executable for Instrumented<P> {
+    type Shared = P::Shared;
+
+    fn shared(&self) -> &P::Shared {
+        self.inner.shared()
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        let instruction = self.inner.instruction(pc)?;
+        let now = Instant::now();
+        let mut state = self.state.borrow_mut();
+        state.charge(now);
+        let name = mnemonic(&instruction);
+        state.opcodes.entry(name).or_default().0 += 1;
+        let node = state.tasks[state.task];
+        state.last = Some((now, name, node));
+        Some(instruction)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.inner.constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.inner.function(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.inner.globals()
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        self.inner.line(pc)
+    }
+
+    fn entered(&self, function: usize) {
+        let mut state = self.state.borrow_mut();
+        let (task, parent) = (state.task, state.tasks[state.task]);
+        state.tasks[task] = state.child(parent, function);
+    }
+
+    fn returned(&self) {
+        let mut state = self.state.borrow_mut();
+        let task = state.task;
+        state.tasks[task] = state.nodes[state.tasks[task]].parent;
+    }
+
+    fn spawned(&self, task: usize, function: usize) {
+        let mut state = self.state.borrow_mut();
+        if state.tasks.len() <= task {
+            state.tasks.resize(task + 1, ROOT);
+        }
+        state.tasks[task] = state.child(ROOT, function);
+    }
+
+    fn switched(&self, task: usize) {
+        self.state.borrow_mut().task = task;
+    }
+}
+
+impl TimeProfile {
+    // Folded stacks, one `main;f:1;g:5 <nanoseconds>` line per call path,
+    // as flamegraph.pl and inferno read them.
+    pub fn folded(&self) -> String {
+        self.stacks
+            .iter()
+            .map(|(stack, time)| format!("{} {}\n", stack, time.as_nanos()))
+            .collect()
+    }
+
+    // The whole profile as JSON, every time in nanoseconds.
+    pub fn json(&self) -> String {
+        let opcodes: Vec<String> = self
+            .opcodes
+            .iter()
+            .map(|opcode| {
+                format!(
+                    "{{\"name\": \"{}\", \"count\": {}, \"time_ns\": {}}}",
+                    opcode.name,
+                    opcode.count,
+                    opcode.time.as_nanos()
+                )
+            })
+            .collect();
+        let functions: Vec<String> = self
+            .functions
+            .iter()
+            .map(|function| {
+                format!(
+                    "{{\"name\": \"{}\", \"line\": {}, \"calls\": {}, \"self_ns\": {}, \"inclusive_ns\": {}}}",
+                    escape(&function.name),
+                    function.line,
+                    function.calls,
+                    function.time.as_nanos(),
+                    function.inclusive.as_nanos()
+                )
+            })
+            .collect();
+        let stacks: Vec<String> = self
+            .stacks
+            .iter()
+            .map(|(stack, time)| {
+                format!(
+                    "{{\"stack\": \"{}\", \"time_ns\": {}}}",
+                    escape(stack),
+                    time.as_nanos()
+                )
+            })
+            .collect();
+        let gc = format!(
+            "{{\"minor\": {}, \"major\": {}, \"pause_ns\": {}, \"freed\": {}, \"reclaimed\": {}}}",
+            self.gc.minor,
+            self.gc.major,
+            self.gc.pause.as_nanos(),
+            self.gc.freed,
+            self.gc.reclaimed
+        );
+        let list = |items: Vec<String>| format!("[\n    {}\n  ]", items.join(",\n    "));
+        format!(
+            "{{\n  \"total_ns\": {},\n  \"opcodes\": {},\n  \"functions\": {},\n  \"gc\": {},\n  \"stacks\": {}\n}}\n",
+            self.total.as_nanos(),
+            list(opcodes),
+            list(functions),
+            gc,
+            list(stacks)
+        )
+    }
+}
+
+fn escape(text: &str) -> String {
+    text.replace('\\', "\\\\").replace('"', "\\\"")
+}
+
+// The instruction's name as the disassembler prints it, without operands.
+pub fn mnemonic(instruction: &Instruction) -> &'static str {
+    match instruction {
+        Instruction::StoreVar(..) => "STORE_VAR",
+        Instruction::LoadVar(..) => "LOAD_VAR",
+        Instruction::Call(_) => "CALL",
+        Instruction::TailCall(_) => "TAIL_CALL",
+        Instruction::CallGlobal(_) => "CALL_GLOBAL",
+        Instruction::Pipeline(_) => "PIPELINE",
+        Instruction::Map(_) => "MAP",
+        Instruction::Filter(_) => "FILTER",
+        Instruction::Async(_) => "ASYNC",
+        Instruction::Await => "AWAIT",
+        Instruction::Return => "RETURN",
+        Instruction::LoadConst(_) => "LOAD_CONST",
+        Instruction::LoadVarAdd(..) => "LOAD_VAR_ADD",
+        Instruction::StoreVarKeep(..) => "STORE_VAR_KEEP",
+        Instruction::Add => "ADD",
+        Instruction::Sub => "SUB",
+        Instruction::Div => "DIV",
+        Instruction::Mul => "MUL",
+        Instruction::Equal => "EQUAL",
+        Instruction::Less => "LESS",
+        Instruction::Greater => "GREATER",
+        Instruction::Not => "NOT",
+        Instruction::CreateArray(_) => "CREATE_ARRAY",
+        Instruction::ConcatArray => "CONCAT_ARRAY",
+        Instruction::Negate => "NEGATE",
+        Instruction::AddConst(_) => "ADD_CONST",
+        Instruction::SubConst(_) => "SUB_CONST",
+        Instruction::MulConst(_) => "MUL_CONST",
+        Instruction::DivConst(_) => "DIV_CONST",
+        Instruction::Jump(_) => "JUMP",
+        Instruction::JumpIfFalse(_) => "JUMP_IF_FALSE",
+        Instruction::JumpIfTrue(_) => "JUMP_IF_TRUE",
+        Instruction::EqualJumpIfFalse(_) => "EQUAL_JUMP_IF_FALSE",
+        Instruction::LessJumpIfFalse(_) => "LESS_JUMP_IF_FALSE",
+        Instruction::GreaterJumpIfFalse(_) => "GREATER_JUMP_IF_FALSE",
+        Instruction::Pop => "POP",
+        Instruction::Dup => "DUP",
+        Instruction::Halt => "HALT",
+        Instruction::CreateRecord(..) => "CREATE_RECORD",
+        Instruction::GetField(_) => "GET_FIELD",
+    }
+}
+
+impl OpcodeProfile {
+    pub fn merge(&mut self, other: &OpcodeProfile) {
+        for (key, count) in &other.singles {
+            *self.singles.entry(key).or_default() += count;
+        }
+        for (key, count) in &other.pairs {
+            *self.pairs.entry(*key).or_default() += count;
+        }
+        for (key, count) in &other.triples {
+            *self.triples.entry(*key).or_default() += count;
+        }
+    }
+}
+
+// Most frequent entries of each table, highest count first.
+impl fmt::Display for OpcodeProfile {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        const TOP: usize = 15;
+        let total: u64 = self.singles.values().sum();
+        let share = |count: u64| 100.0 * count as f64 / total.max(1) as f64;
+
+        writeln!(f, "=== OPCODE PROFILE ({} instructions) ===", total)?;
+        writeln!(f, "\nOpcodes:")?;
+        for (name, count) in top(&self.singles, TOP) {
+            writeln!(f, "  {:>12} {:>5.1}%  {}", count, share(count), name)?;
+        }
+        writeln!(f, "\nPairs:")?;
+        for ((a, b), count) in top(&self.pairs, TOP) {
+            writeln!(f, "  {:>12} {:>5.1}%  {} {}", count, share(count), a, b)?;
+        }
+        writeln!(f, "\nTriples:")?;
+        for ((a, b, c), count) in top(&self.triples, TOP) {
+            writeln!(
+                f,
+                "  {:>12} {:>5.1}%  {} {} {}",
+                count,
+                share(count),
+                a,
+                b,
+                c
+            )?;
+        }
+        Ok(())
+    }
+}
+
+// The longest running opcodes and functions and the collector's totals.
+impl fmt::Display for TimeProfile {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        const TOP: usize = 15;
+        let ms = |time: Duration| time.as_secs_f64() * 1e3;
+        let share =
+            |time: Duration| 100.0 * time.as_secs_f64() / self.total.as_secs_f64().max(1e-9);
+
+        writeln!(f, "=== TIME PROFILE ({:.3} ms) ===", ms(self.total))?;
+        writeln!(f, "\nOpcodes:")?;
+        for opcode in self.opcodes.iter().take(TOP) {
+            writeln!(
+                f,
+                "  {:>12} {:>10.3} ms {:>5.1}%  {}",
+                opcode.count,
+                ms(opcode.time),
+                share(opcode.time),
+                opcode.name
+            )?;
+        }
+        writeln!(f, "\nFunctions (calls, inclusive, self):")?;
+        for function in self.functions.iter().take(TOP) {
+            writeln!(
+                f,
+                "  {:>12} {:>10.3} ms {:>5.1}% {:>10.3} ms  {} (line {})",
+                function.calls,
+                ms(function.inclusive),
+                share(function.inclusive),
+                ms(function.time),
+                function.name,
+                function.line
+            )?;
+        }
+        writeln!(
+            f,
+            "\nGC: {} minor, {} full collections, {:.3} ms paused, {} objects ({} bytes) freed",
+            self.gc.minor,
+            self.gc.major,
+            ms(self.gc.pause),
+            self.gc.freed,
+            self.gc.reclaimed
+        )
+    }
+}
+
+fn top<K: Copy + Ord>(table: &HashMap<K, u64>, limit: usize) -> Vec<(K, u64)> {
+    let mut entries: Vec<(K, u64)> = table.iter().map(|(k, v)| (*k, *v)).collect();
+    entries.sort_by(|(ka, a), (kb, b)| b.cmp(a).then_with(|| ka.cmp(kb)));
+    entries.truncate(limit);
+    entries
+}
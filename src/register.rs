@@ -0,0 +1,1043 @@
+use crate::compiler::{ConstantPool, FusedPipeline, fused_pipeline, is_map};
+use crate::dense;
+use crate::heap::Heap;
+use crate::interpreter::{add, values_equal};
+use crate::natives::{self, Returned};
+use crate::optimizer;
+use crate::types::ast::*;
+use crate::types::compiler::{HeapObject, Value};
+use crate::types::constants::{INVALID_HEAP_POINTER_ERROR, MAX_REGISTERS};
+use crate::types::traits::IntoResult;
+use std::collections::HashMap;
+use std::fmt;
+
+// Register-machine backend, an alternative to the stack VM in interpreter.rs.
+// The AST is lowered to three-address instructions that name their operands
+// directly: `n - 1` with n a parameter is one SUB reading the parameter's
+// register and a constant, where the stack VM executes LOAD_VAR, LOAD_CONST
+// and SUB. Programs compute the same values on both engines; the lowering
+// mirrors the stack compiler's scoping, call and operator semantics.
+//
+// Each call gets a window of registers in one contiguous Vec: the function's
+// locals first (parameters, then its lets in order), then temporaries, which
+// are allocated and released in stack order while an expression is lowered.
+// The top-level window holds the globals. Arguments are evaluated into the
+// caller's topmost temporaries, and the callee's window starts at the first
+// of them, so parameters are never copied; this is the same overlap the stack
+// VM gets from leaving arguments on the stack.
+
+// An instruction operand: a register in the current window, or an entry of
+// the constant table.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Operand {
+    Register(u16),
+    Constant(u16),
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum RegisterInstruction {
+    Move { dst: u16, src: Operand },
+    LoadOuter { dst: u16, depth: u16, index: u16 }, // Local `index` of the frame at `depth`
+    Add { dst: u16, a: Operand, b: Operand },
+    Sub { dst: u16, a: Operand, b: Operand },
+    Mul { dst: u16, a: Operand, b: Operand },
+    Div { dst: u16, a: Operand, b: Operand },
+    Equal { dst: u16, a: Operand, b: Operand },
+    Less { dst: u16, a: Operand, b: Operand },
+    Greater { dst: u16, a: Operand, b: Operand },
+    Negate { dst: u16, src: Operand },
+    Not { dst: u16, src: Operand },
+    CreateArray { dst: u16, start: u16, count: u16 }, // Elements in start..start + count
+    ConcatArray { dst: u16, a: Operand, b: Operand },
+    Call { dst: u16, function: u16, args: u16 }, // Arguments in args..args + arity
+    TailCall { function: u16, args: u16 },       // Call that replaces the current window
+    CallGlobal { dst: u16, native: u16, args: u16 }, // Built-in from natives.rs
+    Pipeline { dst: u16, stages: u16, args: u16 }, // Fused; one CALL_GLOBAL per stage follows
+    Return { src: Operand },
+    Jump { target: u32 },
+    JumpIfFalse { cond: Operand, target: u32 },
+    Halt,
+}
+
+// Parameters occupy the first `arity` of a function's `registers`.
+#[derive(Debug, Clone, PartialEq)]
+pub struct RegisterFunction {
+    pub arity: usize,
+    pub offset: usize,
+    pub registers: usize,
+    pub depth: usize,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct RegisterProgram {
+    pub constants: Vec<Value>,
+    pub functions: Vec<RegisterFunction>,
+    pub globals: usize,
+    pub registers: usize, // Size of the top-level window, globals included
+    pub instructions: Vec<RegisterInstruction>,
+    pub instruction_lines: Vec<usize>,
+}
+
+// With `optimize` set, expressions built only from literals are folded to a
+// constant operand, as the stack compiler does under `-O`.
+pub fn lower(program: &Program, optimize: bool) -> Result<RegisterProgram, String> {
+    let mut lowering = Lowering {
+        program,
+        optimize,
+        constants: ConstantPool::default(),
+        functions: HashMap::new(),
+        function_table: Vec::new(),
+        scopes: vec![Scope::new(count_lets(&program.statements))],
+        instructions: Vec::new(),
+        instruction_lines: Vec::new(),
+        line: 1,
+        next_function: 0,
+    };
+    lowering.collect_functions(&program.statements, 0);
+    for stmt in &program.statements {
+        lowering.statement(stmt, false)?;
+    }
+    lowering.emit(RegisterInstruction::Halt);
+    if lowering.constants.values().len() > MAX_REGISTERS + 1 {
+        return Err(format!("More than {} constants", MAX_REGISTERS + 1));
+    }
+
+    let main = &lowering.scopes[0];
+    Ok(RegisterProgram {
+        globals: main.next_local as usize,
+        registers: main.registers as usize,
+        constants: lowering.constants.values().to_vec(),
+        functions: lowering.function_table,
+        instructions: lowering.instructions,
+        instruction_lines: lowering.instruction_lines,
+    })
+}
+
+// Registers of the function being lowered at one lexical depth. Every let in
+// a body declares a new local, so a window's locals are known up front and
+// temporaries start right after them.
+struct Scope {
+    variables: HashMap<Symbol, u16>,
+    next_local: u16,
+    temps: u16,     // Next free temporary
+    registers: u16, // Window size needed so far
+}
+
+impl Scope {
+    fn new(locals: usize) -> Self {
+        let locals = locals as u16;
+        Self {
+            variables: HashMap::new(),
+            next_local: 0,
+            temps: locals,
+            registers: locals,
+        }
+    }
+}
+
+fn count_lets(statements: &[Stmt]) -> usize {
+    statements
+        .iter()
+        .filter(|stmt| matches!(stmt, Stmt::Let { .. }))
+        .count()
+}
+
+struct Lowering<'p, 'a> {
+    program: &'p Program<'a>,
+    optimize: bool,
+    constants: ConstantPool,
+    functions: HashMap<Symbol, usize>,
+    function_table: Vec<RegisterFunction>,
+    scopes: Vec<Scope>, // One per lexical depth, innermost last
+    instructions: Vec<RegisterInstruction>,
+    instruction_lines: Vec<usize>,
+    line: usize,
+    next_function: usize,
+}
+
+impl<'p, 'a> Lowering<'p, 'a> {
+    // Functions are registered before any code is lowered, in the same order
+    // as the stack compiler's collect pass, so calls may precede definitions.
+    fn collect_functions(&mut self, statements: &[Stmt], depth: usize) {
+        for stmt in statements {
+            if let Stmt::Func {
+                name, params, body, ..
+            } = stmt
+            {
+                self.functions.insert(*name, self.function_table.len());
+                self.function_table.push(RegisterFunction {
+                    arity: params.len(),
+                    offset: 0,
+                    registers: 0,
+                    depth: depth + 1,
+                });
+                self.collect_functions(body, depth + 1);
+            }
+        }
+    }
+
+    fn statement(&mut self, stmt: &Stmt, last: bool) -> Result<(), String> {
+        match stmt {
+            Stmt::Let { name, value, line } => {
+                self.line = *line;
+                // The value is computed straight into the new local's register;
+                // the name only becomes visible once it has been declared.
+                let register = self.scope().next_local;
+                self.expr_into(*value, register)?;
+                if self.scope().variables.contains_key(name) {
+                    return Err(format!(
+                        "Variable '{}' is already defined in the current scope",
+                        self.program.name(*name)
+                    ));
+                }
+                let scope = self.scope_mut();
+                scope.variables.insert(*name, register);
+                scope.next_local += 1;
+                if last {
+                    let zero = self.constants.number(0.0);
+                    self.emit(RegisterInstruction::Return {
+                        src: Operand::Constant(zero as u16),
+                    });
+                }
+            }
+            Stmt::Func {
+                name,
+                params,
+                body,
+                line,
+            } => self.function(*name, params, body, *line)?,
+            Stmt::Import { .. } => {
+                return Err("import is only supported on the stack VM".to_string());
+            }
+            Stmt::Expr(expr, line) => {
+                self.line = *line;
+                if last && self.scopes.len() > 1 {
+                    return self.tail(*expr);
+                }
+                let mark = self.scope().temps;
+                self.operand(*expr)?;
+                self.scope_mut().temps = mark;
+            }
+        }
+        Ok(())
+    }
+
+    fn function(
+        &mut self,
+        name: Symbol,
+        params: &[Symbol],
+        body: &[Stmt],
+        line: usize,
+    ) -> Result<(), String> {
+        self.line = line;
+        let jump_over_function = self.instructions.len();
+        self.emit(RegisterInstruction::Jump { target: 0 });
+
+        let function_index = self.next_function;
+        self.next_function += 1;
+
+        let mut scope = Scope::new(params.len() + count_lets(body));
+        for param in params {
+            if scope.variables.contains_key(param) {
+                return Err(format!(
+                    "Duplicate parameter '{}' in function '{}'",
+                    self.program.name(*param),
+                    self.program.name(name)
+                ));
+            }
+            scope.variables.insert(*param, scope.next_local);
+            scope.next_local += 1;
+        }
+        self.scopes.push(scope);
+
+        let offset = self.instructions.len();
+        for (i, stmt) in body.iter().enumerate() {
+            self.statement(stmt, i == body.len() - 1)?;
+        }
+        // A body that is empty or ends in a nested definition returns 0.
+        if !matches!(body.last(), Some(Stmt::Let { .. } | Stmt::Expr(..))) {
+            self.line = line;
+            let zero = self.constants.number(0.0);
+            self.emit(RegisterInstruction::Return {
+                src: Operand::Constant(zero as u16),
+            });
+        }
+
+        let scope = self.scopes.pop().expect("function scope");
+        let function = &mut self.function_table[function_index];
+        function.offset = offset;
+        function.registers = scope.registers as usize;
+        function.depth = self.scopes.len();
+
+        let after_function = self.instructions.len() as u32;
+        self.instructions[jump_over_function] = RegisterInstruction::Jump {
+            target: after_function,
+        };
+        Ok(())
+    }
+
+    // Where the value of `expr` can be read: a constant, a local's own
+    // register, or a temporary holding it. A temporary stays allocated until
+    // the caller releases it.
+    fn operand(&mut self, expr: ExprId) -> Result<Operand, String> {
+        if let Some(constant) = self.constant(expr) {
+            return Ok(constant);
+        }
+        if let Expr::Identifier(name) = *self.program.expr(expr) {
+            if let Some(register) = self.scope().variables.get(&name) {
+                return Ok(Operand::Register(*register));
+            }
+        }
+        let temp = self.temp()?;
+        self.expr_into(expr, temp)?;
+        Ok(Operand::Register(temp))
+    }
+
+    fn expr_into(&mut self, expr: ExprId, dst: u16) -> Result<(), String> {
+        if let Some(src) = self.constant(expr) {
+            self.emit(RegisterInstruction::Move { dst, src });
+            return Ok(());
+        }
+        let mark = self.scope().temps;
+        match *self.program.expr(expr) {
+            Expr::Identifier(name) => self.variable_into(name, dst)?,
+            Expr::Binary { left, op, right } => {
+                // A left operand that needs computing is computed into dst,
+                // so ADD can extend a string it has just built in place.
+                let a = match self.constant(left) {
+                    Some(constant) => constant,
+                    None if matches!(self.program.expr(left), Expr::Identifier(_)) => {
+                        self.operand(left)?
+                    }
+                    None => {
+                        self.expr_into(left, dst)?;
+                        Operand::Register(dst)
+                    }
+                };
+                let b = self.operand(right)?;
+                // Same lowering of != <= >= as the stack compiler.
+                self.emit(match op {
+                    BinaryOp::Add => RegisterInstruction::Add { dst, a, b },
+                    BinaryOp::Sub => RegisterInstruction::Sub { dst, a, b },
+                    BinaryOp::Mul => RegisterInstruction::Mul { dst, a, b },
+                    BinaryOp::Div => RegisterInstruction::Div { dst, a, b },
+                    BinaryOp::Eq | BinaryOp::Ne => RegisterInstruction::Equal { dst, a, b },
+                    BinaryOp::Lt | BinaryOp::Ge => RegisterInstruction::Less { dst, a, b },
+                    BinaryOp::Gt | BinaryOp::Le => RegisterInstruction::Greater { dst, a, b },
+                });
+            }
+            Expr::Unary { op, right } => {
+                let src = self.operand(right)?;
+                self.emit(match op {
+                    UnaryOp::Neg => RegisterInstruction::Negate { dst, src },
+                    UnaryOp::Not => RegisterInstruction::Not { dst, src },
+                });
+            }
+            Expr::Call { func, args } => {
+                let args = self.program.list(args);
+                self.call(func, None, args, dst, false)?;
+            }
+            Expr::Pipeline { left, right } => match self.fused_pipeline(expr) {
+                Some(fused) => self.pipeline(fused, dst)?,
+                None => match *self.program.expr(right) {
+                    Expr::Call { func, args } => {
+                        let args = self.program.list(args);
+                        self.call(func, Some(left), args, dst, false)?;
+                    }
+                    Expr::Identifier(_) => {
+                        self.call(right, Some(left), &[], dst, false)?;
+                    }
+                    _ => {
+                        self.operand(left)?;
+                        self.expr_into(right, dst)?;
+                    }
+                },
+            },
+            Expr::Update { left, right } => {
+                let a = self.operand(left)?;
+                let b = self.operand(right)?;
+                self.emit(RegisterInstruction::ConcatArray { dst, a, b });
+            }
+            Expr::Array { elements } => {
+                let elements = self.program.list(elements);
+                let start = self.scope().temps;
+                self.consecutive(elements.iter().copied())?;
+                self.emit(RegisterInstruction::CreateArray {
+                    dst,
+                    start,
+                    count: elements.len() as u16,
+                });
+            }
+            Expr::If {
+                cond,
+                then,
+                otherwise,
+            } => {
+                let jump_to_else = self.branch(cond)?;
+                self.expr_into(then, dst)?;
+                let jump_to_end = self.instructions.len();
+                self.emit(RegisterInstruction::Jump { target: 0 });
+                self.patch(jump_to_else);
+                self.expr_into(otherwise, dst)?;
+                self.patch(jump_to_end);
+            }
+            Expr::Async { .. } | Expr::Await { .. } => {
+                return Err("async and await are only supported on the stack VM".to_string());
+            }
+            Expr::Record { .. } | Expr::Field { .. } => {
+                return Err("records are only supported on the stack VM".to_string());
+            }
+            Expr::Number(_) | Expr::String(_) | Expr::Boolean(_) => {
+                unreachable!("literals are constants")
+            }
+        }
+        self.scope_mut().temps = mark;
+        Ok(())
+    }
+
+    // Returns the value of `expr` from the current function. A call here is
+    // lowered to TAIL_CALL, and each branch of an if returns on its own.
+    fn tail(&mut self, expr: ExprId) -> Result<(), String> {
+        let mark = self.scope().temps;
+        match *self.program.expr(expr) {
+            Expr::Call { func, args } => {
+                let args = self.program.list(args);
+                let dst = self.temp()?;
+                if !self.call(func, None, args, dst, true)? {
+                    self.emit(RegisterInstruction::Return {
+                        src: Operand::Register(dst),
+                    });
+                }
+            }
+            Expr::If {
+                cond,
+                then,
+                otherwise,
+            } => {
+                let jump_to_else = self.branch(cond)?;
+                self.tail(then)?;
+                self.patch(jump_to_else);
+                self.tail(otherwise)?;
+            }
+            _ => {
+                let src = self.operand(expr)?;
+                self.emit(RegisterInstruction::Return { src });
+            }
+        }
+        self.scope_mut().temps = mark;
+        Ok(())
+    }
+
+    // Emits the test of an if, returning the jump to patch with the start of
+    // its else branch.
+    fn branch(&mut self, cond: ExprId) -> Result<usize, String> {
+        let mark = self.scope().temps;
+        let cond = self.operand(cond)?;
+        self.scope_mut().temps = mark;
+        self.emit(RegisterInstruction::JumpIfFalse { cond, target: 0 });
+        Ok(self.instructions.len() - 1)
+    }
+
+    // Points the jump at `at` to the next instruction.
+    fn patch(&mut self, at: usize) {
+        let next = self.instructions.len() as u32;
+        match &mut self.instructions[at] {
+            RegisterInstruction::Jump { target }
+            | RegisterInstruction::JumpIfFalse { target, .. } => *target = next,
+            _ => unreachable!("only jumps are patched"),
+        }
+    }
+
+    // Calls `func` with `first` (the left side of a pipeline) followed by
+    // `args`, placing the result in dst. With `tail` set the call replaces
+    // the current window instead, when the callee is not nested deeper than
+    // the caller (and so cannot read its registers); returns whether it did.
+    fn call(
+        &mut self,
+        func: ExprId,
+        first: Option<ExprId>,
+        args: &[ExprId],
+        dst: u16,
+        tail: bool,
+    ) -> Result<bool, String> {
+        if let Expr::Identifier(name) = *self.program.expr(func)
+            && is_map(self.program.name(name))
+            && !self.functions.contains_key(&name)
+        {
+            return Err(format!(
+                "{} is only supported on the stack VM",
+                self.program.name(name)
+            ));
+        }
+        let start = self.scope().temps;
+        self.consecutive(first.into_iter().chain(args.iter().copied()))?;
+        let arg_count = args.len() + first.is_some() as usize;
+
+        let Expr::Identifier(name) = *self.program.expr(func) else {
+            return Err("Only named functions can be called".to_string());
+        };
+        if !self.functions.contains_key(&name) {
+            if let Some(native) = natives::lookup(self.program.name(name)) {
+                let arity = natives::NATIVES[native as usize].arity;
+                if arity != arg_count {
+                    return Err(format!(
+                        "Function '{}' expects {} arguments, got {}",
+                        self.program.name(name),
+                        arity,
+                        arg_count
+                    ));
+                }
+                self.emit(RegisterInstruction::CallGlobal {
+                    dst,
+                    native: native as u16,
+                    args: start,
+                });
+                return Ok(false);
+            }
+        }
+        let function = *self
+            .functions
+            .get(&name)
+            .ok_or_else(|| format!("Undefined function '{}'", self.program.name(name)))?;
+        let RegisterFunction { arity, depth, .. } = self.function_table[function];
+        if arity != arg_count {
+            return Err(format!(
+                "Function '{}' expects {} arguments, got {}",
+                self.program.name(name),
+                arity,
+                arg_count
+            ));
+        }
+        if tail && depth < self.scopes.len() {
+            self.emit(RegisterInstruction::TailCall {
+                function: function as u16,
+                args: start,
+            });
+            return Ok(true);
+        }
+        self.emit(RegisterInstruction::Call {
+            dst,
+            function: function as u16,
+            args: start,
+        });
+        Ok(false)
+    }
+
+    fn fused_pipeline(&self, expr: ExprId) -> Option<FusedPipeline> {
+        match self.optimize {
+            true => fused_pipeline(self.program, expr, &self.functions),
+            false => None,
+        }
+    }
+
+    // The source and every stage's argument go in consecutive registers, as
+    // for a call; the stages follow the PIPELINE as CALL_GLOBALs that share
+    // its registers.
+    fn pipeline(&mut self, fused: FusedPipeline, dst: u16) -> Result<(), String> {
+        let args = self.scope().temps;
+        let values = fused.stages.iter().filter_map(|(_, arg)| *arg);
+        self.consecutive(std::iter::once(fused.source).chain(values))?;
+        self.emit(RegisterInstruction::Pipeline {
+            dst,
+            stages: fused.stages.len() as u16,
+            args,
+        });
+        for (native, _) in fused.stages {
+            self.emit(RegisterInstruction::CallGlobal {
+                dst,
+                native: native as u16,
+                args,
+            });
+        }
+        Ok(())
+    }
+
+    // Evaluates each expression into the next free temporary, leaving the
+    // values in consecutive registers.
+    fn consecutive(&mut self, exprs: impl Iterator<Item = ExprId>) -> Result<(), String> {
+        for expr in exprs {
+            let register = self.temp()?;
+            self.expr_into(expr, register)?;
+            self.scope_mut().temps = register + 1;
+        }
+        Ok(())
+    }
+
+    fn variable_into(&mut self, name: Symbol, dst: u16) -> Result<(), String> {
+        let found = self
+            .scopes
+            .iter()
+            .enumerate()
+            .rev()
+            .find_map(|(depth, scope)| scope.variables.get(&name).map(|index| (depth, *index)));
+        match found {
+            Some((depth, index)) if depth == self.scopes.len() - 1 => {
+                self.emit(RegisterInstruction::Move {
+                    dst,
+                    src: Operand::Register(index),
+                });
+            }
+            Some((depth, index)) => self.emit(RegisterInstruction::LoadOuter {
+                dst,
+                depth: depth as u16,
+                index,
+            }),
+            None => {
+                return Err(format!("Undefined variable '{}'", self.program.name(name)));
+            }
+        }
+        Ok(())
+    }
+
+    fn constant(&mut self, expr: ExprId) -> Option<Operand> {
+        let index = match *self.program.expr(expr) {
+            Expr::Number(_) | Expr::String(_) | Expr::Boolean(_) => {
+                self.constants.literal(self.program, expr)
+            }
+            Expr::Unary { .. } | Expr::Binary { .. } if self.optimize => {
+                let folded = optimizer::fold(self.program, expr)?;
+                self.constants.folded(folded)
+            }
+            _ => return None,
+        };
+        Some(Operand::Constant(index as u16))
+    }
+
+    fn temp(&mut self) -> Result<u16, String> {
+        let scope = self.scope_mut();
+        let register = scope.temps;
+        if register as usize >= MAX_REGISTERS {
+            return Err(format!(
+                "Function needs more than {} registers",
+                MAX_REGISTERS
+            ));
+        }
+        scope.temps += 1;
+        scope.registers = scope.registers.max(scope.temps);
+        Ok(register)
+    }
+
+    fn scope(&self) -> &Scope {
+        self.scopes.last().expect("top-level scope")
+    }
+
+    fn scope_mut(&mut self) -> &mut Scope {
+        self.scopes.last_mut().expect("top-level scope")
+    }
+
+    fn emit(&mut self, instruction: RegisterInstruction) {
+        self.instructions.push(instruction);
+        self.instruction_lines.push(self.line);
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+struct RegisterFrame {
+    return_address: usize,
+    base: usize,
+    top: usize,
+    dst: usize, // Absolute register receiving the result
+    depth: usize,
+    saved_display: usize,
+}
+
+// Executes a RegisterProgram. `display[d]` is the base of the innermost
+// active window at lexical depth d, as in the stack VM. The lowering only
+// names registers inside the current window, so operands index `registers`
+// directly.
+//
+// `registers` only ever grows: returning from a call moves `top` back instead
+// of truncating, so a call sequence reuses the same registers without
+// resizing on every call. Registers past `top` are dead and every one is
+// written before it is read again, so the collector only scans up to `top`.
+pub struct RegisterMachine {
+    registers: Vec<Value>,
+    frames: Vec<RegisterFrame>,
+    display: Vec<usize>,
+    base: usize,
+    top: usize, // End of the current window
+    pc: usize,
+    program: RegisterProgram,
+    heap: Heap,
+}
+
+impl RegisterMachine {
+    pub fn new(program: RegisterProgram) -> Self {
+        Self {
+            registers: vec![Value::Number(0.0); program.registers],
+            frames: Vec::new(),
+            display: vec![0],
+            base: 0,
+            top: program.registers,
+            pc: 0,
+            program,
+            heap: Heap::new(),
+        }
+    }
+
+    pub fn globals(&self) -> &[Value] {
+        &self.registers[..self.program.globals.min(self.registers.len())]
+    }
+
+    pub fn heap(&self) -> &Heap {
+        &self.heap
+    }
+
+    pub fn program(&self) -> &RegisterProgram {
+        &self.program
+    }
+
+    pub fn run(&mut self) -> Result<(), String> {
+        self.dispatch().map_err(|e| {
+            // Leave pc on the instruction that failed.
+            self.pc -= 1;
+            let line = self.program.instruction_lines.get(self.pc).unwrap_or(&0);
+            format!("[line {}] {}", line, e)
+        })
+    }
+
+    fn dispatch(&mut self) -> Result<(), String> {
+        while let Some(&instruction) = self.program.instructions.get(self.pc) {
+            self.pc += 1;
+
+            match instruction {
+                RegisterInstruction::Move { dst, src } => {
+                    let value = self.read(src);
+                    self.write(dst, value);
+                }
+
+                RegisterInstruction::LoadOuter { dst, depth, index } => {
+                    let base = *self
+                        .display
+                        .get(depth as usize)
+                        .ok_or("Invalid scope depth")?;
+                    let value = self.registers[base + index as usize].clone();
+                    self.write(dst, value);
+                }
+
+                RegisterInstruction::Add { dst, a, b } => {
+                    let b = self.read(b);
+                    // A result overwriting its own left operand takes it, which
+                    // leaves a freshly built string uniquely owned.
+                    let a = match a {
+                        Operand::Register(a) if a == dst => std::mem::replace(
+                            &mut self.registers[self.base + a as usize],
+                            Value::Number(0.0),
+                        ),
+                        a => self.read(a),
+                    };
+                    let result = add(a, b, &self.heap)?;
+                    self.write(dst, result);
+                }
+
+                RegisterInstruction::Sub { dst, a, b } => {
+                    let (a, b) = (self.number(a)?, self.number(b)?);
+                    self.write(dst, Value::Number(a - b));
+                }
+
+                RegisterInstruction::Mul { dst, a, b } => {
+                    let (a, b) = (self.number(a)?, self.number(b)?);
+                    self.write(dst, Value::Number(a * b));
+                }
+
+                RegisterInstruction::Div { dst, a, b } => {
+                    let (a, b) = (self.number(a)?, self.number(b)?);
+                    if b == 0.0 {
+                        return Err("Division by zero".to_string());
+                    }
+                    self.write(dst, Value::Number(a / b));
+                }
+
+                RegisterInstruction::Equal { dst, a, b } => {
+                    let result = values_equal(self.value(a), self.value(b));
+                    self.write(dst, Value::Boolean(result));
+                }
+
+                RegisterInstruction::Less { dst, a, b } => {
+                    let (a, b) = (self.number(a)?, self.number(b)?);
+                    self.write(dst, Value::Boolean(a < b));
+                }
+
+                RegisterInstruction::Greater { dst, a, b } => {
+                    let (a, b) = (self.number(a)?, self.number(b)?);
+                    self.write(dst, Value::Boolean(a > b));
+                }
+
+                RegisterInstruction::Negate { dst, src } => {
+                    let value = self.number(src)?;
+                    self.write(dst, Value::Number(0.0 - value));
+                }
+
+                RegisterInstruction::Not { dst, src } => match *self.value(src) {
+                    Value::Boolean(b) => self.write(dst, Value::Boolean(!b)),
+                    ref value => {
+                        return Err(format!(
+                            "Logical NOT operation requires boolean operand, got {}",
+                            value.type_name_stack()
+                        ));
+                    }
+                },
+
+                RegisterInstruction::CreateArray { dst, start, count } => {
+                    let start = self.base + start as usize;
+                    let array = dense::array(&self.registers[start..start + count as usize]);
+                    let index = self.allocate(array);
+                    self.write(dst, Value::HeapPointer(index));
+                }
+
+                RegisterInstruction::ConcatArray { dst, a, b } => {
+                    let (left_idx, right_idx) = match (self.value(a), self.value(b)) {
+                        (Value::HeapPointer(li), Value::HeapPointer(ri)) => (*li, *ri),
+                        (l, r) => {
+                            return Err(format!(
+                                "Update expects arrays, got {} and {}",
+                                l.type_name(&self.heap),
+                                r.type_name(&self.heap)
+                            ));
+                        }
+                    };
+                    let left_arr = self.heap.get(left_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+                    let right_arr = self.heap.get(right_idx).ok_or(INVALID_HEAP_POINTER_ERROR)?;
+                    let joined = dense::concat(left_arr, right_arr)
+                        .ok_or_else(|| "Update expects arrays".to_string())?;
+                    let index = self.allocate(joined);
+                    self.write(dst, Value::HeapPointer(index));
+                }
+
+                RegisterInstruction::Call {
+                    dst,
+                    function,
+                    args,
+                } => {
+                    let caller = RegisterFrame {
+                        return_address: self.pc,
+                        base: self.base,
+                        top: self.top,
+                        dst: self.base + dst as usize,
+                        depth: 0,
+                        saved_display: 0,
+                    };
+                    self.enter(function, self.base + args as usize, caller)?;
+                }
+
+                RegisterInstruction::TailCall { function, args } => {
+                    // The arguments move down over the finished window, and
+                    // the callee returns straight to our caller.
+                    let frame = self.frames.pop().ok_or("No return address available")?;
+                    self.display[frame.depth] = frame.saved_display;
+                    let arity = self
+                        .program
+                        .functions
+                        .get(function as usize)
+                        .ok_or("Invalid function index")?
+                        .arity;
+                    let args = self.base + args as usize;
+                    for i in 0..arity {
+                        let value =
+                            std::mem::replace(&mut self.registers[args + i], Value::Number(0.0));
+                        self.registers[self.base + i] = value;
+                    }
+                    self.enter(function, self.base, frame)?;
+                }
+
+                RegisterInstruction::CallGlobal { dst, native, args } => {
+                    let native = natives::native(native as u32)?;
+                    let args = self.base + args as usize;
+                    let args = &self.registers[args..args + native.arity];
+                    let value = match (native.run)(args, &self.heap)? {
+                        Returned::Value(value) => value,
+                        Returned::Object(object) => Value::HeapPointer(self.allocate(object)),
+                    };
+                    self.write(dst, value);
+                }
+
+                RegisterInstruction::Pipeline { dst, stages, args } => {
+                    let stages = self.program.instructions[self.pc..self.pc + stages as usize]
+                        .iter()
+                        .map(|stage| match stage {
+                            RegisterInstruction::CallGlobal { native, .. } => Ok(*native as u32),
+                            _ => Err("Malformed pipeline".to_string()),
+                        })
+                        .collect::<Result<Vec<u32>, String>>()?;
+                    let args = self.base + args as usize;
+                    let args = &self.registers[args..args + natives::pipeline_arity(&stages)];
+                    let value = match natives::pipeline(&stages, args, &self.heap)? {
+                        Returned::Value(value) => value,
+                        Returned::Object(object) => Value::HeapPointer(self.allocate(object)),
+                    };
+                    self.write(dst, value);
+                    self.pc += stages.len();
+                }
+
+                RegisterInstruction::Return { src } => {
+                    let value = self.read(src);
+                    let frame = self.frames.pop().ok_or("No return address available")?;
+                    self.registers[frame.dst] = value;
+                    self.display[frame.depth] = frame.saved_display;
+                    self.base = frame.base;
+                    self.top = frame.top;
+                    self.pc = frame.return_address;
+                }
+
+                RegisterInstruction::Jump { target } => {
+                    self.pc = target as usize;
+                }
+
+                RegisterInstruction::JumpIfFalse { cond, target } => {
+                    let cond: bool = self.read(cond).into_result()?;
+                    if !cond {
+                        self.pc = target as usize;
+                    }
+                }
+
+                RegisterInstruction::Halt => {
+                    self.pc -= 1;
+                    return Ok(());
+                }
+            }
+        }
+        Ok(())
+    }
+
+    // Starts a call whose window begins at `base`. `frame` records where it
+    // returns to; its display fields are filled in here.
+    fn enter(
+        &mut self,
+        function: u16,
+        base: usize,
+        mut frame: RegisterFrame,
+    ) -> Result<(), String> {
+        let function = self
+            .program
+            .functions
+            .get(function as usize)
+            .ok_or("Invalid function index")?;
+        let (offset, registers, depth) = (function.offset, function.registers, function.depth);
+
+        if self.registers.len() < base + registers {
+            self.registers.resize(base + registers, Value::Number(0.0));
+        }
+        if depth >= self.display.len() {
+            self.display.resize(depth + 1, 0);
+        }
+        frame.depth = depth;
+        frame.saved_display = self.display[depth];
+        self.frames.push(frame);
+        self.display[depth] = base;
+        self.base = base;
+        self.top = base + registers;
+        self.pc = offset;
+        Ok(())
+    }
+
+    fn value(&self, operand: Operand) -> &Value {
+        match operand {
+            Operand::Register(register) => &self.registers[self.base + register as usize],
+            Operand::Constant(index) => &self.program.constants[index as usize],
+        }
+    }
+
+    fn read(&self, operand: Operand) -> Value {
+        self.value(operand).clone()
+    }
+
+    fn number(&self, operand: Operand) -> Result<f64, String> {
+        match self.value(operand) {
+            Value::Number(n) => Ok(*n),
+            value => IntoResult::<f64>::into_result(value.clone()),
+        }
+    }
+
+    fn write(&mut self, register: u16, value: Value) {
+        self.registers[self.base + register as usize] = value;
+    }
+
+    fn allocate(&mut self, object: HeapObject) -> usize {
+        self.heap.allocate(object, &mut self.registers[..self.top])
+    }
+
+    pub fn debug_registers(&self) {
+        println!("=== REGISTER VM DEBUG ===");
+        println!("PC: {}", self.pc);
+        println!("Registers: {:?}", &self.registers[..self.top]);
+        println!("Frames: {}", self.frames.len() + 1);
+        println!("Heap: {:?}", self.heap);
+        println!("=========================");
+    }
+}
+
+impl fmt::Display for Operand {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Operand::Register(register) => write!(f, "r{}", register),
+            Operand::Constant(index) => write!(f, "k{}", index),
+        }
+    }
+}
+
+impl fmt::Display for RegisterInstruction {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use RegisterInstruction::*;
+        match self {
+            Move { dst, src } => write!(f, "MOVE r{} {}", dst, src),
+            LoadOuter { dst, depth, index } => write!(f, "LOAD_OUTER r{} {} {}", dst, depth, index),
+            Add { dst, a, b } => write!(f, "ADD r{} {} {}", dst, a, b),
+            Sub { dst, a, b } => write!(f, "SUB r{} {} {}", dst, a, b),
+            Mul { dst, a, b } => write!(f, "MUL r{} {} {}", dst, a, b),
+            Div { dst, a, b } => write!(f, "DIV r{} {} {}", dst, a, b),
+            Equal { dst, a, b } => write!(f, "EQUAL r{} {} {}", dst, a, b),
+            Less { dst, a, b } => write!(f, "LESS r{} {} {}", dst, a, b),
+            Greater { dst, a, b } => write!(f, "GREATER r{} {} {}", dst, a, b),
+            Negate { dst, src } => write!(f, "NEGATE r{} {}", dst, src),
+            Not { dst, src } => write!(f, "NOT r{} {}", dst, src),
+            CreateArray { dst, start, count } => {
+                write!(f, "CREATE_ARRAY r{} r{} {}", dst, start, count)
+            }
+            ConcatArray { dst, a, b } => write!(f, "CONCAT_ARRAY r{} {} {}", dst, a, b),
+            Call {
+                dst,
+                function,
+                args,
+            } => write!(f, "CALL r{} {} r{}", dst, function, args),
+            TailCall { function, args } => write!(f, "TAIL_CALL {} r{}", function, args),
+            CallGlobal { dst, native, args } => {
+                write!(f, "CALL_GLOBAL r{} {} r{}", dst, native, args)
+            }
+            Pipeline { dst, stages, args } => write!(f, "PIPELINE r{} {} r{}", dst, stages, args),
+            Return { src } => write!(f, "RETURN {}", src),
+            Jump { target } => write!(f, "JUMP {}", target),
+            JumpIfFalse { cond, target } => write!(f, "JUMP_IF_FALSE {} {}", cond, target),
+            Halt => write!(f, "HALT"),
+        }
+    }
+}
+
+impl fmt::Display for RegisterProgram {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        writeln!(f, "=== REGISTER CODE ===")?;
+
+        writeln!(f, "\nConstants:")?;
+        for (i, constant) in self.constants.iter().enumerate() {
+            writeln!(f, "  [{}] {}", i, constant)?;
+        }
+
+        writeln!(f, "\nFunctions:")?;
+        for (i, function) in self.functions.iter().enumerate() {
+            writeln!(
+                f,
+                "  [{}] fn/{} @{} registers={} depth={}",
+                i, function.arity, function.offset, function.registers, function.depth
+            )?;
+        }
+
+        writeln!(
+            f,
+            "\nInstructions (globals={}, registers={}):",
+            self.globals, self.registers
+        )?;
+        for (i, instruction) in self.instructions.iter().enumerate() {
+            writeln!(f, "  {:04}: {}", i, instruction)?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,175 @@
+use crate::interpreter::CallFrame;
+use crate::types::compiler::Value;
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, VecDeque};
+use std::thread;
+use std::time::Instant;
+
+// Cooperative tasks for `async` and `await`. Each task is a VM context of
+// its own: value stack, call frames, display and pc. One task runs at a time
+// in the VM; at an AWAIT that cannot complete yet the VM parks it here and
+// swaps in the context of the next runnable task (see interpreter.rs), so a
+// waiting task holds no thread and no host stack. The main program is task 0.
+//
+// Timers stand in for the reactor: a task waiting on `sleep` is parked on a
+// deadline heap instead of blocking, and only when no task can run does the
+// scheduler put the thread to sleep, until the earliest deadline. However
+// many tasks are waiting, they all wait at the same time.
+pub struct Scheduler {
+    tasks: Vec<Task>,
+    current: usize,
+    ready: VecDeque<usize>,
+    timers: BinaryHeap<Reverse<(Instant, usize)>>,
+}
+
+pub const MAIN: usize = 0;
+
+// The context of the running task lives in the VM; this one is empty then.
+struct Task {
+    context: Context,
+    state: State,
+    result: Option<Value>,
+    waiters: Vec<usize>, // Tasks whose AWAIT is waiting for this one to finish
+}
+
+#[derive(Debug, Default)]
+pub struct Context {
+    pub stack: Vec<Value>,
+    pub frames: Vec<CallFrame>,
+    pub display: Vec<usize>,
+    pub pc: usize,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum State {
+    Ready,
+    Running,
+    Waiting,
+    Done,
+}
+
+// What a task that cannot go on yet is waiting for.
+pub enum Wait {
+    Task(usize),
+    Until(Instant),
+}
+
+impl Scheduler {
+    pub fn new() -> Self {
+        Self {
+            tasks: vec![Task::new(Context::default(), State::Running)],
+            current: MAIN,
+            ready: VecDeque::new(),
+            timers: BinaryHeap::new(),
+        }
+    }
+
+    pub fn current(&self) -> usize {
+        self.current
+    }
+
+    // Queues a new task, which first runs once the current one waits.
+    pub fn spawn(&mut self, context: Context) -> usize {
+        let task = self.tasks.len();
+        self.tasks.push(Task::new(context, State::Ready));
+        self.ready.push_back(task);
+        task
+    }
+
+    // The result of `task`, or None while it is still running.
+    pub fn result(&self, task: usize) -> Result<Option<&Value>, String> {
+        let task = self.tasks.get(task).ok_or("Invalid task")?;
+        Ok(task.result.as_ref())
+    }
+
+    // Makes the current task wait until `wait` is over.
+    pub fn park(&mut self, wait: Wait) {
+        self.tasks[self.current].state = State::Waiting;
+        match wait {
+            Wait::Task(task) => self.tasks[task].waiters.push(self.current),
+            Wait::Until(deadline) => self.timers.push(Reverse((deadline, self.current))),
+        }
+    }
+
+    // Marks the current task done, waking every task waiting for it. The
+    // main program has no result.
+    pub fn finish(&mut self, result: Option<Value>) {
+        let task = &mut self.tasks[self.current];
+        task.state = State::Done;
+        task.result = result;
+        for waiter in std::mem::take(&mut task.waiters) {
+            self.wake(waiter);
+        }
+    }
+
+    // The task to run next: the longest ready one, else the first whose
+    // timer expires, sleeping until it does. None once every task is done.
+    pub fn next(&mut self) -> Result<Option<usize>, String> {
+        if let Some(task) = self.ready.pop_front() {
+            return Ok(Some(task));
+        }
+        if let Some(Reverse((deadline, task))) = self.timers.pop() {
+            let now = Instant::now();
+            if deadline > now {
+                thread::sleep(deadline - now);
+            }
+            return Ok(Some(task));
+        }
+        match self.tasks.iter().all(|task| task.state == State::Done) {
+            true => Ok(None),
+            false => Err("Every task is waiting for another task".to_string()),
+        }
+    }
+
+    // Stores the context of the task that ran last and hands out `next`'s.
+    // The first `globals` slots of every stack are the program's globals,
+    // copied over from the last task so that each task sees the others'
+    // stores. A finished task's context is dropped, except for the main
+    // program's, which is where the globals are read once the run is over.
+    pub fn switch(&mut self, next: usize, context: Context, globals: usize) -> Context {
+        self.tasks[next].state = State::Running;
+        if next == self.current {
+            return context;
+        }
+        let mut incoming = std::mem::take(&mut self.tasks[next].context);
+        incoming.stack[..globals].clone_from_slice(&context.stack[..globals]);
+        let last = &mut self.tasks[self.current];
+        if last.state != State::Done || self.current == MAIN {
+            last.context = context;
+        }
+        self.current = next;
+        incoming
+    }
+
+    // Every value a parked task can still reach, for the collector.
+    pub fn roots(&mut self) -> impl Iterator<Item = &mut [Value]> {
+        self.tasks.iter_mut().flat_map(|task| {
+            std::iter::once(&mut task.context.stack[..])
+                .chain(task.result.as_mut().map(std::slice::from_mut))
+        })
+    }
+
+    fn wake(&mut self, task: usize) {
+        if self.tasks[task].state == State::Waiting {
+            self.tasks[task].state = State::Ready;
+            self.ready.push_back(task);
+        }
+    }
+}
+
+impl Default for Scheduler {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Task {
+    fn new(context: Context, state: State) -> Self {
+        Self {
+            context,
+            state,
+            result: None,
+            waiters: Vec::new(),
+        }
+    }
+}
@@ -0,0 +1,190 @@
+use crate::types::compiler::HeapObject;
+use std::collections::HashMap;
+use std::sync::Arc;
+
+// Hidden classes for records. A record does not own its keys: it points to
+// the Shape listing them in order and keeps only its field values, in a flat
+// slice in the same order. Shapes are hash-consed per VM in `Shapes`, so
+// records built with the same keys in the same order share one Shape, and
+// comparing two shapes is a pointer comparison.
+//
+// That is what the VM's inline caches rely on: it keeps an InlineCache for
+// every instruction that creates, reads or updates records, holding the
+// shape it saw there last. A record literal looks its shape up once, a field
+// read on a record of the cached shape goes straight to the cached slot, and
+// an update of two cached shapes reuses the merged layout, all without
+// hashing a key.
+#[derive(Debug, PartialEq)]
+pub struct Shape {
+    keys: Vec<Arc<String>>,
+    slots: HashMap<String, usize>,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Record {
+    pub shape: Arc<Shape>,
+    pub fields: Arc<[HeapObject]>,
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct Shapes {
+    table: HashMap<Vec<Arc<String>>, Arc<Shape>>,
+}
+
+#[derive(Debug, Clone, Default)]
+pub enum InlineCache {
+    #[default]
+    Empty,
+    Shape(Arc<Shape>),        // CREATE_RECORD: the literal's shape
+    Field(Arc<Shape>, usize), // GET_FIELD: the last shape read and the field's slot in it
+    Update(Box<Merge>),       // CONCAT_ARRAY of two records
+}
+
+// Records of shape `left` updated with records of shape `right` have shape
+// `result`, with right's fields going to slots `targets`.
+#[derive(Debug, Clone)]
+pub struct Merge {
+    left: Arc<Shape>,
+    right: Arc<Shape>,
+    result: Arc<Shape>,
+    targets: Vec<usize>,
+}
+
+impl Shape {
+    pub fn keys(&self) -> &[Arc<String>] {
+        &self.keys
+    }
+
+    pub fn len(&self) -> usize {
+        self.keys.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.keys.is_empty()
+    }
+
+    pub fn slot(&self, key: &str) -> Option<usize> {
+        self.slots.get(key).copied()
+    }
+}
+
+impl Shapes {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    // The one shape with exactly these keys, in this order. Keys must be
+    // distinct, which the parser checks for record literals.
+    pub fn intern(&mut self, keys: Vec<Arc<String>>) -> Arc<Shape> {
+        if let Some(shape) = self.table.get(&keys) {
+            return shape.clone();
+        }
+        let slots = keys
+            .iter()
+            .enumerate()
+            .map(|(slot, key)| (key.to_string(), slot))
+            .collect();
+        let shape = Arc::new(Shape {
+            keys: keys.clone(),
+            slots,
+        });
+        self.table.insert(keys, shape.clone());
+        shape
+    }
+
+    // The shape of a record literal, interning `keys` only on the literal's
+    // first run.
+    pub fn literal(
+        &mut self,
+        cache: &mut InlineCache,
+        keys: impl FnOnce() -> Result<Vec<Arc<String>>, String>,
+    ) -> Result<Arc<Shape>, String> {
+        if let InlineCache::Shape(shape) = cache {
+            return Ok(shape.clone());
+        }
+        let shape = self.intern(keys()?);
+        *cache = InlineCache::Shape(shape.clone());
+        Ok(shape)
+    }
+
+    // `left` with the fields of `right` replacing or following its own, as
+    // `left <- right` builds it: the keys of left in order, then the keys
+    // only right has.
+    pub fn update(&mut self, left: &Record, right: &Record, cache: &mut InlineCache) -> Record {
+        let merge = match std::mem::take(cache) {
+            InlineCache::Update(merge)
+                if Arc::ptr_eq(&merge.left, &left.shape)
+                    && Arc::ptr_eq(&merge.right, &right.shape) =>
+            {
+                merge
+            }
+            _ => Box::new(self.merge(&left.shape, &right.shape)),
+        };
+        let mut fields = left.fields.to_vec();
+        fields.resize(merge.result.len(), HeapObject::Null);
+        for (target, field) in merge.targets.iter().zip(right.fields.iter()) {
+            fields[*target] = field.clone();
+        }
+        let record = Record {
+            shape: merge.result.clone(),
+            fields: fields.into(),
+        };
+        *cache = InlineCache::Update(merge);
+        record
+    }
+
+    fn merge(&mut self, left: &Arc<Shape>, right: &Arc<Shape>) -> Merge {
+        let mut keys = left.keys.clone();
+        let targets = right
+            .keys
+            .iter()
+            .map(|key| {
+                left.slot(key).unwrap_or_else(|| {
+                    keys.push(key.clone());
+                    keys.len() - 1
+                })
+            })
+            .collect();
+        // Updating only fields left already has keeps its shape.
+        let result = match keys.len() == left.len() {
+            true => left.clone(),
+            false => self.intern(keys),
+        };
+        Merge {
+            left: left.clone(),
+            right: right.clone(),
+            result,
+            targets,
+        }
+    }
+}
+
+impl Record {
+    pub fn new(shape: Arc<Shape>, fields: Vec<HeapObject>) -> Self {
+        Self {
+            shape,
+            fields: fields.into(),
+        }
+    }
+
+    // The field `key` names, read through `cache` when it holds this
+    // record's shape; only a miss needs the key.
+    pub fn get(
+        &self,
+        cache: &mut InlineCache,
+        key: impl FnOnce() -> Result<Arc<String>, String>,
+    ) -> Result<&HeapObject, String> {
+        if let InlineCache::Field(shape, slot) = cache
+            && Arc::ptr_eq(shape, &self.shape)
+        {
+            return Ok(&self.fields[*slot]);
+        }
+        let key = key()?;
+        let slot = self
+            .shape
+            .slot(&key)
+            .ok_or_else(|| format!("Record has no field '{}'", key))?;
+        *cache = InlineCache::Field(self.shape.clone(), slot);
+        Ok(&self.fields[slot])
+    }
+}
@@ -1,4 +1,12 @@
-use crate::runtime::compile_and_run;
+use crate::heap::Heap;
+use crate::interpreter::VirtualMachine;
+use crate::register::RegisterMachine;
+use crate::runtime::{
+    Engine, Options, compile_and_run, compile_file, compile_file_with_options, compile_source,
+    lower_file_with_options,
+};
+use crate::types::compiler::{HeapObject, Value};
+use crate::vector::Vector;
 use std::path::Path;
 
 #[derive(Debug)]
@@ -29,6 +37,101 @@ pub fn run_n_file(file_path: &str) -> TestResult {
     }
 }
 
+// Runs a snippet and returns the final value of every global, in declaration
+// order.
+pub fn run_source(source: &str) -> Result<Vec<Value>, String> {
+    let bytecode = compile_source(source.to_string(), false)?;
+    let mut vm = VirtualMachine::new(bytecode);
+    vm.run()?;
+    Ok(vm.globals().to_vec())
+}
+
+// Renders a value with every heap reference followed, so tests can compare
+// nested structures independent of where the collector moved them. Strings
+// are cut short to keep expectations readable.
+pub fn render_value(value: &Value, heap: &Heap) -> String {
+    match value {
+        Value::HeapPointer(idx) => match heap.get(*idx) {
+            Some(object) => render_object(object, heap),
+            None => format!("<dangling {}>", idx),
+        },
+        Value::Number(n) => n.to_string(),
+        Value::String(s) => render_string(s),
+        other => format!("{:?}", other),
+    }
+}
+
+fn render_object(object: &HeapObject, heap: &Heap) -> String {
+    match object {
+        HeapObject::HeapPointer(idx) => render_value(&Value::HeapPointer(*idx), heap),
+        HeapObject::Array(items) => {
+            let items: Vec<String> = items.iter().map(|item| render_object(item, heap)).collect();
+            format!("[{}]", items.join(", "))
+        }
+        HeapObject::Numbers(numbers) => {
+            let items: Vec<String> = numbers.iter().map(f64::to_string).collect();
+            format!("[{}]", items.join(", "))
+        }
+        HeapObject::Booleans(booleans) => {
+            let items: Vec<String> = booleans
+                .iter()
+                .map(|b| format!("{:?}", HeapObject::Boolean(*b)))
+                .collect();
+            format!("[{}]", items.join(", "))
+        }
+        HeapObject::Record(record) => {
+            let fields: Vec<String> = (record.shape.keys().iter())
+                .zip(record.fields.iter())
+                .map(|(key, field)| format!("{} = {}", key, render_object(field, heap)))
+                .collect();
+            format!("{{ {} }}", fields.join(", "))
+        }
+        HeapObject::Number(n) => n.to_string(),
+        HeapObject::String(s) => render_string(s),
+        other => format!("{:?}", other),
+    }
+}
+
+fn render_string(s: &str) -> String {
+    format!("{:?}", s.chars().take(12).collect::<String>())
+}
+
+// Runs a file and renders its globals, or returns the error it stopped with.
+pub fn run_rendered(file_path: &str, options: Options) -> Result<Vec<String>, String> {
+    if options.engine == Engine::Register {
+        let program = lower_file_with_options(file_path, options)?;
+        let mut vm = RegisterMachine::new(program);
+        vm.run()?;
+        return Ok(vm
+            .globals()
+            .iter()
+            .map(|value| render_value(value, vm.heap()))
+            .collect());
+    }
+    let bytecode = compile_file_with_options(file_path, options)?;
+    let mut vm = VirtualMachine::new(bytecode);
+    if options.engine == Engine::Jit {
+        crate::runtime::enable_jit(&mut vm)?;
+    }
+    vm.run()?;
+    Ok(vm
+        .globals()
+        .iter()
+        .map(|value| render_value(value, vm.heap()))
+        .collect())
+}
+
+pub fn round_trip_bytecode(file_path: &str) -> Result<(), String> {
+    let bytecode = compile_file(file_path, false)?;
+    let bytes = crate::bytecode::encode(&bytecode)?;
+    let decoded = crate::bytecode::decode(&bytes)?;
+
+    if decoded != bytecode {
+        return Err(format!("Decoded bytecode differs for '{}'", file_path));
+    }
+    Ok(())
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -89,6 +192,175 @@ mod tests {
         assert!(result.passed, "Heap stress test failed: {}", result.output);
     }
 
+    #[test]
+    fn test_gc_preserves_nested_arrays() {
+        let bytecode = compile_file("tests/heap_stress.n", false).unwrap();
+        let mut vm = VirtualMachine::new(bytecode);
+        vm.run().unwrap();
+
+        // Globals in declaration order: str1, str2, str3, result, product,
+        // str4, inner, nested, combined, churned
+        let globals = vm.globals();
+        let heap = vm.heap();
+        let render = |index: usize| render_value(&globals[index], heap);
+        assert_eq!(render(6), "[1, 2, 3]");
+        assert_eq!(
+            render(7),
+            r#"[[1, 2, 3], [4, [5, 6]], ["This is a ve", "Fourth strin"]]"#
+        );
+        assert_eq!(
+            render(8),
+            r#"[[1, 2, 3], [4, [5, 6]], ["This is a ve", "Fourth strin"], [7, 8]]"#
+        );
+        assert_eq!(render(0), r#""This is a ve""#);
+        assert_eq!(globals[9], Value::Number(1280.0));
+
+        // The 256 leaves allocated over a thousand arrays; only the live ones
+        // and the garbage since the last collection may remain.
+        assert!(heap.len() < 200, "heap was never collected: {}", heap.len());
+    }
+
+    #[test]
+    fn test_heap_reuses_slots_and_compacts() {
+        let mut heap = Heap::new();
+        let mut roots = Vec::new();
+
+        // Keep every other object alive; each kept array references the
+        // previously kept one, in chains of 50, so whole chains have to
+        // survive.
+        for i in 0..4000 {
+            // Links are read back from the roots, which compaction rewrites.
+            let link = match roots.last() {
+                Some(Value::HeapPointer(idx)) if i % 100 != 0 => HeapObject::HeapPointer(*idx),
+                _ => HeapObject::Null,
+            };
+            let object = HeapObject::Array(vec![HeapObject::Number(i as f64), link].into());
+            let idx = heap.allocate(object, &mut roots);
+            if i % 2 == 0 {
+                roots.push(Value::HeapPointer(idx));
+            }
+        }
+        assert!(heap.len() < 4000, "nursery was never swept");
+
+        // Dropping most roots lets a full collection free the old generation
+        // and compact what is left.
+        roots.drain(..roots.len() - 1);
+        for i in 0..4000 {
+            heap.allocate(
+                HeapObject::Array(vec![HeapObject::Number(i as f64)].into()),
+                &mut roots,
+            );
+        }
+        assert!(heap.len() < 2500, "old generation was never swept");
+
+        let rendered = render_value(&roots[0], &heap);
+        assert!(
+            rendered.starts_with("[3998, [3996, [3994, "),
+            "{}",
+            rendered
+        );
+        assert!(rendered.contains("[3902, [3900, Null]]"), "{}", rendered);
+    }
+
+    #[test]
+    fn test_growing_list_of_references_is_scored_by_what_it_wrote() {
+        // Every version of xs shares all but its tail and one path with the
+        // one before, so it is charged only for those: the nursery does not
+        // fill on every append, and full collections stay rare.
+        let source = "func build(n, xs) {\n    if n == 0 { xs } else { build(n - 1, xs <- [[n]]) }\n}\n\
+            let xs = build(20000, [])\nlet k = len(xs)\n";
+        let mut vm = VirtualMachine::new(compile_source(source.to_string(), false).unwrap());
+        vm.run().unwrap();
+        assert_eq!(vm.globals()[1], Value::Number(20000.0));
+        let stats = vm.heap().stats();
+        assert!(stats.minor < 2000, "{:?}", stats);
+        assert!(stats.major < 50, "{:?}", stats);
+    }
+
+    #[test]
+    fn test_minor_collection_traces_only_new_nodes() {
+        // A version made by appending visits its tail and copied path, not
+        // the nodes it shares with the version it was made from.
+        let xs: Vector<HeapObject> = (0..10_000).map(HeapObject::HeapPointer).collect();
+        let since = crate::vector::clock();
+        let mut next = xs.clone();
+        next.push(HeapObject::HeapPointer(10_000));
+        let count = |since| {
+            let mut visited = 0;
+            next.for_each_reference_since(since, &mut |_| visited += 1);
+            visited
+        };
+        assert_eq!(count(0), 10_001);
+        assert!(count(since) <= 2 * crate::vector::WIDTH, "{}", count(since));
+
+        // Shared nodes are still traced while the version that wrote them
+        // is young: here the parent dies in the nursery it was built in, and
+        // its child keeps the young arrays in those nodes alive.
+        let mut heap = Heap::new();
+        let mut roots = Vec::new();
+        while heap.stats().minor == 0 {
+            heap.allocate(HeapObject::Array(vec![HeapObject::Null].into()), &mut roots);
+        }
+        let mut parent: Vector<HeapObject> = Vector::new();
+        for i in 0..100 {
+            let item = HeapObject::Array(vec![HeapObject::Number(i as f64)].into());
+            let idx = heap.allocate(item, &mut roots);
+            roots.push(Value::HeapPointer(idx));
+            parent.push(HeapObject::HeapPointer(idx));
+        }
+        let parent_idx = heap.allocate(HeapObject::Array(parent.clone()), &mut roots);
+        let mut child = parent;
+        child.push(HeapObject::Null);
+        let child_idx = heap.allocate(HeapObject::Array(child), &mut roots);
+        assert_ne!(parent_idx, child_idx);
+        roots.clear();
+        roots.push(Value::HeapPointer(child_idx));
+        let minor = heap.stats().minor;
+        while heap.stats().minor < minor + 2 {
+            heap.allocate(HeapObject::Array(vec![HeapObject::Null].into()), &mut roots);
+        }
+        let rendered = render_value(&roots[0], &heap);
+        assert!(rendered.starts_with("[[0], [1], [2], "), "{}", rendered);
+        assert!(rendered.ends_with("[98], [99], Null]"), "{}", rendered);
+    }
+
+    #[test]
+    fn test_persistent_vector_versions_are_independent() {
+        // Crosses the tail, one-level and two-level trie boundaries.
+        let mut vector: Vector<HeapObject> = Vector::new();
+        let mut snapshots = Vec::new();
+        for i in 0..40_000 {
+            if [0, 31, 32, 33, 1056, 1057, 32800, 32801].contains(&i) {
+                snapshots.push((i, vector.clone()));
+            }
+            vector.push(HeapObject::Number(i as f64));
+        }
+
+        // Appending to an older version must not disturb the newer ones.
+        let (_, mut branch) = snapshots[4].clone();
+        branch.append(&Vector::from(vec![HeapObject::Null; 100]));
+        assert_eq!(branch.len(), 1156);
+        assert_eq!(branch.get(1055), Some(&HeapObject::Number(1055.0)));
+        assert_eq!(branch.get(1056), Some(&HeapObject::Null));
+
+        for (len, snapshot) in &snapshots {
+            assert_eq!(snapshot.len(), *len);
+            assert!(
+                snapshot
+                    .iter()
+                    .enumerate()
+                    .all(|(i, item)| *item == HeapObject::Number(i as f64))
+            );
+        }
+        assert_eq!(vector.len(), 40_000);
+        assert_eq!(vector.get(39_999), Some(&HeapObject::Number(39_999.0)));
+        assert_eq!(vector.get(40_000), None);
+        for i in (0..40_000).step_by(997) {
+            assert_eq!(vector.get(i), Some(&HeapObject::Number(i as f64)));
+        }
+        assert!(!vector.has_references());
+    }
+
     #[test]
     fn test_edge_cases() {
         let result = run_n_file("tests/edge_cases.n");
@@ -109,6 +381,819 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_tail_calls() {
+        let result = run_n_file("tests/tail_calls.n");
+        assert!(result.passed, "Tail calls test failed: {}", result.output);
+        assert_eq!(
+            run_rendered("tests/tail_calls.n", Options::default()).unwrap(),
+            [
+                "5000050000",
+                "[-1, 0, 1]",
+                "\"big\"",
+                "\"done\"",
+                "Boolean(false)"
+            ]
+        );
+    }
+
+    #[test]
+    fn test_records() {
+        let result = run_n_file("tests/records.n");
+        assert!(result.passed, "Records test failed: {}", result.output);
+        assert_eq!(
+            run_rendered("tests/records.n", Options::default()).unwrap(),
+            [
+                "{ name = \"Alice\", age = 30 }",
+                "{ name = \"Alice\", age = 30, role = \"admin\" }",
+                "{ name = \"Alice\", age = 31 }",
+                "[30, 30, 31, 30]",
+                "\"admin\"",
+                "\"Alice\"",
+                "499500",
+                "{ point = { x = 1, y = 2 }, path = [3, 4] }",
+                "{ point = { x = 5, y = 2 }, path = [3, 4] }",
+                "[1, 5, 2]"
+            ]
+        );
+
+        // Records with the same keys share one shape, whichever
+        // instruction built them.
+        let mut vm = VirtualMachine::new(compile_file("tests/records.n", false).unwrap());
+        vm.run().unwrap();
+        let shape = |global: usize| match vm.globals()[global] {
+            Value::HeapPointer(index) => match vm.heap().get(index) {
+                Some(HeapObject::Record(record)) => record.shape.clone(),
+                other => panic!("Expected a record, got {:?}", other),
+            },
+            ref other => panic!("Expected a record, got {:?}", other),
+        };
+        assert!(std::sync::Arc::ptr_eq(&shape(0), &shape(2)));
+        assert!(!std::sync::Arc::ptr_eq(&shape(0), &shape(1)));
+        assert!(std::sync::Arc::ptr_eq(&shape(7), &shape(8)));
+    }
+
+    #[test]
+    fn test_parallel_map_records() {
+        // Records built on worker threads, holding an array and another
+        // record, are read the same as those built on one thread.
+        let source = "func range(n, xs) {\n    if n == 0 { xs } else { range(n - 1, xs <- [n]) }\n}\n\
+            func mk(x) { { a = [x, x], b = x, n = { c = x } } }\n\
+            func geta(r) { len(r.a) }\n\
+            func getc(r) { r.n.c }\n\
+            let rs = range(5000, []) |> map(mk)\n\
+            let lengths = rs |> map(geta) |> sum\n\
+            let total = rs |> map(getc) |> sum\n\
+            let probe = { a = [], b = 0, n = { c = 0 } }\n";
+        let mut results = Vec::new();
+        for threads in [1, 4] {
+            let mut vm = VirtualMachine::new(compile_source(source.to_string(), false).unwrap());
+            vm.set_threads(threads);
+            vm.run().unwrap();
+            let globals = vm.globals();
+            let record = |value: &Value| match value {
+                Value::HeapPointer(index) => match vm.heap().get(*index) {
+                    Some(HeapObject::Record(record)) => record.clone(),
+                    other => panic!("Expected a record, got {:?}", other),
+                },
+                other => panic!("Expected a record, got {:?}", other),
+            };
+            let first = match &globals[0] {
+                Value::HeapPointer(index) => {
+                    crate::dense::element(vm.heap().get(*index).unwrap(), 0).unwrap()
+                }
+                other => panic!("Expected an array, got {:?}", other),
+            };
+            // Attached records take this VM's shapes.
+            assert!(std::sync::Arc::ptr_eq(
+                &record(&first).shape,
+                &record(&globals[3]).shape
+            ));
+            results.push(
+                globals[1..3]
+                    .iter()
+                    .map(|value| render_value(value, vm.heap()))
+                    .collect::<Vec<_>>(),
+            );
+        }
+        assert_eq!(results[0], ["10000", "12502500"]);
+        assert_eq!(results[1], results[0]);
+    }
+
+    #[test]
+    fn test_hot_functions() {
+        let result = run_n_file("tests/hot_functions.n");
+        assert!(
+            result.passed,
+            "Hot functions test failed: {}",
+            result.output
+        );
+        assert_eq!(
+            run_rendered("tests/hot_functions.n", Options::default()).unwrap(),
+            ["6765", "4", "0", "50000"]
+        );
+    }
+
+    #[test]
+    fn test_natives() {
+        let result = run_n_file("tests/natives.n");
+        assert!(result.passed, "Natives test failed: {}", result.output);
+        assert_eq!(
+            run_rendered("tests/natives.n", Options::default()).unwrap(),
+            [
+                "[3, 1, 2]",
+                "[3, 1, 2, 4]",
+                "[3, 4, 5, 4]",
+                "[3, 2, 4]",
+                "[4, 9]",
+                "5"
+            ]
+        );
+    }
+
+    #[test]
+    fn test_array_kernels() {
+        let result = run_n_file("tests/array_kernels.n");
+        assert!(
+            result.passed,
+            "Array kernels test failed: {}",
+            result.output
+        );
+        let expected = [
+            "5050",
+            "[2, 4, 6]",
+            "[11, 22, 33]",
+            "[0.5, 1, 2]",
+            "[Boolean(false), Boolean(true), Boolean(true), Boolean(true)]",
+            "[5, 3, 8]",
+            "955",
+            "10",
+            "[\"a\", \"c\"]",
+            "[1, 2, Boolean(true)]",
+            "6",
+        ];
+        for engine in [Engine::Stack, Engine::Register] {
+            let options = Options {
+                engine,
+                ..Options::default()
+            };
+            let globals = run_rendered("tests/array_kernels.n", options).unwrap();
+            assert_eq!(globals[1..], expected, "{:?}", engine);
+        }
+    }
+
+    #[test]
+    fn test_pipeline_fusion() {
+        use crate::natives::lookup;
+        use crate::runtime::compile_source_with_options;
+        use crate::types::compiler::Instruction::*;
+
+        let run = |engine, optimize| {
+            let options = Options {
+                engine,
+                optimize,
+                ..Options::default()
+            };
+            run_rendered("tests/pipeline_fusion.n", options).unwrap()
+        };
+        // Fused or not, every stage computes the same thing in the same
+        // order, sums included.
+        let plain = run(Engine::Stack, false);
+        assert_eq!(
+            plain[2..],
+            [
+                "-101.25",
+                "75",
+                "100",
+                "[10, 30, 40]",
+                "9.55",
+                "[Boolean(false), Boolean(false), Boolean(true)]",
+                "10",
+                "754.9999999999999"
+            ]
+        );
+        assert_eq!(run(Engine::Stack, true), plain);
+        assert_eq!(run(Engine::Register, false), plain);
+        assert_eq!(run(Engine::Register, true), plain);
+
+        let options = Options {
+            optimize: true,
+            ..Options::default()
+        };
+        let source = "let a = [1, 2] |> mul(2) |> add(1) |> greater(3) |> count\n";
+        let bytecode = compile_source_with_options(source.to_string(), options).unwrap();
+        let stages =
+            ["mul", "add", "greater", "count"].map(|name| CallGlobal(lookup(name).unwrap()));
+        let pipeline = bytecode
+            .instructions
+            .iter()
+            .position(|instruction| *instruction == Pipeline(4))
+            .expect("fused");
+        assert_eq!(bytecode.instructions[pipeline + 1..pipeline + 5], stages);
+        assert!(
+            !bytecode.instructions[..pipeline]
+                .iter()
+                .any(|i| matches!(i, CallGlobal(_)))
+        );
+        let decoded = crate::bytecode::decode(&crate::bytecode::encode(&bytecode).unwrap());
+        assert_eq!(decoded.unwrap(), bytecode);
+
+        // A failing pipeline reports what the unfused calls would have.
+        for source in [
+            "let a = [1, 2] |> mul(2) |> div([1, 0]) |> sum\n",
+            "let a = [1, 2] |> add([1]) |> greater(1) |> count\n",
+            "let a = [\"a\"] |> mul(2) |> sum\n",
+        ] {
+            let bytecode = compile_source_with_options(source.to_string(), options).unwrap();
+            let fused = VirtualMachine::new(bytecode).run().unwrap_err();
+            assert_eq!(Err(fused), run_source(source));
+        }
+    }
+
+    #[test]
+    fn test_parallel_map() {
+        use crate::runtime::lower_source_with_options;
+
+        let result = run_n_file("tests/parallel_map.n");
+        assert!(result.passed, "Parallel map test failed: {}", result.output);
+
+        let run = |source: &str, threads| {
+            let mut vm = VirtualMachine::new(compile_source(source.to_string(), false)?);
+            vm.set_threads(threads);
+            vm.run()?;
+            Ok::<_, String>(
+                vm.globals()
+                    .iter()
+                    .map(|value| render_value(value, vm.heap()))
+                    .collect::<Vec<_>>(),
+            )
+        };
+        let source = std::fs::read_to_string("tests/parallel_map.n").unwrap();
+        let sequential = run(&source, 1).unwrap();
+        assert_eq!(
+            sequential[1..],
+            [
+                "333383335000",
+                "5000",
+                "5000",
+                "10000",
+                "[[1, 2], [2, 4], [3, 6]]",
+                "[]"
+            ]
+        );
+        for threads in [2, 3, 8] {
+            assert_eq!(run(&source, threads).unwrap(), sequential, "{}", threads);
+        }
+
+        // The error is the one of the earliest failing element, however the
+        // elements were split. The array counts down, so 7000 comes first.
+        let failing = "func range(n, xs) {\n    if n == 0 { xs } else { range(n - 1, xs <- [n]) }\n}\n\
+            func check(x) {\n    if x == 6000 { x + \"a\" } else { if x == 7000 { x + true } else { x } }\n}\n\
+            let a = range(10000, []) |> map(check)\n";
+        for threads in [1, 4] {
+            let error = run(failing, threads).unwrap_err();
+            assert!(error.contains("Cannot add number and boolean"), "{}", error);
+        }
+
+        for (source, error) in [
+            (
+                "func f(x, y) { x }\nlet a = map([1], f)\n",
+                "map expects the name of a top-level function of one argument",
+            ),
+            (
+                "let a = filter([1], 2)\n",
+                "filter expects the name of a top-level function of one argument",
+            ),
+            (
+                "func outer(xs) {\n    func inner(x) { x }\n    map(xs, inner)\n}\nlet a = outer([1])\n",
+                "map expects the name of a top-level function of one argument",
+            ),
+            (
+                "func f(x) { x }\nlet a = map([1])\n",
+                "Function 'map' expects 2 arguments, got 1",
+            ),
+            (
+                "func f(x) { x }\nlet a = map(1, f)\n",
+                "map expects an array, got number",
+            ),
+            (
+                "func f(x) { x }\nlet a = filter([1], f)\n",
+                "filter expects a function returning a boolean, got number",
+            ),
+        ] {
+            let result = run(source, 4).unwrap_err();
+            assert!(result.contains(error), "{}", result);
+        }
+
+        // A program's own map is called like any other function.
+        assert_eq!(
+            run_source("func map(xs, n) { n }\nlet a = map([1], 2)\n"),
+            Ok(vec![Value::Number(2.0)])
+        );
+        let register = lower_source_with_options(source, Options::default()).unwrap_err();
+        assert!(register.contains("map is only supported on the stack VM"));
+    }
+
+    #[test]
+    fn test_async_tasks() {
+        use crate::runtime::lower_source_with_options;
+        use std::time::{Duration, Instant};
+
+        let result = run_n_file("tests/async_tasks.n");
+        assert!(result.passed, "Async tasks test failed: {}", result.output);
+
+        let run = |source: &str| {
+            let mut vm = VirtualMachine::new(compile_source(source.to_string(), false)?);
+            vm.run()?;
+            Ok::<_, String>(
+                vm.globals()
+                    .iter()
+                    .map(|value| render_value(value, vm.heap()))
+                    .collect::<Vec<_>>(),
+            )
+        };
+        let source = std::fs::read_to_string("tests/async_tasks.n").unwrap();
+        let globals = run(&source).unwrap();
+        assert_eq!(globals[2..5], ["70", "3", "500500"]);
+        // hold's array lived on its task's stack through main's collections.
+        assert_eq!(globals[6..], ["0", "10000", "5050", "30"]);
+
+        // A thousand tasks sleeping 50 ms each wait at the same time, not
+        // for the 50 s they would take one after another.
+        let waiting = "func nap(prev, n) {\n    let waited = await sleep(50)\n    (await prev) + 1\n}\n\
+            func zero() { 0 }\n\
+            func start(n, prev) {\n    if n == 0 { prev } else { start(n - 1, async nap(prev, n)) }\n}\n\
+            let done = await start(1000, async zero())\n";
+        let started = Instant::now();
+        assert_eq!(run(waiting).unwrap(), ["1000"]);
+        assert!(started.elapsed() < Duration::from_secs(5));
+
+        for (source, error) in [
+            ("let a = await 1\n", "await expects a future, got number"),
+            (
+                "let a = async len([1])\n",
+                "async expects a call to a top-level function",
+            ),
+            (
+                "func outer() {\n    func inner() { 1 }\n    async inner()\n}\nlet a = outer()\n",
+                "async expects a call to a top-level function",
+            ),
+            (
+                "func f(x) { x }\nlet a = async f()\n",
+                "Function 'f' expects 1 arguments, got 0",
+            ),
+            (
+                "let a = async 1\n",
+                "Expected a function call after 'async' at line 1",
+            ),
+            (
+                "func w(x) { await sleep(1) }\nlet a = map([1], w)\n",
+                "Cannot await inside map or filter",
+            ),
+            (
+                "func t() { 1 }\nfunc w(x) { async t() }\nlet a = map([1], w)\n",
+                "Cannot start a task inside map or filter",
+            ),
+            (
+                "let a = sleep(\"a\")\n",
+                "sleep expects a number, got string",
+            ),
+        ] {
+            let result = run(source).unwrap_err();
+            assert!(result.contains(error), "{}", result);
+        }
+
+        let register = lower_source_with_options(source, Options::default()).unwrap_err();
+        assert!(register.contains("async and await are only supported on the stack VM"));
+    }
+
+    #[test]
+    fn test_pooled_runs() {
+        use crate::embed::{Image, Pool};
+
+        let source = "func double(x) { x * 2 }\nlet xs = [1, 2, 3] |> map(double)\nlet total = sum(xs)\nlet name = \"n\"\n";
+        let image = Image::compile(source.to_string(), Options::default()).unwrap();
+        assert_eq!(image.global("total"), Some(1));
+        assert_eq!(image.global("double"), None);
+
+        let pool = Pool::new(image.clone());
+        let read = |vm: &crate::embed::Instance| {
+            (
+                vm.global("total").cloned(),
+                render_value(vm.global("xs").unwrap(), vm.heap()),
+            )
+        };
+        for _ in 0..3 {
+            assert_eq!(
+                pool.run(read).unwrap(),
+                (Some(Value::Number(12.0)), "[2, 4, 6]".to_string())
+            );
+        }
+        assert_eq!(pool.idle(), 1);
+
+        // Every thread shares the one image and reuses the pool's VMs.
+        std::thread::scope(|scope| {
+            for _ in 0..4 {
+                scope.spawn(|| {
+                    for _ in 0..20 {
+                        assert_eq!(pool.run(read).unwrap().0, Some(Value::Number(12.0)));
+                    }
+                });
+            }
+        });
+        assert!((1..=4).contains(&pool.idle()));
+        assert_eq!(std::sync::Arc::strong_count(&image), 2 + pool.idle());
+
+        // A run that fails mid-call leaves nothing behind for the next one.
+        let failing = Pool::new(
+            Image::compile(
+                "func f(x) { x + true }\nlet a = f(1)\n".to_string(),
+                Options::default(),
+            )
+            .unwrap(),
+        );
+        for _ in 0..2 {
+            let error = failing.run(|_| ()).unwrap_err();
+            assert!(error.contains("Cannot add number and boolean"), "{}", error);
+        }
+        assert_eq!(failing.idle(), 1);
+
+        // Reset puts even a run of several tasks back at the start.
+        let bytecode = compile_file("tests/async_tasks.n", false).unwrap();
+        let mut vm = VirtualMachine::new(bytecode);
+        vm.run().unwrap();
+        let first = vm.globals().to_vec();
+        vm.reset();
+        vm.run().unwrap();
+        assert_eq!(vm.globals(), &first[..]);
+    }
+
+    #[test]
+    fn test_compilation_cache() {
+        use crate::cache;
+        use crate::runtime::compile_and_run_cached;
+
+        let dir = std::env::temp_dir().join(format!("n-cache-test-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        let file = "tests/tail_calls.n";
+        let source = std::fs::read_to_string(file).unwrap();
+        let options = Options::default();
+
+        assert!(cache::load(&dir, &source, options).is_none());
+        compile_and_run_cached(file, &dir, options).unwrap();
+        let image = cache::load(&dir, &source, options).expect("cached");
+        let mut cached = VirtualMachine::new(image);
+        cached.run().unwrap();
+        let mut fresh = VirtualMachine::new(compile_file(file, false).unwrap());
+        fresh.run().unwrap();
+        assert_eq!(cached.globals(), fresh.globals());
+        assert!(compile_and_run_cached(file, &dir, options).is_ok());
+
+        // Other source text or code generation options get entries of their own.
+        let entry = cache::entry(&dir, &source, options);
+        let optimized = Options {
+            optimize: true,
+            ..options
+        };
+        assert_ne!(cache::entry(&dir, &source, optimized), entry);
+        assert_ne!(cache::entry(&dir, &format!("{} ", source), options), entry);
+        assert_eq!(
+            cache::entry(
+                &dir,
+                &source,
+                Options {
+                    debug: true,
+                    ..options
+                }
+            ),
+            entry
+        );
+
+        // A damaged entry is compiled again and replaced.
+        std::fs::write(&entry, b"NB").unwrap();
+        assert!(cache::load(&dir, &source, options).is_none());
+        compile_and_run_cached(file, &dir, options).unwrap();
+        assert!(cache::load(&dir, &source, options).is_some());
+        assert_eq!(std::fs::read_dir(&dir).unwrap().count(), 1);
+
+        let register = Options {
+            engine: Engine::Register,
+            cache: true,
+            ..options
+        };
+        assert!(crate::runtime::compile_and_run_with_options(file, register).is_err());
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_modules() {
+        use crate::modules::Build;
+
+        let result = run_n_file("tests/modules/main.n");
+        assert!(result.passed, "Modules test failed: {}", result.output);
+        for optimize in [false, true] {
+            let options = Options {
+                optimize,
+                ..Options::default()
+            };
+            let mut vm = VirtualMachine::new(
+                compile_file_with_options("tests/modules/main.n", options).unwrap(),
+            );
+            vm.run().unwrap();
+            let globals: Vec<String> = vm
+                .globals()
+                .iter()
+                .map(|value| render_value(value, vm.heap()))
+                .collect();
+            assert_eq!(globals, ["10", "24", "14", "\"Hello, n\"", "\"done\""]);
+        }
+
+        // Only what changed is compiled again.
+        let dir = std::env::temp_dir().join(format!("n-modules-test-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        let write = |name: &str, source: &str| std::fs::write(dir.join(name), source).unwrap();
+        write("main.n", "import \"b\"\nlet x = twice(3)\n");
+        write("b.n", "import \"./c\"\nfunc twice(x) { inc(x) + inc(x) }\n");
+        write("c.n", "func inc(x) { x + 1 }\n");
+        let entry = dir.join("main.n");
+        let entry = entry.to_str().unwrap();
+        let mut build = Build::new(Options::default());
+        let run = |build: &mut Build| {
+            let (bytecode, symbols) = build.build(entry)?;
+            let mut vm = VirtualMachine::new(bytecode);
+            vm.run()?;
+            let x = symbols
+                .globals
+                .get("x")
+                .map(|slot| vm.globals()[*slot].clone());
+            Ok::<_, String>(x)
+        };
+        let compiled = |build: &Build| -> Vec<String> {
+            build
+                .compiled()
+                .iter()
+                .map(|path| path.file_name().unwrap().to_string_lossy().to_string())
+                .collect()
+        };
+        assert_eq!(run(&mut build), Ok(Some(Value::Number(8.0))));
+        assert_eq!(compiled(&build), ["c.n", "b.n", "main.n"]);
+        assert_eq!(run(&mut build), Ok(Some(Value::Number(8.0))));
+        assert!(compiled(&build).is_empty());
+
+        // A new function body is relinked into its importers as they are.
+        write("c.n", "func inc(x) { x + 10 }\n");
+        assert_eq!(run(&mut build), Ok(Some(Value::Number(26.0))));
+        assert_eq!(compiled(&build), ["c.n"]);
+        // A new function changes what b is compiled against, but not b itself.
+        write("c.n", "func dec(x) { x - 1 }\nfunc inc(x) { x + 10 }\n");
+        assert_eq!(run(&mut build), Ok(Some(Value::Number(26.0))));
+        assert_eq!(compiled(&build), ["c.n", "b.n"]);
+        write("main.n", "import \"b\"\nlet x = twice(40)\n");
+        assert_eq!(run(&mut build), Ok(Some(Value::Number(100.0))));
+        assert_eq!(compiled(&build), ["main.n"]);
+
+        // The compilation cache sees a change to any module of the program.
+        let key = crate::modules::sources(entry).unwrap();
+        assert!(key.starts_with("import \"b\"\nlet x = twice(40)\n") && key.contains("x - 1"));
+        write("c.n", "func dec(x) { x - 2 }\nfunc inc(x) { x + 10 }\n");
+        assert_ne!(crate::modules::sources(entry).unwrap(), key);
+
+        for (files, error) in [
+            (
+                [
+                    ("main.n", "import \"b\"\nlet x = inc(1)\n"),
+                    ("b.n", "func twice(x) { x }\n"),
+                ],
+                "Undefined function 'inc'",
+            ),
+            (
+                [
+                    ("main.n", "import \"b\"\nlet x = 1\n"),
+                    ("b.n", "import \"main\"\n"),
+                ],
+                "Import cycle: ",
+            ),
+            (
+                [("main.n", "import \"missing\"\n"), ("b.n", "")],
+                "Cannot import 'missing' at line 1 of ",
+            ),
+            (
+                [
+                    ("main.n", "import \"b\"\nfunc twice(x) { x }\n"),
+                    ("b.n", "func twice(x) { x }\n"),
+                ],
+                "Function 'twice' is defined by both ",
+            ),
+            (
+                [
+                    ("main.n", "import \"b\"\n"),
+                    ("b.n", "import \"c\"\nfunc inc(x) { x }\n"),
+                ],
+                "Function 'inc' is defined by both ",
+            ),
+            (
+                [("main.n", "import \"b\"\n"), ("b.n", "let y = 1\n")],
+                "Modules can only define functions and imports, found a statement at line 1 of ",
+            ),
+            (
+                [
+                    ("main.n", "import \"b\"\n"),
+                    ("b.n", "func f() { 1 + true }\nfunc g(x) { f(x) }\n"),
+                ],
+                "Compile error: Function 'f' expects 0 arguments, got 1 (in ",
+            ),
+            (
+                [
+                    ("main.n", "func f() {\n    import \"b\"\n    1\n}\n"),
+                    ("b.n", ""),
+                ],
+                "import is only allowed at the top level of a file, found one at line 2",
+            ),
+        ] {
+            for (name, source) in files {
+                write(name, source);
+            }
+            let result = run(&mut build).unwrap_err();
+            assert!(result.contains(error), "{}", result);
+        }
+        std::fs::remove_dir_all(&dir).unwrap();
+
+        let single = compile_source("import \"b\"\n".to_string(), false).unwrap_err();
+        assert!(single.contains("import at line 1 needs the program to be compiled from its file"));
+        let register = Options {
+            engine: Engine::Register,
+            ..Options::default()
+        };
+        let error = lower_file_with_options("tests/modules/main.n", register).unwrap_err();
+        assert!(
+            error.contains("import is only supported on the stack VM"),
+            "{}",
+            error
+        );
+    }
+
+    #[test]
+    fn test_bench_phases() {
+        use crate::bench::{self, Config, Stats};
+        use std::time::Duration;
+
+        let millis = |ms: u64| Duration::from_millis(ms);
+        let stats = Stats::of(&[millis(4), millis(1), millis(3), millis(2), millis(5)]);
+        assert_eq!(stats.mean, millis(3));
+        assert_eq!(stats.median, millis(3));
+        assert_eq!((stats.min, stats.max), (millis(1), millis(5)));
+        assert!((stats.stddev.as_secs_f64() - 2.5f64.sqrt() * 1e-3).abs() < 1e-9);
+
+        let config = Config {
+            warmup: 1,
+            iterations: 3,
+            ..Config::default()
+        };
+        let source = std::fs::read_to_string("benches/workloads/recursion.n").unwrap();
+        let report = bench::bench("recursion", &source, config).unwrap();
+        assert_eq!(report.iterations, 3);
+        assert!(report.execute.min > Duration::ZERO);
+        assert!(report.total.min >= report.execute.min);
+
+        // Failing programs are reported, not timed.
+        let source = std::fs::read_to_string("tests/error_cases.n").unwrap();
+        assert!(bench::bench("error_cases", &source, config).is_err());
+        let programs = bench::programs(&["tests".to_string()]).unwrap();
+        assert!(programs.iter().any(|path| path.ends_with("tail_calls.n")));
+        assert!(!programs.iter().any(|path| path.ends_with("main.n")));
+    }
+
+    #[test]
+    fn test_time_profile() {
+        use crate::profile::Instrumented;
+        use crate::runtime::compile_source_with_symbols;
+
+        let source = "func fib(n) {\n    if n < 2 { n } else { fib(n - 1) + fib(n - 2) }\n}\n\
+                      func twice(n) { fib(n) + fib(n) }\n\
+                      let x = twice(10)\n";
+        let (bytecode, symbols) =
+            compile_source_with_symbols(source.to_string(), Options::default()).unwrap();
+        let mut vm = VirtualMachine::new(Instrumented::new(bytecode));
+        vm.run().unwrap();
+        assert_eq!(vm.globals(), [Value::Number(110.0)]);
+        let profile = vm.program().profile(&symbols, vm.heap().stats());
+
+        let calls: Vec<(&str, usize, u64)> = profile
+            .functions
+            .iter()
+            .map(|function| (function.name.as_str(), function.line, function.calls))
+            .collect();
+        assert_eq!(calls, [("twice", 4, 1), ("fib", 1, 354)]);
+        let (twice, fib) = (&profile.functions[0], &profile.functions[1]);
+        assert!(twice.inclusive >= fib.inclusive && fib.inclusive >= fib.time);
+        assert!(profile.total >= twice.inclusive);
+        let halt = profile.opcodes.iter().find(|opcode| opcode.name == "HALT");
+        assert_eq!(halt.map(|opcode| opcode.count), Some(1));
+
+        let folded = profile.folded();
+        assert!(
+            folded
+                .lines()
+                .any(|line| line.starts_with("main;twice:4;fib:1;fib:1 "))
+        );
+        assert!(
+            folded
+                .lines()
+                .all(|line| line.rsplit(' ').next().unwrap().parse::<u64>().is_ok())
+        );
+        let json = profile.json();
+        assert!(json.contains("\"name\": \"fib\", \"line\": 1, \"calls\": 354"));
+
+        // The collector reports its own work.
+        let source = std::fs::read_to_string("tests/heap_stress.n").unwrap();
+        let (bytecode, symbols) = compile_source_with_symbols(source, Options::default()).unwrap();
+        let mut vm = VirtualMachine::new(Instrumented::new(bytecode));
+        vm.run().unwrap();
+        let gc = vm.program().profile(&symbols, vm.heap().stats()).gc;
+        assert!(gc.minor > 0 && gc.freed > 0 && gc.reclaimed > 0, "{:?}", gc);
+    }
+
+    #[test]
+    fn test_homogeneous_arrays_are_dense() {
+        use crate::dense;
+
+        let numbers = dense::array(&[Value::Number(1.0), Value::Number(2.0)]);
+        assert!(matches!(numbers, HeapObject::Numbers(_)));
+        let booleans = dense::array(&[Value::Boolean(true)]);
+        assert!(matches!(booleans, HeapObject::Booleans(_)));
+        let mixed = dense::concat(&numbers, &booleans).unwrap();
+        assert_eq!(
+            mixed,
+            HeapObject::Array(
+                vec![
+                    HeapObject::Number(1.0),
+                    HeapObject::Number(2.0),
+                    HeapObject::Boolean(true)
+                ]
+                .into()
+            )
+        );
+
+        // Sums of a thousand elements cross many leaves and the lane tail.
+        let many: Vec<Value> = (1..=1000).map(|n| Value::Number(n as f64)).collect();
+        let HeapObject::Numbers(xs) = dense::array(&many) else {
+            panic!("expected a dense array");
+        };
+        assert_eq!(dense::sum(&xs), 500500.0);
+        let doubled = dense::zip(&xs, &xs, |x, y| x + y);
+        assert_eq!(dense::sum(&doubled), 1001000.0);
+        assert_eq!(dense::count(&dense::compare(&xs, 900.0, |x, y| x > y)), 100);
+
+        let error = run_source("let a = [1, 2] |> div([1, 0])\n").unwrap_err();
+        assert!(error.contains("Division by zero"), "{}", error);
+        let error = run_source("let a = [1, 2] |> add([1])\n").unwrap_err();
+        assert!(error.contains("same length"), "{}", error);
+        let error = run_source("let a = [\"a\"] |> sum\n").unwrap_err();
+        assert!(
+            error.contains("sum expects an array of numbers"),
+            "{}",
+            error
+        );
+    }
+
+    #[test]
+    fn test_natives_resolve_at_compile_time() {
+        use crate::types::compiler::Instruction::*;
+
+        // A user function of the same name wins, wherever it is defined.
+        let bytecode = compile_source(
+            "let a = len(2)\nlet b = abs(-2)\nfunc len(x) {\n    x + 1\n}\n".to_string(),
+            false,
+        )
+        .unwrap();
+        assert!(bytecode.instructions.contains(&Call(0)));
+        assert!(bytecode.instructions.contains(&CallGlobal(2)));
+        assert_eq!(
+            run_source("let a = len(2)\nfunc len(x) {\n    x + 1\n}\n"),
+            Ok(vec![Value::Number(3.0)])
+        );
+
+        let wrong_arity = compile_source("let a = min(1)\n".to_string(), false).unwrap_err();
+        assert!(
+            wrong_arity.contains("'min' expects 2 arguments, got 1"),
+            "{}",
+            wrong_arity
+        );
+        let wrong_type = run_source("let a = sqrt(\"four\")\n").unwrap_err();
+        assert!(
+            wrong_type.contains("sqrt expects a number"),
+            "{}",
+            wrong_type
+        );
+        let record = run_source("let a = len({ x = [1, 2, 3] })\n").unwrap_err();
+        assert!(
+            record.ends_with("len expects an array or string, got record"),
+            "{}",
+            record
+        );
+    }
+
     #[test]
     fn test_error_cases() {
         let result = run_n_file("tests/error_cases.n");
@@ -135,4 +1220,650 @@ mod tests {
             result.output
         );
     }
+
+    #[test]
+    fn test_bytecode_round_trip() {
+        for file in [
+            "tests/basic_arithmetic.n",
+            "tests/comparison_operators.n",
+            "tests/string_operations.n",
+            "tests/function_definitions.n",
+            "tests/complex_expressions.n",
+            "tests/heap_stress.n",
+            "tests/edge_cases.n",
+            "tests/nested_functions.n",
+            "tests/array_operations.n",
+        ] {
+            if let Err(e) = round_trip_bytecode(file) {
+                panic!("Bytecode round trip failed for {}: {}", file, e);
+            }
+        }
+    }
+
+    #[test]
+    fn test_run_precompiled_bytecode() {
+        let output = std::env::temp_dir().join("n_test_nested_functions.nb");
+        let output = output.to_string_lossy().to_string();
+        crate::runtime::build("tests/nested_functions.n", &output)
+            .expect("Failed to build bytecode");
+
+        let result = crate::runtime::run_bytecode(&output);
+        let profiled = crate::runtime::run_bytecode_with_options(
+            &output,
+            Options {
+                profile: true,
+                ..Options::default()
+            },
+        );
+        // Options that only apply to compiling a source file are refused.
+        let refused = [
+            Options {
+                optimize: true,
+                ..Options::default()
+            },
+            Options {
+                engine: Engine::Register,
+                ..Options::default()
+            },
+            Options {
+                cache: true,
+                ..Options::default()
+            },
+        ]
+        .map(|options| crate::runtime::run_bytecode_with_options(&output, options));
+        let _ = std::fs::remove_file(&output);
+        assert!(result.is_ok(), "Precompiled bytecode failed: {:?}", result);
+        assert!(profiled.is_ok(), "{:?}", profiled);
+        assert!(refused.iter().all(Result::is_err), "{:?}", refused);
+    }
+
+    #[test]
+    fn test_rejects_invalid_bytecode() {
+        assert!(crate::bytecode::decode(b"NOPE").is_err());
+        assert!(crate::bytecode::decode(b"NB\x01\x00\x00\x00\x00\x00").is_err());
+    }
+
+    #[test]
+    fn test_mapped_bytecode_matches_decoded() {
+        use crate::types::traits::Executable;
+
+        let output = std::env::temp_dir().join("n_test_function_definitions.nb");
+        let output = output.to_string_lossy().to_string();
+        crate::runtime::build("tests/function_definitions.n", &output)
+            .expect("Failed to build bytecode");
+
+        let image = crate::runtime::load_bytecode(&output).expect("Failed to map bytecode");
+        let _ = std::fs::remove_file(&output);
+        let bytecode = compile_file("tests/function_definitions.n", false).unwrap();
+
+        for (pc, instruction) in bytecode.instructions.iter().enumerate() {
+            assert_eq!(image.instruction(pc).as_ref(), Some(instruction));
+            assert_eq!(image.line(pc), bytecode.instruction_lines[pc]);
+        }
+        assert_eq!(image.instruction(bytecode.instructions.len()), None);
+        for (index, constant) in bytecode.constants.iter().enumerate() {
+            assert_eq!(image.constant(index).as_ref(), Some(constant));
+        }
+        for index in 0..bytecode.functions.len() {
+            assert_eq!(image.function(index), bytecode.function(index));
+        }
+    }
+
+    #[test]
+    fn test_call_arguments_bind_in_order() {
+        let globals = run_source(
+            "func sub(a, b) {\n    a - b\n}\nlet r = sub(10, 4)\nlet p = 10 |> sub(4)\n",
+        )
+        .unwrap();
+        assert_eq!(globals, vec![Value::Number(6.0), Value::Number(6.0)]);
+    }
+
+    #[test]
+    fn test_nested_functions_read_enclosing_frame() {
+        let globals = run_source(
+            "func twice(v) {\n    v * 2\n}\n\
+             func outer(x) {\n    let k = 100\n    func inner(y) {\n        twice(x) + y + k\n    }\n    inner(10)\n}\n\
+             let a = outer(5)\nlet b = outer(7)\n",
+        )
+        .unwrap();
+        assert_eq!(globals, vec![Value::Number(120.0), Value::Number(124.0)]);
+    }
+
+    #[test]
+    fn test_string_concatenation_shares_constants() {
+        let globals = run_source(
+            "let a = \"ab\"\nlet b = a + \"cd\" + \"ef\" + a\nlet c = \"ab\"\nlet d = a + \"\"\n",
+        )
+        .unwrap();
+        let text = |value: &Value| match value {
+            Value::String(s) => s.clone(),
+            other => panic!("expected a string, got {:?}", other),
+        };
+
+        // Building b in place must never write through the shared a.
+        assert_eq!(text(&globals[0]).as_str(), "ab");
+        assert_eq!(text(&globals[1]).as_str(), "abcdefab");
+        assert_eq!(text(&globals[3]).as_str(), "ab");
+
+        // Both loads of the "ab" literal share the interned constant.
+        assert!(std::sync::Arc::ptr_eq(
+            &text(&globals[0]),
+            &text(&globals[2])
+        ));
+        assert!(!std::sync::Arc::ptr_eq(
+            &text(&globals[0]),
+            &text(&globals[3])
+        ));
+    }
+
+    #[test]
+    fn test_constant_pool_deduplicates_literals() {
+        let bytecode = compile_source(
+            "let a = 1\nlet b = \"x\" + \"x\"\nlet c = 1 + 2\nlet d = -2\nlet e = true == true\n"
+                .to_string(),
+            false,
+        )
+        .unwrap();
+        assert_eq!(
+            bytecode.constants,
+            vec![
+                Value::Number(1.0),
+                Value::String(std::sync::Arc::new("x".to_string())),
+                Value::Number(2.0),
+                Value::Boolean(true),
+                Value::Number(0.0),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_optimizer_preserves_results() {
+        let optimized = Options {
+            optimize: true,
+            ..Options::default()
+        };
+        for entry in std::fs::read_dir("tests").unwrap() {
+            let path = entry.unwrap().path();
+            if path.extension().is_none_or(|extension| extension != "n") {
+                continue;
+            }
+            let path = path.to_str().unwrap();
+            assert_eq!(
+                run_rendered(path, Options::default()),
+                run_rendered(path, optimized),
+                "{}",
+                path
+            );
+
+            if let Ok(bytecode) = compile_file_with_options(path, optimized) {
+                let bytes = crate::bytecode::encode(&bytecode).unwrap();
+                let decoded = crate::bytecode::decode(&bytes);
+                assert_eq!(decoded.as_ref(), Ok(&bytecode), "{}", path);
+            }
+        }
+    }
+
+    #[test]
+    fn test_optimizer_folds_and_fuses() {
+        use crate::runtime::compile_source_with_options;
+        use crate::types::compiler::Instruction::*;
+
+        let source = "let x = (2 * 3) + 1\nlet y = -x\nlet z = 4 / 0\n\
+                      func f(n) {\n    n\n    n - 1\n}\nfunc g(n) {\n    n + 2\n}\n"
+            .to_string();
+        let bytecode = compile_source_with_options(
+            source,
+            Options {
+                optimize: true,
+                ..Options::default()
+            },
+        )
+        .unwrap();
+        assert_eq!(
+            bytecode.constants,
+            vec![
+                Value::Number(7.0),
+                Value::Number(4.0),
+                Value::Number(0.0),
+                Value::Number(1.0),
+                Value::Number(2.0),
+            ]
+        );
+        assert_eq!(
+            bytecode.instructions,
+            vec![
+                LoadConst(0),
+                StoreVarKeep(0, 0),
+                Negate,
+                StoreVar(0, 1),
+                LoadConst(1),
+                DivConst(2),
+                StoreVar(0, 2),
+                // The jump over f is threaded past g, and `n` alone is dropped
+                Jump(15),
+                LoadVar(1, 0),
+                SubConst(3),
+                Return,
+                Jump(15),
+                LoadVar(1, 0),
+                AddConst(4),
+                Return,
+                Halt,
+            ]
+        );
+        assert_eq!(bytecode.functions[0].offset, 8);
+        assert_eq!(bytecode.functions[1].offset, 12);
+        assert_eq!(
+            bytecode.instruction_lines.len(),
+            bytecode.instructions.len()
+        );
+    }
+
+    #[test]
+    fn test_superinstructions_match_unfused_code() {
+        use crate::types::compiler::{ByteCode, Instruction::*};
+
+        // g0 = 5; g1 = g0 < 7 ? g0 * 3 : 0 - 1; g2 = g1 + g0, where the
+        // branch is built by hand since the compiler emits no conditionals.
+        let unfused = ByteCode {
+            constants: vec![Value::Number(5.0), Value::Number(7.0), Value::Number(3.0)],
+            functions: Vec::new(),
+            globals: 3,
+            instructions: vec![
+                LoadConst(0),
+                StoreVar(0, 0),
+                LoadVar(0, 0),
+                LoadConst(1),
+                Less,
+                JumpIfFalse(11),
+                LoadVar(0, 0),
+                LoadConst(2),
+                Mul,
+                StoreVar(0, 1),
+                Jump(13),
+                LoadConst(0),
+                StoreVar(0, 1),
+                LoadVar(0, 1),
+                LoadVar(0, 0),
+                Add,
+                StoreVar(0, 2),
+                Halt,
+            ],
+            instruction_lines: vec![1; 18],
+        };
+        let mut fused = unfused.clone();
+        crate::optimizer::optimize(&mut fused);
+        assert_eq!(
+            fused.instructions,
+            vec![
+                LoadConst(0),
+                StoreVarKeep(0, 0),
+                LoadConst(1),
+                LessJumpIfFalse(8),
+                LoadVar(0, 0),
+                MulConst(2),
+                StoreVar(0, 1),
+                Jump(10),
+                LoadConst(0),
+                StoreVar(0, 1),
+                LoadVar(0, 1),
+                LoadVarAdd(0, 0),
+                StoreVar(0, 2),
+                Halt,
+            ]
+        );
+
+        let run = |bytecode: ByteCode| {
+            let mut vm = VirtualMachine::new(bytecode);
+            vm.run().map(|()| vm.globals().to_vec())
+        };
+        let expected = vec![Value::Number(5.0), Value::Number(15.0), Value::Number(20.0)];
+        assert_eq!(run(unfused), Ok(expected.clone()));
+        assert_eq!(run(fused), Ok(expected));
+
+        // Fused division still reports a zero divisor.
+        let optimized = Options {
+            optimize: true,
+            ..Options::default()
+        };
+        let bytecode =
+            crate::runtime::compile_source_with_options("let z = 4 / 0\n".to_string(), optimized)
+                .unwrap();
+        assert!(bytecode.instructions.contains(&DivConst(1)));
+        let result = VirtualMachine::new(bytecode).run();
+        assert!(
+            matches!(&result, Err(e) if e.contains("Division by zero")),
+            "{:?}",
+            result
+        );
+    }
+
+    #[test]
+    fn test_tail_position_calls_reuse_the_frame() {
+        use crate::types::compiler::Instruction::*;
+
+        let bytecode = compile_source(
+            "func sum(n, acc) {\n    if n == 0 { acc } else { sum(n - 1, acc + n) }\n}\n\
+             func outer(x) {\n    func inner(y) {\n        x + y\n    }\n    inner(1)\n}\n\
+             let a = sum(3, 0)\nlet b = outer(2)\n"
+                .to_string(),
+            false,
+        )
+        .unwrap();
+        let calls: Vec<_> = bytecode
+            .instructions
+            .iter()
+            .filter(|instruction| matches!(instruction, Call(_) | TailCall(_)))
+            .collect();
+        // inner reads outer's frame, so calling it cannot replace that frame.
+        assert_eq!(calls, [&TailCall(0), &Call(2), &Call(0), &Call(1)]);
+
+        // A million frames deep, in constant space on both engines.
+        let source = "func sum(n, acc) {\n    if n == 0 { acc } else { sum(n - 1, acc + n) }\n}\n\
+                      let total = sum(1000000, 0)\n";
+        let expected = vec![Value::Number(500000500000.0)];
+        assert_eq!(run_source(source), Ok(expected.clone()));
+        let program =
+            crate::runtime::lower_source_with_options(source.to_string(), Options::default())
+                .unwrap();
+        let mut vm = RegisterMachine::new(program);
+        vm.run().unwrap();
+        assert_eq!(vm.globals(), &expected[..]);
+    }
+
+    #[test]
+    fn test_register_vm_matches_stack_vm() {
+        for entry in std::fs::read_dir("tests").unwrap() {
+            let path = entry.unwrap().path();
+            // map, filter, tasks and records only run on the stack VM.
+            if path.extension().is_none_or(|extension| extension != "n")
+                || path.ends_with("parallel_map.n")
+                || path.ends_with("async_tasks.n")
+                || path.ends_with("records.n")
+            {
+                continue;
+            }
+            let path = path.to_str().unwrap();
+            for optimize in [false, true] {
+                let stack = Options {
+                    optimize,
+                    ..Options::default()
+                };
+                let register = Options {
+                    engine: Engine::Register,
+                    ..stack
+                };
+                assert_eq!(
+                    run_rendered(path, stack),
+                    run_rendered(path, register),
+                    "{} (optimize: {})",
+                    path,
+                    optimize
+                );
+            }
+        }
+    }
+
+    #[cfg(feature = "jit")]
+    #[test]
+    fn test_jit_matches_interpreter() {
+        for entry in std::fs::read_dir("tests").unwrap() {
+            let path = entry.unwrap().path();
+            if path.extension().is_none_or(|extension| extension != "n") {
+                continue;
+            }
+            let path = path.to_str().unwrap();
+            for optimize in [false, true] {
+                let stack = Options {
+                    optimize,
+                    ..Options::default()
+                };
+                let jit = Options {
+                    engine: Engine::Jit,
+                    ..stack
+                };
+                assert_eq!(
+                    run_rendered(path, stack),
+                    run_rendered(path, jit),
+                    "{} (optimize: {})",
+                    path,
+                    optimize
+                );
+            }
+        }
+    }
+
+    // Native code gives up on a zero divisor and the interpreter runs the
+    // call again, so the error and its line are the interpreter's.
+    #[cfg(feature = "jit")]
+    #[test]
+    fn test_jit_falls_back_to_the_interpreter() {
+        let source = "func ratio(a, b) {\n    a / b\n}\n\
+                      func total(n, acc) {\n    if n == 0 { acc } else { total(n - 1, acc + ratio(n, n - 1)) }\n}\n\
+                      let t = total(5000, 0)\n";
+        let run = |jit: bool| {
+            let mut vm = VirtualMachine::new(compile_source(source.to_string(), false).unwrap());
+            if jit {
+                vm.enable_jit();
+            }
+            vm.run()
+        };
+        let expected = run(false);
+        assert!(
+            expected
+                .as_ref()
+                .is_err_and(|e| e.ends_with("Division by zero"))
+        );
+        assert_eq!(run(true), expected);
+
+        // Strings keep a function in the interpreter.
+        let source = "func greet(n) {\n    if n == 0 { \"hi\" } else { greet(n - 1) }\n}\n\
+                      let g = greet(5000)\n";
+        let mut vm = VirtualMachine::new(compile_source(source.to_string(), false).unwrap());
+        vm.enable_jit();
+        vm.run().unwrap();
+        assert_eq!(render_value(&vm.globals()[0], vm.heap()), "\"hi\"");
+    }
+
+    #[cfg(not(feature = "jit"))]
+    #[test]
+    fn test_jit_engine_needs_the_feature() {
+        let jit = Options {
+            engine: Engine::Jit,
+            ..Options::default()
+        };
+        let error =
+            crate::runtime::compile_and_run_with_options("tests/hot_functions.n", jit).unwrap_err();
+        assert!(error.contains("--features jit"), "{}", error);
+    }
+
+    #[test]
+    fn test_register_lowering_names_operands() {
+        use crate::register::{Operand::*, RegisterInstruction::*, RegisterMachine};
+        use crate::runtime::lower_source_with_options;
+
+        let source = "let a = 2\nfunc f(n) {\n    n - 1\n}\n\
+                      let b = f(a) + a\nlet c = [a, b]\nlet d = (\"x\" + \"y\") + \"z\"\n"
+            .to_string();
+        let program = lower_source_with_options(source, Options::default()).unwrap();
+        assert_eq!(program.globals, 4);
+        assert_eq!(program.functions[0].registers, 2);
+        assert_eq!(
+            program.instructions,
+            vec![
+                Move {
+                    dst: 0,
+                    src: Constant(0)
+                },
+                Jump { target: 4 },
+                // The parameter is read in place; no loads or pushes
+                Sub {
+                    dst: 1,
+                    a: Register(0),
+                    b: Constant(1)
+                },
+                Return { src: Register(1) },
+                // The argument is evaluated into the callee's first register
+                Move {
+                    dst: 4,
+                    src: Register(0)
+                },
+                Call {
+                    dst: 1,
+                    function: 0,
+                    args: 4
+                },
+                Add {
+                    dst: 1,
+                    a: Register(1),
+                    b: Register(0)
+                },
+                Move {
+                    dst: 4,
+                    src: Register(0)
+                },
+                Move {
+                    dst: 5,
+                    src: Register(1)
+                },
+                CreateArray {
+                    dst: 2,
+                    start: 4,
+                    count: 2
+                },
+                // The left operand is built in d's register and extended there
+                Add {
+                    dst: 3,
+                    a: Constant(2),
+                    b: Constant(3)
+                },
+                Add {
+                    dst: 3,
+                    a: Register(3),
+                    b: Constant(4)
+                },
+                Halt,
+            ]
+        );
+
+        let mut vm = RegisterMachine::new(program);
+        vm.run().unwrap();
+        let globals: Vec<String> = vm
+            .globals()
+            .iter()
+            .map(|value| render_value(value, vm.heap()))
+            .collect();
+        assert_eq!(globals, ["2", "3", "[2, 3]", "\"xyz\""]);
+
+        let result = lower_source_with_options("let z = 4 / 0\n".to_string(), Options::default())
+            .map(RegisterMachine::new)
+            .and_then(|mut vm| vm.run());
+        assert_eq!(result, Err("[line 1] Division by zero".to_string()));
+    }
+
+    #[test]
+    fn test_lexer_tokens_borrow_source() {
+        use crate::lexer::Lexer;
+        use crate::types::token::Token;
+
+        let source =
+            "let! größe_1 = \"héllo\" // note\n/* block\n */ x |> f(2.5) <- [a] != b\n\"open";
+        let tokens = Lexer::new(source).tokenize();
+        assert_eq!(
+            tokens,
+            vec![
+                Token::LetBang,
+                Token::Identifier("größe_1"),
+                Token::Assign,
+                Token::String("héllo"),
+                Token::Newline,
+                Token::Identifier("x"),
+                Token::Pipeline,
+                Token::Identifier("f"),
+                Token::LeftParen,
+                Token::Number(2.5),
+                Token::RightParen,
+                Token::Update,
+                Token::LeftBracket,
+                Token::Identifier("a"),
+                Token::RightBracket,
+                Token::NotEqual,
+                Token::Identifier("b"),
+                Token::Newline,
+                Token::String("open"),
+                Token::Eof,
+            ]
+        );
+
+        // Identifiers are slices of the source, not copies.
+        let Token::Identifier(name) = tokens[1] else {
+            unreachable!()
+        };
+        assert!(source.as_bytes().as_ptr_range().contains(&name.as_ptr()));
+    }
+
+    #[test]
+    fn test_ast_arena_interns_names() {
+        use crate::lexer::Lexer;
+        use crate::parser::Parser;
+        use crate::types::ast::{Expr, Stmt};
+
+        let source = "let a = [1, f(a, 2)]\nlet b = a + a\n";
+        let program = Parser::new(Lexer::new(source)).parse().unwrap();
+        // 1, a, 2, f, f(..), [..], then a, a, and the sum
+        assert_eq!(program.expr_count(), 9);
+
+        let Stmt::Let { name: a, value, .. } = program.statements[0] else {
+            unreachable!()
+        };
+        let Expr::Array { elements } = *program.expr(value) else {
+            unreachable!()
+        };
+        let Expr::Call { args, .. } = *program.expr(program.list(elements)[1]) else {
+            unreachable!()
+        };
+        assert!(matches!(*program.expr(program.list(args)[0]), Expr::Identifier(s) if s == a));
+
+        let Stmt::Let { value, .. } = program.statements[1] else {
+            unreachable!()
+        };
+        let Expr::Binary { left, right, .. } = *program.expr(value) else {
+            unreachable!()
+        };
+        assert!(matches!(
+            (*program.expr(left), *program.expr(right)),
+            (Expr::Identifier(l), Expr::Identifier(r)) if l == a && r == a
+        ));
+        assert_eq!(program.name(a), "a");
+    }
+
+    #[test]
+    fn test_undefined_variable_is_compile_error() {
+        let result = run_source("let z = undefined_variable\n");
+        assert!(
+            matches!(&result, Err(e) if e.contains("Undefined variable")),
+            "{:?}",
+            result
+        );
+    }
+
+    #[test]
+    fn test_parse_error_reports_line() {
+        let result = run_source("let a = 1\nlet b = 2\n\nlet = 3\nlet c = 4\n");
+        assert!(
+            matches!(&result, Err(e) if e.starts_with("Parse error") && e.contains("line 4")),
+            "{:?}",
+            result
+        );
+    }
+
+    #[test]
+    fn test_runtime_division_by_zero() {
+        let result = run_source("let x = 5\nlet y = 0\nlet r = x / y\n");
+        assert!(
+            matches!(&result, Err(e) if e.contains("Division by zero")),
+            "{:?}",
+            result
+        );
+    }
 }
@@ -1,42 +1,79 @@
-#[derive(Debug, Clone)]
+use std::collections::HashMap;
+
+// The AST lives in flat arenas owned by the Program: expressions refer to
+// their children by ExprId, argument and element lists are ranges of a shared
+// id table, and every name or string literal is interned once as a Symbol
+// borrowed from the source. Parsing a node is a push onto a Vec rather than a
+// Box allocation, and the compiler walks indices into contiguous memory.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct ExprId(u32);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct Symbol(u32);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ExprList {
+    start: u32,
+    len: u32,
+}
+
+#[derive(Debug, Clone, Copy)]
 pub enum Expr {
-    Identifier(String),
+    Identifier(Symbol),
     Number(f64),
-    String(String),
+    String(Symbol),
     Boolean(bool),
     Update {
-        left: Box<Expr>,
-        right: Box<Expr>,
+        left: ExprId,
+        right: ExprId,
     },
     Unary {
         op: UnaryOp,
-        right: Box<Expr>,
+        right: ExprId,
     },
     Binary {
-        left: Box<Expr>,
+        left: ExprId,
         op: BinaryOp,
-        right: Box<Expr>,
+        right: ExprId,
     },
     Call {
-        func: Box<Expr>,
-        args: Vec<Expr>,
+        func: ExprId,
+        args: ExprList,
     },
     Pipeline {
-        left: Box<Expr>,
-        right: Box<Expr>,
+        left: ExprId,
+        right: ExprId,
     },
     Array {
-        elements: Vec<Expr>,
+        elements: ExprList,
+    },
+    Record {
+        fields: ExprList, // Each key, an Expr::String, followed by its value
+    },
+    Field {
+        record: ExprId,
+        name: Symbol,
+    },
+    If {
+        cond: ExprId,
+        then: ExprId,
+        otherwise: ExprId,
+    },
+    Async {
+        call: ExprId, // Always a Call
+    },
+    Await {
+        right: ExprId,
     },
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy)]
 pub enum UnaryOp {
     Neg, // Unary minus
     Not, // Logical not
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy)]
 pub enum BinaryOp {
     Add,
     Sub,
@@ -53,20 +90,80 @@ pub enum BinaryOp {
 #[derive(Debug, Clone)]
 pub enum Stmt {
     Let {
-        name: String,
-        value: Expr,
+        name: Symbol,
+        value: ExprId,
         line: usize,
     },
     Func {
-        name: String,
-        params: Vec<String>,
+        name: Symbol,
+        params: Vec<Symbol>,
         body: Vec<Stmt>,
         line: usize,
     },
-    Expr(Expr, usize),
+    Expr(ExprId, usize),
+    // Resolved by the module build in modules.rs before compilation.
+    Import {
+        path: Symbol,
+        line: usize,
+    },
 }
 
-#[derive(Debug, Clone)]
-pub struct Program {
+#[derive(Debug, Clone, Default)]
+pub struct Program<'a> {
     pub statements: Vec<Stmt>,
+    exprs: Vec<Expr>,
+    lists: Vec<ExprId>,
+    symbols: Vec<&'a str>,
+    interned: HashMap<&'a str, Symbol>,
+}
+
+impl<'a> Program<'a> {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn push(&mut self, expr: Expr) -> ExprId {
+        self.exprs.push(expr);
+        ExprId(self.exprs.len() as u32 - 1)
+    }
+
+    pub fn push_list(&mut self, ids: &[ExprId]) -> ExprList {
+        let start = self.lists.len() as u32;
+        self.lists.extend_from_slice(ids);
+        ExprList {
+            start,
+            len: ids.len() as u32,
+        }
+    }
+
+    pub fn intern(&mut self, name: &'a str) -> Symbol {
+        if let Some(symbol) = self.interned.get(name) {
+            return *symbol;
+        }
+        let symbol = Symbol(self.symbols.len() as u32);
+        self.symbols.push(name);
+        self.interned.insert(name, symbol);
+        symbol
+    }
+
+    pub fn expr(&self, id: ExprId) -> &Expr {
+        &self.exprs[id.0 as usize]
+    }
+
+    pub fn list(&self, list: ExprList) -> &[ExprId] {
+        &self.lists[list.start as usize..(list.start + list.len) as usize]
+    }
+
+    // The symbol of `name`, if the program uses it at all.
+    pub fn lookup(&self, name: &str) -> Option<Symbol> {
+        self.interned.get(name).copied()
+    }
+
+    pub fn name(&self, symbol: Symbol) -> &'a str {
+        self.symbols[symbol.0 as usize]
+    }
+
+    pub fn expr_count(&self) -> usize {
+        self.exprs.len()
+    }
 }
@@ -1,14 +1,30 @@
+use crate::heap::Heap;
+use crate::shape::Record;
+use crate::vector::Vector;
 use std::collections::HashMap;
+use std::sync::Arc;
+use std::time::Instant;
 
+// Instructions are plain copyable opcodes: every operand is an index into a
+// table (constants, functions, variable slots) or an instruction stream
+// position, so fetching one never clones a Value.
 #[repr(u8)]
-#[derive(Debug, Clone, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub enum Instruction {
-    StoreVar(usize, usize) = 0x01,
-    LoadVar(usize, usize) = 0x02,
-    LoadArg(usize) = 0x03,
-    Call(usize) = 0x04,
+    StoreVar(u32, u32) = 0x01,
+    LoadVar(u32, u32) = 0x02,
+    TailCall(u32) = 0x03, // CALL then RETURN, reusing the caller's frame
+    Call(u32) = 0x04,
     Return = 0x05,
-    LoadConst(usize) = 0x06,
+    LoadConst(u32) = 0x06,
+    LoadVarAdd(u32, u32) = 0x07, // Superinstructions below are emitted by the optimizer
+    StoreVarKeep(u32, u32) = 0x08, // STORE_VAR, then LOAD_VAR of the same slot
+    CallGlobal(u32) = 0x09,      // Calls a built-in from natives.rs
+    Pipeline(u32) = 0x0A,        // Fused built-ins, one CALL_GLOBAL per stage after it
+    Map(u32) = 0x0B,             // Calls a function on every element, in parallel
+    Filter(u32) = 0x0C,
+    Async(u32) = 0x0D, // Starts a call as a new task, pushing its future
+    Await = 0x0E,
     Add = 0x10,
     Sub = 0x11,
     Div = 0x12,
@@ -17,15 +33,73 @@ pub enum Instruction {
     Less = 0x15,
     Greater = 0x16,
     Not = 0x17,
-    CreateArray(usize) = 0x18, // Create array with N elements from stack
-    ConcatArray = 0x19,        // Pop two arrays, concatenate, push result
-    Jump(usize) = 0x20,
-    JumpIfFalse(usize) = 0x21,
-    JumpIfTrue(usize) = 0x22,
+    CreateArray(u32) = 0x18, // Create array with N elements from stack
+    ConcatArray = 0x19,      // Pop two arrays, concatenate, push result; or merge two records
+    Negate = 0x1A,           // Fused forms emitted by the optimizer
+    AddConst(u32) = 0x1B,
+    SubConst(u32) = 0x1C,
+    MulConst(u32) = 0x1D,
+    DivConst(u32) = 0x1E,
+    Jump(u32) = 0x20,
+    JumpIfFalse(u32) = 0x21,
+    JumpIfTrue(u32) = 0x22,
+    EqualJumpIfFalse(u32) = 0x23,
+    LessJumpIfFalse(u32) = 0x24,
+    GreaterJumpIfFalse(u32) = 0x25,
     Pop = 0x30,
-    Push(Value) = 0x31,
     Dup = 0x32,
     Halt = 0x33,
+    CreateRecord(u32, u32) = 0x40, // Keys are constants first..first + count
+    GetField(u32) = 0x41,          // Field named by a string constant
+}
+
+const _: () = assert!(std::mem::size_of::<Instruction>() == 12);
+
+impl Instruction {
+    pub fn opcode(&self) -> u8 {
+        match self {
+            Instruction::StoreVar(..) => 0x01,
+            Instruction::LoadVar(..) => 0x02,
+            Instruction::TailCall(_) => 0x03,
+            Instruction::Call(_) => 0x04,
+            Instruction::Return => 0x05,
+            Instruction::LoadConst(_) => 0x06,
+            Instruction::LoadVarAdd(..) => 0x07,
+            Instruction::StoreVarKeep(..) => 0x08,
+            Instruction::CallGlobal(_) => 0x09,
+            Instruction::Pipeline(_) => 0x0A,
+            Instruction::Map(_) => 0x0B,
+            Instruction::Filter(_) => 0x0C,
+            Instruction::Async(_) => 0x0D,
+            Instruction::Await => 0x0E,
+            Instruction::Add => 0x10,
+            Instruction::Sub => 0x11,
+            Instruction::Div => 0x12,
+            Instruction::Mul => 0x13,
+            Instruction::Equal => 0x14,
+            Instruction::Less => 0x15,
+            Instruction::Greater => 0x16,
+            Instruction::Not => 0x17,
+            Instruction::CreateArray(_) => 0x18,
+            Instruction::ConcatArray => 0x19,
+            Instruction::Negate => 0x1A,
+            Instruction::AddConst(_) => 0x1B,
+            Instruction::SubConst(_) => 0x1C,
+            Instruction::MulConst(_) => 0x1D,
+            Instruction::DivConst(_) => 0x1E,
+            Instruction::Jump(_) => 0x20,
+            Instruction::JumpIfFalse(_) => 0x21,
+            Instruction::JumpIfTrue(_) => 0x22,
+            Instruction::EqualJumpIfFalse(_) => 0x23,
+            Instruction::LessJumpIfFalse(_) => 0x24,
+            Instruction::GreaterJumpIfFalse(_) => 0x25,
+            Instruction::Pop => 0x30,
+            Instruction::Dup => 0x32,
+            Instruction::Halt => 0x33,
+            Instruction::CreateRecord(..) => 0x40,
+            Instruction::GetField(_) => 0x41,
+        }
+    }
 }
 
 #[derive(Debug, Clone, PartialEq)]
@@ -35,35 +109,47 @@ pub enum VarOutput {
     GotOuterScope { index: usize, depth: usize },
 }
 
+// Every variant is at most one word, so a Value is a 16-byte tagged union:
+// anything larger lives behind a handle. Strings are shared, immutable
+// handles, so loading a string constant or a variable bumps a reference count
+// instead of copying the bytes. Constant strings are interned once, when the
+// constant table is built or loaded, so every load of the same literal yields
+// the same allocation. Functions are indices into the function table.
 #[derive(Debug, Clone, PartialEq)]
 pub enum Value {
     Number(f64),
-    String(String),
+    String(Arc<String>),
     Boolean(bool),
-    Function { params: Vec<String>, offset: usize },
+    Function(u32),
     HeapPointer(usize),
 }
 
+const _: () = assert!(std::mem::size_of::<Value>() == 16);
+
 impl Value {
     pub fn type_name_stack(&self) -> &'static str {
         match self {
             Value::Number(_) => "number",
             Value::String(_) => "string",
             Value::Boolean(_) => "boolean",
-            Value::Function { .. } => "function",
+            Value::Function(_) => "function",
             Value::HeapPointer(_) => "heap pointer",
         }
     }
 
-    pub fn type_name<'a>(&'a self, heap: &'a [HeapObject]) -> &'static str {
+    pub fn type_name(&self, heap: &Heap) -> &'static str {
         match self {
             Value::HeapPointer(idx) => match heap.get(*idx) {
                 Some(HeapObject::String(_)) => "string",
                 Some(HeapObject::Number(_)) => "number",
                 Some(HeapObject::Boolean(_)) => "boolean",
                 Some(HeapObject::Null) => "null",
-                Some(HeapObject::Array(_)) => "array",
-                Some(HeapObject::Object(_)) => "object",
+                Some(HeapObject::Array(_) | HeapObject::Numbers(_) | HeapObject::Booleans(_)) => {
+                    "array"
+                }
+                Some(HeapObject::Record(_)) => "record",
+                Some(HeapObject::Future(_)) => "future",
+                Some(HeapObject::HeapPointer(_)) => "reference",
                 None => "unknown",
             },
             _ => self.type_name_stack(),
@@ -73,18 +159,74 @@ impl Value {
 
 #[derive(Debug, Clone, PartialEq)]
 pub enum HeapObject {
-    String(String),
+    String(Arc<String>),
     Number(f64),
     Boolean(bool),
     Null,
-    Array(Vec<HeapObject>),
-    Object(HashMap<String, HeapObject>),
+    Array(Vector<HeapObject>),
+    Numbers(Vector<f64>), // Dense arrays: every element a number, or a boolean
+    Booleans(Vector<bool>),
+    Record(Record),     // Fields laid out by a shared Shape (see shape.rs)
+    HeapPointer(usize), // Reference to another heap object, e.g. a nested array
+    Future(Future),
+}
+
+// What `await` waits for: a task started by `async`, identified by its index
+// in the scheduler (see scheduler.rs), or the deadline of a `sleep`, which
+// resolves to `value`.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Future {
+    Task(usize),
+    Timer { deadline: Instant, value: f64 },
+}
+
+// How a value is stored as an array element.
+impl From<Value> for HeapObject {
+    fn from(value: Value) -> Self {
+        match value {
+            Value::Number(n) => HeapObject::Number(n),
+            Value::String(s) => HeapObject::String(s),
+            Value::Boolean(b) => HeapObject::Boolean(b),
+            Value::HeapPointer(idx) => HeapObject::HeapPointer(idx),
+            Value::Function(_) => HeapObject::Null, // Functions can't go in arrays yet
+        }
+    }
+}
+
+// Everything the VM needs to set up a call. Parameters occupy the first
+// `params.len()` of the function's `locals` slots, and `depth` is the lexical
+// nesting level its LOAD_VAR/STORE_VAR instructions address.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Function {
+    pub params: Vec<String>,
+    pub offset: usize,
+    pub locals: usize,
+    pub depth: usize,
 }
 
 #[derive(Debug, Clone, PartialEq)]
 pub struct ByteCode {
     pub constants: Vec<Value>,
-    pub functions: Vec<Value>,
+    pub functions: Vec<Function>,
+    pub globals: usize,
     pub instructions: Vec<Instruction>,
     pub instruction_lines: Vec<usize>,
 }
+
+// A top-level function of a module as the modules importing it see it.
+// `index` is its entry in the module's own function table.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Export {
+    pub name: String,
+    pub params: Vec<String>,
+    pub index: usize,
+}
+
+// The names the bytecode no longer carries: the global slot of every
+// top-level variable, for code that reads a program's results by name, and
+// the name of every entry of the function table, for the profiler.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct Symbols {
+    pub globals: HashMap<String, usize>,
+    pub functions: Vec<String>,
+}
@@ -2,21 +2,52 @@ pub const UNDERFLOW_ERROR: &str = "Stack underflow";
 pub const INVALID_HEAP_POINTER_ERROR: &str = "Invalid heap pointer";
 
 // Garbage Collection Configuration
-pub const GC_CHECK_INTERVAL: usize = 12;
-pub const GC_THRESHOLD: usize = 4000;
-pub const GC_HISTORY_BUFFER_SIZE: usize = 10;
+pub const GC_NURSERY_SIZE: usize = 4000; // Young heap score that triggers a minor collection
+pub const GC_THRESHOLD: usize = 4000; // Minimum old heap score that triggers a full collection
+pub const GC_GROWTH_FACTOR: usize = 2; // Next threshold as a multiple of the live heap score
+pub const GC_HISTORY_BUFFER_SIZE: usize = 10; // Collections the threshold looks back over
+pub const GC_COMPACT_MIN_SLOTS: usize = 1024; // Heaps smaller than this are never compacted
 
 // Heap Scoring Weights (for GC heuristics)
 pub const HEAP_SCORE_ARRAY_BASE: usize = 16;
 pub const HEAP_SCORE_ARRAY_PER_ELEMENT: usize = 8;
+pub const HEAP_SCORE_DENSE_PER_ELEMENT: usize = 2; // Numbers and Booleans arrays
 pub const HEAP_SCORE_STRING_BASE: usize = 24;
-pub const HEAP_SCORE_MAP_BASE: usize = 32;
-pub const HEAP_SCORE_MAP_PER_ELEMENT: usize = 16;
+pub const HEAP_SCORE_RECORD_BASE: usize = 16; // Keys live in the shared Shape
+pub const HEAP_SCORE_RECORD_PER_FIELD: usize = 8;
 pub const HEAP_SCORE_OTHER_OBJECT: usize = 32;
 
+// Register VM: operands and constant indices are u16
+pub const MAX_REGISTERS: usize = u16::MAX as usize;
+
+// JIT (built with `--features jit`)
+pub const JIT_THRESHOLD: u32 = 100; // Calls before a function is compiled
+pub const JIT_STACK_BUDGET: usize = 256 * 1024; // Machine stack native calls may use
+
+// Parallel map and filter (see parallel.rs)
+pub const PARALLEL_MIN_ELEMENTS: usize = 4096; // Smaller arrays run on the calling thread
+pub const PARALLEL_CHUNK: usize = 512; // Elements a worker claims at a time
+
+// Compilation cache (see cache.rs)
+pub const CACHE_DIR_VARIABLE: &str = "N_CACHE_DIR"; // Overrides the default cache directory
+pub const CACHE_DIR_NAME: &str = "n"; // Under $XDG_CACHE_HOME or ~/.cache
+
 // String Processing
 pub const MAX_STRING_LENGTH: usize = 1024;
 
+// Bytecode File Format (see docs/BYTECODE.md)
+pub const BYTECODE_EXTENSION: &str = ".nb";
+pub const BYTECODE_MAGIC: &[u8; 2] = b"NB";
+pub const BYTECODE_VERSION: u16 = 3;
+pub const BYTECODE_HEADER_SIZE: usize = 8;
+pub const BYTECODE_ANONYMOUS_NAME: u16 = 0xFFFF;
+
+// Bytecode Constant Type Tags
+pub const CONSTANT_TAG_STRING: u8 = 0;
+pub const CONSTANT_TAG_NUMBER: u8 = 1;
+pub const CONSTANT_TAG_BOOLEAN: u8 = 2;
+pub const CONSTANT_TAG_NULL: u8 = 3;
+
 #[repr(u8)]
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 pub enum Precedence {
@@ -1,8 +1,9 @@
-#[derive(Debug, Clone, PartialEq)]
-pub enum Token {
+// Identifier and string tokens are slices of the source they were lexed from.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum Token<'a> {
     // Literals
-    Identifier(String),
-    String(String),
+    Identifier(&'a str),
+    String(&'a str),
     Number(f64),
     True,
     False,
@@ -1,4 +1,5 @@
-use crate::types::compiler::Value;
+use crate::types::compiler::{ByteCode, Function, HeapObject, Instruction, Value};
+use std::sync::Arc;
 
 pub trait IntoResult<T> {
     fn into_result(self) -> Result<T, String>;
@@ -13,8 +14,8 @@ impl IntoResult<f64> for Value {
     }
 }
 
-impl IntoResult<String> for Value {
-    fn into_result(self) -> Result<String, String> {
+impl IntoResult<Arc<String>> for Value {
+    fn into_result(self) -> Result<Arc<String>, String> {
         match self {
             Value::String(s) => Ok(s),
             _ => Err("Expected string on stack".to_string()),
@@ -30,3 +31,174 @@ impl IntoResult<bool> for Value {
         }
     }
 }
+
+// A program image the VM can execute, either compiled in memory or read
+// lazily out of a precompiled .nb file. `shared` is the image the worker
+// threads of a parallel map run, which must be safe to read from all of them
+// at once; for a wrapper such as Profiled it is the program underneath.
+pub trait Executable {
+    type Shared: Executable + Sync;
+
+    fn shared(&self) -> &Self::Shared;
+    fn instruction(&self, pc: usize) -> Option<Instruction>;
+    fn constant(&self, index: usize) -> Option<Value>;
+    fn function(&self, index: usize) -> Option<&Function>;
+    fn globals(&self) -> usize;
+    fn line(&self, pc: usize) -> usize;
+
+    // Instrumentation hooks: the VM reports every function it enters and
+    // returns from, every task it starts and every task switch. Only
+    // profile::Instrumented does anything with them; for every other program
+    // they are empty and compile away.
+    fn entered(&self, _function: usize) {}
+    fn returned(&self) {}
+    fn spawned(&self, _task: usize, _function: usize) {}
+    fn switched(&self, _task: usize) {}
+}
+
+impl Executable for ByteCode {
+    type Shared = ByteCode;
+
+    fn shared(&self) -> &ByteCode {
+        self
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        self.instructions.get(pc).cloned()
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        self.constants.get(index).cloned()
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        self.functions.get(index)
+    }
+
+    fn globals(&self) -> usize {
+        self.globals
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        self.instruction_lines.get(pc).cloned().unwrap_or(0)
+    }
+}
+
+impl<T: Executable> Executable for &T {
+    type Shared = T::Shared;
+
+    fn shared(&self) -> &T::Shared {
+        (**self).shared()
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        (**self).instruction(pc)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        (**self).constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        (**self).function(index)
+    }
+
+    fn globals(&self) -> usize {
+        (**self).globals()
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        (**self).line(pc)
+    }
+
+    fn entered(&self, function: usize) {
+        (**self).entered(function)
+    }
+
+    fn returned(&self) {
+        (**self).returned()
+    }
+
+    fn spawned(&self, task: usize, function: usize) {
+        (**self).spawned(task, function)
+    }
+
+    fn switched(&self, task: usize) {
+        (**self).switched(task)
+    }
+}
+
+// A program shared by the VMs of several threads, as in embed::Pool.
+impl<T: Executable> Executable for Arc<T> {
+    type Shared = T::Shared;
+
+    fn shared(&self) -> &T::Shared {
+        (**self).shared()
+    }
+
+    fn instruction(&self, pc: usize) -> Option<Instruction> {
+        (**self).instruction(pc)
+    }
+
+    fn constant(&self, index: usize) -> Option<Value> {
+        (**self).constant(index)
+    }
+
+    fn function(&self, index: usize) -> Option<&Function> {
+        (**self).function(index)
+    }
+
+    fn globals(&self) -> usize {
+        (**self).globals()
+    }
+
+    fn line(&self, pc: usize) -> usize {
+        (**self).line(pc)
+    }
+
+    fn entered(&self, function: usize) {
+        (**self).entered(function)
+    }
+
+    fn returned(&self) {
+        (**self).returned()
+    }
+
+    fn spawned(&self, task: usize, function: usize) {
+        (**self).spawned(task, function)
+    }
+
+    fn switched(&self, task: usize) {
+        (**self).switched(task)
+    }
+}
+
+// Lets containers tell the collector which of their elements are worth
+// tracing into.
+pub trait Traceable {
+    fn has_references(&self) -> bool;
+}
+
+impl Traceable for HeapObject {
+    fn has_references(&self) -> bool {
+        match self {
+            HeapObject::HeapPointer(_) => true,
+            HeapObject::Array(items) => items.has_references(),
+            HeapObject::Record(record) => record.fields.iter().any(HeapObject::has_references),
+            _ => false,
+        }
+    }
+}
+
+// Elements of the dense arrays never point into the heap.
+impl Traceable for f64 {
+    fn has_references(&self) -> bool {
+        false
+    }
+}
+
+impl Traceable for bool {
+    fn has_references(&self) -> bool {
+        false
+    }
+}
@@ -0,0 +1,388 @@
+use crate::types::traits::Traceable;
+use std::fmt;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+const BITS: usize = 5;
+pub const WIDTH: usize = 1 << BITS;
+const MASK: usize = WIDTH - 1;
+
+// Persistent vector: a 32-way trie of full leaves plus a separate tail that
+// takes appends, in the style of Clojure's PersistentVector. Cloning shares
+// every node, and an append copies at most the tail and one root-to-leaf
+// path of a vector that is still shared, so building an array by repeated
+// `xs <- [x]` costs O(1) amortized per element instead of copying xs.
+//
+// Each node also records whether anything below it holds a heap reference,
+// which lets the collector skip whole subtrees of plain numbers and strings,
+// and when it was last written (see `clock`), which lets a minor collection
+// skip the subtrees a new version shares with older ones.
+pub struct Vector<T> {
+    len: usize,
+    shift: usize,
+    root: Arc<Node<T>>,
+    tail: Arc<Vec<T>>,
+    written: usize, // Element slots this value stored or copied itself
+}
+
+#[derive(Clone)]
+struct Node<T> {
+    references: bool,
+    stamp: u64, // The clock when this node was created or last changed
+    children: Children<T>,
+}
+
+// Counts node writes across every vector and thread. A node stamped before
+// some reading of the clock has not changed since, so if it was reachable
+// then it still references only what it referenced then.
+static CLOCK: AtomicU64 = AtomicU64::new(1);
+
+pub fn clock() -> u64 {
+    CLOCK.load(Ordering::Relaxed)
+}
+
+fn tick() -> u64 {
+    CLOCK.fetch_add(1, Ordering::Relaxed)
+}
+
+#[derive(Clone)]
+enum Children<T> {
+    Branch(Vec<Arc<Node<T>>>),
+    Leaf(Vec<T>),
+}
+
+impl<T: Clone + Traceable> Vector<T> {
+    pub fn new() -> Self {
+        Self {
+            len: 0,
+            shift: BITS,
+            root: Arc::new(Node::branch(Vec::new())),
+            tail: Arc::new(Vec::new()),
+            written: 0,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    // How much storage this value owns rather than shares with the vector it
+    // was cloned from; used to score it for the collector.
+    pub fn written(&self) -> usize {
+        self.written
+    }
+
+    pub fn get(&self, index: usize) -> Option<&T> {
+        if index >= self.len {
+            return None;
+        }
+        let tail_offset = self.tail_offset();
+        if index >= tail_offset {
+            return self.tail.get(index - tail_offset);
+        }
+
+        let mut node = &self.root;
+        let mut level = self.shift;
+        loop {
+            match &node.children {
+                Children::Branch(children) => {
+                    node = children.get((index >> level) & MASK)?;
+                    level -= BITS;
+                }
+                Children::Leaf(items) => return items.get(index & MASK),
+            }
+        }
+    }
+
+    pub fn push(&mut self, value: T) {
+        if self.len - self.tail_offset() < WIDTH {
+            Self::unique(&mut self.tail, &mut self.written).push(value);
+            self.len += 1;
+            self.written += 1;
+            return;
+        }
+
+        // The tail is full: it becomes a leaf of the trie and a new tail
+        // starts with `value`.
+        let tail = std::mem::replace(&mut self.tail, Arc::new(vec![value]));
+        if Arc::strong_count(&tail) > 1 {
+            self.written += tail.len();
+        }
+        let leaf = Arc::new(Node::leaf(Arc::unwrap_or_clone(tail)));
+        if (self.len >> BITS) > (1 << self.shift) {
+            let old_root = std::mem::replace(&mut self.root, Arc::new(Node::branch(Vec::new())));
+            let path = Self::new_path(self.shift, leaf);
+            self.root = Arc::new(Node::branch(vec![old_root, path]));
+            self.shift += BITS;
+        } else {
+            Self::push_tail(
+                &mut self.root,
+                self.shift,
+                self.len - 1,
+                leaf,
+                &mut self.written,
+            );
+        }
+        self.len += 1;
+        self.written += 1;
+    }
+
+    // Appends `items` a tail's worth at a time; push only runs when the tail
+    // is full and has to move into the trie.
+    pub fn extend_from_slice(&mut self, mut items: &[T]) {
+        while let Some((first, rest)) = items.split_first() {
+            let room = WIDTH - (self.len - self.tail_offset());
+            if room == 0 {
+                self.push(first.clone());
+                items = rest;
+                continue;
+            }
+            let (now, later) = items.split_at(room.min(items.len()));
+            Self::unique(&mut self.tail, &mut self.written).extend_from_slice(now);
+            self.len += now.len();
+            self.written += now.len();
+            items = later;
+        }
+    }
+
+    pub fn append(&mut self, other: &Vector<T>) {
+        if self.is_empty() {
+            *self = other.clone();
+            return;
+        }
+        for chunk in other.chunks() {
+            self.extend_from_slice(chunk);
+        }
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &T> {
+        self.chunks().flatten()
+    }
+
+    // The elements as contiguous runs, in order: every full leaf of WIDTH
+    // elements and then the tail. Two vectors of the same length are always
+    // split at the same indices.
+    pub fn chunks(&self) -> impl Iterator<Item = &[T]> {
+        let mut chunks = Vec::with_capacity(self.len / WIDTH + 1);
+        Self::collect_leaves(&self.root, &mut chunks);
+        chunks.push(self.tail.as_slice());
+        chunks.into_iter().filter(|chunk| !chunk.is_empty())
+    }
+
+    pub fn has_references(&self) -> bool {
+        self.root.references || self.tail.iter().any(T::has_references)
+    }
+
+    // Visits every element that may hold a heap reference.
+    pub fn for_each_reference(&self, visit: &mut impl FnMut(&T)) {
+        self.for_each_reference_since(0, visit);
+    }
+
+    // Like for_each_reference, but skips the nodes stamped before `since`:
+    // a version made by appending visits only its tail and the path it
+    // copied, not the nodes it shares with the version it was made from.
+    pub fn for_each_reference_since(&self, since: u64, visit: &mut impl FnMut(&T)) {
+        Self::visit_node(&self.root, since, visit);
+        self.tail
+            .iter()
+            .filter(|item| item.has_references())
+            .for_each(visit);
+    }
+
+    // Like for_each_reference, but lets the elements be rewritten. Nodes
+    // shared with other vectors are copied first, as for any other update.
+    pub fn for_each_reference_mut(&mut self, visit: &mut impl FnMut(&mut T)) {
+        Self::visit_node_mut(&mut self.root, visit);
+        if self.tail.iter().any(T::has_references) {
+            Arc::make_mut(&mut self.tail)
+                .iter_mut()
+                .filter(|item| item.has_references())
+                .for_each(visit);
+        }
+    }
+
+    fn tail_offset(&self) -> usize {
+        if self.len < WIDTH {
+            0
+        } else {
+            ((self.len - 1) >> BITS) << BITS
+        }
+    }
+
+    // Arc::make_mut that also accounts for the copy it may have to make.
+    fn unique<'a, N: Clone + Weighted>(arc: &'a mut Arc<N>, written: &mut usize) -> &'a mut N {
+        if Arc::get_mut(arc).is_none() {
+            *written += arc.weight();
+        }
+        Arc::make_mut(arc)
+    }
+
+    fn push_tail(
+        node: &mut Arc<Node<T>>,
+        level: usize,
+        last: usize,
+        leaf: Arc<Node<T>>,
+        written: &mut usize,
+    ) {
+        let node = Self::unique(node, written);
+        node.references |= leaf.references;
+        node.stamp = tick();
+        let Children::Branch(children) = &mut node.children else {
+            unreachable!("leaves only sit at level 0");
+        };
+
+        let slot = (last >> level) & MASK;
+        if level == BITS {
+            children.push(leaf);
+        } else if slot < children.len() {
+            Self::push_tail(&mut children[slot], level - BITS, last, leaf, written);
+        } else {
+            children.push(Self::new_path(level - BITS, leaf));
+        }
+    }
+
+    fn new_path(level: usize, leaf: Arc<Node<T>>) -> Arc<Node<T>> {
+        if level == 0 {
+            return leaf;
+        }
+        Arc::new(Node {
+            references: leaf.references,
+            stamp: tick(),
+            children: Children::Branch(vec![Self::new_path(level - BITS, leaf)]),
+        })
+    }
+
+    fn collect_leaves<'a>(node: &'a Node<T>, chunks: &mut Vec<&'a [T]>) {
+        match &node.children {
+            Children::Branch(children) => {
+                for child in children {
+                    Self::collect_leaves(child, chunks);
+                }
+            }
+            Children::Leaf(items) => chunks.push(items),
+        }
+    }
+
+    fn visit_node(node: &Node<T>, since: u64, visit: &mut impl FnMut(&T)) {
+        if !node.references || node.stamp < since {
+            return;
+        }
+        match &node.children {
+            Children::Branch(children) => {
+                for child in children {
+                    Self::visit_node(child, since, visit);
+                }
+            }
+            Children::Leaf(items) => items
+                .iter()
+                .filter(|item| item.has_references())
+                .for_each(visit),
+        }
+    }
+
+    fn visit_node_mut(node: &mut Arc<Node<T>>, visit: &mut impl FnMut(&mut T)) {
+        if !node.references {
+            return;
+        }
+        match &mut Arc::make_mut(node).children {
+            Children::Branch(children) => {
+                for child in children {
+                    Self::visit_node_mut(child, visit);
+                }
+            }
+            Children::Leaf(items) => items
+                .iter_mut()
+                .filter(|item| item.has_references())
+                .for_each(visit),
+        }
+    }
+}
+
+impl<T: Traceable> Node<T> {
+    fn branch(children: Vec<Arc<Node<T>>>) -> Self {
+        Self {
+            references: children.iter().any(|child| child.references),
+            stamp: tick(),
+            children: Children::Branch(children),
+        }
+    }
+
+    fn leaf(items: Vec<T>) -> Self {
+        Self {
+            references: items.iter().any(T::has_references),
+            stamp: tick(),
+            children: Children::Leaf(items),
+        }
+    }
+}
+
+// Number of element or child slots a copy of the value has to write.
+trait Weighted {
+    fn weight(&self) -> usize;
+}
+
+impl<T> Weighted for Vec<T> {
+    fn weight(&self) -> usize {
+        self.len()
+    }
+}
+
+impl<T> Weighted for Node<T> {
+    fn weight(&self) -> usize {
+        match &self.children {
+            Children::Branch(children) => children.len(),
+            Children::Leaf(items) => items.len(),
+        }
+    }
+}
+
+// A clone shares all of its storage, so it starts out owning none of it.
+impl<T> Clone for Vector<T> {
+    fn clone(&self) -> Self {
+        Self {
+            len: self.len,
+            shift: self.shift,
+            root: Arc::clone(&self.root),
+            tail: Arc::clone(&self.tail),
+            written: 0,
+        }
+    }
+}
+
+impl<T: Clone + Traceable> Default for Vector<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<T: Clone + Traceable> FromIterator<T> for Vector<T> {
+    fn from_iter<I: IntoIterator<Item = T>>(iter: I) -> Self {
+        let mut vector = Self::new();
+        for value in iter {
+            vector.push(value);
+        }
+        vector
+    }
+}
+
+impl<T: Clone + Traceable> From<Vec<T>> for Vector<T> {
+    fn from(items: Vec<T>) -> Self {
+        items.into_iter().collect()
+    }
+}
+
+impl<T: Clone + Traceable + PartialEq> PartialEq for Vector<T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.len == other.len && self.iter().eq(other.iter())
+    }
+}
+
+impl<T: Clone + Traceable + fmt::Debug> fmt::Debug for Vector<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_list().entries(self.iter()).finish()
+    }
+}